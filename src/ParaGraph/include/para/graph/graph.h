@@ -87,24 +87,162 @@ struct derivative {
 	tensor_cptr_vec node_derivative;
 };
 
+struct tensor_function;
+typedef std::shared_ptr<const tensor_function> tensor_function_csptr;
+
 /**
  * An abstract type
  *   representing a function from a vector of tensors to a single tensor.
+ * Its functions may be invoked concurrently from several threads,
+ *   and must not modify shared state without synchronization.
  */
 struct tensor_function {
 	/** Function to compute the value of the function on a set of inputs. */
 	virtual tensor_cptr value(const tensor_cptr_vec& tv) const = 0;
 	/** Function to compute the value and gradients of the function on a set of inputs. */
 	virtual derivative deriv(const tensor_cptr_vec& tv) const = 0;
+	/**
+	 * Function to infer the dimensionalities of the value of the function
+	 *   from the dimensionalities of its inputs, without computing anything.
+	 * Returns false if the function has no shape rule,
+	 *   which is what the default implementation does.
+	 * Throws if the function cannot work with inputs of the given dimensionalities.
+	 */
+	virtual bool infer_dimensionalities(const std::vector<tensor::N_vector>& input_dimensionalities,
+			tensor::N_vector& output_dimensionalities) const;
+	/**
+	 * Function to estimate the number of floating point operations
+	 *   required to compute the value of the function
+	 *   on inputs of the given dimensionalities.
+	 * The default implementation returns 0, i.e., unknown.
+	 */
+	virtual double flop_count(const std::vector<tensor::N_vector>& input_dimensionalities) const;
+	/**
+	 * Function to create a version of this function that works on a batch of examples.
+	 * The inputs flagged in is_batched, as well as the output,
+	 *   have an additional leading axis indexing the examples,
+	 *   while the other inputs are shared by all the examples.
+	 * Returns nullptr if the function has no native batched version,
+	 *   which is what the default implementation does,
+	 *   in which case vmap falls back to invoking the function once per example.
+	 */
+	virtual tensor_function_csptr batched(const std::vector<bool>& is_batched) const;
+	/**
+	 * Function to chain the derivative of one of the inputs w.r.t. some X,
+	 *   of dimensionalities (X..., input...),
+	 *   with the derivative of the function w.r.t. that input,
+	 *   giving the derivative of the function w.r.t. X, of dimensionalities (X..., output...).
+	 * The value of the function on the inputs is provided, so that it need not be recomputed.
+	 * The default implementation multiplies input_derivative with the derivative computed by deriv.
+	 */
+	virtual tensor chain_derivative(const tensor_cptr_vec& inputs, const tensor& value, std::size_t input_index,
+			const tensor& input_derivative) const;
+	/**
+	 * Whether chain_derivative is cheaper than computing the derivatives with deriv and multiplying them,
+	 *   in which case partial_gradient uses chain_derivative.
+	 * The default implementation returns false.
+	 */
+	virtual bool prefers_chain_derivative() const;
+	/**
+	 * Function to compute the derivative of the function w.r.t. one of its inputs,
+	 *   of dimensionalities (input..., output...),
+	 *   i.e., chain_derivative of the identity, without materializing the identity.
+	 * partial_gradient uses it for the moving variables that are direct inputs of functions
+	 *   that prefer chain_derivative.
+	 * The value of the function on the inputs is provided, so that it need not be recomputed.
+	 * The default implementation returns the derivative computed by deriv.
+	 */
+	virtual tensor derivative_wrt_input(const tensor_cptr_vec& inputs, const tensor& value,
+			std::size_t input_index) const;
+	/**
+	 * Whether the function can work with a value of the given layout as its input_index-th input.
+	 * While building a graph, inputs of layouts that are not accepted are repacked to row_major.
+	 * The default implementation accepts only row_major.
+	 */
+	virtual bool accepts_layout(std::size_t input_index, tensor_layout layout) const;
+	/**
+	 * The layout of the values computed by the function.
+	 * The default implementation returns row_major.
+	 * Derivatives are always row_major.
+	 */
+	virtual tensor_layout output_layout() const;
+	/**
+	 * Function to create an int8 version of this function for inference,
+	 *   with the weight_index-th input frozen to the given weight value and removed from the inputs.
+	 * input_ranges holds the calibrated largest absolute value of every input
+	 *   (the entry of the weight is unused).
+	 * Returns nullptr if the function has no quantized version,
+	 *   which is what the default implementation does.
+	 */
+	virtual tensor_function_csptr quantized(std::size_t weight_index, const tensor& weight,
+			const std::vector<double>& input_ranges) const;
 	virtual ~tensor_function();
 };
-typedef std::shared_ptr<const tensor_function> tensor_function_csptr;
 
 /**
  * A type representing the values of the input variables of a graph.
  */
 typedef std::map<variable, tensor_cptr> graph_input_map;
 
+/**
+ * Options for trading computation for memory while computing gradients.
+ * Results (values and derivatives) of checkpoint operations are retained until the gradient is complete,
+ *   while results of other operations may be discarded after being consumed,
+ *   and recomputed from the nearest retained ancestors when they are consumed again.
+ * partial_gradient accumulates derivatives in forward mode, in a single pass over the operations,
+ *   so unlike checkpointing for a reverse sweep, what is discarded and recomputed
+ *   is the value of an operation together with its derivatives w.r.t. the moving variables.
+ */
+struct checkpoint_policy {
+	/** Operations whose results are always retained. */
+	std::vector<operation> checkpoints;
+	/** Whether to additionally checkpoint every ⌈√n⌉-th of the n operations that the output depends on. */
+	bool automatic;
+	/**
+	 * The number of doubles (over all retained values and derivatives)
+	 *   beyond which results of non-checkpoint operations are discarded after being consumed.
+	 * A budget of 0 discards them as soon as possible.
+	 */
+	std::size_t memory_budget;
+};
+
+/**
+ * A stateful evaluator of a single graph,
+ *   for repeatedly computing values while only some of the inputs change.
+ * The values of operations are retained between calls,
+ *   and updating an input only invalidates the operations that (transitively) consume it,
+ *   so that the next call only recomputes those.
+ * A session refers to the graph that created it, which must outlive the session.
+ * A session must not be used by several threads at the same time.
+ */
+struct evaluation_session {
+	/** Update the value of an input variable, invalidating all its consumers. */
+	virtual void set_input(variable v, const tensor_cptr& value) = 0;
+	/** Compute the value of a node, reusing retained values where possible. */
+	virtual tensor_cptr value(node output_node) = 0;
+	/** Compute the values of several nodes, reusing retained values where possible. */
+	virtual tensor_cptr_vec value(const std::vector<node>& output_nodes) = 0;
+	/** The number of operation values currently retained by the session. */
+	virtual std::size_t num_retained_values() const = 0;
+	virtual ~evaluation_session();
+};
+typedef std::unique_ptr<evaluation_session> evaluation_session_uptr;
+
+/**
+ * Reusable scratch space for evaluating the values of a graph.
+ * A context is created by graph::create_context,
+ *   and can only be used with the graph that created it.
+ * It remembers the evaluation schedule for the output nodes it was last used with,
+ *   and reuses its buffers across calls,
+ *   so that repeated evaluations only allocate the tensors created by the tensor_functions.
+ * A context must not be used by several threads at the same time:
+ *   threads evaluating the same graph concurrently should use one context each.
+ */
+struct evaluation_context {
+	virtual ~evaluation_context();
+};
+typedef std::unique_ptr<evaluation_context> evaluation_context_uptr;
+
 /**
  * An immutable dependency graph describing how tensor_functions depend
  *   on input variables and other tensor_functions.
@@ -116,6 +254,14 @@ typedef std::map<variable, tensor_cptr> graph_input_map;
  * The graph CANNOT describe circular dependencies.
  * Thus, the graph is a tree, with variables forming the leaves.
  * A graph can only be created using a graph_builder.
+ *
+ * Concurrency contract:
+ *   A graph is never modified after it has been built,
+ *   so all its functions may be called concurrently from any number of threads,
+ *   as long as the tensor_functions it contains are safe to invoke concurrently
+ *   (those created by tensor_function_factory are).
+ *   The stateful helpers created by a graph (evaluation_session, evaluation_context)
+ *   must each be used by only one thread at a time.
  */
 struct graph {
 	/**
@@ -132,6 +278,68 @@ struct graph {
 			const std::vector<variable>& moving_variables,
 			const tensor_cptr_vec& input_values) const = 0;
 
+	/**
+	 * Compute the value and gradients of a node,
+	 *   discarding and recomputing intermediate results according to a checkpoint_policy,
+	 *   so that memory usage can be bounded for deep graphs.
+	 */
+	virtual derivative partial_gradient(node output_node,
+			const std::vector<variable>& moving_variables,
+			const tensor_cptr_vec& input_values,
+			const checkpoint_policy& policy) const = 0;
+
+	/**
+	 * Compute the values of several nodes in one pass,
+	 *   returned in the order of output_nodes.
+	 * Operations shared by the output nodes are computed only once,
+	 *   and intermediate values are released as soon as no other requested computation needs them.
+	 */
+	virtual tensor_cptr_vec value(const std::vector<node>& output_nodes,
+			const tensor_cptr_vec& input_values) const = 0;
+	/**
+	 * Compute the values and gradients of several nodes in one pass,
+	 *   returned in the order of output_nodes.
+	 * Operations shared by the output nodes are computed (and differentiated) only once.
+	 */
+	virtual std::vector<derivative> partial_gradient(const std::vector<node>& output_nodes,
+			const std::vector<variable>& moving_variables,
+			const tensor_cptr_vec& input_values) const = 0;
+
+	/** Create scratch space for evaluating values of this graph from one thread. */
+	virtual evaluation_context_uptr create_context() const = 0;
+	/**
+	 * Compute the value of a node using a vector of input values,
+	 *   reusing the scratch space in the given context.
+	 */
+	virtual tensor_cptr value(node output_node, const tensor_cptr_vec& input_values,
+			evaluation_context& context) const = 0;
+	/**
+	 * Compute the values of several nodes using a vector of input values,
+	 *   reusing the scratch space in the given context.
+	 */
+	virtual tensor_cptr_vec value(const std::vector<node>& output_nodes, const tensor_cptr_vec& input_values,
+			evaluation_context& context) const = 0;
+
+	/**
+	 * Compute the value of a node for many independent vectors of input values,
+	 *   distributing them over the threads of the pool in parallel.h,
+	 *   with one evaluation_context per thread.
+	 * The results are returned in the order of batch_input_values.
+	 */
+	virtual tensor_cptr_vec value_batch(node output_node,
+			const std::vector<tensor_cptr_vec>& batch_input_values) const = 0;
+
+	/**
+	 * Create an evaluation_session starting from a vector of input values.
+	 * At most max_retained_values operation values are retained between calls.
+	 * When more are available, the session prefers to retain the values
+	 *   that have been invalidated least often, and then the most recently used ones.
+	 * Within a call, the values it will not retain are released after their last consumer,
+	 *   so that the cap also bounds the values alive besides those being computed with.
+	 */
+	virtual evaluation_session_uptr create_session(const tensor_cptr_vec& input_values,
+			std::size_t max_retained_values) const = 0;
+
 	/**
 	 * A utility function that
 	 *   takes a convenient map from variables to their tensor values,
@@ -155,9 +363,160 @@ struct graph {
 	 */
 	virtual operation get_operation(const std::string& name) const = 0;
 
+	/**
+	 * Function to check whether the dimensionalities of a node are known at build time.
+	 * They are known for variables that were added with declared dimensionalities,
+	 *   and for operations whose tensor_function can infer dimensionalities
+	 *   from the known dimensionalities of all its dependencies.
+	 */
+	virtual bool has_dimensionalities(node n) const = 0;
+	/**
+	 * Function to retrieve the build-time dimensionalities of a node.
+	 * Throws if they are not known.
+	 */
+	virtual tensor::N_vector get_dimensionalities(node n) const = 0;
+	/**
+	 * Function to retrieve the layout of the value of a node.
+	 * Values of variables must have their declared layout.
+	 */
+	virtual tensor_layout get_layout(node n) const = 0;
+	/**
+	 * Function to estimate the number of floating point operations
+	 *   required to compute the value of a node,
+	 *   summed over all the operations that the node depends on.
+	 * Throws if the dimensionalities of any of these operations are not known.
+	 */
+	virtual double flop_count(node output_node) const = 0;
+
+	/** The number of variables in the graph, indexed from 0. */
+	virtual std::size_t num_variables() const = 0;
+	/** The number of operations in the graph, indexed from 0 in the order they were added. */
+	virtual std::size_t num_operations() const = 0;
+	/** Function to retrieve the tensor_function of an operation. */
+	virtual tensor_function_csptr get_function(operation o) const = 0;
+	/** Function to retrieve the dependencies of an operation. */
+	virtual std::vector<node> get_dependencies(operation o) const = 0;
+
 	virtual ~graph();
 };
 typedef std::unique_ptr<const graph> graph_cuptr;
+typedef std::shared_ptr<const graph> graph_csptr;
+
+/**
+ * Transform a graph written for a single example
+ *   into a graph that computes the same nodes for a batch of examples.
+ * batch_axes maps the batched variables to the axis of their values that indexes the examples;
+ *   the other variables are shared by all the examples.
+ * Every operation that depends on a batched variable is lifted to work on the batch
+ *   (using tensor_function::batched where available),
+ *   and its value has the examples on its leading axis.
+ * The batched graph has the same variables (with the same indices) and operation names as the original graph,
+ *   so operations are to be retrieved with get_operation.
+ * Per-example gradients are obtained from partial_gradient on the batched graph
+ *   w.r.t. shared variables: the derivative of a batched node w.r.t. a shared variable V
+ *   has dimensionalities (V..., examples, node...).
+ */
+graph_cuptr vmap(const graph& g, const std::map<variable, int>& batch_axes);
+
+/**
+ * A graph computing the gradients of a node of another graph, as created by gradient_graph.
+ */
+struct symbolic_gradient {
+	/** The graph, with the same variables (with the same indices) and operations as the original graph. */
+	graph_cuptr built_graph;
+	/** The node of built_graph computing the value of the original node. */
+	node value;
+	/** The nodes of built_graph computing the derivatives w.r.t. the moving variables, as partial_gradient does. */
+	std::vector<node> gradients;
+};
+
+/**
+ * Build a graph whose nodes compute the value of a node of a graph and its derivatives w.r.t. moving variables,
+ *   so that gradients can be evaluated (and scheduled, and planned) like any other value.
+ * The derivatives are accumulated operation by operation as in partial_gradient,
+ *   with one operation per (operation, moving variable) pair consuming the moving variable,
+ *   using tensor_function::chain_derivative (and derivative_wrt_input for the moving variable itself)
+ *   where the function prefers it.
+ * Other functions are differentiated by a single call to deriv per operation,
+ *   shared by all of its inputs and all the moving variables.
+ * The operations computing derivatives are named "d_<operation>/d_<variable>",
+ *   and cannot themselves be differentiated.
+ */
+symbolic_gradient gradient_graph(const graph& g, node output_node, const std::vector<variable>& moving_variables);
+
+/**
+ * Create a tensor_function that copies its single input into the given layout.
+ * graph_builder inserts these for dependencies whose layout an operation does not accept,
+ *   and they may also be added explicitly, e.g., to convert a value once for several consumers.
+ */
+tensor_function_csptr layout_conversion(tensor_layout layout);
+
+/**
+ * The description of a loop (scan) over a body graph with carried state,
+ *   e.g., the cell of a recurrent network, applied to every step of a sequence with shared weights.
+ * At every step, the body is evaluated with
+ *   the current values of the states,
+ *   the slices of the sequences for the step (along their leading axis),
+ *   and the constants (the same at every step),
+ *   giving the values of the states for the next step and an output.
+ * Every variable of the body must be one of its states, sequence slices or constants.
+ */
+struct scan_body {
+	/** The body graph, evaluated once per step, and shared by all the steps. */
+	graph_csptr subgraph;
+	/** The variables of the body holding the carried states. */
+	std::vector<variable> states;
+	/** The variables of the body holding one slice of every sequence. */
+	std::vector<variable> sequence_slices;
+	/** The variables of the body holding the constants. */
+	std::vector<variable> constants;
+	/** The nodes of the body computing the next value of every state, in the order of states. */
+	std::vector<node> next_states;
+	/** The node of the body computing the output of a step. */
+	node output;
+	/** Whether the scan gives the outputs of all the steps stacked along a leading axis, or of the last step only. */
+	bool stack_outputs;
+	/** The number of steps, if there are no sequences; otherwise the steps are the leading axis of the sequences. */
+	std::size_t num_steps;
+	/**
+	 * While differentiating, only the states of every checkpoint_interval-th step are retained,
+	 *   and the others are recomputed one interval at a time.
+	 * An interval of 1 (or 0) retains all the states.
+	 */
+	std::size_t checkpoint_interval;
+};
+
+/**
+ * Create a tensor_function evaluating a scan, without unrolling it.
+ * Its inputs are the initial values of the states, then the sequences, then the constants,
+ *   in the order of the corresponding variables of the body.
+ * Its value is the output of the last step, or of all the steps stacked along a new leading axis.
+ * Values only keep the current states, and derivatives are accumulated backwards from the last step,
+ *   with the Jacobians of the body at one step at a time.
+ */
+tensor_function_csptr scan(const scan_body& body);
+
+/**
+ * A branch of a conditional: a graph computing an output from the operands of the conditional.
+ */
+struct conditional_branch {
+	/** The branch graph, only evaluated when the branch is taken. */
+	graph_csptr subgraph;
+	/** The variables of the branch holding the operands, one per operand in their order; these are all its variables. */
+	std::vector<variable> operands;
+	/** The node of the branch computing the output of the conditional. */
+	node output;
+};
+
+/**
+ * Create a tensor_function evaluating only one of several branches,
+ *   chosen by its first input (the predicate): a single integral value k in [0, branches.size()),
+ *   e.g., 0 or 1 for a boolean flag, which takes branches[k].
+ * Its other inputs are the operands of the branches.
+ * The branches must have outputs of the same dimensionalities.
+ * Values and derivatives only evaluate the branch that is taken, and the derivative w.r.t. the predicate is zero.
+ */
+tensor_function_csptr conditional(const std::vector<conditional_branch>& branches);
 
 /**
  * A mutable structure for describing how to create a graph.
@@ -185,6 +544,22 @@ struct graph_builder {
 	 */
 	virtual variable add_variable(const std::string& name) = 0;
 
+	/**
+	 * A function to add a variable with declared dimensionalities.
+	 * The dimensionalities are propagated to all consumer operations
+	 *   whose tensor_functions can infer them,
+	 *   so that shape errors are raised while building the graph,
+	 *   and input values with different dimensionalities are rejected.
+	 */
+	virtual variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities) = 0;
+
+	/**
+	 * A function to add a variable with declared dimensionalities and layout.
+	 * Input values of a different layout are rejected.
+	 */
+	virtual variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities,
+			tensor_layout layout) = 0;
+
 	/**
 	 * A function to add an operation in the grpah that is to be built.
 	 * The resulting "operation" object may be used to perform computations
@@ -192,11 +567,37 @@ struct graph_builder {
 	 * The name of the operation is mostly for debugging purposes,
 	 *   and need not be unique,
 	 *   unless you wish to re-retrieve the operation object later again using its name.
+	 * If the dimensionalities of all the dependencies are known,
+	 *   the function is asked to infer the dimensionalities of the operation,
+	 *   and any shape error is raised here.
+	 * Dependencies whose layout is not accepted by the function
+	 *   are repacked to row_major by additional operations named "<dependency>_to_row_major",
+	 *   which are shared by all the operations that need them.
+	 * The operation always produces the output_layout of its function:
+	 *   layouts are not chosen across the graph to minimise the number of repacks,
+	 *   so that the repacks of a dependency are known as soon as the operation is added.
 	 */
 	virtual operation add_operation(const std::string& name,
 			const tensor_function_csptr& function,
 			const std::vector<node>& dependencies) = 0;
 
+	/**
+	 * A function to add a scan operation, applying a body repeatedly instead of unrolling it (see scan_body).
+	 * The operation depends on the initial states, then the sequences, then the constants.
+	 */
+	virtual operation add_scan(const std::string& name, const scan_body& body,
+			const std::vector<node>& initial_states, const std::vector<node>& sequences,
+			const std::vector<node>& constants) = 0;
+
+	/**
+	 * A function to add a conditional operation (see conditional),
+	 *   depending on the predicate and then the operands.
+	 * The operations of the branch that is not taken are never evaluated,
+	 *   since they live in the branch graphs rather than in the graph that is built.
+	 */
+	virtual operation add_conditional(const std::string& name, node predicate,
+			const std::vector<conditional_branch>& branches, const std::vector<node>& operands) = 0;
+
 	/**
 	 * Create the graph based on the dependencies that have been described.
 	 */
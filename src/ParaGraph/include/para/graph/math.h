@@ -26,10 +26,20 @@
 namespace para {
 namespace graph {
 
+/**
+ * The order in which the values of a tensor are stored.
+ * row_major stores the last axis contiguously, and column_major the first axis.
+ * E.g., if its a 2x3 matrix, column_major stores
+ *   [(0,0), (1,0), (0,1), (1,1), (0,2), (1,2)]
+ */
+enum class tensor_layout {
+    row_major, column_major
+};
+
 /**
  * A type representing a multi-dimensional array of doubles.
  * API and implementation are that of a thin wrapper
- *   over a row-major vector f doubles,
+ *   over a vector f doubles, stored row-major unless specified otherwise by "layout",
  *   restricting it to a dense, random access representation.
  */
 class tensor {
@@ -41,10 +51,17 @@ public:
 
     /** The sizes of the various dimensions of the multi-dimensional array. */
     N_vector dimensionalities;
+    /**
+     * The order in which the values are stored.
+     * Offsets (used by operator[], at and the iterators) refer to this order,
+     *   while positions are independent of it.
+     */
+    tensor_layout layout;
 
     tensor(const N_vector& dimensionalities, const std::vector<double>& data);
     tensor(N_vector&& dimensionalities, std::vector<double>&& data);
     tensor(const N_vector& dimensionalities, std::vector<double>&& data);
+    tensor(N_vector&& dimensionalities, std::vector<double>&& data, tensor_layout layout);
 
     /** Get the offset in "data" from n-dimensional coordinates */
     N compute_offset(const N_vector& position) const;
@@ -87,13 +104,15 @@ public:
      *     ∆F ≈ chain_multiplication(∆x, ∇F(x), ∆x.dimensionalities.size())
      */
     static tensor chain_multiplication(const tensor& lhs, const tensor& rhs, int num_common_dims);
-    /** Add two tensors */
+    /** Add two tensors, which must have the same layout */
     static tensor add(const tensor& lhs, const tensor& rhs);
+    /** Copy the values of a tensor into the requested layout. */
+    static tensor to_layout(const tensor& t, tensor_layout layout);
 
 private:
     /**
       * The actual data that is stored in the tensor.
-      * The ordering is row major.
+      * The ordering is that of "layout", by default row major.
       * E.g., if its a 2x3 matrix
       *   "dimensionalities" would contain [2, 3]
       *   and the ordering within "data" would be
@@ -105,6 +124,60 @@ private:
 typedef std::shared_ptr<const tensor> tensor_cptr;
 typedef std::vector<tensor_cptr> tensor_cptr_vec;
 
+/**
+ * A type representing a multi-dimensional array of doubles that are mostly zero.
+ * Only the non-zero values are stored, together with their offsets in a row-major dense tensor,
+ *   in increasing order of offset.
+ * This is the coordinate (COO) format with linearized coordinates,
+ *   and since the values are sorted, it is also the compressed sparse row (CSR) format
+ *   for any split of the axes into leading row axes and trailing column axes.
+ */
+class sparse_tensor {
+public:
+    typedef tensor::N N;
+    typedef tensor::N_vector N_vector;
+
+    /** The sizes of the various dimensions of the multi-dimensional array. */
+    N_vector dimensionalities;
+    /** The row-major offsets of the stored values, strictly increasing. */
+    std::vector<N> offsets;
+    /** The stored values, in the order of their offsets. */
+    std::vector<double> values;
+
+    sparse_tensor(const N_vector& dimensionalities, std::vector<N>&& offsets, std::vector<double>&& values);
+
+    /** Create a sparse tensor from the positions of its values, in any order, summing repeated positions. */
+    static sparse_tensor from_coo(const N_vector& dimensionalities, const std::vector<N_vector>& positions,
+            const std::vector<double>& values);
+    /** Create a sparse tensor from the non-zero values of a dense tensor. */
+    static sparse_tensor from_dense(const tensor& t);
+    /** Create a dense, row-major copy. */
+    tensor to_dense() const;
+
+    /** The number of stored values. */
+    std::size_t nnz() const { return values.size(); }
+    /**
+     * The CSR row pointers for rows indexed by the first num_row_axes axes:
+     *   the values of row r are [pointers[r], pointers[r + 1]).
+     */
+    std::vector<N> row_pointers(std::size_t num_row_axes) const;
+
+    /** The offsets as a {nnz} tensor, e.g., for feeding them to a graph. */
+    tensor offset_tensor() const;
+    /** The values as a {nnz} tensor, e.g., for feeding them to a graph. */
+    tensor value_tensor() const;
+    /** Recreate a sparse tensor from offset_tensor() and value_tensor(). */
+    static sparse_tensor from_tensors(const N_vector& dimensionalities, const tensor& offsets, const tensor& values);
+
+    /**
+     * Same as tensor::chain_multiplication of the dense equivalents,
+     *   while only multiplying the stored values of the sparse operand.
+     * The result is dense.
+     */
+    static tensor chain_multiplication(const sparse_tensor& lhs, const tensor& rhs, int num_common_dims);
+    static tensor chain_multiplication(const tensor& lhs, const sparse_tensor& rhs, int num_common_dims);
+};
+
 }
 }
 
@@ -19,21 +19,234 @@
 
 #include "graph.h"
 
+#include <cstdint>
+
 namespace para {
 namespace graph {
 
+/**
+ * A gradient w.r.t. a table that is zero except on a few rows (slices along its leading axis),
+ *   such as the gradient of a scalar w.r.t. the table of an embedding lookup.
+ */
+struct sparse_row_gradient {
+    /** The dimensionalities of the (dense) table. */
+    tensor::N_vector dimensionalities;
+    /** The distinct rows with a non-zero gradient, in increasing order. */
+    std::vector<std::size_t> row_indices;
+    /** The gradients of these rows, with dimensionalities {row_indices.size(), dimensionalities[1:]...}. */
+    tensor rows;
+
+    /** Add scale times the gradient to a row-major table in place, e.g., with scale = -learning_rate. */
+    void scatter_add(tensor& table, double scale) const;
+    /** The equivalent dense gradient. */
+    tensor to_dense() const;
+};
+
+/**
+ * A dense layer W x + b, i.e., bias_add(chain_multiplication(W, x, 1), b, 0),
+ *   with weights W {out, in} and a bias b {out}.
+ */
+struct folded_dense_layer {
+    tensor weights;
+    tensor bias;
+};
+
 /**
  * Factory for creating tensor_functions relevant to ML.
  */
 struct tensor_function_factory {
+    /** The ways of combining the values reduced by reduce. */
+    enum class reduction_type {
+        sum, mean, max, min, log_sum_exp
+    };
+    /** The element-wise functions computed by activation. */
+    enum class activation_type {
+        sigmoid, tanh, relu, leaky_relu, gelu, exp, log
+    };
+    /**
+     * The accuracy of exp and log behind activation: vectorizable polynomial approximations with
+     *   relative errors below about 1e-5 (fast) or 1e-9 (balanced), or std::exp and std::log (precise).
+     */
+    enum class activation_accuracy {
+        fast, balanced, precise
+    };
+
     static tensor_function_csptr add();
     static tensor_function_csptr chain_multiplication(int num_common_dims);
+    /**
+     * Element-wise activation, computing exp and log to the given accuracy, in parallel for large inputs.
+     * The shortcuts, e.g., sigmoid() or log(), are precise.
+     * gelu is the tanh approximation 0.5 x (1 + tanh(sqrt(2 / pi) (x + 0.044715 x^3))),
+     *   and leaky_relu has a slope of 0.01 for negative inputs.
+     * Derivatives reuse the forward outputs, e.g., y (1 - y) for sigmoid, instead of evaluating exp again,
+     *   except for the precise sigmoid, which keeps exp(-x) y^2 for positive x, where 1 - y would cancel.
+     */
+    static tensor_function_csptr activation(activation_type type, activation_accuracy accuracy);
     static tensor_function_csptr sigmoid();
-    static tensor_function_csptr reduce_sum(int axis);
+    static tensor_function_csptr tanh();
+    static tensor_function_csptr relu();
+    static tensor_function_csptr leaky_relu(double negative_slope);
+    static tensor_function_csptr gelu();
+    static tensor_function_csptr exp();
+    /**
+     * Reduction of several axes at once, e.g., { 0, 2 } reduces a { a, b, c } tensor to a { b } tensor.
+     * An empty set of axes reduces all the axes, into a scalar.
+     * The derivatives of max and min flow to the first value attaining the extremum.
+     */
+    static tensor_function_csptr reduce(reduction_type type, const std::vector<int>& axes);
+    static tensor_function_csptr reduce_sum(const std::vector<int>& axes);
     static tensor_function_csptr log();
     static tensor_function_csptr element_wise_multiplication();
     static tensor_function_csptr negative();
+    /** Softmax normalizing all the values of its input together. */
     static tensor_function_csptr softmax();
+    /** Softmax normalizing the values along one axis, independently for every position along the other axes. */
+    static tensor_function_csptr softmax(int axis);
+    /**
+     * Cross entropy of labels (the second input) w.r.t. the softmax of logits (the first input) along an axis,
+     *   summed over all the other axes into a scalar.
+     * The gradient w.r.t. the logits is softmax(logits) - labels (for labels summing to 1 along the axis),
+     *   computed without materializing the log probabilities.
+     */
+    static tensor_function_csptr softmax_cross_entropy(int axis);
+    /**
+     * Cross entropy of the softmax over classes of the logits W x,
+     *   for weights W {classes, features}, points x {features, points},
+     *   and labels {points} holding the index of the class of every point,
+     *   summed over the points into a scalar.
+     * Logits are computed for tile_size classes at a time, for the loss as well as the gradients,
+     *   so that the full {classes, points} logits are never materialized.
+     */
+    static tensor_function_csptr linear_softmax_cross_entropy(std::size_t tile_size);
+    /**
+     * 2-D convolution of images {n, c, h, w} (the first input) with kernels {f, c / groups, kh, kw} (the second input),
+     *   giving images {n, f, oh, ow}.
+     * The kernels slide with the given stride, over the images padded with zeros on every side,
+     *   with taps spaced by the dilation.
+     * Channels and kernels are split into groups, and each group of kernels only sees its group of channels.
+     */
+    static tensor_function_csptr conv2d(std::size_t stride, std::size_t padding, std::size_t dilation,
+            std::size_t groups);
+    /**
+     * Embedding lookup of the rows of a table {rows, row...} (the first input)
+     *   selected by indices {idx...} (the second input) holding row numbers,
+     *   giving {idx..., row...}.
+     * This replaces multiplying the table with one-hot encoded indices, at the cost of a copy.
+     * The derivative w.r.t. the indices is zero.
+     */
+    static tensor_function_csptr gather();
+    /**
+     * chain_multiplication(lhs, rhs, num_common_dims) where one of the operands is a sparse_tensor
+     *   with the given dimensionalities, fed as two {nnz} inputs:
+     *   its sparse_tensor::offset_tensor() and sparse_tensor::value_tensor().
+     * The inputs are (offsets, values, rhs) if sparse_is_lhs, and (lhs, offsets, values) otherwise.
+     * Only the stored values of the sparse operand are multiplied,
+     *   and its derivatives are w.r.t. the stored values only (zero w.r.t. the offsets).
+     */
+    static tensor_function_csptr sparse_chain_multiplication(const tensor::N_vector& sparse_dimensionalities,
+            int num_common_dims, bool sparse_is_lhs);
+    /**
+     * Symmetric int8 quantization: round(x / scale), clamped to [-127, 127].
+     * The values stay doubles. For inference only: there are no derivatives.
+     */
+    static tensor_function_csptr quantize(double scale);
+    /** The inverse of quantize: x * scale. For inference only: there are no derivatives. */
+    static tensor_function_csptr dequantize(double scale);
+    /**
+     * chain_multiplication(weights, x, 1) of its single input x {in, ...} with frozen weights {out, in},
+     *   computed with int8 x int8 -> int32 kernels.
+     * The weights are quantized with one scale per row (output channel),
+     *   and x is quantized with the scale mapping [-input_range, input_range] onto the int8 range.
+     * For inference only: there are no derivatives.
+     */
+    static tensor_function_csptr quantized_chain_multiplication(const tensor& weights, double input_range);
+    /**
+     * The gradient of a scalar w.r.t. the table of gather,
+     *   given its gradient w.r.t. the output of gather,
+     *   as the few rows that were looked up (summed over repeated lookups)
+     *   instead of a dense tensor with the dimensionalities of the table.
+     */
+    static sparse_row_gradient gather_gradient(const tensor::N_vector& table_dimensionalities, const tensor& indices,
+            const tensor& output_gradient);
+    /**
+     * The gradient of a scalar node of a graph (e.g., a loss) w.r.t. the table of one of its gather operations,
+     *   as the few rows that were looked up.
+     * The gradient w.r.t. the output of the lookup is computed by partial_gradient on a copy of the graph
+     *   in which the output of the lookup is a variable, so the cost scales with the output of the lookup,
+     *   not with the table.
+     */
+    static sparse_row_gradient gather_gradient(const graph& g, node loss, operation lookup,
+            const tensor_cptr_vec& input_values);
+    /**
+     * Scaled dot-product attention softmax(q k^T / sqrt(d)) v
+     *   of queries q {B..., lq, d}, keys k {B..., lk, d} and values v {B..., lk, dv}, giving {B..., lq, dv},
+     *   where the leading axes B... (e.g., examples and heads) are independent and processed in parallel.
+     * An optional fourth input, a mask {M..., lq, lk} whose leading axes M... are trailing axes of B...,
+     *   excludes the keys where it is zero; queries with all keys excluded give zeros.
+     * Scores are computed for tile_size queries and tile_size keys at a time, with an online softmax,
+     *   for the value as well as the derivatives, so that the {lq, lk} scores are never materialized.
+     */
+    static tensor_function_csptr attention(std::size_t tile_size);
+    /**
+     * Layer normalization of x (the first input) over its trailing num_normalized_dims axes:
+     *   scale * (x - mean) / sqrt(variance + epsilon) + shift,
+     *   with the mean and variance of the trailing axes at every position along the leading axes,
+     *   and a scale (the second input) and a shift (the third input) of the dimensionalities of the trailing axes.
+     * Statistics are computed in a single pass, and the affine transform is applied in the same loop.
+     */
+    static tensor_function_csptr layer_norm(int num_normalized_dims, double epsilon);
+    /**
+     * Batch normalization of x (the first input), as layer_norm
+     *   but with the mean and variance of every position along the axis over all the other axes,
+     *   e.g., axis 1 for images {n, c, h, w}, or axis 0 for the {out, points} output of a dense layer,
+     *   and a scale and a shift {x.dimensionalities[axis]}.
+     * The statistics are always those of the batch; for inference, see fold_batch_norm.
+     */
+    static tensor_function_csptr batch_norm(int axis, double epsilon);
+    /** Adds a bias {x.dimensionalities[axis]} (the second input) to every position along an axis of x. */
+    static tensor_function_csptr bias_add(int axis);
+    /**
+     * Folds batch_norm(chain_multiplication(weights, x, 1), 0, epsilon) with frozen statistics,
+     *   e.g., running averages of the mean and variance of the batches seen in training,
+     *   into a single dense layer with equivalent weights {out, in} and bias {out}.
+     */
+    static folded_dense_layer fold_batch_norm(const tensor& weights, const tensor& scale, const tensor& shift,
+            const tensor& mean, const tensor& variance, double epsilon);
+    /** Maximum over square windows of the two trailing axes, ignoring the padding. */
+    static tensor_function_csptr max_pool(std::size_t window, std::size_t stride, std::size_t padding);
+    /** Average over square windows of the two trailing axes, with the padding counting as zeros. */
+    static tensor_function_csptr avg_pool(std::size_t window, std::size_t stride, std::size_t padding);
+    /**
+     * Generic tensor contraction described by subscripts in Einstein notation,
+     *   e.g., "ij,jk->ik" for matrix multiplication, or "bij,bjk->bik" for batched matrix multiplication.
+     * Each operand is labelled by one letter per axis.
+     * Labels missing from the output (after "->") are summed over.
+     * Without "->", the output has all labels appearing exactly once, in alphabetical order.
+     * Expressions with many operands are evaluated as a sequence of pairwise contractions,
+     *   in the order that minimizes the number of floating point operations.
+     */
+    static tensor_function_csptr einsum(const std::string& subscripts);
+    /**
+     * Dropout of x (the first input): x * mask / (1 - rate),
+     *   with every element of the mask zero with probability rate, and one otherwise.
+     * The mask is drawn from a counter-based generator keyed by the seed,
+     *   at an offset given by the optional second input (e.g., the training step),
+     *   and depends only on the seed, the offset and the position of the element,
+     *   so that it is reproducible whatever the number of threads,
+     *   and regenerated for the derivatives instead of being stored.
+     * Its batched version (see vmap) drops out the stacked examples at once,
+     *   so that every example gets its own mask.
+     */
+    static tensor_function_csptr dropout(double rate, std::uint64_t seed);
+    /**
+     * A tensor of the given dimensionalities with elements uniform in (low, high),
+     *   drawn from the same generator as dropout at the offset given by the only input.
+     */
+    static tensor_function_csptr random_uniform(const tensor::N_vector& dimensionalities, double low, double high,
+            std::uint64_t seed);
+    /** As random_uniform, but with normally distributed elements. */
+    static tensor_function_csptr random_normal(const tensor::N_vector& dimensionalities, double mean,
+            double standard_deviation, std::uint64_t seed);
 };
 
 /**
@@ -43,16 +256,65 @@ struct ml_graph_builder {
     typedef std::unique_ptr<ml_graph_builder> uptr;
 
     virtual variable add_variable(const std::string& name) = 0;
+    virtual variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities) = 0;
+    virtual variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities,
+            tensor_layout layout) = 0;
     virtual operation add_operation(const std::string& name, const tensor_function_csptr& function,
             const std::vector<node>& dependencies) = 0;
+    virtual operation add_scan(const std::string& name, const scan_body& body,
+            const std::vector<node>& initial_states, const std::vector<node>& sequences,
+            const std::vector<node>& constants) = 0;
+    virtual operation add_conditional(const std::string& name, node predicate,
+            const std::vector<conditional_branch>& branches, const std::vector<node>& operands) = 0;
     virtual operation add(node lhs, node rhs) = 0;
     virtual operation chain_multiplication(node lhs, node rhs, int num_common_dims) = 0;
+    virtual operation activation(node n, tensor_function_factory::activation_type type,
+            tensor_function_factory::activation_accuracy accuracy) = 0;
     virtual operation sigmoid(node n) = 0;
-    virtual operation reduce_sum(node n, int axis) = 0;
+    virtual operation tanh(node n) = 0;
+    virtual operation relu(node n) = 0;
+    virtual operation leaky_relu(node n, double negative_slope) = 0;
+    virtual operation gelu(node n) = 0;
+    virtual operation exp(node n) = 0;
+    virtual operation reduce_sum(node n, const std::vector<int>& axes) = 0;
+    virtual operation reduce(node n, tensor_function_factory::reduction_type type, const std::vector<int>& axes) = 0;
     virtual operation log(node n) = 0;
     virtual operation element_wise_multiplication(node lhs, node rhs) = 0;
     virtual operation negative(node lhs) = 0;
     virtual operation softmax(node n) = 0;
+    virtual operation softmax(node n, int axis) = 0;
+    virtual operation softmax_cross_entropy(node logits, node labels, int axis) = 0;
+    virtual operation linear_softmax_cross_entropy(node weights, node points, node labels, std::size_t tile_size) = 0;
+    virtual operation conv2d(node images, node kernels, std::size_t stride, std::size_t padding, std::size_t dilation,
+            std::size_t groups) = 0;
+    virtual operation max_pool(node n, std::size_t window, std::size_t stride, std::size_t padding) = 0;
+    virtual operation avg_pool(node n, std::size_t window, std::size_t stride, std::size_t padding) = 0;
+    virtual operation einsum(const std::string& subscripts, const std::vector<node>& operands) = 0;
+    virtual operation gather(node table, node indices) = 0;
+    virtual operation attention(node queries, node keys, node values, std::size_t tile_size) = 0;
+    virtual operation layer_norm(node n, node scale, node shift, int num_normalized_dims, double epsilon) = 0;
+    virtual operation batch_norm(node n, node scale, node shift, int axis, double epsilon) = 0;
+    virtual operation bias_add(node n, node bias, int axis) = 0;
+    virtual operation attention(node queries, node keys, node values, node mask, std::size_t tile_size) = 0;
+    virtual operation sparse_dense_chain_multiplication(node lhs_offsets, node lhs_values,
+            const tensor::N_vector& lhs_dimensionalities, node rhs, int num_common_dims) = 0;
+    virtual operation dense_sparse_chain_multiplication(node lhs, node rhs_offsets, node rhs_values,
+            const tensor::N_vector& rhs_dimensionalities, int num_common_dims) = 0;
+    virtual operation to_layout(node n, tensor_layout layout) = 0;
+    virtual operation quantize(node n, double scale) = 0;
+    virtual operation dequantize(node n, double scale) = 0;
+    /**
+     * Dropout (see tensor_function_factory::dropout) at offset zero,
+     *   which draws the same mask at every evaluation:
+     *   change the seed at every training step, or use the version with an offset.
+     */
+    virtual operation dropout(node n, double rate, std::uint64_t seed) = 0;
+    /** Dropout at the offset given by a node, e.g., a variable holding the training step. */
+    virtual operation dropout(node n, node offset, double rate, std::uint64_t seed) = 0;
+    virtual operation random_uniform(node offset, const tensor::N_vector& dimensionalities, double low, double high,
+            std::uint64_t seed) = 0;
+    virtual operation random_normal(node offset, const tensor::N_vector& dimensionalities, double mean,
+            double standard_deviation, std::uint64_t seed) = 0;
 
     virtual graph_cuptr build_graph() const = 0;
 
@@ -0,0 +1,53 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PARA_GRAPH_PARALLEL_H_
+#define PARA_GRAPH_PARALLEL_H_
+
+#include <cstddef>
+#include <functional>
+
+namespace para {
+namespace graph {
+
+/**
+ * The number of threads (including the calling thread)
+ *   that ParaGraph uses for parallel computations.
+ * Defaults to the number of hardware threads.
+ */
+std::size_t get_num_threads();
+
+/**
+ * Set the number of threads that ParaGraph uses for parallel computations.
+ * A value of 1 disables parallelism.
+ * Must not be called while parallel computations are running.
+ */
+void set_num_threads(std::size_t num_threads);
+
+/**
+ * Split the range [0, n) into at most get_num_threads() contiguous chunks,
+ *   and invoke func(begin, end) for each chunk on a shared pool of threads.
+ * The calling thread works on one of the chunks,
+ *   and the function returns once all chunks have been processed.
+ * Calls made from within a chunk run serially on the thread processing the chunk.
+ * If any chunk throws, the first exception is rethrown after all chunks have finished.
+ */
+void parallel_for(std::size_t n, const std::function<void(std::size_t begin, std::size_t end)>& func);
+
+} // end namespace graph
+} // end namespace para
+
+#endif /* PARA_GRAPH_PARALLEL_H_ */
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#ifndef PARA_GRAPH_QUANTIZATION_H_
+#define PARA_GRAPH_QUANTIZATION_H_
+
+#include "graph.h"
+
+namespace para {
+namespace graph {
+
+/**
+ * How a quantized graph compares with the graph it was created from,
+ *   measured on the calibration inputs.
+ */
+struct quantization_report {
+    /** The number of operations replaced by int8 versions. */
+    std::size_t num_quantized_operations;
+    /** The largest absolute difference between any value of the outputs of the two graphs. */
+    double max_absolute_error;
+    /** The norm of the differences between the outputs, relative to the norm of the original outputs. */
+    double relative_error;
+    /** Seconds taken to compute the outputs for all the calibration inputs using the original graph. */
+    double reference_seconds;
+    /** Seconds taken to compute the outputs for all the calibration inputs using the quantized graph. */
+    double quantized_seconds;
+
+    /** reference_seconds / quantized_seconds */
+    double speedup() const;
+};
+
+/**
+ * Post-training quantization of a graph for inference.
+ * The weights are frozen to their values in the calibration inputs, which must be the same for all of them.
+ * The calibration inputs are run through graph::value to find the range of every input of the operations
+ *   that consume a weight, and every such operation with a tensor_function::quantized version is replaced by it,
+ *   e.g., dense layers chain_multiplication(W, x, 1) become int8 matrix multiplications,
+ *   with one scale per row (output channel) of W and one calibrated scale for x.
+ * The resulting graph has the same variables (with the same indices) and operation names as the original graph,
+ *   so operations are to be retrieved with get_operation, and its operations have no derivatives.
+ * The report compares the values of the outputs computed by both graphs on the calibration inputs.
+ */
+graph_cuptr quantize(const graph& g, const std::vector<variable>& weights,
+        const std::vector<tensor_cptr_vec>& calibration_inputs, const std::vector<node>& outputs,
+        quantization_report& report);
+
+} // end namespace graph
+} // end namespace para
+
+#endif /* PARA_GRAPH_QUANTIZATION_H_ */
@@ -0,0 +1,489 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+typedef tensor_function_factory::activation_type activation_type;
+typedef tensor_function_factory::activation_accuracy activation_accuracy;
+
+/** The number of elements the kernels work on at a time, sized for temporaries on the stack. */
+const N block_size = 256;
+/** The smallest number of elements for which activations use the thread pool. */
+const N min_parallel_size = 1 << 16;
+
+const double log2e = 1.4426950408889634;
+// ln(2) split into a head with trailing zero bits (so that k * ln2_hi is exact) and a tail
+const double ln2_hi = 6.93147180369123816490e-01;
+const double ln2_lo = 1.90821492927058770002e-10;
+// the inputs for which exp is a normal double, with 2^round(x / ln(2)) built from its exponent bits
+const double exp_min = -708;
+const double exp_max = 709;
+// 1.5 * 2^52, adding which rounds any |x| < 2^51 to the nearest integer, in the default rounding mode
+const double round_shift = 6755399441055744.0;
+// 2^52 + 1023, the double whose low mantissa bits hold a biased exponent of 0
+const double exponent_shift = 4503599627370496.0 + 1023;
+const double sqrt2 = 1.41421356237309504880;
+// gelu(x) ~ x * sigmoid(2 * gelu_scale * (x + gelu_cubic * x^3))
+const double gelu_scale = 0.79788456080286535588;
+const double gelu_cubic = 0.044715;
+
+/** exp(x) - 1 if minus_one, and exp(x) otherwise, for n <= block_size elements. */
+void exp_block(const double* x, double* y, N n, int degree, bool minus_one) {
+    // the loops are kept free of branches, calls and int64 conversions, so that they vectorize
+    double xb[block_size], r[block_size], s[block_size];
+    std::copy(x, x + n, xb);
+    double coefficients[14] = { 1 };
+    for (int j = 1; j <= degree; ++j)
+        coefficients[j] = coefficients[j - 1] / j;
+
+    for (N i = 0; i < n; ++i) {
+        const double clamped_below = xb[i] > exp_min ? xb[i] : exp_min;
+        r[i] = clamped_below < exp_max ? clamped_below : exp_max;
+    }
+    double out_of_range = 0;
+    for (N i = 0; i < n; ++i)
+        out_of_range = r[i] != xb[i] ? 1 : out_of_range;
+    // x = k ln(2) + r, with |r| <= ln(2) / 2
+    for (N i = 0; i < n; ++i) {
+        const double xi = r[i];
+        // adding round_shift + 1023 rounds to the nearest integer, leaving k + 1023 in the low mantissa bits
+        const double shifted = xi * log2e + (round_shift + 1023);
+        const double k = shifted - (round_shift + 1023);
+        r[i] = (xi - k * ln2_hi) - k * ln2_lo;
+        // and shifting those bits into the exponent field gives 2^k
+        std::uint64_t bits;
+        std::memcpy(&bits, &shifted, sizeof(bits));
+        bits <<= 52;
+        std::memcpy(&s[i], &bits, sizeof(bits));
+    }
+    for (N i = 0; i < n; ++i)
+        y[i] = coefficients[degree];
+    // exp(r) - 1 = r * (1 + r / 2 + r^2 / 6 + ...), by Horner's rule, one coefficient at a time for the whole block
+    for (int j = degree - 1; j >= 1; --j) {
+        const double c = coefficients[j];
+        for (N i = 0; i < n; ++i)
+            y[i] = y[i] * r[i] + c;
+    }
+    // exp(x) = 2^k (1 + (exp(r) - 1)), where 2^k - 1 is exact
+    const double one = minus_one ? 1 : 0;
+    for (N i = 0; i < n; ++i)
+        y[i] = s[i] * (y[i] * r[i]) + (s[i] - one);
+    if (out_of_range != 0)
+        for (N i = 0; i < n; ++i)
+            if (!(xb[i] >= exp_min && xb[i] <= exp_max))
+                y[i] = minus_one ? std::expm1(xb[i]) : std::exp(xb[i]);
+}
+
+/** log(x) for n <= block_size elements. */
+void log_block(const double* x, double* y, N n, int num_terms) {
+    // the loops are kept free of branches, calls and int64 conversions, so that they vectorize
+    double xb[block_size], s[block_size], e[block_size];
+    std::copy(x, x + n, xb);
+
+    for (N i = 0; i < n; ++i) {
+        const double clamped_below = xb[i] < DBL_MIN ? DBL_MIN : xb[i];
+        s[i] = clamped_below > DBL_MAX ? DBL_MAX : clamped_below;
+    }
+    double out_of_range = 0;
+    for (N i = 0; i < n; ++i)
+        out_of_range = s[i] != xb[i] ? 1 : out_of_range;
+    // x = 2^e m, with m in [sqrt(1/2), sqrt(2)]
+    for (N i = 0; i < n; ++i) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &s[i], sizeof(bits));
+        const std::uint64_t mantissa_bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+        // the biased exponent in the low mantissa bits of 2^52, read back as the double 2^52 + e + 1023
+        const std::uint64_t exponent_bits = (bits >> 52) | 0x4330000000000000ULL;
+        double m, biased_exponent;
+        std::memcpy(&m, &mantissa_bits, sizeof(m));
+        std::memcpy(&biased_exponent, &exponent_bits, sizeof(biased_exponent));
+        const double halve = m > sqrt2 ? 1 : 0;
+        m -= 0.5 * halve * m;
+        e[i] = (biased_exponent - exponent_shift) + halve;
+        s[i] = (m - 1) / (m + 1);
+        y[i] = 1.0 / (2 * num_terms - 1);
+    }
+    // log(m) = 2 atanh(s) = 2 s (1 + s^2 / 3 + s^4 / 5 + ...)
+    for (int j = num_terms - 2; j >= 0; --j) {
+        const double c = 1.0 / (2 * j + 1);
+        for (N i = 0; i < n; ++i)
+            y[i] = y[i] * (s[i] * s[i]) + c;
+    }
+    for (N i = 0; i < n; ++i)
+        y[i] = e[i] * ln2_hi + (2 * s[i] * y[i] + e[i] * ln2_lo);
+    if (out_of_range != 0)
+        for (N i = 0; i < n; ++i)
+            if (!(xb[i] >= DBL_MIN && xb[i] <= DBL_MAX))
+                y[i] = std::log(xb[i]);
+}
+
+/** The degree of the exp polynomial for an accuracy. */
+int exp_degree(activation_accuracy accuracy) {
+    switch (accuracy) {
+    case activation_accuracy::fast:
+        return 5;
+    case activation_accuracy::balanced:
+        return 8;
+    default:
+        return 13;
+    }
+}
+
+/** The number of terms of the log series for an accuracy. */
+int log_terms(activation_accuracy accuracy) {
+    switch (accuracy) {
+    case activation_accuracy::fast:
+        return 3;
+    case activation_accuracy::balanced:
+        return 6;
+    default:
+        return 10;
+    }
+}
+
+const char* activation_name(activation_type type) {
+    switch (type) {
+    case activation_type::sigmoid:
+        return "sigmoid";
+    case activation_type::tanh:
+        return "tanh";
+    case activation_type::relu:
+        return "relu";
+    case activation_type::leaky_relu:
+        return "leaky_relu";
+    case activation_type::gelu:
+        return "gelu";
+    case activation_type::exp:
+        return "exp";
+    default:
+        return "log";
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_activation -----------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Element-wise activation, evaluated block by block with the polynomial kernels,
+ *   and in parallel for large inputs.
+ * The derivative of every output only depends on its input and the output itself,
+ *   so derivatives are diagonal, and are computed from the forward outputs.
+ */
+struct tensor_function_activation: tensor_function {
+    activation_type type;
+    activation_accuracy accuracy;
+    double negative_slope;
+
+    tensor_function_activation(activation_type v_type, activation_accuracy v_accuracy, double v_negative_slope) :
+                    type(v_type),
+                    accuracy(v_accuracy),
+                    negative_slope(v_negative_slope) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        check_inputs(tv);
+        const tensor& input = *tv[0];
+        std::vector<double> result(input.size());
+        for_each_block(input.size(), [&](N first, N n) {evaluate(&input[first], &result[first], n);});
+        return tensor_cptr(new tensor(input.dimensionalities, std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        const tensor& input = *tv[0];
+        std::vector<double> slopes = local_derivatives(input, *v);
+        tensor d(std::move(tensor::zero_derivative(v->dimensionalities, input.dimensionalities)));
+        const N step_size = input.size() + 1;
+        for (N i = 0; i < slopes.size(); ++i)
+            d[i * step_size] = slopes[i];
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        // the derivative is diagonal, so chaining U just scales every row of U element-wise
+        check_inputs(tv);
+        assert(input_index == 0, activation_name(type), " only works on a single input.");
+        const tensor& input = *tv[0];
+        assert(input.size() > 0 && U.size() % input.size() == 0, activation_name(type),
+                " cannot chain derivative of incompatible size.");
+        std::vector<double> slopes = local_derivatives(input, value);
+        std::vector<double> result(U.size());
+        for_each_block(U.size(), [&](N first, N n) {
+            for (N i = first; i < first + n; ++i)
+                result[i] = U[i] * slopes[i % slopes.size()];
+        });
+        return tensor(U.dimensionalities, std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, activation_name(type), " only works on a single input.");
+        odims = idims[0];
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        const double num_elements = std::accumulate(idims[0].begin(), idims[0].end(), 1.0,
+                [](double acc, tensor::N dim) {return acc * dim;});
+        // range reduction and reconstruction, plus a multiply-add per coefficient
+        const double exp_cost = 8 + 2 * exp_degree(accuracy);
+        switch (type) {
+        case activation_type::relu:
+        case activation_type::leaky_relu:
+            return num_elements;
+        case activation_type::exp:
+            return exp_cost * num_elements;
+        case activation_type::log:
+            return (10 + 3 * log_terms(accuracy)) * num_elements;
+        case activation_type::gelu:
+            return (exp_cost + 6) * num_elements;
+        default:
+            return (exp_cost + 3) * num_elements;
+        }
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // element-wise functions do not care about the batch axis
+        return tensor_function_csptr(new tensor_function_activation(type, accuracy, negative_slope));
+    }
+
+    void check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 1, activation_name(type), " only works on a single input.");
+    }
+
+    /** Invoke func(first, n) on consecutive blocks of [0, size), on the thread pool for large sizes. */
+    static void for_each_block(N size, const std::function<void(N, N)>& func) {
+        auto blocks = [&](N begin, N end) {
+            for (N b = begin; b < end; ++b)
+                func(b * block_size, std::min(block_size, size - b * block_size));
+        };
+        const N num_blocks = (size + block_size - 1) / block_size;
+        if (size >= min_parallel_size)
+            parallel_for(num_blocks, blocks);
+        else
+            blocks(0, num_blocks);
+    }
+
+    /** The activation of n <= block_size elements. */
+    void evaluate(const double* x, double* y, N n) const {
+        double t[block_size];
+        switch (type) {
+        case activation_type::sigmoid:
+            for (N i = 0; i < n; ++i)
+                t[i] = -x[i];
+            exp(t, t, n);
+            for (N i = 0; i < n; ++i)
+                y[i] = 1 / (1 + t[i]);
+            break;
+        case activation_type::tanh:
+            // tanh(|x|) = -expm1(-2|x|) / (2 + expm1(-2|x|)), which does not cancel for small x
+            for (N i = 0; i < n; ++i)
+                t[i] = -2 * std::abs(x[i]);
+            expm1(t, t, n);
+            for (N i = 0; i < n; ++i)
+                y[i] = std::copysign(-t[i] / (2 + t[i]), x[i]);
+            break;
+        case activation_type::relu:
+            for (N i = 0; i < n; ++i)
+                y[i] = x[i] > 0 ? x[i] : 0;
+            break;
+        case activation_type::leaky_relu:
+            for (N i = 0; i < n; ++i)
+                y[i] = x[i] > 0 ? x[i] : negative_slope * x[i];
+            break;
+        case activation_type::gelu:
+            // 0.5 x (1 + tanh(u)) = x sigmoid(2u), which does not cancel for negative x
+            for (N i = 0; i < n; ++i)
+                t[i] = -2 * gelu_scale * (x[i] + gelu_cubic * x[i] * x[i] * x[i]);
+            exp(t, t, n);
+            for (N i = 0; i < n; ++i)
+                y[i] = x[i] / (1 + t[i]);
+            break;
+        case activation_type::exp:
+            exp(x, y, n);
+            break;
+        case activation_type::log:
+            log(x, y, n);
+            break;
+        }
+    }
+
+    // the polynomial kernels only beat the standard library when they vectorize to at least 4 lanes,
+    //   so precise activations, the defaults, stick to std::exp and std::log unless compiled for AVX2
+
+    void exp(const double* x, double* y, N n) const {
+        if (accuracy == activation_accuracy::precise)
+            kernels::precise_exp(x, y, n);
+        else
+            kernels::poly_exp(x, y, n, exp_degree(accuracy));
+    }
+
+    void expm1(const double* x, double* y, N n) const {
+        if (accuracy == activation_accuracy::precise)
+            std::transform(x, x + n, y, [](double v) {return std::expm1(v);});
+        else
+            kernels::poly_expm1(x, y, n, exp_degree(accuracy));
+    }
+
+    void log(const double* x, double* y, N n) const {
+        if (accuracy == activation_accuracy::precise)
+            std::transform(x, x + n, y, [](double v) {return std::log(v);});
+        else
+            kernels::poly_log(x, y, n, log_terms(accuracy));
+    }
+
+    /** The diagonal of the derivative, from the inputs x and the outputs y. */
+    std::vector<double> local_derivatives(const tensor& x, const tensor& y) const {
+        assert(x.size() == y.size(), activation_name(type), " expects an output of the size of its input.");
+        std::vector<double> result(x.size());
+        const N n = x.size();
+        switch (type) {
+        case activation_type::sigmoid:
+            if (accuracy == activation_accuracy::precise) {
+                // 1 - y cancels for large x, so use exp(-x) y^2 there; for x < 0 it does not (and exp(-x) may overflow)
+                for (N i = 0; i < n; ++i)
+                    result[i] = x[i] > 0 ? std::exp(-x[i]) * y[i] * y[i] : y[i] * (1 - y[i]);
+            } else {
+                for (N i = 0; i < n; ++i)
+                    result[i] = y[i] * (1 - y[i]);
+            }
+            break;
+        case activation_type::tanh:
+            for (N i = 0; i < n; ++i)
+                result[i] = 1 - y[i] * y[i];
+            break;
+        case activation_type::relu:
+            for (N i = 0; i < n; ++i)
+                result[i] = x[i] > 0 ? 1 : 0;
+            break;
+        case activation_type::leaky_relu:
+            for (N i = 0; i < n; ++i)
+                result[i] = x[i] > 0 ? 1 : negative_slope;
+            break;
+        case activation_type::gelu:
+            // with s = sigmoid(2u) = y / x: s + x s (1 - s) 2 u'
+            for (N i = 0; i < n; ++i) {
+                const double s = x[i] != 0 ? y[i] / x[i] : 0.5;
+                const double du = gelu_scale * (1 + 3 * gelu_cubic * x[i] * x[i]);
+                result[i] = s + 2 * x[i] * s * (1 - s) * du;
+            }
+            break;
+        case activation_type::exp:
+            std::copy(y.cbegin(), y.cend(), result.begin());
+            break;
+        case activation_type::log:
+            for (N i = 0; i < n; ++i)
+                result[i] = 1 / x[i];
+            break;
+        }
+        return result;
+    }
+};
+// end struct tensor_function_activation
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::activation(activation_type type, activation_accuracy accuracy) {
+    return tensor_function_csptr(new tensor_function_activation(type, accuracy, 0.01));
+}
+
+tensor_function_csptr tensor_function_factory::sigmoid() {
+    return activation(activation_type::sigmoid, activation_accuracy::precise);
+}
+
+tensor_function_csptr tensor_function_factory::tanh() {
+    return activation(activation_type::tanh, activation_accuracy::precise);
+}
+
+tensor_function_csptr tensor_function_factory::relu() {
+    return activation(activation_type::relu, activation_accuracy::precise);
+}
+
+tensor_function_csptr tensor_function_factory::leaky_relu(double negative_slope) {
+    return tensor_function_csptr(
+            new tensor_function_activation(activation_type::leaky_relu, activation_accuracy::precise, negative_slope));
+}
+
+tensor_function_csptr tensor_function_factory::gelu() {
+    return activation(activation_type::gelu, activation_accuracy::precise);
+}
+
+tensor_function_csptr tensor_function_factory::exp() {
+    return activation(activation_type::exp, activation_accuracy::precise);
+}
+
+tensor_function_csptr tensor_function_factory::log() {
+    return activation(activation_type::log, activation_accuracy::precise);
+}
+
+namespace kernels {
+
+void poly_exp(const double* x, double* y, std::size_t n, int degree) {
+    assert(degree >= 1 && degree <= 13, "poly_exp supports degrees 1 to 13, found ", degree);
+    for (N first = 0; first < n; first += block_size)
+        exp_block(x + first, y + first, std::min(block_size, n - first), degree, false);
+}
+
+void precise_exp(const double* x, double* y, std::size_t n) {
+    // 2^20 values at -O3: 1.7x as fast as std::exp with AVX2 and 3.8x with AVX-512,
+    //   but only as fast with SSE2, and 4x as slow unoptimized
+#ifdef __AVX2__
+    poly_exp(x, y, n, 13);
+#else
+    std::transform(x, x + n, y, [](double v) {return std::exp(v);});
+#endif
+}
+
+void poly_expm1(const double* x, double* y, std::size_t n, int degree) {
+    assert(degree >= 1 && degree <= 13, "poly_expm1 supports degrees 1 to 13, found ", degree);
+    for (N first = 0; first < n; first += block_size)
+        exp_block(x + first, y + first, std::min(block_size, n - first), degree, true);
+}
+
+void poly_log(const double* x, double* y, std::size_t n, int num_terms) {
+    assert(num_terms >= 1 && num_terms <= 16, "poly_log supports 1 to 16 terms, found ", num_terms);
+    for (N first = 0; first < n; first += block_size)
+        log_block(x + first, y + first, std::min(block_size, n - first), num_terms);
+}
+
+} // end namespace kernels
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,329 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** The smallest number of multiply-adds for which attention uses the thread pool. */
+const N min_parallel_work = 1 << 16;
+const double negative_infinity = -std::numeric_limits<double>::infinity();
+
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_attention ------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Scaled dot-product attention
+ *       O[b, i] = ∑ P[b, i, j] v[b, j],      P[b, i, j] = softmax ( q[b, i] . k[b, j] / sqrt(d) )
+ *                 j                                        j
+ *   for queries q {B..., lq, d}, keys k {B..., lk, d} and values v {B..., lk, dv},
+ *   where the leading axes B... (e.g., examples and heads) are independent,
+ *   and an optional mask {M..., lq, lk} (with M... trailing axes of B...) excludes the keys where it is zero.
+ * Queries are processed a block of tile_size at a time, against a tile of tile_size keys at a time,
+ *   with the maximum and the sum of exponentials of every query updated online from tile to tile,
+ *   so memory is bounded by the tile size rather than the {lq, lk} matrix of scores.
+ * Blocks of queries of all the leading axes are independent, and are processed in parallel.
+ */
+struct tensor_function_attention: tensor_function {
+    N tile_size;
+    tensor_function_attention(N ts) :
+                    tile_size(ts) {
+    }
+
+    struct problem {
+        const double* q;
+        const double* k;
+        const double* v;
+        const double* mask;
+        N batch, mask_batch, lq, lk, d, dv;
+        double scale;
+    };
+
+    /** The shape of the problem, and the dimensionalities of the output, from the dimensionalities of the inputs. */
+    static problem shape(const N_vector_vec& idims, tensor::N_vector& odims) {
+        assert(idims.size() == 3 || idims.size() == 4, "attention expects queries, keys, values and optionally a mask,"
+                " found ", idims.size(), " inputs.");
+        const tensor::N_vector& qd = idims[0], &kd = idims[1], &vd = idims[2];
+        assert(qd.size() >= 2 && kd.size() == qd.size() && vd.size() == qd.size(),
+                "attention expects queries, keys and values with the same number (at least 2) of axes.");
+        const N nb = qd.size() - 2;
+        assert(std::equal(qd.begin(), qd.begin() + nb, kd.begin()) && std::equal(qd.begin(), qd.begin() + nb,
+                vd.begin()), "attention expects queries, keys and values with the same leading axes.");
+        assert(kd[nb + 1] == qd[nb + 1], "attention expects queries and keys of the same size, found ", qd[nb + 1],
+                " and ", kd[nb + 1]);
+        assert(vd[nb] == kd[nb], "attention expects as many values as keys, found ", vd[nb], " and ", kd[nb]);
+        problem result { nullptr, nullptr, nullptr, nullptr, product(qd.begin(), qd.begin() + nb), 1, qd[nb], kd[nb],
+                qd[nb + 1], vd[nb + 1], 1 / std::sqrt(static_cast<double>(qd[nb + 1])) };
+        if (idims.size() == 4) {
+            const tensor::N_vector& md = idims[3];
+            assert(md.size() >= 2 && md.size() <= qd.size() && md[md.size() - 2] == result.lq
+                    && md[md.size() - 1] == result.lk, "attention expects a mask {..., ", result.lq, ", ", result.lk,
+                    "}.");
+            assert(std::equal(md.begin(), md.end() - 2, qd.begin() + (qd.size() - md.size())),
+                    "attention expects the leading axes of the mask to be trailing leading axes of the queries.");
+            result.mask_batch = product(md.begin(), md.end() - 2);
+        }
+        odims.assign(qd.begin(), qd.end() - 1);
+        odims.push_back(result.dv);
+        return result;
+    }
+
+    problem check_inputs(const tensor_cptr_vec& tv) const {
+        N_vector_vec idims;
+        for (const auto& t : tv)
+            idims.push_back(t->dimensionalities);
+        tensor::N_vector odims;
+        problem result = shape(idims, odims);
+        result.q = &(*tv[0])[0];
+        result.k = &(*tv[1])[0];
+        result.v = &(*tv[2])[0];
+        result.mask = tv.size() == 4 ? &(*tv[3])[0] : nullptr;
+        return result;
+    }
+
+    N num_query_blocks(const problem& pr) const {
+        return (pr.lq + tile_size - 1) / tile_size;
+    }
+
+    /**
+     * The scaled scores S[i, j] = q[b, i0 + i] . k[b, j0 + j] / sqrt(d) of m queries and n keys,
+     *   and -infinity where masked if masked.
+     * q and k may be replaced by derivatives w.r.t. them, of the same layout.
+     */
+    static void scores(const problem& pr, const double* q, const double* k, N b, N i0, N m, N j0, N n, bool masked,
+            double* S) {
+        kernels::gemm(q + (b * pr.lq + i0) * pr.d, false, k + (b * pr.lk + j0) * pr.d, true, S, m, pr.d, n);
+        const double* mask = pr.mask ? pr.mask + ((b % pr.mask_batch) * pr.lq + i0) * pr.lk + j0 : nullptr;
+        for (N i = 0; i < m; ++i)
+            for (N j = 0; j < n; ++j)
+                S[i * n + j] = masked && mask && mask[i * pr.lk + j] == 0 ? negative_infinity : S[i * n + j] * pr.scale;
+    }
+
+    /**
+     * The outputs (if out is not null) and the log of the softmax normalizer L of the queries [i0, i0 + m) of b,
+     *   with the online softmax over tiles of keys.
+     * Queries with all their keys masked have zero outputs and L = -infinity.
+     */
+    void forward_block(const problem& pr, N b, N i0, N m, double* out, double* L) const {
+        std::vector<double> S(m * tile_size), PV(m * pr.dv), acc(m * pr.dv, 0.0);
+        std::vector<double> row_max(m, negative_infinity), row_sum(m, 0.0);
+        for (N j0 = 0; j0 < pr.lk; j0 += tile_size) {
+            const N n = std::min(tile_size, pr.lk - j0);
+            scores(pr, pr.q, pr.k, b, i0, m, j0, n, true, S.data());
+            for (N i = 0; i < m; ++i) {
+                double* s = &S[i * n];
+                const double new_max = std::max(row_max[i], *std::max_element(s, s + n));
+                if (new_max == negative_infinity)
+                    continue; // all masked so far, the scores stay -infinity
+                // rescale what was accumulated w.r.t. the old maximum
+                const double alpha = std::exp(row_max[i] - new_max);
+                row_sum[i] *= alpha;
+                for (N e = 0; e < pr.dv; ++e)
+                    acc[i * pr.dv + e] *= alpha;
+                row_max[i] = new_max;
+                for (N j = 0; j < n; ++j)
+                    s[j] -= new_max;
+            }
+            kernels::precise_exp(S.data(), S.data(), m * n);
+            for (N i = 0; i < m; ++i)
+                row_sum[i] = std::accumulate(&S[i * n], &S[i * n] + n, row_sum[i]);
+            if (out) {
+                kernels::gemm(S.data(), pr.v + (b * pr.lk + j0) * pr.dv, PV.data(), m, n, pr.dv);
+                std::transform(acc.begin(), acc.end(), PV.begin(), acc.begin(), std::plus<double>());
+            }
+        }
+        for (N i = 0; i < m; ++i) {
+            L[i] = row_sum[i] > 0 ? row_max[i] + std::log(row_sum[i]) : negative_infinity;
+            if (out)
+                for (N e = 0; e < pr.dv; ++e)
+                    out[i * pr.dv + e] = row_sum[i] > 0 ? acc[i * pr.dv + e] / row_sum[i] : 0;
+        }
+    }
+
+    /**
+     * The directional derivative r of the outputs of the queries [i0, i0 + m) of b,
+     *   along the direction u of the input input_index,
+     *   given the outputs O and log normalizers L of these queries:
+     *       w.r.t. v:         r[i] = ∑ P[i, j] u[j]
+     *                               j
+     *       w.r.t. q or k:    r[i] = ∑ P[i, j] dS[i, j] v[j] - O[i] ∑ P[i, j] dS[i, j]
+     *                               j                              j
+     *   where dS are the scores with u in place of q or k.
+     * P is recomputed from L a tile at a time.
+     */
+    void jvp_block(const problem& pr, N input_index, const double* u, N b, N i0, N m, const double* O,
+            const double* L, double* r) const {
+        std::vector<double> P(m * tile_size), dS(m * tile_size), WV(m * pr.dv), c(m, 0.0);
+        std::fill(r, r + m * pr.dv, 0.0);
+        for (N j0 = 0; j0 < pr.lk; j0 += tile_size) {
+            const N n = std::min(tile_size, pr.lk - j0);
+            scores(pr, pr.q, pr.k, b, i0, m, j0, n, true, P.data());
+            for (N i = 0; i < m; ++i)
+                for (N j = 0; j < n; ++j)
+                    P[i * n + j] = L[i] == negative_infinity ? negative_infinity : P[i * n + j] - L[i];
+            kernels::precise_exp(P.data(), P.data(), m * n);
+            if (input_index == 2) {
+                kernels::gemm(P.data(), u + (b * pr.lk + j0) * pr.dv, WV.data(), m, n, pr.dv);
+            } else {
+                scores(pr, input_index == 0 ? u : pr.q, input_index == 1 ? u : pr.k, b, i0, m, j0, n, false,
+                        dS.data());
+                for (N i = 0; i < m; ++i)
+                    for (N j = 0; j < n; ++j) {
+                        dS[i * n + j] *= P[i * n + j];
+                        c[i] += dS[i * n + j];
+                    }
+                kernels::gemm(dS.data(), pr.v + (b * pr.lk + j0) * pr.dv, WV.data(), m, n, pr.dv);
+            }
+            std::transform(r, r + m * pr.dv, WV.begin(), r, std::plus<double>());
+        }
+        if (input_index != 2)
+            for (N i = 0; i < m; ++i)
+                for (N e = 0; e < pr.dv; ++e)
+                    r[i * pr.dv + e] -= c[i] * O[i * pr.dv + e];
+    }
+
+    /** Invoke func(unit) for units [0, num_units), on the thread pool if there is enough work. */
+    static void for_each_unit(N num_units, N work, const std::function<void(N)>& func) {
+        auto units = [&](N begin, N end) {
+            for (N unit = begin; unit < end; ++unit)
+                func(unit);
+        };
+        if (work >= min_parallel_work)
+            parallel_for(num_units, units);
+        else
+            units(0, num_units);
+    }
+
+    /** The log normalizers of all the queries {batch, lq}, and the outputs into out if it is not null. */
+    std::vector<double> forward(const problem& pr, double* out) const {
+        std::vector<double> L(pr.batch * pr.lq);
+        const N nqb = num_query_blocks(pr);
+        for_each_unit(pr.batch * nqb, pr.batch * pr.lq * pr.lk * (pr.d + pr.dv), [&](N unit) {
+            const N b = unit / nqb, i0 = (unit % nqb) * tile_size, m = std::min(tile_size, pr.lq - i0);
+            forward_block(pr, b, i0, m, out ? out + (b * pr.lq + i0) * pr.dv : nullptr, &L[b * pr.lq + i0]);
+        });
+        return L;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        problem pr = check_inputs(tv);
+        tensor::N_vector odims(tv[0]->dimensionalities.begin(), tv[0]->dimensionalities.end() - 1);
+        odims.push_back(pr.dv);
+        std::vector<double> result(pr.batch * pr.lq * pr.dv);
+        forward(pr, result.data());
+        return tensor_cptr(new tensor(std::move(odims), std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        tensor_cptr_vec derivatives;
+        for (N i_input = 0; i_input < tv.size(); ++i_input)
+            derivatives.push_back(tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *v, i_input)))));
+        return derivative { v, derivatives };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        // chain the identity: every element of the input may influence every output of its batch
+        assert(input_index < tv.size(), "attention cannot differentiate w.r.t. input ", input_index, " of ",
+                tv.size());
+        return chain_derivative(tv, value, input_index, tensor::identity_derivative(tv[input_index]->dimensionalities));
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        problem pr = check_inputs(tv);
+        assert(input_index < tv.size(), "attention cannot chain derivative w.r.t. input ", input_index, " of ",
+                tv.size());
+        const tensor& input = *tv[input_index];
+        assert(input.size() > 0 && U.size() % input.size() == 0,
+                "attention cannot chain derivative of incompatible size.");
+        const N x_size = U.size() / input.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        if (input_index == 3)
+            return tensor::zero(rdims); // the mask only selects keys
+
+        std::vector<double> L = forward(pr, nullptr);
+        std::vector<double> result(x_size * value.size());
+        const N nqb = num_query_blocks(pr);
+        const N units_per_x = pr.batch * nqb;
+        for_each_unit(x_size * units_per_x, x_size * pr.batch * pr.lq * pr.lk * (pr.d + pr.dv), [&](N unit) {
+            const N x = unit / units_per_x, b = (unit % units_per_x) / nqb, i0 = (unit % nqb) * tile_size;
+            const N m = std::min(tile_size, pr.lq - i0), first = (b * pr.lq + i0) * pr.dv;
+            jvp_block(pr, input_index, &U[x * input.size()], b, i0, m, &value[first], &L[b * pr.lq + i0],
+                    &result[x * value.size() + first]);
+        });
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        shape(idims, odims);
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        tensor::N_vector odims;
+        problem pr = shape(idims, odims);
+        // scores and weighted values, plus the exponentials
+        return pr.batch * pr.lq * pr.lk * (2.0 * pr.d + 2.0 * pr.dv + 30);
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // batched queries, keys and values just add a leading axis, and an unbatched mask is broadcast over it;
+        // a batched mask only lines up with them if it had all their leading axes, which is not known here
+        if (!is_batched[0] || !is_batched[1] || !is_batched[2] || (is_batched.size() == 4 && is_batched[3]))
+            return nullptr;
+        return tensor_function_csptr(new tensor_function_attention(tile_size));
+    }
+};
+// end struct tensor_function_attention
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::attention(std::size_t tile_size) {
+    assert(tile_size > 0, "attention expects a positive tile size.");
+    return tensor_function_csptr(new tensor_function_attention(tile_size));
+}
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,139 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/graph.h>
+#include <para/graph/exception.h>
+#include "subgraph.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_conditional ----------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Evaluates the branch selected by the predicate (the first input) on the operands (the other inputs).
+ * The branches are separate graphs, so the branches that are not taken are never touched.
+ */
+struct tensor_function_conditional: tensor_function {
+    std::vector<conditional_branch> branches;
+
+    tensor_function_conditional(const std::vector<conditional_branch>& b) :
+                    branches(b) {
+        assert(!branches.empty(), "conditional expects at least one branch.");
+        for (const auto& branch : branches) {
+            assert(branch.subgraph != nullptr, "conditional expects a graph for every branch.");
+            assert(branch.operands.size() == branches[0].operands.size(),
+                    "conditional expects every branch to bind all the operands.");
+            assert(binds_every_variable_once(*branch.subgraph, branch.operands),
+                    "conditional expects every variable of a branch to hold exactly one operand.");
+        }
+    }
+
+    N num_operands() const {
+        return branches[0].operands.size();
+    }
+
+    /** The branch selected by the value of the predicate. */
+    const conditional_branch& taken_branch(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == num_operands() + 1, "conditional expects a predicate and ", num_operands(),
+                " operands, found ", tv.size(), " inputs.");
+        assert(tv[0]->size() == 1, "conditional expects a predicate with a single value.");
+        const double k = (*tv[0])[0];
+        assert(k >= 0 && k < branches.size() && k == std::floor(k), "conditional expects a predicate in [0, ",
+                branches.size(), "), found ", k);
+        return branches[static_cast<N>(k)];
+    }
+
+    /** The values of the variables of a branch. */
+    static tensor_cptr_vec branch_inputs(const conditional_branch& branch, const tensor_cptr_vec& tv) {
+        tensor_cptr_vec result(branch.operands.size());
+        for (N i = 0; i < branch.operands.size(); ++i)
+            result[branch.operands[i].index] = tv[i + 1];
+        return result;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        const conditional_branch& branch = taken_branch(tv);
+        return branch.subgraph->value(branch.output, branch_inputs(branch, tv));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        const conditional_branch& branch = taken_branch(tv);
+        derivative d = branch.subgraph->partial_gradient(branch.output, branch.operands, branch_inputs(branch, tv));
+        tensor_cptr d_predicate(new tensor(tensor::zero_derivative(d.node_value->dimensionalities,
+                tv[0]->dimensionalities)));
+        d.node_derivative.insert(d.node_derivative.begin(), d_predicate);
+        return d;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == num_operands() + 1, "conditional expects a predicate and ", num_operands(),
+                " operands, found ", idims.size(), " inputs.");
+        assert(std::accumulate(idims[0].begin(), idims[0].end(), N(1), std::multiplies<N>()) == 1,
+                "conditional expects a predicate with a single value.");
+        bool known = true, found = false;
+        for (const auto& branch : branches) {
+            const graph& g = *branch.subgraph;
+            for (N i = 0; i < branch.operands.size(); ++i)
+                assert(!g.has_dimensionalities(branch.operands[i]) || g.get_dimensionalities(branch.operands[i])
+                        == idims[i + 1], "conditional operand ", i, " does not have the dimensionalities declared by"
+                        " a branch.");
+            if (!g.has_dimensionalities(branch.output)) {
+                known = false;
+                continue;
+            }
+            tensor::N_vector branch_dims = g.get_dimensionalities(branch.output);
+            // compared with the first branch whose output dimensionalities are known
+            assert(!found || branch_dims == odims,
+                    "conditional expects branches with outputs of the same dimensionalities.");
+            odims = branch_dims;
+            found = true;
+        }
+        return known;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // an estimate: the most expensive branch
+        double result = 0;
+        for (const auto& branch : branches)
+            if (branch.subgraph->has_dimensionalities(branch.output))
+                result = std::max(result, branch.subgraph->flop_count(branch.output));
+        return result;
+    }
+};
+// end struct tensor_function_conditional
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr conditional(const std::vector<conditional_branch>& branches) {
+    return tensor_function_csptr(new tensor_function_conditional(branches));
+}
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,411 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- window_geometry ----------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * A window of kh x kw taps, sliding over an h x w image,
+ *   with a stride, zero padding on every side, and a dilation between taps.
+ */
+struct window_geometry {
+    N h, w, kh, kw, stride, padding, dilation;
+    N oh, ow;
+
+    window_geometry(N v_h, N v_w, N v_kh, N v_kw, N v_stride, N v_padding, N v_dilation) :
+                    h(v_h),
+                    w(v_w),
+                    kh(v_kh),
+                    kw(v_kw),
+                    stride(v_stride),
+                    padding(v_padding),
+                    dilation(v_dilation) {
+        assert(stride > 0 && dilation > 0, "Sliding windows need a positive stride and dilation.");
+        assert(kh > 0 && kw > 0 && h + 2 * padding >= dilation * (kh - 1) + 1
+                && w + 2 * padding >= dilation * (kw - 1) + 1, "A window of ", kh, "x", kw, " with dilation ",
+                dilation, " does not fit in an image of ", h, "x", w, " with padding ", padding);
+        oh = (h + 2 * padding - dilation * (kh - 1) - 1) / stride + 1;
+        ow = (w + 2 * padding - dilation * (kw - 1) - 1) / stride + 1;
+    }
+
+    /** Find the image position of a tap of the window at an output position, returning false if it is padding. */
+    bool tap(N i_oh, N i_ow, N i_kh, N i_kw, N& offset) const {
+        // unsigned arithmetic: positions in the padding before the image wrap around to large values
+        const N ih = i_oh * stride + i_kh * dilation - padding;
+        const N iw = i_ow * stride + i_kw * dilation - padding;
+        if (ih >= h || iw >= w)
+            return false;
+        offset = ih * w + iw;
+        return true;
+    }
+
+    /**
+     * Visit every tap of the window at every output position:
+     *   visitor(output offset within the image, tap number, image offset), skipping the padding.
+     */
+    template<typename t_visitor>
+    void visit(t_visitor visitor) const {
+        for (N i_oh = 0, o = 0; i_oh < oh; ++i_oh)
+            for (N i_ow = 0; i_ow < ow; ++i_ow, ++o)
+                for (N i_kh = 0, t = 0; i_kh < kh; ++i_kh)
+                    for (N i_kw = 0; i_kw < kw; ++i_kw, ++t) {
+                        N offset;
+                        if (tap(i_oh, i_ow, i_kh, i_kw, offset))
+                            visitor(o, t, offset);
+                    }
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_conv2d ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * 2-D convolution (strictly, cross-correlation) of images {n, c, h, w}
+ *   with kernels {f, c / groups, kh, kw}, giving images {n, f, oh, ow}.
+ * The channels and the kernels are split into groups,
+ *   and each group of kernels only sees the corresponding group of channels.
+ */
+struct tensor_function_conv2d: tensor_function {
+    N stride, padding, dilation, groups;
+    tensor_function_conv2d(N v_stride, N v_padding, N v_dilation, N v_groups) :
+                    stride(v_stride),
+                    padding(v_padding),
+                    dilation(v_dilation),
+                    groups(v_groups) {
+    }
+
+    struct shape {
+        N n, c, f, cg, fg;
+        window_geometry geometry;
+    };
+
+    shape check_dimensionalities(const tensor::N_vector& xdims, const tensor::N_vector& kdims) const {
+        assert(xdims.size() == 4 && kdims.size() == 4, "conv2d expects images {n, c, h, w} and kernels",
+                " {f, c / groups, kh, kw}, found orders ", xdims.size(), " and ", kdims.size());
+        assert(groups > 0 && xdims[1] % groups == 0 && kdims[0] % groups == 0,
+                "conv2d expects channels and kernels divisible by ", groups, " groups.");
+        assert(kdims[1] == xdims[1] / groups, "conv2d expects kernels with ", xdims[1] / groups, " channels, found ",
+                kdims[1]);
+        return shape { xdims[0], xdims[1], kdims[0], kdims[1], kdims[0] / groups, window_geometry(xdims[2], xdims[3],
+                kdims[2], kdims[3], stride, padding, dilation) };
+    }
+
+    /**
+     * Convolve images with kernels, by lowering every image and group to a matrix multiplication:
+     *   the taps seen by every output position are gathered as columns (im2col),
+     *   and multiplied by the kernels of the group, seen as a {fg, cg x kh x kw} matrix.
+     * Images are convolved in parallel.
+     */
+    static std::vector<double> convolve(const shape& s, N num_images, const double* x, const double* k) {
+        const window_geometry& g = s.geometry;
+        const N taps = g.kh * g.kw;
+        const N rows = s.cg * taps, cols = g.oh * g.ow;
+        const N groups = s.c / s.cg;
+        std::vector<double> result(num_images * s.f * cols);
+        parallel_for(num_images, [&](N image_begin, N image_end) {
+            std::vector<double> columns(rows * cols);
+            for (N image = image_begin; image < image_end; ++image)
+                for (N group = 0; group < groups; ++group) {
+                    std::fill(columns.begin(), columns.end(), 0.0);
+                    const double* channels = x + (image * s.c + group * s.cg) * g.h * g.w;
+                    for (N c = 0; c < s.cg; ++c) {
+                        const double* channel = channels + c * g.h * g.w;
+                        double* channel_columns = &columns[c * taps * cols];
+                        g.visit([&](N o, N t, N offset) {channel_columns[t * cols + o] = channel[offset];});
+                    }
+                    kernels::gemm(k + group * s.fg * rows, columns.data(),
+                            &result[(image * s.f + group * s.fg) * cols], s.fg, rows, cols);
+                }
+        });
+        return result;
+    }
+
+    static void check_inputs(const tensor_cptr_vec& tv) {
+        assert(tv.size() == 2, "conv2d expects images and kernels, found ", tv.size(), " inputs.");
+    }
+
+    tensor::N_vector output_dimensionalities(const shape& s) const {
+        return tensor::N_vector { s.n, s.f, s.geometry.oh, s.geometry.ow };
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        check_inputs(tv);
+        shape s = check_dimensionalities(tv[0]->dimensionalities, tv[1]->dimensionalities);
+        return tensor_cptr(new tensor(output_dimensionalities(s), convolve(s, s.n, &(*tv[0])[0], &(*tv[1])[0])));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        /*
+         * The output is linear in each input:
+         *   out[n, f, o] = ∑ x[n, c, image offset of tap t at o] x k[f, c, t]
+         * so the derivatives are scattered from the taps,
+         *   with the value of the other input at each tap.
+         */
+        check_inputs(tv);
+        tensor_cptr v = value(tv);
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *v, 0)))),
+                tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *v, 1)))) } };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        check_inputs(tv);
+        assert(input_index < 2, "conv2d expects images and kernels.");
+        const tensor& x = *tv[0];
+        const tensor& k = *tv[1];
+        shape s = check_dimensionalities(x.dimensionalities, k.dimensionalities);
+        tensor result(std::move(tensor::zero_derivative(value.dimensionalities, tv[input_index]->dimensionalities)));
+        const window_geometry& g = s.geometry;
+        const N out_size = value.size(), image_size = g.h * g.w, taps = g.kh * g.kw, cols = g.oh * g.ow;
+        for (N image = 0; image < s.n; ++image)
+            for (N f = 0; f < s.f; ++f)
+                for (N c = 0; c < s.cg; ++c) {
+                    const N x_channel = (image * s.c + f / s.fg * s.cg + c) * image_size;
+                    const N k_channel = (f * s.cg + c) * taps;
+                    const N out_channel = (image * s.f + f) * cols;
+                    if (input_index == 0)
+                        g.visit([&](N o, N t, N offset) {
+                            result[(x_channel + offset) * out_size + out_channel + o] += k[k_channel + t];
+                        });
+                    else
+                        g.visit([&](N o, N t, N offset) {
+                            result[(k_channel + t) * out_size + out_channel + o] += x[x_channel + offset];
+                        });
+                }
+        return result;
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        /*
+         * Since the convolution is linear in each input,
+         *   chaining a derivative U w.r.t. some X through it
+         *   convolves every row of U in place of that input.
+         */
+        check_inputs(tv);
+        assert(input_index < 2, "conv2d expects images and kernels.");
+        shape s = check_dimensionalities(tv[0]->dimensionalities, tv[1]->dimensionalities);
+        const tensor& input = *tv[input_index];
+        assert(input.size() > 0 && U.size() % input.size() == 0,
+                "conv2d cannot chain derivative of incompatible size.");
+        const N rows = U.size() / input.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - 4);
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        std::vector<double> result;
+        if (input_index == 0) {
+            // the rows of U are just more images
+            result = convolve(s, rows * s.n, &U[0], &(*tv[1])[0]);
+        } else {
+            result.reserve(rows * value.size());
+            for (N row = 0; row < rows; ++row) {
+                std::vector<double> r = convolve(s, s.n, &(*tv[0])[0], &U[row * input.size()]);
+                result.insert(result.end(), r.begin(), r.end());
+            }
+        }
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 2, "conv2d expects images and kernels, found ", idims.size(), " inputs.");
+        odims = output_dimensionalities(check_dimensionalities(idims[0], idims[1]));
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        shape s = check_dimensionalities(idims[0], idims[1]);
+        return 2.0 * s.n * s.f * s.geometry.oh * s.geometry.ow * s.cg * s.geometry.kh * s.geometry.kw;
+    }
+};
+// end struct tensor_function_conv2d
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_pool -----------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Max or average pooling over windows of the two trailing axes of its input.
+ * Padding never wins a max, and counts as zeros in an average.
+ */
+struct tensor_function_pool: tensor_function {
+    bool is_max;
+    N window, stride, padding;
+    tensor_function_pool(bool v_is_max, N v_window, N v_stride, N v_padding) :
+                    is_max(v_is_max),
+                    window(v_window),
+                    stride(v_stride),
+                    padding(v_padding) {
+    }
+
+    window_geometry geometry(const tensor::N_vector& idims) const {
+        assert(idims.size() >= 2, "pooling expects an input with at least two axes, found ", idims.size());
+        assert(padding < window, "pooling expects padding smaller than the window.");
+        return window_geometry(idims[idims.size() - 2], idims.back(), window, window, stride, padding, 1);
+    }
+
+    static const tensor& single_input(const tensor_cptr_vec& tv) {
+        assert(tv.size() == 1, "pooling only works on a single input.");
+        return *tv[0];
+    }
+
+    /**
+     * The input values that every output value depends on, with their weights:
+     *   the first maximum of the window with weight 1 (or its first NaN, if any, or its first tap,
+     *   if all of them are -infinity), or every tap with weight 1 / window^2.
+     */
+    void visit_sources(const tensor& input, const window_geometry& g,
+            const std::function<void(N output_offset, N input_offset, double weight)>& visitor) const {
+        const N images = input.size() / (g.h * g.w);
+        const N cols = g.oh * g.ow;
+        const double average_weight = 1.0 / (window * window);
+        std::vector<N> argmax(cols);
+        std::vector<bool> seen(cols);
+        for (N image = 0; image < images; ++image) {
+            const N in_base = image * g.h * g.w, out_base = image * cols;
+            if (is_max) {
+                // every window starts from its first tap, and only moves on to larger values or to a first NaN
+                std::fill(seen.begin(), seen.end(), false);
+                g.visit([&](N o, N, N offset) {
+                    const double x = input[in_base + offset];
+                    if (!seen[o] || x > input[argmax[o]] || (std::isnan(x) && !std::isnan(input[argmax[o]])))
+                        argmax[o] = in_base + offset;
+                    seen[o] = true;
+                });
+                for (N o = 0; o < cols; ++o)
+                    if (seen[o])
+                        visitor(out_base + o, argmax[o], 1);
+            } else
+                g.visit([&](N o, N, N offset) {visitor(out_base + o, in_base + offset, average_weight);});
+        }
+    }
+
+    tensor::N_vector output_dimensionalities(const tensor::N_vector& idims, const window_geometry& g) const {
+        tensor::N_vector result(idims.begin(), idims.end() - 2);
+        result.push_back(g.oh);
+        result.push_back(g.ow);
+        return result;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        const tensor& input = single_input(tv);
+        window_geometry g = geometry(input.dimensionalities);
+        tensor::N_vector odims = output_dimensionalities(input.dimensionalities, g);
+        std::vector<double> result(product(odims.begin(), odims.end()), 0);
+        visit_sources(input, g, [&](N o, N i, double weight) {result[o] += weight * input[i];});
+        return tensor_cptr(new tensor(std::move(odims), std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        const tensor& input = single_input(tv);
+        tensor_cptr v = value(tv);
+        tensor d(std::move(tensor::zero_derivative(v->dimensionalities, input.dimensionalities)));
+        const N out_size = v->size();
+        visit_sources(input, geometry(input.dimensionalities),
+                [&](N o, N i, double weight) {d[i * out_size + o] += weight;});
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        // gather every row of U from the sources of each output value
+        const tensor& input = single_input(tv);
+        assert(input_index == 0, "pooling only works on a single input.");
+        const N n = input.size(), out_size = value.size();
+        assert(n > 0 && U.size() % n == 0, "pooling cannot chain derivative of incompatible size.");
+        std::vector<N> sources;
+        std::vector<N> outputs;
+        std::vector<double> weights;
+        visit_sources(input, geometry(input.dimensionalities), [&](N o, N i, double weight) {
+            outputs.push_back(o);
+            sources.push_back(i);
+            weights.push_back(weight);
+        });
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        std::vector<double> result(U.size() / n * out_size, 0);
+        for (N row = 0; row < U.size() / n; ++row)
+            for (N s = 0; s < sources.size(); ++s)
+                result[row * out_size + outputs[s]] += weights[s] * U[row * n + sources[s]];
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "pooling only works on a single input.");
+        odims = output_dimensionalities(idims[0], geometry(idims[0]));
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        tensor::N_vector odims;
+        infer_dimensionalities(idims, odims);
+        return 1.0 * product(odims.begin(), odims.end()) * window * window;
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>&) const override {
+        // pooling works on the two trailing axes, whatever the leading ones
+        return tensor_function_csptr(new tensor_function_pool(is_max, window, stride, padding));
+    }
+};
+// end struct tensor_function_pool
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::conv2d(std::size_t stride, std::size_t padding, std::size_t dilation,
+        std::size_t groups) {
+    assert(stride > 0 && dilation > 0 && groups > 0, "conv2d needs a positive stride, dilation and number of groups.");
+    return tensor_function_csptr(new tensor_function_conv2d(stride, padding, dilation, groups));
+}
+
+tensor_function_csptr tensor_function_factory::max_pool(std::size_t window, std::size_t stride, std::size_t padding) {
+    assert(window > 0 && stride > 0, "max_pool needs a positive window and stride.");
+    return tensor_function_csptr(new tensor_function_pool(true, window, stride, padding));
+}
+
+tensor_function_csptr tensor_function_factory::avg_pool(std::size_t window, std::size_t stride, std::size_t padding) {
+    assert(window > 0 && stride > 0, "avg_pool needs a positive window and stride.");
+    return tensor_function_csptr(new tensor_function_pool(false, window, stride, padding));
+}
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,570 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<int> label_vec;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** Number of labels that can be written in a subscript string: a-z and A-Z. */
+const int num_letter_labels = 52;
+
+/**
+ * Operands with up to this many inputs are contracted in the optimal order,
+ *   found by dynamic programming over all subsets of operands.
+ * Larger expressions fall back to a greedy ordering.
+ */
+const std::size_t max_optimal_path_operands = 10;
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- einsum_expression --------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * A parsed einsum subscript string like "ij,jk->ik".
+ * Labels are integers, so that fresh labels can be created when differentiating.
+ */
+struct einsum_expression {
+    std::vector<label_vec> operand_labels;
+    label_vec output_labels;
+
+    static int letter_to_label(char c) {
+        if (c >= 'a' && c <= 'z')
+            return c - 'a';
+        if (c >= 'A' && c <= 'Z')
+            return 26 + c - 'A';
+        throw std::runtime_error(concat("einsum subscripts can only contain letters, found '", c, "'"));
+    }
+
+    static einsum_expression parse(const std::string& subscripts) {
+        einsum_expression result;
+        std::string::size_type arrow = subscripts.find("->");
+        std::string inputs = subscripts.substr(0, arrow);
+        result.operand_labels.push_back(label_vec());
+        for (char c : inputs) {
+            if (c == ',')
+                result.operand_labels.push_back(label_vec());
+            else if (c != ' ')
+                result.operand_labels.back().push_back(letter_to_label(c));
+        }
+        if (arrow != std::string::npos) {
+            for (char c : subscripts.substr(arrow + 2)) {
+                if (c != ' ')
+                    result.output_labels.push_back(letter_to_label(c));
+            }
+        } else {
+            // implicit mode: labels appearing exactly once, in alphabetical order
+            std::vector<int> counts(num_letter_labels, 0);
+            for (const auto& ol : result.operand_labels)
+                for (int l : ol)
+                    ++counts[l];
+            for (int l = 0; l < num_letter_labels; ++l)
+                if (counts[l] == 1)
+                    result.output_labels.push_back(l);
+        }
+        for (std::size_t i = 0; i < result.output_labels.size(); ++i) {
+            int l = result.output_labels[i];
+            assert(std::count(result.output_labels.begin(), result.output_labels.end(), l) == 1,
+                    "einsum output subscripts cannot repeat a label: ", subscripts);
+            assert(std::any_of(result.operand_labels.begin(), result.operand_labels.end(),
+                    [l](const label_vec& ol) {return std::find(ol.begin(), ol.end(), l) != ol.end();}),
+                    "einsum output subscripts must appear in some operand: ", subscripts);
+        }
+        return result;
+    }
+
+    int num_labels() const {
+        int result = num_letter_labels;
+        for (const auto& ol : operand_labels)
+            for (int l : ol)
+                result = std::max(result, l + 1);
+        for (int l : output_labels)
+            result = std::max(result, l + 1);
+        return result;
+    }
+
+    /** Find the size of every label, checking that the operands agree with each other. */
+    tensor::N_vector label_dimensionalities(const N_vector_vec& idims) const {
+        assert(idims.size() == operand_labels.size(), "einsum expects ", operand_labels.size(), " inputs, found ",
+                idims.size());
+        tensor::N_vector result(num_labels(), 0);
+        for (std::size_t i_op = 0; i_op < idims.size(); ++i_op) {
+            const label_vec& labels = operand_labels[i_op];
+            assert(labels.size() == idims[i_op].size(), "einsum input ", i_op, " has order ", idims[i_op].size(),
+                    " but its subscripts have ", labels.size(), " labels.");
+            for (std::size_t i_dim = 0; i_dim < labels.size(); ++i_dim) {
+                N& size = result[labels[i_dim]];
+                assert(size == 0 || size == idims[i_op][i_dim], "einsum input ", i_op,
+                        " has mismatching dimensionality at axis ", i_dim);
+                size = idims[i_op][i_dim];
+            }
+        }
+        return result;
+    }
+
+    tensor::N_vector output_dimensionalities(const tensor::N_vector& label_dims) const {
+        tensor::N_vector result;
+        for (int l : output_labels)
+            result.push_back(label_dims[l]);
+        return result;
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- contraction path ---------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * An order of pairwise contractions.
+ * Operands are numbered 0..n-1, and step s creates the intermediate numbered n+s.
+ */
+struct contraction_path {
+    std::vector<std::pair<int, int>> steps;
+    /** Number of multiply-adds needed by all the pairwise contractions. */
+    double cost;
+};
+
+double label_product(const label_vec& labels, const tensor::N_vector& label_dims) {
+    return std::accumulate(labels.begin(), labels.end(), 1.0,
+            [&](double acc, int l) {return acc * label_dims[l];});
+}
+
+label_vec sorted_union(const label_vec& lhs, const label_vec& rhs) {
+    label_vec result;
+    std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(result));
+    return result;
+}
+
+label_vec sorted_unique(label_vec labels) {
+    std::sort(labels.begin(), labels.end());
+    labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+    return labels;
+}
+
+/**
+ * Find the order of pairwise contractions minimizing the number of multiply-adds,
+ *   exactly for small expressions and greedily for large ones.
+ */
+contraction_path find_contraction_path(const einsum_expression& expr, const tensor::N_vector& label_dims) {
+    const std::size_t n = expr.operand_labels.size();
+    std::vector<label_vec> sets;
+    for (const auto& ol : expr.operand_labels)
+        sets.push_back(sorted_unique(ol));
+    const label_vec output_set = sorted_unique(expr.output_labels);
+
+    // the labels of an intermediate are those that are still needed by the output or by other operands
+    auto kept_labels = [&](const std::vector<bool>& in_group) {
+        label_vec inside, outside = output_set;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (in_group[i])
+                inside = sorted_union(inside, sets[i]);
+            else
+                outside = sorted_union(outside, sets[i]);
+        }
+        label_vec result;
+        std::set_intersection(inside.begin(), inside.end(), outside.begin(), outside.end(),
+                std::back_inserter(result));
+        return result;
+    };
+
+    contraction_path path { { }, 0 };
+    if (n <= 1)
+        return path;
+
+    if (n <= max_optimal_path_operands) {
+        const std::size_t num_masks = std::size_t(1) << n;
+        std::vector<label_vec> mask_labels(num_masks);
+        for (std::size_t mask = 1; mask < num_masks; ++mask) {
+            std::vector<bool> in_group(n);
+            for (std::size_t i = 0; i < n; ++i)
+                in_group[i] = (mask >> i) & 1;
+            mask_labels[mask] = kept_labels(in_group);
+        }
+        std::vector<double> best_cost(num_masks, std::numeric_limits<double>::infinity());
+        std::vector<std::size_t> best_split(num_masks, 0);
+        for (std::size_t i = 0; i < n; ++i)
+            best_cost[std::size_t(1) << i] = 0;
+        for (std::size_t mask = 1; mask < num_masks; ++mask) {
+            if ((mask & (mask - 1)) == 0)
+                continue;
+            for (std::size_t sub = (mask - 1) & mask; sub > 0; sub = (sub - 1) & mask) {
+                std::size_t rest = mask ^ sub;
+                if (sub < rest)
+                    continue;
+                double cost = best_cost[sub] + best_cost[rest]
+                        + label_product(sorted_union(mask_labels[sub], mask_labels[rest]), label_dims);
+                if (cost < best_cost[mask]) {
+                    best_cost[mask] = cost;
+                    best_split[mask] = sub;
+                }
+            }
+        }
+        // unroll the optimal binary tree into steps, children before parents
+        struct unroller {
+            const std::vector<std::size_t>& split;
+            contraction_path& path;
+            int next_id;
+            int unroll(std::size_t mask) {
+                if ((mask & (mask - 1)) == 0) {
+                    int i = 0;
+                    while (!((mask >> i) & 1))
+                        ++i;
+                    return i;
+                }
+                int lhs = unroll(split[mask]);
+                int rhs = unroll(mask ^ split[mask]);
+                path.steps.push_back(std::make_pair(lhs, rhs));
+                return next_id++;
+            }
+        } u { best_split, path, static_cast<int>(n) };
+        u.unroll(num_masks - 1);
+        path.cost = best_cost[num_masks - 1];
+        return path;
+    }
+
+    // greedy: repeatedly contract the pair with the cheapest contraction
+    std::vector<std::vector<bool>> groups;
+    std::vector<int> ids;
+    for (std::size_t i = 0; i < n; ++i) {
+        groups.push_back(std::vector<bool>(n, false));
+        groups.back()[i] = true;
+        ids.push_back(i);
+    }
+    int next_id = n;
+    while (groups.size() > 1) {
+        std::size_t best_i = 0, best_j = 1;
+        double best = std::numeric_limits<double>::infinity();
+        for (std::size_t i = 0; i < groups.size(); ++i)
+            for (std::size_t j = i + 1; j < groups.size(); ++j) {
+                double cost = label_product(sorted_union(kept_labels(groups[i]), kept_labels(groups[j])), label_dims);
+                if (cost < best) {
+                    best = cost;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        path.steps.push_back(std::make_pair(ids[best_i], ids[best_j]));
+        path.cost += best;
+        for (std::size_t k = 0; k < n; ++k)
+            groups[best_i][k] = groups[best_i][k] || groups[best_j][k];
+        ids[best_i] = next_id++;
+        groups.erase(groups.begin() + best_j);
+        ids.erase(ids.begin() + best_j);
+    }
+    return path;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- pairwise contraction -----------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/** A tensor whose axes are identified by labels. */
+struct labelled_tensor {
+    tensor_cptr value;
+    label_vec labels;
+};
+
+/**
+ * Rearrange a labelled tensor so that its axes have the requested labels.
+ * Axes with labels that are not requested are summed over,
+ *   and repeated labels in the input select diagonals.
+ */
+labelled_tensor relabel(const labelled_tensor& in, const label_vec& out_labels, const tensor::N_vector& label_dims) {
+    if (in.labels == out_labels)
+        return in;
+    // loop over output labels first, then over the labels that are summed over
+    label_vec loop_labels = out_labels;
+    for (int l : in.labels)
+        if (std::find(loop_labels.begin(), loop_labels.end(), l) == loop_labels.end())
+            loop_labels.push_back(l);
+    const std::size_t num_loops = loop_labels.size();
+    std::vector<N> in_strides(num_loops, 0), out_strides(num_loops, 0), sizes(num_loops);
+    N stride = 1;
+    for (int i = static_cast<int>(in.labels.size()) - 1; i >= 0; --i) {
+        std::size_t loop = std::find(loop_labels.begin(), loop_labels.end(), in.labels[i]) - loop_labels.begin();
+        in_strides[loop] += stride;
+        stride *= label_dims[in.labels[i]];
+    }
+    stride = 1;
+    tensor::N_vector out_dims(out_labels.size());
+    for (int i = static_cast<int>(out_labels.size()) - 1; i >= 0; --i) {
+        out_strides[i] = stride;
+        out_dims[i] = label_dims[out_labels[i]];
+        stride *= out_dims[i];
+    }
+    N total = 1;
+    for (std::size_t loop = 0; loop < num_loops; ++loop) {
+        sizes[loop] = label_dims[loop_labels[loop]];
+        total *= sizes[loop];
+    }
+    std::vector<double> data(stride, 0.0);
+    const tensor& input = *in.value;
+    std::vector<N> position(num_loops, 0);
+    N in_offset = 0, out_offset = 0;
+    for (N it = 0; it < total; ++it) {
+        data[out_offset] += input[in_offset];
+        for (int loop = static_cast<int>(num_loops) - 1; loop >= 0; --loop) {
+            in_offset += in_strides[loop];
+            out_offset += out_strides[loop];
+            if (++position[loop] < sizes[loop])
+                break;
+            in_offset -= in_strides[loop] * sizes[loop];
+            out_offset -= out_strides[loop] * sizes[loop];
+            position[loop] = 0;
+        }
+    }
+    return labelled_tensor { tensor_cptr(new tensor(std::move(out_dims), std::move(data))), out_labels };
+}
+
+bool contains(const label_vec& labels, int l) {
+    return std::find(labels.begin(), labels.end(), l) != labels.end();
+}
+
+/** Check whether the labels in [begin, end) are exactly the labels in "expected", in any order. */
+bool is_permutation_of(label_vec::const_iterator begin, label_vec::const_iterator end, const label_vec& expected) {
+    return static_cast<std::size_t>(end - begin) == expected.size()
+            && std::is_permutation(begin, end, expected.begin());
+}
+
+label_vec concatenate(const label_vec& a, const label_vec& b, const label_vec& c = label_vec()) {
+    label_vec result(a);
+    result.insert(result.end(), b.begin(), b.end());
+    result.insert(result.end(), c.begin(), c.end());
+    return result;
+}
+
+/**
+ * Contract two labelled tensors, keeping only the labels in "keep" (indexed by label).
+ * Whenever the axes of the operands are already arranged as
+ *   [free..., contracted...] and [contracted..., free...]
+ *   they are passed to the GEMM kernel as they are, without any copies.
+ */
+labelled_tensor contract(labelled_tensor a, labelled_tensor b, const std::vector<bool>& keep,
+        const tensor::N_vector& label_dims) {
+    // sum out labels that are neither kept nor shared, and extract diagonals of repeated labels
+    auto prune = [&](const labelled_tensor& t, const labelled_tensor& other) {
+        label_vec needed;
+        for (int l : t.labels)
+            if ((keep[l] || contains(other.labels, l)) && !contains(needed, l))
+                needed.push_back(l);
+        return relabel(t, needed, label_dims);
+    };
+    a = prune(a, b);
+    b = prune(b, a);
+
+    label_vec batch, contracted, free_a, free_b;
+    for (int l : a.labels) {
+        if (!contains(b.labels, l))
+            free_a.push_back(l);
+        else if (keep[l])
+            batch.push_back(l);
+        else
+            contracted.push_back(l);
+    }
+    for (int l : b.labels)
+        if (!contains(a.labels, l))
+            free_b.push_back(l);
+    const std::size_t ncd = contracted.size();
+
+    if (batch.empty()) {
+        // does a end with the contracted labels, and b start with them in the same order?
+        auto fits = [ncd](const label_vec& lhs, const label_vec& rhs) {
+            return std::equal(lhs.end() - ncd, lhs.end(), rhs.begin());
+        };
+        auto trailing = [&](const labelled_tensor& t) {
+            return is_permutation_of(t.labels.end() - ncd, t.labels.end(), contracted);
+        };
+        auto leading = [&](const labelled_tensor& t) {
+            return is_permutation_of(t.labels.begin(), t.labels.begin() + ncd, contracted);
+        };
+        if (!(trailing(a) && leading(b) && fits(a.labels, b.labels))
+                && trailing(b) && leading(a) && fits(b.labels, a.labels))
+            std::swap(a, b);
+        else if (!(trailing(a) && leading(b) && fits(a.labels, b.labels))) {
+            // rearrange whichever operands do not fit, preferring to keep the order of a's contracted labels
+            if (trailing(a)) {
+                label_vec order(a.labels.end() - ncd, a.labels.end());
+                label_vec rest(b.labels.begin(), b.labels.end());
+                rest.erase(std::remove_if(rest.begin(), rest.end(), [&](int l) {return contains(order, l);}),
+                        rest.end());
+                b = relabel(b, concatenate(order, rest), label_dims);
+            } else if (leading(b)) {
+                label_vec order(b.labels.begin(), b.labels.begin() + ncd);
+                label_vec rest(a.labels.begin(), a.labels.end());
+                rest.erase(std::remove_if(rest.begin(), rest.end(), [&](int l) {return contains(order, l);}),
+                        rest.end());
+                a = relabel(a, concatenate(rest, order), label_dims);
+            } else {
+                a = relabel(a, concatenate(free_a, contracted), label_dims);
+                b = relabel(b, concatenate(contracted, free_b), label_dims);
+            }
+        }
+        label_vec labels(a.labels.begin(), a.labels.end() - ncd);
+        labels.insert(labels.end(), b.labels.begin() + ncd, b.labels.end());
+        tensor_cptr value(new tensor(tensor::chain_multiplication(*a.value, *b.value, ncd)));
+        return labelled_tensor { value, labels };
+    }
+
+    // batched contraction: one GEMM per position of the batch labels
+    a = relabel(a, concatenate(batch, free_a, contracted), label_dims);
+    b = relabel(b, concatenate(batch, contracted, free_b), label_dims);
+    const N batch_size = label_product(batch, label_dims);
+    const N m = label_product(free_a, label_dims);
+    const N k = label_product(contracted, label_dims);
+    const N n = label_product(free_b, label_dims);
+    std::vector<double> data(batch_size * m * n);
+    const tensor& av = *a.value;
+    const tensor& bv = *b.value;
+    for (N i_batch = 0; i_batch < batch_size; ++i_batch) {
+        kernels::gemm(&av[0] + i_batch * m * k, &bv[0] + i_batch * k * n, data.data() + i_batch * m * n, m, k, n);
+    }
+    label_vec labels = concatenate(batch, free_a, free_b);
+    tensor::N_vector dims;
+    for (int l : labels)
+        dims.push_back(label_dims[l]);
+    return labelled_tensor { tensor_cptr(new tensor(std::move(dims), std::move(data))), labels };
+}
+
+/** Evaluate an einsum expression along its optimal contraction path. */
+tensor_cptr evaluate(const einsum_expression& expr, const tensor_cptr_vec& inputs) {
+    N_vector_vec idims;
+    for (const auto& input : inputs)
+        idims.push_back(input->dimensionalities);
+    const tensor::N_vector label_dims = expr.label_dimensionalities(idims);
+    const contraction_path path = find_contraction_path(expr, label_dims);
+
+    const std::size_t n = inputs.size();
+    std::vector<labelled_tensor> operands;
+    for (std::size_t i = 0; i < n; ++i)
+        operands.push_back(labelled_tensor { inputs[i], expr.operand_labels[i] });
+    std::vector<bool> alive(n, true);
+    for (const auto& step : path.steps) {
+        alive[step.first] = alive[step.second] = false;
+        std::vector<bool> keep(label_dims.size(), false);
+        for (int l : expr.output_labels)
+            keep[l] = true;
+        for (std::size_t i = 0; i < operands.size(); ++i)
+            if (alive[i])
+                for (int l : operands[i].labels)
+                    keep[l] = true;
+        operands.push_back(contract(operands[step.first], operands[step.second], keep, label_dims));
+        operands[step.first].value.reset();
+        operands[step.second].value.reset();
+        alive.push_back(true);
+    }
+    return relabel(operands.back(), expr.output_labels, label_dims).value;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_einsum ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+struct tensor_function_einsum: tensor_function {
+    einsum_expression expr;
+    tensor_function_einsum(const std::string& subscripts) :
+                    expr(einsum_expression::parse(subscripts)) {
+    }
+    tensor_function_einsum(const einsum_expression& e) :
+                    expr(e) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        return evaluate(expr, tv);
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        /*
+         * The einsum is linear in each of its operands.
+         * The derivative w.r.t. operand X with labels (x_1, ..., x_r) is itself an einsum:
+         *   rename the axes of X to fresh labels (y_1, ..., y_r),
+         *   drop X, and add identity operands δ(y_i, x_i) in its place,
+         *   producing the labels (y_1, ..., y_r, output labels).
+         */
+        derivative result { value(tv), tensor_cptr_vec() };
+        N_vector_vec idims;
+        for (const auto& input : tv)
+            idims.push_back(input->dimensionalities);
+        const tensor::N_vector label_dims = expr.label_dimensionalities(idims);
+        const int first_fresh_label = expr.num_labels();
+        for (std::size_t i_op = 0; i_op < tv.size(); ++i_op) {
+            einsum_expression dexpr;
+            tensor_cptr_vec dinputs;
+            for (std::size_t j_op = 0; j_op < tv.size(); ++j_op) {
+                if (j_op != i_op) {
+                    dexpr.operand_labels.push_back(expr.operand_labels[j_op]);
+                    dinputs.push_back(tv[j_op]);
+                }
+            }
+            const label_vec& x_labels = expr.operand_labels[i_op];
+            for (std::size_t i_axis = 0; i_axis < x_labels.size(); ++i_axis) {
+                int fresh = first_fresh_label + i_axis;
+                dexpr.operand_labels.push_back(label_vec { fresh, x_labels[i_axis] });
+                dexpr.output_labels.push_back(fresh);
+                N size = label_dims[x_labels[i_axis]];
+                dinputs.push_back(tensor_cptr(new tensor(tensor::identity_derivative(tensor::N_vector { size }))));
+            }
+            dexpr.output_labels.insert(dexpr.output_labels.end(), expr.output_labels.begin(),
+                    expr.output_labels.end());
+            result.node_derivative.push_back(evaluate(dexpr, dinputs));
+        }
+        return result;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        odims = expr.output_dimensionalities(expr.label_dimensionalities(idims));
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        const tensor::N_vector label_dims = expr.label_dimensionalities(idims);
+        double result = 2 * find_contraction_path(expr, label_dims).cost;
+        if (expr.operand_labels.size() == 1)
+            result += label_product(expr.operand_labels[0], label_dims);
+        return result;
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // a fresh label for the examples, leading the batched operands and the output
+        assert(is_batched.size() == expr.operand_labels.size(), "einsum expects ", expr.operand_labels.size(),
+                " inputs, found ", is_batched.size());
+        einsum_expression bexpr = expr;
+        const int batch_label = expr.num_labels();
+        for (std::size_t i_op = 0; i_op < is_batched.size(); ++i_op)
+            if (is_batched[i_op])
+                bexpr.operand_labels[i_op].insert(bexpr.operand_labels[i_op].begin(), batch_label);
+        bexpr.output_labels.insert(bexpr.output_labels.begin(), batch_label);
+        return tensor_function_csptr(new tensor_function_einsum(bexpr));
+    }
+};
+// end struct tensor_function_einsum
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::einsum(const std::string& subscripts) {
+    return tensor_function_csptr(new tensor_function_einsum(subscripts));
+}
+
+} // end namespace graph
+} // end namespace para
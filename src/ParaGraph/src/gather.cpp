@@ -0,0 +1,259 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+/** The rows selected by a tensor of indices, checked to be integers in [0, num_rows). */
+std::vector<N> row_indices(const tensor& indices, N num_rows) {
+    std::vector<N> result(indices.size());
+    for (N i = 0; i < indices.size(); ++i) {
+        double index = indices[i];
+        assert(index >= 0 && index < num_rows && index == std::floor(index), "gather expects row indices in [0, ",
+                num_rows, "), found ", index);
+        result[i] = static_cast<N>(index);
+    }
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_gather ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Looks up rows (slices along the leading axis) of a table {rows, row...}
+ *   for indices of any dimensionalities {idx...}, giving {idx..., row...}.
+ * Only the table is differentiable; the derivative w.r.t. the indices is zero.
+ */
+struct tensor_function_gather: tensor_function {
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        check_inputs(tv);
+        const tensor& table = *tv[0];
+        const N row_size = product(table.dimensionalities.begin() + 1, table.dimensionalities.end());
+        std::vector<N> rows = row_indices(*tv[1], table.dimensionalities[0]);
+        std::vector<double> result(rows.size() * row_size);
+        for (N i = 0; i < rows.size(); ++i)
+            std::copy(&table[0] + rows[i] * row_size, &table[0] + (rows[i] + 1) * row_size, &result[i * row_size]);
+        return tensor_cptr(new tensor(output_dimensionalities(table.dimensionalities, tv[1]->dimensionalities),
+                std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *v, 0)))),
+                tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *v, 1)))) } };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        check_inputs(tv);
+        assert(input_index < 2, "gather expects a table and indices.");
+        tensor result = tensor::zero_derivative(value.dimensionalities, tv[input_index]->dimensionalities);
+        if (input_index == 1)
+            return result;
+        // d output[i, e] / d table[r, e'] = 1 if r == rows[i] and e == e', scattered from the looked-up rows
+        const tensor& table = *tv[0];
+        const N row_size = product(table.dimensionalities.begin() + 1, table.dimensionalities.end());
+        std::vector<N> rows = row_indices(*tv[1], table.dimensionalities[0]);
+        for (N i = 0; i < rows.size(); ++i)
+            for (N e = 0; e < row_size; ++e)
+                result[(rows[i] * row_size + e) * value.size() + i * row_size + e] = 1;
+        return result;
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        /*
+         * Since the lookup only copies values,
+         *   chaining a derivative U w.r.t. some X through it
+         *   looks up the same rows in every row of U.
+         */
+        check_inputs(tv);
+        assert(input_index < 2, "gather expects a table and indices.");
+        const tensor& input = *tv[input_index];
+        assert(input.size() > 0 && U.size() % input.size() == 0,
+                "gather cannot chain derivative of incompatible size.");
+        const N x_size = U.size() / input.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        if (input_index == 1)
+            return tensor::zero(rdims);
+
+        const tensor& table = *tv[0];
+        const N row_size = product(table.dimensionalities.begin() + 1, table.dimensionalities.end());
+        std::vector<N> rows = row_indices(*tv[1], table.dimensionalities[0]);
+        std::vector<double> result(x_size * value.size());
+        for (N x = 0; x < x_size; ++x) {
+            const double* u = &U[x * table.size()];
+            double* r = &result[x * value.size()];
+            for (N i = 0; i < rows.size(); ++i)
+                std::copy(u + rows[i] * row_size, u + (rows[i] + 1) * row_size, r + i * row_size);
+        }
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 2, "gather expects a table and indices, found ", idims.size(), " inputs.");
+        assert(!idims[0].empty(), "gather expects a table with at least one axis.");
+        odims = output_dimensionalities(idims[0], idims[1]);
+        return true;
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        assert(is_batched.size() == 2, "gather expects a table and indices, found ", is_batched.size(), " inputs.");
+        // batched indices just look up more rows, with the examples leading the output
+        if (is_batched[0])
+            return nullptr;
+        return tensor_function_csptr(new tensor_function_gather);
+    }
+
+    static void check_inputs(const tensor_cptr_vec& tv) {
+        assert(tv.size() == 2, "gather expects a table and indices, found ", tv.size(), " inputs.");
+        assert(!tv[0]->dimensionalities.empty(), "gather expects a table with at least one axis.");
+    }
+
+    static tensor::N_vector output_dimensionalities(const tensor::N_vector& table_dims,
+            const tensor::N_vector& index_dims) {
+        tensor::N_vector result(index_dims);
+        result.insert(result.end(), table_dims.begin() + 1, table_dims.end());
+        return result;
+    }
+};
+// end struct tensor_function_gather
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+void sparse_row_gradient::scatter_add(tensor& table, double scale) const {
+    assert(table.dimensionalities == dimensionalities,
+            "sparse_row_gradient cannot be added to a table of different dimensionalities.");
+    assert(table.layout == tensor_layout::row_major, "sparse_row_gradient can only be added to a row-major table.");
+    const N row_size = product(dimensionalities.begin() + 1, dimensionalities.end());
+    for (N i = 0; i < row_indices.size(); ++i) {
+        const double* row = &rows[i * row_size];
+        double* target = &table[row_indices[i] * row_size];
+        for (N e = 0; e < row_size; ++e)
+            target[e] += scale * row[e];
+    }
+}
+
+tensor sparse_row_gradient::to_dense() const {
+    tensor result = tensor::zero(dimensionalities);
+    scatter_add(result, 1);
+    return result;
+}
+
+tensor_function_csptr tensor_function_factory::gather() {
+    return tensor_function_csptr(new tensor_function_gather);
+}
+
+sparse_row_gradient tensor_function_factory::gather_gradient(const tensor::N_vector& table_dimensionalities,
+        const tensor& indices, const tensor& output_gradient) {
+    assert(!table_dimensionalities.empty(), "gather expects a table with at least one axis.");
+    tensor::N_vector output_dims = tensor_function_gather::output_dimensionalities(table_dimensionalities,
+            indices.dimensionalities);
+    assert(output_gradient.dimensionalities == output_dims,
+            "gather_gradient expects a gradient with the dimensionalities of the output of gather.");
+    const N row_size = product(table_dimensionalities.begin() + 1, table_dimensionalities.end());
+    std::vector<N> index_rows = row_indices(indices, table_dimensionalities[0]);
+
+    // the distinct rows, in increasing order, with the gradients of repeated lookups summed up
+    std::vector<N> unique_rows(index_rows);
+    std::sort(unique_rows.begin(), unique_rows.end());
+    unique_rows.erase(std::unique(unique_rows.begin(), unique_rows.end()), unique_rows.end());
+    tensor::N_vector rows_dims(table_dimensionalities);
+    rows_dims[0] = unique_rows.size();
+    std::vector<double> rows(unique_rows.size() * row_size, 0.0);
+    tensor gradient = tensor::to_layout(output_gradient, tensor_layout::row_major);
+    for (N i = 0; i < index_rows.size(); ++i) {
+        N u = std::lower_bound(unique_rows.begin(), unique_rows.end(), index_rows[i]) - unique_rows.begin();
+        for (N e = 0; e < row_size; ++e)
+            rows[u * row_size + e] += gradient[i * row_size + e];
+    }
+    return sparse_row_gradient { table_dimensionalities, std::move(unique_rows), tensor(std::move(rows_dims),
+            std::move(rows)) };
+}
+
+sparse_row_gradient tensor_function_factory::gather_gradient(const graph& g, node loss, operation lookup,
+        const tensor_cptr_vec& input_values) {
+    assert(lookup.index >= 0 && static_cast<N>(lookup.index) < g.num_operations(), "Invalid gather operation index ",
+            lookup.index);
+    assert(dynamic_cast<const tensor_function_gather*>(g.get_function(lookup).get()) != nullptr,
+            "gather_gradient expects a gather operation, found ", g.get_operation_name(lookup));
+    const std::vector<node> lookup_dependencies = g.get_dependencies(lookup);
+    auto dependency_value = [&](node n) {
+        return n.type == node::nt_variable ? input_values[n.index] : g.value(n, input_values);
+    };
+    tensor_cptr table = dependency_value(lookup_dependencies[0]), indices = dependency_value(lookup_dependencies[1]);
+    tensor_cptr output = g.value(lookup, input_values);
+
+    // a copy of the graph with the same variables, plus one for the output of the lookup replacing it
+    graph_builder_uptr gb = graph_builder::empty();
+    std::vector<node> variable_nodes;
+    for (N i_v = 0; i_v < g.num_variables(); ++i_v) {
+        variable v(i_v);
+        if (g.has_dimensionalities(v))
+            variable_nodes.push_back(gb->add_variable(g.get_variable_name(v), g.get_dimensionalities(v),
+                    g.get_layout(v)));
+        else
+            variable_nodes.push_back(gb->add_variable(g.get_variable_name(v)));
+    }
+    variable output_variable = gb->add_variable(g.get_operation_name(lookup), output->dimensionalities);
+    std::vector<node> operation_nodes;
+    auto copied = [&](node n) {
+        if (n == lookup)
+            return node(output_variable);
+        return n.type == node::nt_variable ? variable_nodes[n.index] : operation_nodes[n.index];
+    };
+    for (N i_op = 0; i_op < g.num_operations(); ++i_op) {
+        operation op(i_op);
+        std::vector<node> dependencies = g.get_dependencies(op);
+        std::transform(dependencies.begin(), dependencies.end(), dependencies.begin(), copied);
+        operation_nodes.push_back(gb->add_operation(g.get_operation_name(op), g.get_function(op), dependencies));
+    }
+    graph_cuptr cut = gb->build_graph();
+
+    tensor_cptr_vec cut_inputs(input_values);
+    cut_inputs.push_back(output);
+    derivative d = cut->partial_gradient(copied(loss), { output_variable }, cut_inputs);
+    assert(d.node_value->size() == 1, "gather_gradient expects a scalar loss.");
+    const tensor& d_output = *d.node_derivative[0];
+    return gather_gradient(table->dimensionalities, *indices, tensor(output->dimensionalities, std::vector<double>(
+            d_output.cbegin(), d_output.cend())));
+}
+
+} // end namespace graph
+} // end namespace para
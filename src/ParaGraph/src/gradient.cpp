@@ -0,0 +1,493 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/graph.h>
+#include <para/graph/exception.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+double product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, 1.0, [](double acc, tensor::N dim) {return acc * dim;});
+}
+
+/** The base of the functions computing derivatives, which are not differentiated themselves. */
+struct tensor_function_derivative: tensor_function {
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        assert(false, "The operations of a gradient graph cannot be differentiated.");
+        return derivative();
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_identity_derivative --------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/** The derivative of its single input w.r.t. itself. */
+struct tensor_function_identity_derivative: tensor_function_derivative {
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 1, "identity_derivative only works on a single input.");
+        return tensor_cptr(new tensor(tensor::identity_derivative(tv[0]->dimensionalities)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "identity_derivative only works on a single input.");
+        odims = idims[0];
+        odims.insert(odims.end(), idims[0].begin(), idims[0].end());
+        return true;
+    }
+
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        return true;
+    }
+};
+// end struct tensor_function_identity_derivative
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_zero_derivative ------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/** The derivative of its first input w.r.t. its second input, which it does not depend on. */
+struct tensor_function_zero_derivative: tensor_function_derivative {
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 2, "zero_derivative expects a node and a variable.");
+        return tensor_cptr(new tensor(tensor::zero_derivative(tv[0]->dimensionalities, tv[1]->dimensionalities)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 2, "zero_derivative expects a node and a variable.");
+        odims = idims[1];
+        odims.insert(odims.end(), idims[0].begin(), idims[0].end());
+        return true;
+    }
+
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        return true;
+    }
+};
+// end struct tensor_function_zero_derivative
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_sum ------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/** The sum of the derivatives contributed by the dependencies of an operation. */
+struct tensor_function_sum: tensor_function_derivative {
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(!tv.empty(), "sum expects at least one input.");
+        if (tv.size() == 1)
+            return tv[0];
+        tensor result(*tv[0]);
+        for (N i = 1; i < tv.size(); ++i)
+            result = tensor::add(result, *tv[i]);
+        return tensor_cptr(new tensor(std::move(result)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(!idims.empty(), "sum expects at least one input.");
+        for (const auto& dims : idims)
+            assert(dims == idims[0], "sum expects inputs of the same dimensionalities.");
+        odims = idims[0];
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        return (idims.size() - 1) * product(idims[0].begin(), idims[0].end());
+    }
+};
+// end struct tensor_function_sum
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_packed_derivatives ---------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The derivatives of a function w.r.t. all of its inputs, as computed by a single call to deriv,
+ *   flattened and concatenated in the order of the inputs.
+ */
+struct tensor_function_packed_derivatives: tensor_function_derivative {
+    tensor_function_csptr function;
+
+    tensor_function_packed_derivatives(const tensor_function_csptr& f) :
+                    function(f) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        derivative d = function->deriv(tv);
+        std::vector<double> data;
+        data.reserve(std::accumulate(d.node_derivative.begin(), d.node_derivative.end(), N(0),
+                [](N acc, const tensor_cptr& nd) {return acc + nd->size();}));
+        for (const tensor_cptr& nd : d.node_derivative) {
+            const tensor row_major = tensor::to_layout(*nd, tensor_layout::row_major);
+            for (N i = 0; i < row_major.size(); ++i)
+                data.push_back(row_major[i]);
+        }
+        return tensor_cptr(new tensor( { data.size() }, std::move(data)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        tensor::N_vector function_dims;
+        if (!function->infer_dimensionalities(idims, function_dims))
+            return false;
+        double inputs_size = 0;
+        for (const auto& dims : idims)
+            inputs_size += product(dims.begin(), dims.end());
+        odims = { static_cast<N>(inputs_size * product(function_dims.begin(), function_dims.end())) };
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // an estimate: the function, once per element of the inputs
+        double inputs_size = 0;
+        for (const auto& dims : idims)
+            inputs_size += product(dims.begin(), dims.end());
+        return function->flop_count(idims) * inputs_size;
+    }
+
+    bool accepts_layout(std::size_t i, tensor_layout layout) const override {
+        return function->accepts_layout(i, layout);
+    }
+};
+// end struct tensor_function_packed_derivatives
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_jacobian -------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The derivative of a function w.r.t. one of its inputs, unpacked from tensor_function_packed_derivatives.
+ * The inputs are the packed derivatives, then the inputs of the function, then the value of the function.
+ */
+struct tensor_function_jacobian: tensor_function_derivative {
+    N input_index;
+
+    tensor_function_jacobian(N i) :
+                    input_index(i) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() > input_index + 2, "jacobian expects the packed derivatives, the inputs of the function,"
+                " and its value.");
+        const N value_size = tv.back()->size();
+        N offset = 0;
+        for (N i = 0; i < input_index; ++i)
+            offset += tv[i + 1]->size() * value_size;
+        const tensor& input = *tv[input_index + 1];
+        std::vector<double> data(tv[0]->begin() + offset, tv[0]->begin() + offset + input.size() * value_size);
+        tensor::N_vector dims(input.dimensionalities);
+        dims.insert(dims.end(), tv.back()->dimensionalities.begin(), tv.back()->dimensionalities.end());
+        return tensor_cptr(new tensor(std::move(dims), std::move(data)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        odims = idims[input_index + 1];
+        odims.insert(odims.end(), idims.back().begin(), idims.back().end());
+        return true;
+    }
+
+    bool accepts_layout(std::size_t i, tensor_layout layout) const override {
+        // only the packed derivatives are read by offset
+        return i > 0 || layout == tensor_layout::row_major;
+    }
+};
+// end struct tensor_function_jacobian
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_input_derivative -----------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The derivative of a function w.r.t. one of its inputs, as computed by derivative_wrt_input.
+ * The inputs are those of the function, then the value of the function.
+ */
+struct tensor_function_input_derivative: tensor_function_derivative {
+    tensor_function_csptr function;
+    N input_index;
+    N num_function_inputs;
+
+    tensor_function_input_derivative(const tensor_function_csptr& f, N i, N n) :
+                    function(f),
+                    input_index(i),
+                    num_function_inputs(n) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() > input_index + 1, "input_derivative expects the inputs of the function and its value.");
+        const tensor_cptr_vec function_inputs(tv.begin(), tv.end() - 1);
+        return tensor_cptr(new tensor(function->derivative_wrt_input(function_inputs, *tv.back(), input_index)));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        odims = idims[input_index];
+        odims.insert(odims.end(), idims.back().begin(), idims.back().end());
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // an estimate: the function, once per element of the input
+        const N_vector_vec function_dims(idims.begin(), idims.end() - 1);
+        return function->flop_count(function_dims) * product(idims[input_index].begin(), idims[input_index].end());
+    }
+
+    bool accepts_layout(std::size_t i, tensor_layout layout) const override {
+        if (i < num_function_inputs)
+            return function->accepts_layout(i, layout);
+        return layout == function->output_layout();
+    }
+};
+// end struct tensor_function_input_derivative
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_chained_derivative ---------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The derivative of a function w.r.t. some X, from the derivative of one of its inputs w.r.t. X,
+ *   as computed by chain_derivative.
+ * The inputs are those of the function, then the value of the function, then the derivative of the input.
+ */
+struct tensor_function_chained_derivative: tensor_function_derivative {
+    tensor_function_csptr function;
+    N input_index;
+    N num_function_inputs;
+
+    tensor_function_chained_derivative(const tensor_function_csptr& f, N i, N n) :
+                    function(f),
+                    input_index(i),
+                    num_function_inputs(n) {
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() > input_index + 2, "chained_derivative expects the inputs of the function, its value,"
+                " and a derivative.");
+        const tensor_cptr_vec function_inputs(tv.begin(), tv.end() - 2);
+        return tensor_cptr(new tensor(function->chain_derivative(function_inputs, *tv[tv.size() - 2], input_index,
+                *tv.back())));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        // (X..., input...) to (X..., output...)
+        const tensor::N_vector& input_dims = idims[input_index];
+        const tensor::N_vector& d_dims = idims.back();
+        assert(d_dims.size() >= input_dims.size() && std::equal(input_dims.begin(), input_dims.end(),
+                d_dims.end() - input_dims.size()), "chained_derivative expects the derivative of input ",
+                input_index, " w.r.t. some X.");
+        odims.assign(d_dims.begin(), d_dims.end() - input_dims.size());
+        odims.insert(odims.end(), idims[idims.size() - 2].begin(), idims[idims.size() - 2].end());
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // an estimate: the function, once per element of X
+        const N_vector_vec function_dims(idims.begin(), idims.end() - 2);
+        const double x_size = product(idims.back().begin(), idims.back().end())
+                / product(idims[input_index].begin(), idims[input_index].end());
+        return function->flop_count(function_dims) * x_size;
+    }
+
+    bool accepts_layout(std::size_t i, tensor_layout layout) const override {
+        if (i < num_function_inputs)
+            return function->accepts_layout(i, layout);
+        return layout == (i == num_function_inputs ? function->output_layout() : tensor_layout::row_major);
+    }
+};
+// end struct tensor_function_chained_derivative
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_jacobian_product -----------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The derivative of a function w.r.t. some X, as the chain multiplication of
+ *   the derivative of one of its inputs D w.r.t. X, and the derivative of the function w.r.t. D.
+ * The inputs are those two derivatives, then D (whose order is the number of dimensions multiplied).
+ */
+struct tensor_function_jacobian_product: tensor_function_derivative {
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 3, "jacobian_product expects two derivatives and the node they are chained through.");
+        return tensor_cptr(new tensor(tensor::chain_multiplication(*tv[0], *tv[1],
+                tv[2]->dimensionalities.size())));
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        // (X..., D...) and (D..., output...) to (X..., output...)
+        assert(idims.size() == 3, "jacobian_product expects two derivatives and the node they are chained through.");
+        const N d_order = idims[2].size();
+        assert(idims[0].size() >= d_order && idims[1].size() >= d_order, "jacobian_product expects derivatives"
+                " w.r.t. and of a node of order ", d_order);
+        odims.assign(idims[0].begin(), idims[0].end() - d_order);
+        odims.insert(odims.end(), idims[1].begin() + d_order, idims[1].end());
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        return product(idims[0].begin(), idims[0].end()) * product(idims[1].begin(), idims[1].end())
+                / product(idims[2].begin(), idims[2].end());
+    }
+
+    bool accepts_layout(std::size_t i, tensor_layout layout) const override {
+        // only the dimensionalities of the node are used
+        return i == 2 || layout == tensor_layout::row_major;
+    }
+};
+// end struct tensor_function_jacobian_product
+
+/** The name of the derivative of a node w.r.t. a variable. */
+std::string derivative_name(const std::string& node_name, const std::string& variable_name) {
+    return "d_" + node_name + "/d_" + variable_name;
+}
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+symbolic_gradient gradient_graph(const graph& g, node output_node, const std::vector<variable>& moving_variables) {
+    graph_builder_uptr gb = graph_builder::empty();
+    const int num_variables = static_cast<int>(g.num_variables());
+    for (variable mv : moving_variables)
+        assert(mv.index >= 0 && mv.index < num_variables, "Cannot differentiate w.r.t. variable with index ",
+                mv.index);
+
+    // a copy of the original graph, with the same variables and operations
+    std::vector<node> variable_nodes;
+    for (int i_v = 0; i_v < num_variables; ++i_v) {
+        variable v(i_v);
+        if (g.has_dimensionalities(v))
+            variable_nodes.push_back(gb->add_variable(g.get_variable_name(v), g.get_dimensionalities(v),
+                    g.get_layout(v)));
+        else
+            variable_nodes.push_back(gb->add_variable(g.get_variable_name(v)));
+    }
+    std::vector<node> operation_nodes;
+    std::vector<std::vector<node> > operation_dependencies;
+    auto copied = [&](node n) {
+        return n.type == node::nt_variable ? variable_nodes[n.index] : operation_nodes[n.index];
+    };
+    for (std::size_t i_op = 0; i_op < g.num_operations(); ++i_op) {
+        operation op(i_op);
+        std::vector<node> dependencies = g.get_dependencies(op);
+        std::transform(dependencies.begin(), dependencies.end(), dependencies.begin(), copied);
+        operation_nodes.push_back(gb->add_operation(g.get_operation_name(op), g.get_function(op), dependencies));
+        operation_dependencies.push_back(dependencies);
+    }
+
+    // dO/dD for the dependencies D of operations that do not chain derivatives directly,
+    //   shared by all the moving variables and unpacked from a single call to deriv per operation
+    std::vector<operation> packed_derivatives(g.num_operations(), operation(-1));
+    std::vector<std::vector<operation> > jacobians(g.num_operations());
+    auto jacobian = [&](std::size_t i_op, std::size_t i_D) {
+        const std::string op_name = g.get_operation_name(operation(i_op));
+        const std::vector<node>& dependencies = operation_dependencies[i_op];
+        if (packed_derivatives[i_op].index < 0) {
+            packed_derivatives[i_op] = gb->add_operation(derivative_name(op_name, "inputs"),
+                    tensor_function_csptr(new tensor_function_packed_derivatives(g.get_function(operation(i_op)))),
+                    dependencies);
+            jacobians[i_op].assign(dependencies.size(), operation(-1));
+        }
+        if (jacobians[i_op][i_D].index < 0) {
+            std::vector<node> jacobian_dependencies { packed_derivatives[i_op] };
+            jacobian_dependencies.insert(jacobian_dependencies.end(), dependencies.begin(), dependencies.end());
+            jacobian_dependencies.push_back(operation_nodes[i_op]);
+            jacobians[i_op][i_D] = gb->add_operation(derivative_name(op_name, "input_" + std::to_string(i_D)),
+                    tensor_function_csptr(new tensor_function_jacobian(i_D)), jacobian_dependencies);
+        }
+        return jacobians[i_op][i_D];
+    };
+
+    // the derivatives of the operations that consume each moving variable, in the order of the operations
+    symbolic_gradient result { nullptr, copied(output_node), std::vector<node>() };
+    for (variable mv : moving_variables) {
+        const std::string mv_name = g.get_variable_name(mv);
+        const node mv_node = variable_nodes[mv.index];
+        operation identity(-1);
+        auto identity_derivative = [&]() {
+            if (identity.index < 0)
+                identity = gb->add_operation(derivative_name(mv_name, mv_name),
+                        tensor_function_csptr(new tensor_function_identity_derivative()),
+                        std::vector<node> { mv_node });
+            return identity;
+        };
+        std::vector<bool> is_consumer(g.num_operations(), false);
+        std::vector<operation> derivatives(g.num_operations(), operation(-1));
+        for (std::size_t i_op = 0; i_op < g.num_operations(); ++i_op) {
+            operation op(i_op);
+            const tensor_function_csptr function = g.get_function(op);
+            const std::vector<node> original_dependencies = g.get_dependencies(op);
+            const std::vector<node>& dependencies = operation_dependencies[i_op];
+            const bool chain_directly = function->prefers_chain_derivative();
+
+            // dO/dMV = sum over the dependencies D of dO/dD * dD/dMV,
+            //   with the terms that are shared jacobians kept as their node (and a null function)
+            std::vector<std::pair<tensor_function_csptr, std::vector<node> > > terms;
+            for (std::size_t i_D = 0; i_D < dependencies.size(); ++i_D) {
+                const node D = original_dependencies[i_D];
+                if (D.type == node::nt_variable && D.index == mv.index) {
+                    // dD/dMV is the identity, so the term is dO/dD
+                    if (chain_directly) {
+                        std::vector<node> input_dependencies(dependencies);
+                        input_dependencies.push_back(operation_nodes[i_op]);
+                        terms.emplace_back(tensor_function_csptr(new tensor_function_input_derivative(function, i_D,
+                                dependencies.size())), input_dependencies);
+                    } else
+                        terms.emplace_back(nullptr, std::vector<node> { jacobian(i_op, i_D) });
+                } else if (D.type == node::nt_operation && is_consumer[D.index]) {
+                    if (chain_directly) {
+                        std::vector<node> chained_dependencies(dependencies);
+                        chained_dependencies.push_back(operation_nodes[i_op]);
+                        chained_dependencies.push_back(derivatives[D.index]);
+                        terms.emplace_back(tensor_function_csptr(new tensor_function_chained_derivative(function,
+                                i_D, dependencies.size())), chained_dependencies);
+                    } else
+                        terms.emplace_back(tensor_function_csptr(new tensor_function_jacobian_product()),
+                                std::vector<node> { derivatives[D.index], jacobian(i_op, i_D), dependencies[i_D] });
+                }
+            }
+            if (terms.empty())
+                continue;
+            is_consumer[i_op] = true;
+            const std::string name = derivative_name(g.get_operation_name(op), mv_name);
+            if (terms.size() == 1 && terms[0].first) {
+                derivatives[i_op] = gb->add_operation(name, terms[0].first, terms[0].second);
+                continue;
+            }
+            std::vector<node> term_nodes;
+            for (std::size_t i_term = 0; i_term < terms.size(); ++i_term)
+                term_nodes.push_back(terms[i_term].first ?
+                        gb->add_operation(name + "_" + std::to_string(i_term), terms[i_term].first,
+                                terms[i_term].second) :
+                        terms[i_term].second[0]);
+            derivatives[i_op] = gb->add_operation(name, tensor_function_csptr(new tensor_function_sum()), term_nodes);
+        }
+
+        if (output_node.type == node::nt_variable && output_node.index == mv.index) {
+            result.gradients.push_back(identity_derivative());
+        } else if (output_node.type == node::nt_operation && is_consumer[output_node.index]) {
+            result.gradients.push_back(derivatives[output_node.index]);
+        } else {
+            const std::string output_name = output_node.type == node::nt_variable ?
+                    g.get_variable_name(variable(output_node.index)) :
+                    g.get_operation_name(operation(output_node.index));
+            result.gradients.push_back(gb->add_operation(derivative_name(output_name, mv_name),
+                    tensor_function_csptr(new tensor_function_zero_derivative()),
+                    std::vector<node> { copied(output_node), mv_node }));
+        }
+    }
+    result.built_graph = gb->build_graph();
+    return result;
+}
+
+} // end namespace graph
+} // end namespace para
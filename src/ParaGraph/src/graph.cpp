@@ -16,7 +16,10 @@
 
 #include <para/graph/graph.h>
 #include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "subgraph.h"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #define NYI throw std::logic_error("Not yet implemented.")
@@ -31,6 +34,9 @@ struct variable_impl {
     int index;
     std::vector<operation> consumers;
     int highest_consumer_operation_index;
+    bool has_dimensionalities;
+    tensor::N_vector dimensionalities;
+    tensor_layout layout;
 };
 struct operation_impl {
     std::string name;
@@ -39,206 +45,535 @@ struct operation_impl {
     std::vector<operation> consumers;
     std::vector<node> dependencies;
     int highest_consumer_operation_index;
+    bool has_dimensionalities;
+    tensor::N_vector dimensionalities;
+    tensor_layout layout;
 };
 
+std::vector<tensor::N_vector> dependency_dimensionalities(const std::vector<variable_impl>& variables,
+        const std::vector<operation_impl>& operations, const std::vector<node>& dependencies) {
+    std::vector<tensor::N_vector> result;
+    result.reserve(dependencies.size());
+    for (node dep : dependencies) {
+        switch (dep.type) {
+        case node::nt_variable:
+            result.push_back(variables[dep.index].dimensionalities);
+            break;
+        case node::nt_operation:
+            result.push_back(operations[dep.index].dimensionalities);
+            break;
+        }
+    }
+    return result;
+}
+
+/**
+ * Scratch space for evaluating values of a graph:
+ *   the schedule for the last requested output nodes,
+ *   storage for the values of operations,
+ *   and an input vector for each scheduled operation, allocated when the schedule is prepared.
+ */
+struct evaluation_context_impl: evaluation_context {
+    const graph* owner;
+    std::vector<node> output_nodes;           // the output nodes that the schedule was prepared for
+    std::vector<int> schedule;                // operations to compute, in topological order
+    std::vector<int> releases;                // operations whose values can be released after each step
+    std::vector<std::size_t> release_begin;   // the releases of step i are [release_begin[i], release_begin[i+1])
+    tensor_cptr_vec storage;                  // values of operations, indexed by operation
+    std::vector<tensor_cptr_vec> step_inputs; // inputs of the scheduled operations, indexed by step
+
+    evaluation_context_impl(const graph* v_owner, std::size_t num_operations) :
+                    owner(v_owner),
+                    storage(num_operations) {
+    }
+
+    /** Drop all references to tensors, keeping the buffers and the schedule. */
+    void clear() {
+        for (std::size_t step = 0; step < schedule.size(); ++step) {
+            storage[schedule[step]].reset();
+            std::fill(step_inputs[step].begin(), step_inputs[step].end(), tensor_cptr());
+        }
+    }
+};
+
+/** Whether the function is a layout_conversion, whose value equals its input at every position. */
+bool is_layout_conversion(const tensor_function& function);
+
 struct graph_impl: para::graph::graph {
 
     std::vector<variable_impl> variables;
     std::vector<operation_impl> operations;
 
     tensor_cptr value(node output_node, const tensor_cptr_vec& input_values) const override {
-        switch (output_node.type) {
-        case node::nt_variable: {
-            // if output_node is a variable, just return it's value
-            return input_values[output_node.index];
-        }
-        case node::nt_operation: {
-            // find dependency operations
-            std::vector<bool> is_dependency = all_dependency_operations(output_node);
+        return value(std::vector<node> { output_node }, input_values)[0];
+    }
 
-            // initialize storage space for computed values
-            tensor_cptr_vec storage(operations.size());
+    tensor_cptr_vec value(const std::vector<node>& output_nodes, const tensor_cptr_vec& input_values) const override {
+        evaluation_context_impl context(this, operations.size());
+        return value(output_nodes, input_values, context);
+    }
 
-            // no need to compute variable nodes since their values are already provided
+    evaluation_context_uptr create_context() const override {
+        return evaluation_context_uptr(new evaluation_context_impl(this, operations.size()));
+    }
 
-            // for each dependency node, in topological order, compute the value
-            for (std::size_t iop = 0; iop < operations.size(); ++iop) {
-                if (is_dependency[iop]) {
-                    const operation_impl& op = operations[iop];
-                    tensor_cptr_vec op_inputs(op.dependencies.size());
-                    for (std::size_t idep = 0; idep < op.dependencies.size(); ++idep) {
-                        node dep = op.dependencies[idep];
-                        switch (dep.type) {
-                        case node::nt_variable:
-                            op_inputs[idep] = input_values[dep.index];
-                            break;
-                        case node::nt_operation:
-                            op_inputs[idep] = storage[dep.index];
-                            // free memory for dependency when done:
-                            if (operations[dep.index].highest_consumer_operation_index == op.index)
-                                storage[dep.index].reset();
-                            break;
-                        }
+    tensor_cptr value(node output_node, const tensor_cptr_vec& input_values, evaluation_context& context) const
+            override {
+        evaluation_context_impl& ctx = own_context(context);
+        check_input_values(input_values);
+        prepare(ctx, &output_node, 1);
+        evaluate(ctx, input_values);
+        tensor_cptr result = output_value(ctx, output_node, input_values);
+        ctx.clear();
+        return result;
+    }
 
-                    }
+    tensor_cptr_vec value(const std::vector<node>& output_nodes, const tensor_cptr_vec& input_values,
+            evaluation_context& context) const override {
+        evaluation_context_impl& ctx = own_context(context);
+        check_input_values(input_values);
+        prepare(ctx, output_nodes.data(), output_nodes.size());
+        evaluate(ctx, input_values);
+        tensor_cptr_vec result(output_nodes.size());
+        for (std::size_t i_out = 0; i_out < output_nodes.size(); ++i_out)
+            result[i_out] = output_value(ctx, output_nodes[i_out], input_values);
+        ctx.clear();
+        return result;
+    }
 
-                    storage[iop] = op.function->value(op_inputs);
+    tensor_cptr_vec value_batch(node output_node, const std::vector<tensor_cptr_vec>& batch_input_values) const
+            override {
+        tensor_cptr_vec result(batch_input_values.size());
+        parallel_for(batch_input_values.size(), [&](std::size_t begin, std::size_t end) {
+            evaluation_context_impl context(this, operations.size());
+            for (std::size_t i = begin; i < end; ++i)
+                result[i] = value(output_node, batch_input_values[i], context);
+        });
+        return result;
+    }
+
+    evaluation_context_impl& own_context(evaluation_context& context) const {
+        evaluation_context_impl* ctx = dynamic_cast<evaluation_context_impl*>(&context);
+        assert(ctx != nullptr && ctx->owner == this, "evaluation_context can only be used with its own graph.");
+        return *ctx;
+    }
+
+    /** Compute the evaluation schedule for a set of output nodes, unless the context already has it. */
+    void prepare(evaluation_context_impl& ctx, const node* output_nodes, std::size_t num_outputs) const {
+        if (ctx.output_nodes.size() == num_outputs && std::equal(output_nodes, output_nodes + num_outputs,
+                ctx.output_nodes.begin()))
+            return;
+        ctx.output_nodes.assign(output_nodes, output_nodes + num_outputs);
+
+        // find dependency operations of all the output nodes
+        std::vector<bool> is_dependency = all_dependency_operations(ctx.output_nodes);
+        std::vector<bool> is_output = output_operations(ctx.output_nodes);
+        std::vector<int> last_use = last_consumers(is_dependency);
+
+        // for each dependency node, in topological order,
+        //   schedule the computation of its value,
+        //   followed by freeing memory for its dependencies when done, unless they have been requested
+        ctx.schedule.clear();
+        ctx.releases.clear();
+        ctx.release_begin.clear();
+        for (const operation_impl& op : operations) {
+            if (!is_dependency[op.index])
+                continue;
+            ctx.schedule.push_back(op.index);
+            ctx.step_inputs.resize(ctx.schedule.size());
+            ctx.step_inputs.back().assign(op.dependencies.size(), tensor_cptr());
+            ctx.release_begin.push_back(ctx.releases.size());
+            for (int dep : distinct_operation_dependencies(op))
+                if (last_use[dep] == op.index && !is_output[dep])
+                    ctx.releases.push_back(dep);
+        }
+        ctx.release_begin.push_back(ctx.releases.size());
+    }
+
+    /** Compute the values of all the operations scheduled in the context. */
+    void evaluate(evaluation_context_impl& ctx, const tensor_cptr_vec& input_values) const {
+        try {
+            // no need to compute variable nodes since their values are already provided
+            for (std::size_t step = 0; step < ctx.schedule.size(); ++step) {
+                const operation_impl& op = operations[ctx.schedule[step]];
+                tensor_cptr_vec& op_inputs = ctx.step_inputs[step];
+                for (std::size_t idep = 0; idep < op.dependencies.size(); ++idep) {
+                    node dep = op.dependencies[idep];
+                    switch (dep.type) {
+                    case node::nt_variable:
+                        op_inputs[idep] = input_values[dep.index];
+                        break;
+                    case node::nt_operation:
+                        op_inputs[idep] = ctx.storage[dep.index];
+                        break;
+                    }
                 }
+
+                ctx.storage[op.index] = op.function->value(op_inputs);
+
+                for (std::size_t r = ctx.release_begin[step]; r < ctx.release_begin[step + 1]; ++r)
+                    ctx.storage[ctx.releases[r]].reset();
             }
-            return storage[output_node.index];
-        }
+        } catch (...) {
+            ctx.clear();
+            throw;
         }
-        URC;
+    }
+
+    static tensor_cptr output_value(const evaluation_context_impl& ctx, node out, const tensor_cptr_vec& input_values) {
+        return out.type == node::nt_variable ? input_values[out.index] : ctx.storage[out.index];
     }
 
     derivative partial_gradient(node output_node, const std::vector<variable>& moving_variables,
             const tensor_cptr_vec& input_values) const override {
-        switch (output_node.type) {
-        case node::nt_variable: {
-            derivative result { input_values[output_node.index], tensor_cptr_vec(moving_variables.size()) };
-            for (std::size_t i_mv = 0; i_mv < moving_variables.size(); ++i_mv) {
-                variable mv = moving_variables[i_mv];
-                if (mv.index == output_node.index) {
-                    auto& dim = input_values[mv.index]->dimensionalities;
-                    tensor identity = std::move(tensor::identity_derivative(dim));
-                    result.node_derivative[i_mv] = tensor_cptr(new tensor(std::move(identity)));
-                } else {
-                    auto& mv_dim = input_values[mv.index]->dimensionalities;
-                    auto& output_dim = input_values[output_node.index]->dimensionalities;
-                    tensor zero = std::move(tensor::zero_derivative(output_dim, mv_dim));
-                    result.node_derivative[i_mv] = tensor_cptr(new tensor(std::move(zero)));
-                }
+        return std::move(partial_gradient(std::vector<node> { output_node }, moving_variables, input_values)[0]);
+    }
+
+    std::vector<derivative> partial_gradient(const std::vector<node>& output_nodes,
+            const std::vector<variable>& moving_variables, const tensor_cptr_vec& input_values) const override {
+        check_input_values(input_values);
+
+        // find and remember all consumer operations of the moving variables
+        // compute their union U
+        // find all dependency operations dep_ops of the output_nodes
+        // for each operation O (in topological order),
+        //     if O is not in dep_ops, skip
+        //     if O is not in U
+        //         compute the value of O
+        //     else
+        //         compute the value of O, as well as dO/dD for all dependencies D (virtual function call implemented by user)
+        //     for each moving variable MV,
+        //         set dO/dMV to 0
+        //         if O is a consumer of MV
+        //             for each dependency D of O,
+        //                 if D is a variable
+        //                      if D is same as MV
+        //                          dO/dMV += dO/dD
+        //                      else
+        //                          do nothing
+        //                 else (if D is an operation)
+        //                     add to dO/dMV the chain_multiplication of dO/dD and dD/dMV
+        //     for each dependency D of O,
+        //         if O is the last consumer of D among dep_ops, and D is not an output node
+        //              for each moving variable V,
+        //                  release dD/dV from memory
+
+        // find and remember all consumer operations of the moving variables
+        // compute their union U
+        moving_variable_consumers mvc = find_moving_variable_consumers(moving_variables);
+
+        // find all dependency operations dep_ops of the output_nodes
+        std::vector<bool> dep_ops = all_dependency_operations(output_nodes);
+        std::vector<bool> is_output = output_operations(output_nodes);
+        std::vector<int> last_use = last_consumers(dep_ops);
+
+        std::vector<derivative> dOs_dMVs(operations.size()); // to store all dO/dMV values
+                                                             // where MV is the moving variable
+
+        // for each operation O (in topological order),
+        for (const operation_impl& O : operations) {
+            // if O is not in dep_ops, skip
+            if (!dep_ops[O.index])
+                continue;
+
+            dOs_dMVs[O.index] = operation_derivative(O, dOs_dMVs, mvc, moving_variables, input_values);
+
+            // for each dependency D of O,
+            // if O is the last consumer of D, release dD/dMV from memory for all moving variables MV
+            release_dependencies(O, last_use, is_output, dOs_dMVs);
+        }
+
+        std::vector<derivative> result;
+        result.reserve(output_nodes.size());
+        for (node out : output_nodes) {
+            if (out.type == node::nt_variable)
+                result.push_back(variable_derivative(variable(out.index), moving_variables, input_values));
+            else
+                result.push_back(dOs_dMVs[out.index]);
+        }
+        return result;
+    }
+
+    derivative partial_gradient(node output_node, const std::vector<variable>& moving_variables,
+            const tensor_cptr_vec& input_values, const checkpoint_policy& policy) const override {
+        check_input_values(input_values);
+        if (output_node.type == node::nt_variable)
+            return variable_derivative(variable(output_node.index), moving_variables, input_values);
+
+        // Same computation as partial_gradient without a policy, except that
+        //   results of non-checkpoint operations are discarded after being consumed
+        //   whenever the retained results exceed the memory budget,
+        //   and are recomputed from the nearest retained ancestors when they are needed again.
+        // Checkpoints (and the output) are retained until the end.
+        moving_variable_consumers mvc = find_moving_variable_consumers(moving_variables);
+        std::vector<bool> dep_ops = all_dependency_operations(output_node);
+
+        std::vector<bool> is_checkpoint(operations.size(), false);
+        for (operation c : policy.checkpoints) {
+            assert(c.index >= 0 && c.index < static_cast<int>(operations.size()), "Invalid checkpoint index ",
+                    c.index);
+            is_checkpoint[c.index] = true;
+        }
+        if (policy.automatic) {
+            // checkpoint every ⌈√n⌉-th of the n operations that the output depends on
+            std::size_t n = std::count(dep_ops.begin(), dep_ops.end(), true);
+            std::size_t step = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(n))));
+            for (std::size_t iop = 0, i_dep = 0; iop < operations.size(); ++iop)
+                if (dep_ops[iop] && (++i_dep % step == 0))
+                    is_checkpoint[iop] = true;
+        }
+        is_checkpoint[output_node.index] = true;
+
+        // number of consumers of each operation among dep_ops that have yet to run
+        std::vector<int> remaining_uses(operations.size(), 0);
+        for (const operation_impl& O : operations)
+            if (dep_ops[O.index])
+                for (int D : distinct_operation_dependencies(O))
+                    ++remaining_uses[D];
+
+        std::vector<derivative> dOs_dMVs(operations.size());
+        std::size_t retained_size = 0;
+        auto result_size = [](const derivative& d) {
+            std::size_t result = d.node_value->size();
+            for (const auto& nd : d.node_derivative)
+                result += nd->size();
+            return result;
+        };
+        auto release = [&](int D) {
+            retained_size -= result_size(dOs_dMVs[D]);
+            dOs_dMVs[D] = derivative();
+        };
+        // operations whose results are about to be consumed, and hence cannot be discarded
+        std::vector<int> pinned(operations.size(), 0);
+        // after O has consumed the (possibly recomputed) results of its dependencies,
+        //   discard those that are not checkpoints if we are over budget
+        auto discard_over_budget = [&](const operation_impl& O) {
+            for (int D : distinct_operation_dependencies(O))
+                if (dOs_dMVs[D].node_value && !is_checkpoint[D] && !pinned[D]
+                        && retained_size > policy.memory_budget)
+                    release(D);
+        };
+        std::function<void(const operation_impl&)> compute = [&](const operation_impl& O) {
+            // rematerialize discarded dependencies first
+            std::vector<int> deps = distinct_operation_dependencies(O);
+            for (int D : deps)
+                ++pinned[D];
+            for (int D : deps)
+                if (!dOs_dMVs[D].node_value)
+                    compute(operations[D]);
+            dOs_dMVs[O.index] = operation_derivative(O, dOs_dMVs, mvc, moving_variables, input_values);
+            retained_size += result_size(dOs_dMVs[O.index]);
+            for (int D : deps)
+                --pinned[D];
+            discard_over_budget(O);
+        };
+
+        for (const operation_impl& O : operations) {
+            if (!dep_ops[O.index])
+                continue;
+            compute(O);
+            for (int D : distinct_operation_dependencies(O))
+                if (--remaining_uses[D] == 0 && dOs_dMVs[D].node_value && !is_checkpoint[D])
+                    release(D);
+        }
+        return std::move(dOs_dMVs[output_node.index]);
+    }
+
+    /** The distinct operations among the dependencies of an operation. */
+    static std::vector<int> distinct_operation_dependencies(const operation_impl& op) {
+        std::vector<int> result;
+        for (node dep : op.dependencies)
+            if (dep.type == node::nt_operation && std::find(result.begin(), result.end(), dep.index) == result.end())
+                result.push_back(dep.index);
+        return result;
+    }
+
+    /** Consumer operations of each moving variable, and their union. */
+    struct moving_variable_consumers {
+        std::vector<std::vector<bool>> comv;
+        std::vector<bool> U;
+    };
+
+    moving_variable_consumers find_moving_variable_consumers(const std::vector<variable>& moving_variables) const {
+        moving_variable_consumers result { std::vector<std::vector<bool>>(), std::vector<bool>(operations.size(),
+                false) };
+        for (variable v : moving_variables) {
+            result.comv.push_back(all_consumer_operations(v));
+            for (std::size_t i_op = 0; i_op < operations.size(); ++i_op) {
+                result.U[i_op] = result.U[i_op] or result.comv.back()[i_op];
             }
-            return std::move(result);
         }
-        case node::nt_operation: {
-            // find and remember all consumer operations of the moving variables
-            // compute their union U
-            // find all dependency operations dep_ops of the output_node
-            // for each operation O (in topological order),
-            //     if O is not in dep_ops, skip
-            //     if O is not in U
-            //         compute the value of O
-            //     else
-            //         compute the value of O, as well as dO/dD for all dependencies D (virtual function call implemented by user)
-            //     for each moving variable MV,
-            //         set dO/dMV to 0
-            //         if O is a consumer of MV
-            //             for each dependency D of O,
-            //                 if D is a variable
-            //                      if D is same as MV
-            //                          dO/dMV += dO/dD
-            //                      else
-            //                          do nothing
-            //                 else (if D is an operation)
-            //                     add to dO/dMV the chain_multiplication of dO/dD and dD/dMV
-            //     for each dependency D of O,
-            //         if O is the highest consumer of D
-            //              for each moving variable V,
-            //                  release dD/dV from memory
-
-            // find and remember all consumer operations of the moving variables
-            // compute their union U
-            std::vector<std::vector<bool>> comv;
-            std::vector<bool> U(operations.size(), false);
-            for (variable v : moving_variables) {
-                comv.push_back(all_consumer_operations(v));
-                for (std::size_t i_op = 0; i_op < operations.size(); ++i_op) {
-                    U[i_op] = U[i_op] or comv.back()[i_op];
-                }
+        return result;
+    }
+
+    /**
+     * Compute the value of O and dO/dMV for every moving variable MV,
+     *   given the values and derivatives of all the operations that O depends on.
+     */
+    derivative operation_derivative(const operation_impl& O, const std::vector<derivative>& dOs_dMVs,
+            const moving_variable_consumers& mvc, const std::vector<variable>& moving_variables,
+            const tensor_cptr_vec& input_values) const {
+        const std::vector<std::vector<bool>>& comv = mvc.comv;
+        tensor_cptr_vec O_dep_values(O.dependencies.size()); // collecting the values of the dependencies of O for function invocations
+        auto extract_O_dep_value = [&](node O_dep) {
+            switch(O_dep.type) {
+                case node::nt_variable:
+                return input_values[O_dep.index];
+                case node::nt_operation:
+                return dOs_dMVs[O_dep.index].node_value;
             }
+            URC;
+        };
+        std::transform(O.dependencies.begin(), O.dependencies.end(), O_dep_values.begin(), extract_O_dep_value);
 
-            // find all dependency operations dep_ops of the output_node
-            std::vector<bool> dep_ops = all_dependency_operations(output_node);
+        derivative dO_dMVs; // storage for the derivative (and value) of O
+        derivative dOdDs; // place holder for dO/dD for all dependencies of O
+        tensor_cptr& O_value = dO_dMVs.node_value; // storage for the value of O
 
-            std::vector<derivative> dOs_dMVs(operations.size()); // to store all dO/dMV values
-                                                                 // where MV is the moving variable
+        // whether to chain the derivatives of the dependencies through O directly, instead of computing dO/dD
+        const bool chain_directly = mvc.U[O.index] && O.function->prefers_chain_derivative();
 
-            // for each operation O (in topological order),
-            for (operation_impl O : operations) {
-                // if O is not in dep_ops, skip
-                if (!dep_ops[O.index])
-                    continue;
+        // if O is not in U (or its derivatives are chained directly)
+        if (!mvc.U[O.index] || chain_directly) {
+            // compute the value of O
+            O_value = O.function->value(O_dep_values);
+        }
+        // else
+        else {
+            // compute the value of O, as well as dO/dD for all dependencies D (virtual function call implemented by user)
+            dOdDs = O.function->deriv(O_dep_values);
+            O_value = dOdDs.node_value;
+        }
 
-                tensor_cptr_vec O_dep_values(O.dependencies.size()); // collecting the values of the dependencies of O for function invocations
-                auto extract_O_dep_value = [&](node O_dep) {
-                    switch(O_dep.type) {
+        // for each moving variable MV (independently of each other, so in parallel),
+        dO_dMVs.node_derivative.resize(moving_variables.size());
+        parallel_for(moving_variables.size(), [&](std::size_t MV_begin, std::size_t MV_end) {
+            for (std::size_t i_MV = MV_begin; i_MV < MV_end; ++i_MV) {
+                variable MV = moving_variables[i_MV];
+                // set dO/dMV to 0
+                const tensor::N_vector & O_dim = O_value->dimensionalities;
+                const tensor::N_vector & MV_dim = input_values[MV.index]->dimensionalities;
+                tensor dO_dMV(std::move(tensor::zero_derivative(O_dim, MV_dim)));
+                // if O is a consumer of MV
+                if (comv[i_MV][O.index]) {
+                    // for each dependency D of O,
+                    for (std::size_t i_D = 0; i_D < O.dependencies.size(); ++i_D) {
+                        node D = O.dependencies[i_D];
+                        switch (D.type) {
+                        // if D is a variable
                         case node::nt_variable:
-                        return input_values[O_dep.index];
+                            // if D is same as MV
+                            if (D.index == MV.index) {
+                                // dO/dMV += dO/dD
+                                if (chain_directly) {
+                                    // chaining the identity would cost |MV|^2
+                                    dO_dMV = std::move(tensor::add(dO_dMV,
+                                            O.function->derivative_wrt_input(O_dep_values, *O_value, i_D)));
+                                } else
+                                    dO_dMV = std::move(tensor::add(dO_dMV, *dOdDs.node_derivative[i_D]));
+                            }
+                            break;
                         case node::nt_operation:
-                        return dOs_dMVs[O_dep.index].node_value;
-                    }
-                    URC;
-                };
-                std::transform(O.dependencies.begin(), O.dependencies.end(), O_dep_values.begin(), extract_O_dep_value);
-
-                derivative& dO_dMVs = dOs_dMVs[O.index]; // storage for the derivative (and value) of O
-                derivative dOdDs; // place holder for dO/dD for all dependencies of O
-                tensor_cptr& O_value = dO_dMVs.node_value; // storage for the value of O
-
-                // if O is not in U
-                if (!U[O.index]) {
-                    // compute the value of O
-                    O_value = O.function->value(O_dep_values);
-                }
-                // else
-                else {
-                    // compute the value of O, as well as dO/dD for all dependencies D (virtual function call implemented by user)
-                    dOdDs = O.function->deriv(O_dep_values);
-                    O_value = dOdDs.node_value;
-                }
-
-                // for each moving variable MV,
-                for (std::size_t i_MV = 0; i_MV < moving_variables.size(); ++i_MV) {
-                    variable MV = moving_variables[i_MV];
-                    // set dO/dMV to 0
-                    const tensor::N_vector & O_dim = O_value->dimensionalities;
-                    const tensor::N_vector & MV_dim = input_values[MV.index]->dimensionalities;
-                    tensor dO_dMV(std::move(tensor::zero_derivative(O_dim, MV_dim)));
-                    // if O is a consumer of MV
-                    if (comv[MV.index][O.index]) {
-                        // for each dependency D of O,
-                        for (std::size_t i_D = 0; i_D < O.dependencies.size(); ++i_D) {
-                            node D = O.dependencies[i_D];
-                            switch (D.type) {
-                            // if D is a variable
-                            case node::nt_variable:
-                                // if D is same as MV
-                                if (D.index == MV.index) {
-                                    // dO/dMV += dO/dD
+                            // if D only copies MV into another layout, D has the same values as MV
+                            if (is_layout_conversion_of(D, MV)) {
+                                // dO/dMV += dO/dD, instead of chaining dO/dD with the identity dD/dMV
+                                if (chain_directly)
+                                    dO_dMV = std::move(tensor::add(dO_dMV,
+                                            O.function->derivative_wrt_input(O_dep_values, *O_value, i_D)));
+                                else
                                     dO_dMV = std::move(tensor::add(dO_dMV, *dOdDs.node_derivative[i_D]));
-                                }
                                 break;
-                            case node::nt_operation:
-                                // else (if D is an operation)
-                                // dO/dMV += dO/dD * dD/dMV
-                                int d_order = dOs_dMVs[D.index].node_value->dimensionalities.size();
-                                tensor multiple(
-                                        std::move(
-                                                tensor::chain_multiplication(*dOs_dMVs[D.index].node_derivative[i_MV],
-                                                        *dOdDs.node_derivative[i_D], d_order)));
-                                dO_dMV = std::move(tensor::add(multiple, dO_dMV));
                             }
-                        }
-                    }
-                    dO_dMVs.node_derivative.push_back(tensor_cptr(new tensor(std::move(dO_dMV))));
-                }
-                // for each dependency D of O,
-                for (node D : O.dependencies) {
-                    if (D.type == node::nt_operation) {
-                        // if O is the highest consumer of D
-                        int hcoi = operations[D.index].highest_consumer_operation_index;
-                        if (O.index == hcoi) {
-                            // release dD/dMV from memory for all moving variables MV
-                            dOs_dMVs[D.index] = derivative();
+                            // else (if D is any other operation)
+                            // dO/dMV += dO/dD * dD/dMV
+                            const tensor& dD_dMV = *dOs_dMVs[D.index].node_derivative[i_MV];
+                            int d_order = dOs_dMVs[D.index].node_value->dimensionalities.size();
+                            tensor multiple(
+                                    chain_directly ?
+                                            O.function->chain_derivative(O_dep_values, *O_value, i_D, dD_dMV) :
+                                            tensor::chain_multiplication(dD_dMV, *dOdDs.node_derivative[i_D],
+                                                    d_order));
+                            dO_dMV = std::move(tensor::add(multiple, dO_dMV));
                         }
                     }
                 }
+                dO_dMVs.node_derivative[i_MV] = tensor_cptr(new tensor(std::move(dO_dMV)));
+            }
+        });
+        return dO_dMVs;
+    }
+
+    /** Whether the operation D only copies the variable V into another layout. */
+    bool is_layout_conversion_of(node D, variable V) const {
+        const operation_impl& op = operations[D.index];
+        return is_layout_conversion(*op.function) && op.dependencies.size() == 1
+                && op.dependencies[0].type == node::nt_variable && op.dependencies[0].index == V.index;
+    }
+
+    /** The derivative of a variable w.r.t. the moving variables: identity w.r.t. itself, zero otherwise. */
+    derivative variable_derivative(variable output_node, const std::vector<variable>& moving_variables,
+            const tensor_cptr_vec& input_values) const {
+        derivative result { input_values[output_node.index], tensor_cptr_vec(moving_variables.size()) };
+        for (std::size_t i_mv = 0; i_mv < moving_variables.size(); ++i_mv) {
+            variable mv = moving_variables[i_mv];
+            if (mv.index == output_node.index) {
+                auto& dim = input_values[mv.index]->dimensionalities;
+                tensor identity = std::move(tensor::identity_derivative(dim));
+                result.node_derivative[i_mv] = tensor_cptr(new tensor(std::move(identity)));
+            } else {
+                auto& mv_dim = input_values[mv.index]->dimensionalities;
+                auto& output_dim = input_values[output_node.index]->dimensionalities;
+                tensor zero = std::move(tensor::zero_derivative(output_dim, mv_dim));
+                result.node_derivative[i_mv] = tensor_cptr(new tensor(std::move(zero)));
             }
-            return std::move(dOs_dMVs[output_node.index]);
         }
+        return result;
+    }
+
+    /**
+     * For each operation in the given set,
+     *   find the index of the last operation within the set that consumes it,
+     *   or -1 if none does.
+     */
+    std::vector<int> last_consumers(const std::vector<bool>& operation_set) const {
+        std::vector<int> result(operations.size(), -1);
+        for (const operation_impl& op : operations) {
+            if (!operation_set[op.index])
+                continue;
+            for (node dep : op.dependencies)
+                if (dep.type == node::nt_operation)
+                    result[dep.index] = op.index;
+        }
+        return result;
+    }
+
+    /** Flags for the operations among a set of output nodes. */
+    std::vector<bool> output_operations(const std::vector<node>& output_nodes) const {
+        std::vector<bool> result(operations.size(), false);
+        for (node out : output_nodes)
+            if (out.type == node::nt_operation)
+                result[out.index] = true;
+        return result;
+    }
+
+    /**
+     * Release the stored results of all dependencies of op
+     *   for which op is the last consumer, unless they have been requested as outputs.
+     */
+    template<typename t_result>
+    static void release_dependencies(const operation_impl& op, const std::vector<int>& last_use,
+            const std::vector<bool>& is_output, std::vector<t_result>& storage) {
+        for (node dep : op.dependencies) {
+            if (dep.type == node::nt_operation && last_use[dep.index] == op.index && !is_output[dep.index])
+                storage[dep.index] = t_result();
         }
-        URC;
+    }
+
+    std::vector<bool> all_dependency_operations(const std::vector<node>& top_nodes) const {
+        std::vector<bool> result(operations.size(), false);
+        for (node top_node : top_nodes)
+            all_dependency_operations(top_node, result);
+        return result;
     }
 
     std::vector<bool> all_dependency_operations(node top_node) const {
@@ -295,6 +630,9 @@ struct graph_impl: para::graph::graph {
         }
     }
 
+    evaluation_session_uptr create_session(const tensor_cptr_vec& input_values,
+            std::size_t max_retained_values) const override;
+
     tensor_cptr_vec create_variable_values(const graph_input_map& input_value_map) const override {
         tensor_cptr_vec result(variables.size());
         for (auto i_map : input_value_map) {
@@ -304,9 +642,23 @@ struct graph_impl: para::graph::graph {
                     i_map.first.index);
             result[i_map.first.index] = i_map.second;
         }
+        check_input_values(result);
         return std::move(result);
     }
 
+    void check_input_values(const tensor_cptr_vec& input_values) const {
+        assert(input_values.size() == variables.size(), "Expected values for ", variables.size(),
+                " variables, found ", input_values.size());
+        for (const variable_impl& v : variables) {
+            if (v.has_dimensionalities && input_values[v.index])
+                assert(input_values[v.index]->dimensionalities == v.dimensionalities,
+                        "Value of variable ", v.name, " does not have its declared dimensionalities.");
+            if (input_values[v.index])
+                assert(input_values[v.index]->layout == v.layout,
+                        "Value of variable ", v.name, " does not have its declared layout.");
+        }
+    }
+
     graph_impl(const std::vector<variable_impl>& _variables, const std::vector<operation_impl>& _operations) :
                     variables(_variables),
                     operations(_operations) {
@@ -337,22 +689,356 @@ struct graph_impl: para::graph::graph {
                 return operation(oimpl.index);
         throw std::runtime_error("Could not find operation with name " + name);
     }
+
+    bool has_dimensionalities(node n) const override {
+        switch (n.type) {
+        case node::nt_variable:
+            assert(n.index >= 0 && n.index < static_cast<int>(variables.size()), "Invalid variable index ", n.index);
+            return variables[n.index].has_dimensionalities;
+        case node::nt_operation:
+            assert(n.index >= 0 && n.index < static_cast<int>(operations.size()), "Invalid operation index ",
+                    n.index);
+            return operations[n.index].has_dimensionalities;
+        }
+        URC;
+    }
+
+    tensor::N_vector get_dimensionalities(node n) const override {
+        assert(has_dimensionalities(n), "Dimensionalities of node ", n.index, " are not known at build time.");
+        switch (n.type) {
+        case node::nt_variable:
+            return variables[n.index].dimensionalities;
+        case node::nt_operation:
+            return operations[n.index].dimensionalities;
+        }
+        URC;
+    }
+
+    tensor_layout get_layout(node n) const override {
+        switch (n.type) {
+        case node::nt_variable:
+            assert(n.index >= 0 && n.index < static_cast<int>(variables.size()), "Invalid variable index ", n.index);
+            return variables[n.index].layout;
+        case node::nt_operation:
+            assert(n.index >= 0 && n.index < static_cast<int>(operations.size()), "Invalid operation index ",
+                    n.index);
+            return operations[n.index].layout;
+        }
+        URC;
+    }
+
+    double flop_count(node output_node) const override {
+        std::vector<bool> is_dependency = all_dependency_operations(output_node);
+        double result = 0;
+        for (const operation_impl& op : operations) {
+            if (!is_dependency[op.index])
+                continue;
+            assert(op.has_dimensionalities, "Cannot count flops of operation ", op.name,
+                    " since its dimensionalities are not known.");
+            result += op.function->flop_count(dependency_dimensionalities(variables, operations, op.dependencies));
+        }
+        return result;
+    }
+
+    std::size_t num_variables() const override {
+        return variables.size();
+    }
+
+    std::size_t num_operations() const override {
+        return operations.size();
+    }
+
+    tensor_function_csptr get_function(operation o) const override {
+        assert(o.index >= 0 && o.index < static_cast<int>(operations.size()), "Invalid operation index ", o.index);
+        return operations[o.index].function;
+    }
+
+    std::vector<node> get_dependencies(operation o) const override {
+        assert(o.index >= 0 && o.index < static_cast<int>(operations.size()), "Invalid operation index ", o.index);
+        return operations[o.index].dependencies;
+    }
 };
 
+struct evaluation_session_impl: evaluation_session {
+    const graph_impl& g;
+    tensor_cptr_vec input_values;
+    std::size_t max_retained_values;
+    tensor_cptr_vec retained;                  // retained values, indexed by operation
+    std::vector<std::size_t> num_invalidations; // how often each operation has been invalidated
+    std::vector<std::size_t> last_used;         // the call in which each operation was last used
+    std::size_t num_calls;
+
+    evaluation_session_impl(const graph_impl& v_g, const tensor_cptr_vec& v_input_values,
+            std::size_t v_max_retained_values) :
+                    g(v_g),
+                    input_values(v_input_values),
+                    max_retained_values(v_max_retained_values),
+                    retained(v_g.operations.size()),
+                    num_invalidations(v_g.operations.size(), 0),
+                    last_used(v_g.operations.size(), 0),
+                    num_calls(0) {
+        g.check_input_values(input_values);
+    }
+
+    void set_input(variable v, const tensor_cptr& value) override {
+        assert(v.index >= 0 && v.index < static_cast<int>(input_values.size()), "Invalid variable index ", v.index);
+        tensor_cptr previous = input_values[v.index];
+        input_values[v.index] = value;
+        try {
+            g.check_input_values(input_values);
+        } catch (...) {
+            input_values[v.index] = previous;
+            throw;
+        }
+        // invalidate all transitive consumers of the variable
+        std::vector<bool> dirty = g.all_consumer_operations(v);
+        for (std::size_t iop = 0; iop < dirty.size(); ++iop) {
+            if (dirty[iop]) {
+                ++num_invalidations[iop];
+                retained[iop].reset();
+            }
+        }
+    }
+
+    tensor_cptr value(node output_node) override {
+        return value(std::vector<node> { output_node })[0];
+    }
+
+    tensor_cptr_vec value(const std::vector<node>& output_nodes) override {
+        ++num_calls;
+        // find the operations that need to be (re)computed:
+        //   dependencies of the outputs that are not retained, without looking beyond retained values
+        std::vector<bool> missing(g.operations.size(), false);
+        for (node out : output_nodes)
+            find_missing(out, missing);
+
+        std::vector<bool> used = g.all_dependency_operations(output_nodes);
+        for (std::size_t iop = 0; iop < used.size(); ++iop)
+            if (used[iop])
+                last_used[iop] = num_calls;
+
+        // decide up front which values to retain after the call,
+        //   so that the others are released as soon as their last consumer has been computed
+        std::vector<bool> keep = values_to_retain(missing);
+        std::vector<bool> is_output = g.output_operations(output_nodes);
+        std::vector<int> last_use = g.last_consumers(missing);
+        try {
+            for (std::size_t iop = 0; iop < retained.size(); ++iop)
+                if (retained[iop] && last_use[iop] < 0 && !keep[iop] && !is_output[iop])
+                    retained[iop].reset();
+            for (std::size_t iop = 0; iop < g.operations.size(); ++iop) {
+                if (!missing[iop])
+                    continue;
+                const operation_impl& op = g.operations[iop];
+                tensor_cptr_vec op_inputs(op.dependencies.size());
+                for (std::size_t idep = 0; idep < op.dependencies.size(); ++idep) {
+                    node dep = op.dependencies[idep];
+                    op_inputs[idep] = dep.type == node::nt_variable ? input_values[dep.index] : retained[dep.index];
+                }
+                retained[iop] = op.function->value(op_inputs);
+                for (node dep : op.dependencies)
+                    if (dep.type == node::nt_operation && last_use[dep.index] == static_cast<int>(iop)
+                            && !keep[dep.index] && !is_output[dep.index])
+                        retained[dep.index].reset();
+            }
+        } catch (...) {
+            release_all_but(keep);
+            throw;
+        }
+
+        tensor_cptr_vec result(output_nodes.size());
+        for (std::size_t i_out = 0; i_out < output_nodes.size(); ++i_out) {
+            node out = output_nodes[i_out];
+            result[i_out] = out.type == node::nt_variable ? input_values[out.index] : retained[out.index];
+        }
+        release_all_but(keep);
+        return result;
+    }
+
+    std::size_t num_retained_values() const override {
+        return std::count_if(retained.begin(), retained.end(), [](const tensor_cptr& t) {return bool(t);});
+    }
+
+    void find_missing(node n, std::vector<bool>& missing) const {
+        if (n.type == node::nt_variable || missing[n.index] || retained[n.index])
+            return;
+        missing[n.index] = true;
+        for (node dep : g.operations[n.index].dependencies)
+            find_missing(dep, missing);
+    }
+
+    /**
+     * Choose at most max_retained_values of the values available at the end of a call,
+     *   i.e., those retained and those missing, preferring those invalidated least often,
+     *   then the most recently used, then those closest to the outputs.
+     */
+    std::vector<bool> values_to_retain(const std::vector<bool>& missing) const {
+        std::vector<int> candidates;
+        for (std::size_t iop = 0; iop < retained.size(); ++iop)
+            if (retained[iop] || missing[iop])
+                candidates.push_back(iop);
+        std::sort(candidates.begin(), candidates.end(), [this](int lhs, int rhs) {
+            if (num_invalidations[lhs] != num_invalidations[rhs])
+                return num_invalidations[lhs] < num_invalidations[rhs];
+            if (last_used[lhs] != last_used[rhs])
+                return last_used[lhs] > last_used[rhs];
+            return lhs > rhs;
+        });
+        if (candidates.size() > max_retained_values)
+            candidates.resize(max_retained_values);
+        std::vector<bool> result(retained.size(), false);
+        for (int iop : candidates)
+            result[iop] = true;
+        return result;
+    }
+
+    void release_all_but(const std::vector<bool>& keep) {
+        for (std::size_t iop = 0; iop < retained.size(); ++iop)
+            if (!keep[iop])
+                retained[iop].reset();
+    }
+};
+
+evaluation_session_uptr graph_impl::create_session(const tensor_cptr_vec& input_values,
+        std::size_t max_retained_values) const {
+    return evaluation_session_uptr(new evaluation_session_impl(*this, input_values, max_retained_values));
+}
+
+/** Copies its input into a fixed layout, which does not change the value at any position. */
+struct tensor_function_to_layout: tensor_function {
+    tensor_layout layout;
+    tensor_function_to_layout(tensor_layout _layout) :
+                    layout(_layout) {
+    }
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 1, "to_layout expects one input, found ", tv.size());
+        if (tv[0]->layout == layout)
+            return tv[0];
+        return tensor_cptr(new tensor(tensor::to_layout(*tv[0], layout)));
+    }
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr d(new tensor(tensor::identity_derivative(tv[0]->dimensionalities)));
+        return derivative { value(tv), tensor_cptr_vec { d } };
+    }
+    bool infer_dimensionalities(const std::vector<tensor::N_vector>& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "to_layout expects one input, found ", idims.size());
+        odims = idims[0];
+        return true;
+    }
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        return tensor_function_csptr(new tensor_function_to_layout(layout));
+    }
+    tensor derivative_wrt_input(const tensor_cptr_vec& inputs, const tensor& value, std::size_t input_index) const
+            override {
+        return tensor::identity_derivative(inputs[0]->dimensionalities);
+    }
+    tensor chain_derivative(const tensor_cptr_vec& inputs, const tensor& value, std::size_t input_index,
+            const tensor& input_derivative) const override {
+        return input_derivative;
+    }
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+    bool accepts_layout(std::size_t input_index, tensor_layout input_layout) const override {
+        return true;
+    }
+    tensor_layout output_layout() const override {
+        return layout;
+    }
+};
+
+bool is_layout_conversion(const tensor_function& function) {
+    return dynamic_cast<const tensor_function_to_layout*>(&function) != nullptr;
+}
+
 struct graph_builder_impl: graph_builder {
     std::vector<variable_impl> variables;
     std::vector<operation_impl> operations;
+    std::map<node, operation> row_major_repacks;    // the operation repacking each node, if one was needed
 
     variable add_variable(const std::string& name) override {
-        variable_impl vimpl { name, static_cast<int>(variables.size()), std::vector<operation>(), -1 };
+        variable_impl vimpl { name, static_cast<int>(variables.size()), std::vector<operation>(), -1, false,
+                tensor::N_vector(), tensor_layout::row_major };
+        variables.push_back(vimpl);
+        return variable(vimpl.index);
+    }
+
+    variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities) override {
+        return add_variable(name, dimensionalities, tensor_layout::row_major);
+    }
+
+    variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities, tensor_layout layout)
+            override {
+        variable_impl vimpl { name, static_cast<int>(variables.size()), std::vector<operation>(), -1, true,
+                dimensionalities, layout };
         variables.push_back(vimpl);
         return variable(vimpl.index);
     }
 
+    tensor_layout layout_of(node n) const {
+        return n.type == node::nt_variable ? variables[n.index].layout : operations[n.index].layout;
+    }
+
+    /**
+     * Replace the dependencies that the function cannot work with by their row_major repacks.
+     * This is decided one operation at a time, as it is added:
+     *   the layouts of the dependencies are taken as they are, and no layout is chosen for any node.
+     */
+    std::vector<node> repack_dependencies(const tensor_function& function, const std::vector<node>& dependencies) {
+        std::vector<node> result(dependencies);
+        for (std::size_t i_dep = 0; i_dep < result.size(); ++i_dep) {
+            node dep = result[i_dep];
+            if (function.accepts_layout(i_dep, layout_of(dep)))
+                continue;
+            auto i_repack = row_major_repacks.find(dep);
+            if (i_repack == row_major_repacks.end()) {
+                std::string dep_name = dep.type == node::nt_variable ? variables[dep.index].name
+                        : operations[dep.index].name;
+                operation repack = add_operation(dep_name + "_to_row_major",
+                        layout_conversion(tensor_layout::row_major), std::vector<node> { dep });
+                i_repack = row_major_repacks.insert(std::make_pair(dep, repack)).first;
+            }
+            result[i_dep] = i_repack->second;
+        }
+        return result;
+    }
+
     operation add_operation(const std::string& name, const tensor_function_csptr& function,
-            const std::vector<node>& dependencies) override {
+            const std::vector<node>& given_dependencies) override {
+        for (node dep : given_dependencies) {
+            switch (dep.type) {
+            case node::nt_variable:
+                assert(dep.index >= 0 && dep.index < static_cast<int>(variables.size()),
+                        "Operation ", name, " depends on invalid variable index ", dep.index);
+                break;
+            case node::nt_operation:
+                assert(dep.index >= 0 && dep.index < static_cast<int>(operations.size()),
+                        "Operation ", name, " depends on invalid operation index ", dep.index);
+                break;
+            }
+        }
+        std::vector<node> dependencies = repack_dependencies(*function, given_dependencies);
         operation_impl oimpl { name, static_cast<int>(operations.size()), function, std::vector<operation>(),
-                dependencies, -1 };
+                dependencies, -1, false, tensor::N_vector(), function->output_layout() };
+        bool all_dependencies_known = true;
+        for (node dep : dependencies) {
+            switch (dep.type) {
+            case node::nt_variable:
+                all_dependencies_known = all_dependencies_known && variables[dep.index].has_dimensionalities;
+                break;
+            case node::nt_operation:
+                all_dependencies_known = all_dependencies_known && operations[dep.index].has_dimensionalities;
+                break;
+            }
+        }
+        if (all_dependencies_known) {
+            try {
+                oimpl.has_dimensionalities = function->infer_dimensionalities(
+                        dependency_dimensionalities(variables, operations, dependencies), oimpl.dimensionalities);
+            } catch (std::exception& e) {
+                throw std::runtime_error("Shape error in operation " + name + ": " + e.what());
+            }
+        }
         operation o(oimpl.index);
         for (node dep : dependencies) {
             switch (dep.type) {
@@ -370,6 +1056,21 @@ struct graph_builder_impl: graph_builder {
         return o;
     }
 
+    operation add_scan(const std::string& name, const scan_body& body, const std::vector<node>& initial_states,
+            const std::vector<node>& sequences, const std::vector<node>& constants) override {
+        std::vector<node> dependencies(initial_states);
+        dependencies.insert(dependencies.end(), sequences.begin(), sequences.end());
+        dependencies.insert(dependencies.end(), constants.begin(), constants.end());
+        return add_operation(name, scan(body), dependencies);
+    }
+
+    operation add_conditional(const std::string& name, node predicate, const std::vector<conditional_branch>& branches,
+            const std::vector<node>& operands) override {
+        std::vector<node> dependencies { predicate };
+        dependencies.insert(dependencies.end(), operands.begin(), operands.end());
+        return add_operation(name, conditional(branches), dependencies);
+    }
+
     graph_cuptr build_graph() const override {
         return graph_cuptr(new graph_impl { variables, operations });
     }
@@ -393,9 +1094,73 @@ operation::operation(int index) :
                 node(node::nt_operation, index) {
 }
 
+bool tensor_function::infer_dimensionalities(const std::vector<tensor::N_vector>& input_dimensionalities,
+        tensor::N_vector& output_dimensionalities) const {
+    return false;
+}
+
+double tensor_function::flop_count(const std::vector<tensor::N_vector>& input_dimensionalities) const {
+    return 0;
+}
+
+tensor_function_csptr tensor_function::batched(const std::vector<bool>& is_batched) const {
+    return nullptr;
+}
+
+tensor tensor_function::chain_derivative(const tensor_cptr_vec& inputs, const tensor& value, std::size_t input_index,
+        const tensor& input_derivative) const {
+    derivative d = deriv(inputs);
+    assert(input_index < d.node_derivative.size(), "Cannot chain derivative of input ", input_index);
+    return tensor::chain_multiplication(input_derivative, *d.node_derivative[input_index],
+            inputs[input_index]->dimensionalities.size());
+}
+
+bool tensor_function::prefers_chain_derivative() const {
+    return false;
+}
+
+tensor tensor_function::derivative_wrt_input(const tensor_cptr_vec& inputs, const tensor& value,
+        std::size_t input_index) const {
+    derivative d = deriv(inputs);
+    assert(input_index < d.node_derivative.size(), "Cannot compute derivative of input ", input_index);
+    return *d.node_derivative[input_index];
+}
+
+bool tensor_function::accepts_layout(std::size_t input_index, tensor_layout layout) const {
+    return layout == tensor_layout::row_major;
+}
+
+tensor_layout tensor_function::output_layout() const {
+    return tensor_layout::row_major;
+}
+
+tensor_function_csptr tensor_function::quantized(std::size_t weight_index, const tensor& weight,
+        const std::vector<double>& input_ranges) const {
+    return nullptr;
+}
+
+bool binds_every_variable_once(const graph& subgraph, const std::vector<variable>& variables) {
+    std::vector<variable> sorted(variables);
+    std::sort(sorted.begin(), sorted.end());
+    // as many distinct variables as the subgraph has, all within its range, are exactly 0 .. n - 1
+    return sorted.size() == subgraph.num_variables() && std::unique(sorted.begin(), sorted.end()) == sorted.end()
+            && (sorted.empty() || (sorted.front().index >= 0
+                    && static_cast<std::size_t>(sorted.back().index) < sorted.size()));
+}
+
+tensor_function_csptr layout_conversion(tensor_layout layout) {
+    return tensor_function_csptr(new tensor_function_to_layout(layout));
+}
+
 tensor_function::~tensor_function() {
 }
 
+evaluation_session::~evaluation_session() {
+}
+
+evaluation_context::~evaluation_context() {
+}
+
 graph::~graph() {
 }
 
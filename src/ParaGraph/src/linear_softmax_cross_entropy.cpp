@@ -0,0 +1,273 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+//----------------------------------------------------------------------------------------------------------------------
+//-------------------------------- tensor_function_linear_softmax_cross_entropy ----------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Cross entropy of the softmax of the logits W x over the classes,
+ *   for weights W {classes, features}, points x {features, points} and class indices y {points}:
+ *            points
+ *       J =    ∑   ( L_p - (W x)[y_p, p] ),      L_p = log ∑ exp((W x)[c, p])
+ *             p=1                                          c
+ * The logits are only ever computed for a tile of classes at a time,
+ *   with the maximum and the sum of exponentials of every point updated online from tile to tile,
+ *   so memory is bounded by the tile size rather than the number of classes.
+ */
+struct tensor_function_linear_softmax_cross_entropy: tensor_function {
+    N tile_size;
+    tensor_function_linear_softmax_cross_entropy(N ts) :
+                    tile_size(ts) {
+    }
+
+    struct problem {
+        const tensor& W;
+        const tensor& x;
+        const tensor& y;
+        N classes, features, points;
+    };
+
+    problem check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 3, "linear_softmax_cross_entropy expects weights, points and labels, found ", tv.size(),
+                " inputs.");
+        tensor::N_vector odims;
+        infer_dimensionalities(N_vector_vec { tv[0]->dimensionalities, tv[1]->dimensionalities,
+                tv[2]->dimensionalities }, odims);
+        problem result { *tv[0], *tv[1], *tv[2], tv[0]->dimensionalities[0], tv[0]->dimensionalities[1],
+                tv[1]->dimensionalities[1] };
+        for (N p = 0; p < result.points; ++p) {
+            double label = result.y[p];
+            assert(label >= 0 && label < result.classes && label == std::floor(label),
+                    "linear_softmax_cross_entropy expects class indices as labels, found ", label);
+        }
+        return result;
+    }
+
+    /** The logits of the classes [first, first + size) for all the points, into a {size, points} buffer. */
+    static void logits_tile(const problem& pr, N first, N size, std::vector<double>& z) {
+        z.resize(size * pr.points);
+        kernels::gemm(&pr.W[first * pr.features], &pr.x[0], z.data(), size, pr.features, pr.points);
+    }
+
+    /** L_p = log ∑ exp((W x)[c, p]) for every point, streaming over tiles of classes. */
+    std::vector<double> log_sum_exp(const problem& pr) const {
+        std::vector<double> M(pr.points, -std::numeric_limits<double>::infinity()), S(pr.points, 0), z;
+        for (N first = 0; first < pr.classes; first += tile_size) {
+            const N size = std::min(tile_size, pr.classes - first);
+            logits_tile(pr, first, size, z);
+            for (N i_c = 0; i_c < size; ++i_c)
+                for (N p = 0; p < pr.points; ++p) {
+                    const double z_cp = z[i_c * pr.points + p];
+                    // rescale the running sum whenever the running maximum grows
+                    if (z_cp > M[p]) {
+                        S[p] = S[p] * std::exp(M[p] - z_cp) + 1;
+                        M[p] = z_cp;
+                    } else
+                        S[p] += std::exp(z_cp - M[p]);
+                }
+        }
+        std::vector<double> L(pr.points);
+        for (N p = 0; p < pr.points; ++p)
+            L[p] = M[p] + std::log(S[p]);
+        return L;
+    }
+
+    /** The logit of the labelled class of every point, i.e., (W x)[y_p, p]. */
+    static double labelled_logit(const problem& pr, N p) {
+        const N c = static_cast<N>(pr.y[p]);
+        double result = 0;
+        for (N f = 0; f < pr.features; ++f)
+            result += pr.W[c * pr.features + f] * pr.x[f * pr.points + p];
+        return result;
+    }
+
+    static double loss(const problem& pr, const std::vector<double>& L) {
+        double result = 0;
+        for (N p = 0; p < pr.points; ++p)
+            result += L[p] - labelled_logit(pr, p);
+        return result;
+    }
+
+    /**
+     * The gradient w.r.t. W, from G = ∂J/∂(W x) = softmax(W x) - onehot(y), again tile by tile,
+     *   with each tile of classes giving the corresponding rows of ∂J/∂W = G x^T.
+     */
+    tensor weights_gradient(const problem& pr, const std::vector<double>& L) const {
+        tensor dW(tensor::zero(pr.W.dimensionalities));
+        std::vector<double> xT(pr.points * pr.features);
+        for (N f = 0; f < pr.features; ++f)
+            for (N p = 0; p < pr.points; ++p)
+                xT[p * pr.features + f] = pr.x[f * pr.points + p];
+        std::vector<double> G;
+        for (N first = 0; first < pr.classes; first += tile_size) {
+            const N size = std::min(tile_size, pr.classes - first);
+            logits_tile(pr, first, size, G);
+            for (N i_c = 0; i_c < size; ++i_c)
+                for (N p = 0; p < pr.points; ++p) {
+                    double& g = G[i_c * pr.points + p];
+                    g = std::exp(g - L[p]) - (static_cast<N>(pr.y[p]) == first + i_c ? 1 : 0);
+                }
+            kernels::gemm(G.data(), xT.data(), &dW[first * pr.features], size, pr.points, pr.features);
+        }
+        return dW;
+    }
+
+    /**
+     * The gradient w.r.t. x, ∂J/∂x = W^T softmax(W x) - W^T onehot(y), in a single pass over the tiles:
+     *   W^T exp(W x - M) is accumulated alongside the online maximum M and sum of exponentials S,
+     *   and rescaled with them, so that the log-sum-exp L = M + log S comes out of the same pass.
+     */
+    tensor points_gradient(const problem& pr, std::vector<double>& L) const {
+        tensor dx(tensor::zero(pr.x.dimensionalities));
+        std::vector<double> M(pr.points, -std::numeric_limits<double>::infinity()), S(pr.points, 0), E, WT;
+        std::vector<double> dx_tile(pr.features * pr.points);
+        for (N first = 0; first < pr.classes; first += tile_size) {
+            const N size = std::min(tile_size, pr.classes - first);
+            logits_tile(pr, first, size, E);
+            for (N p = 0; p < pr.points; ++p) {
+                double tile_max = M[p];
+                for (N i_c = 0; i_c < size; ++i_c)
+                    tile_max = std::max(tile_max, E[i_c * pr.points + p]);
+                // rescale what was accumulated whenever the running maximum grows
+                if (tile_max > M[p]) {
+                    const double alpha = std::exp(M[p] - tile_max);
+                    S[p] *= alpha;
+                    for (N f = 0; f < pr.features; ++f)
+                        dx[f * pr.points + p] *= alpha;
+                    M[p] = tile_max;
+                }
+                for (N i_c = 0; i_c < size; ++i_c) {
+                    double& e = E[i_c * pr.points + p];
+                    e = std::exp(e - M[p]);
+                    S[p] += e;
+                }
+            }
+            WT.resize(pr.features * size);
+            for (N i_c = 0; i_c < size; ++i_c)
+                for (N f = 0; f < pr.features; ++f)
+                    WT[f * size + i_c] = pr.W[(first + i_c) * pr.features + f];
+            kernels::gemm(WT.data(), E.data(), dx_tile.data(), pr.features, size, pr.points);
+            for (N i = 0; i < dx_tile.size(); ++i)
+                dx[i] += dx_tile[i];
+        }
+        L.resize(pr.points);
+        for (N p = 0; p < pr.points; ++p) {
+            L[p] = M[p] + std::log(S[p]);
+            const N c = static_cast<N>(pr.y[p]);
+            for (N f = 0; f < pr.features; ++f)
+                dx[f * pr.points + p] = dx[f * pr.points + p] / S[p] - pr.W[c * pr.features + f];
+        }
+        return dx;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        problem pr = check_inputs(tv);
+        return tensor_cptr(new tensor(tensor::N_vector { }, std::vector<double> { loss(pr, log_sum_exp(pr)) }));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        problem pr = check_inputs(tv);
+        std::vector<double> L;
+        tensor dx = points_gradient(pr, L);
+        tensor dW = weights_gradient(pr, L);
+        // the labels are discrete, so the loss is locally constant w.r.t. them
+        return derivative { tensor_cptr(new tensor(tensor::N_vector { }, std::vector<double> { loss(pr, L) })),
+                tensor_cptr_vec { tensor_cptr(new tensor(std::move(dW))), tensor_cptr(new tensor(std::move(dx))),
+                        tensor_cptr(new tensor(tensor::zero(pr.y.dimensionalities))) } };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& J, std::size_t input_index) const override {
+        // J sums L over the points, so the log-sum-exp of every point still needs a pass over the classes:
+        //   a separate one for W, and the one computing the gradient itself for x
+        assert(input_index < 3, "linear_softmax_cross_entropy expects weights, points and labels.");
+        problem pr = check_inputs(tv);
+        std::vector<double> L;
+        switch (input_index) {
+        case 0:
+            return weights_gradient(pr, log_sum_exp(pr));
+        case 1:
+            return points_gradient(pr, L);
+        default:
+            return tensor::zero(pr.y.dimensionalities);
+        }
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& J, std::size_t input_index,
+            const tensor& U) const override {
+        assert(input_index < 3, "linear_softmax_cross_entropy expects weights, points and labels.");
+        const tensor::N_vector& idims = tv[input_index]->dimensionalities;
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - idims.size());
+        if (input_index == 2)
+            return tensor::zero(rdims);
+        tensor g = derivative_wrt_input(tv, J, input_index);
+        // the loss is a scalar, so chaining is a dot product with the gradient for every position of X
+        std::vector<double> result(U.size() / g.size(), 0);
+        for (N x = 0; x < result.size(); ++x)
+            for (N i = 0; i < g.size(); ++i)
+                result[x] += U[x * g.size() + i] * g[i];
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 3, "linear_softmax_cross_entropy expects weights, points and labels, found ",
+                idims.size(), " inputs.");
+        assert(idims[0].size() == 2 && idims[1].size() == 2 && idims[2].size() == 1,
+                "linear_softmax_cross_entropy expects weights {classes, features}, points {features, points}",
+                " and labels {points}.");
+        assert(idims[0][1] == idims[1][0] && idims[1][1] == idims[2][0],
+                "linear_softmax_cross_entropy expects matching features and points.");
+        odims.clear();
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // the logits, plus exponentiation and accumulation of each of them
+        const double classes = idims[0][0], features = idims[0][1], points = idims[1][1];
+        return 2 * classes * features * points + 3 * classes * points;
+    }
+};
+// end struct tensor_function_linear_softmax_cross_entropy
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::linear_softmax_cross_entropy(std::size_t tile_size) {
+    assert(tile_size > 0, "linear_softmax_cross_entropy needs a positive tile size.");
+    return tensor_function_csptr(new tensor_function_linear_softmax_cross_entropy(tile_size));
+}
+
+} // end namespace graph
+} // end namespace para
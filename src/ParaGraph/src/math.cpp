@@ -16,35 +16,53 @@
 
 #include <para/graph/math.h>
 #include <para/graph/exception.h>
+#include "kernels.h"
 #include <algorithm>
+#include <numeric>
 
 namespace para {
 namespace graph {
 
 tensor::tensor(const tensor::N_vector& _dimensionalities, const std::vector<double>& _data) :
                 dimensionalities(_dimensionalities),
+                layout(tensor_layout::row_major),
                 m_data(_data) {
     assert(is_valid(), "tensor construction invalid, check the size of the data.");
 }
 
 tensor::tensor(tensor::N_vector&& _dimensionalities, std::vector<double>&& _data) :
                 dimensionalities(std::move(_dimensionalities)),
+                layout(tensor_layout::row_major),
                 m_data(std::move(_data)) {
     assert(is_valid(), "tensor construction invalid, check the size of the data.");
 }
 
 tensor::tensor(const tensor::N_vector& _dimensionalities, std::vector<double>&& _data) :
                 dimensionalities(std::move(_dimensionalities)),
+                layout(tensor_layout::row_major),
                 m_data(_data) {
     assert(is_valid(), "tensor construction invalid, check the size of the data.");
 }
 
+tensor::tensor(tensor::N_vector&& _dimensionalities, std::vector<double>&& _data, tensor_layout _layout) :
+                dimensionalities(std::move(_dimensionalities)),
+                layout(_layout),
+                m_data(std::move(_data)) {
+    assert(is_valid(), "tensor construction invalid, check the size of the data.");
+}
+
 tensor::N tensor::compute_offset(const tensor::N_vector& position) const {
     assert(position.size() == dimensionalities.size(), "Cannot compute offset of a", dimensionalities.size(),
             "-D tensor using a ", position.size(), "-D position.");
-    ;
     N skip_size = 1;
     N offset = 0;
+    if (layout == tensor_layout::column_major) {
+        for (N dim = 0; dim < position.size(); ++dim) {
+            offset += position[dim] * skip_size;
+            skip_size *= dimensionalities[dim];
+        }
+        return offset;
+    }
     for (int dim = position.size() - 1; dim >= 0; --dim) {
         offset += position[dim] * skip_size;
         skip_size *= dimensionalities[dim];
@@ -54,6 +72,13 @@ tensor::N tensor::compute_offset(const tensor::N_vector& position) const {
 
 tensor::N_vector tensor::compute_position(tensor::N offset) const {
     N_vector position(dimensionalities.size());
+    if (layout == tensor_layout::column_major) {
+        for (N dim = 0; dim < position.size(); ++dim) {
+            position[dim] = offset % dimensionalities[dim];
+            offset /= dimensionalities[dim];
+        }
+        return position;
+    }
     N skip_size = 1;
     for (auto i_dim = dimensionalities.begin(); i_dim < dimensionalities.end(); ++i_dim) {
         skip_size *= *i_dim;
@@ -136,24 +161,27 @@ tensor tensor::chain_multiplication(const tensor& lhs, const tensor& rhs, int nu
         r_part_size *= rdim[d];
     }
 
-    N data_size = l_part_size * r_part_size;
-    std::vector<double> data(data_size);
-    for (N data_pos = 0; data_pos < data_size; ++data_pos) {
-        N l_part_pos = data_pos / r_part_size;
-        N r_part_pos = data_pos % r_part_size;
-        data[data_pos] = 0;
-        for (N common_pos = 0; common_pos < common_size; ++common_pos) {
-            N l_pos = l_part_pos * common_size + common_pos;
-            N r_pos = common_pos * r_part_size + r_part_pos;
-            data[data_pos] += lhs.m_data[l_pos] * rhs.m_data[r_pos];
-        }
-    }
+    // a column-major lhs with at most one free and one chained axis is a row-major [common x l_part] matrix,
+    // and likewise a column-major rhs with at most one chained and one free axis is a row-major [r_part x common] one;
+    // other column-major operands are repacked
+    N l_free = ldim.size() - ncd, r_free = rdim.size() - ncd;
+    bool l_transposed = lhs.layout == tensor_layout::column_major && l_free <= 1 && ncd <= 1;
+    bool r_transposed = rhs.layout == tensor_layout::column_major && r_free <= 1 && ncd <= 1;
+    if (lhs.layout != tensor_layout::row_major && !l_transposed)
+        return chain_multiplication(to_layout(lhs, tensor_layout::row_major), rhs, num_common_dims);
+    if (rhs.layout != tensor_layout::row_major && !r_transposed)
+        return chain_multiplication(lhs, to_layout(rhs, tensor_layout::row_major), num_common_dims);
+
+    std::vector<double> data(l_part_size * r_part_size);
+    kernels::gemm(lhs.m_data.data(), l_transposed, rhs.m_data.data(), r_transposed, data.data(), l_part_size,
+            common_size, r_part_size);
     return tensor(std::move(dim), std::move(data));
 }
 
 tensor tensor::add(const tensor& lhs, const tensor& rhs) {
     assert(lhs.dimensionalities.size() == rhs.dimensionalities.size(),
             "Tensors must have matching orders for addition.");
+    assert(lhs.layout == rhs.layout, "Tensors must have matching layouts for addition.");
     std::size_t order = lhs.dimensionalities.size();
     for (std::size_t i_dim = 0; i_dim < order; ++i_dim)
         assert(lhs.dimensionalities[i_dim] == rhs.dimensionalities[i_dim],
@@ -163,9 +191,105 @@ tensor tensor::add(const tensor& lhs, const tensor& rhs) {
     for (std::size_t i_data = 0; i_data < size; ++i_data) {
         result_data[i_data] = lhs.m_data[i_data] + rhs.m_data[i_data];
     }
-    return std::move(tensor(lhs.dimensionalities, std::move(result_data)));
+    return std::move(tensor(N_vector(lhs.dimensionalities), std::move(result_data), lhs.layout));
 }
 
+tensor tensor::to_layout(const tensor& t, tensor_layout layout) {
+    if (t.layout == layout)
+        return t;
+    // both layouts visit the positions in odometer order, one counting from the last axis and the other from the first;
+    // walk the source in its own order while tracking the offset of the same position in the target order
+    const N_vector& dims = t.dimensionalities;
+    std::size_t order = dims.size();
+    N_vector target_strides(order, 1);
+    if (layout == tensor_layout::column_major) {
+        for (std::size_t d = 1; d < order; ++d)
+            target_strides[d] = target_strides[d - 1] * dims[d - 1];
+    } else {
+        for (std::size_t d = order; d-- > 1;)
+            target_strides[d - 1] = target_strides[d] * dims[d];
+    }
+    // the source order, fastest-moving axis first
+    N_vector axes(order);
+    std::iota(axes.begin(), axes.end(), 0);
+    if (t.layout == tensor_layout::row_major)
+        std::reverse(axes.begin(), axes.end());
+
+    std::vector<double> data(t.m_data.size());
+    N_vector position(order, 0);
+    N target_offset = 0;
+    for (N source_offset = 0; source_offset < t.m_data.size(); ++source_offset) {
+        data[target_offset] = t.m_data[source_offset];
+        for (std::size_t a : axes) {
+            target_offset += target_strides[a];
+            if (++position[a] < dims[a])
+                break;
+            target_offset -= target_strides[a] * dims[a];
+            position[a] = 0;
+        }
+    }
+    return tensor(N_vector(dims), std::move(data), layout);
+}
+
+namespace kernels {
+
+void gemm(const double* a, const double* b, double* c, std::size_t m, std::size_t k, std::size_t n) {
+    // i-k-j loop order, so that the innermost loop runs over contiguous rows of b and c
+    std::fill(c, c + m * n, 0.0);
+    for (std::size_t i = 0; i < m; ++i) {
+        double* c_row = c + i * n;
+        const double* a_row = a + i * k;
+        for (std::size_t p = 0; p < k; ++p) {
+            const double a_ip = a_row[p];
+            const double* b_row = b + p * n;
+            for (std::size_t j = 0; j < n; ++j)
+                c_row[j] += a_ip * b_row[j];
+        }
+    }
+}
+
+void gemm(const double* a, bool a_transposed, const double* b, bool b_transposed, double* c, std::size_t m,
+        std::size_t k, std::size_t n) {
+    if (!a_transposed && !b_transposed) {
+        gemm(a, b, c, m, k, n);
+        return;
+    }
+    std::fill(c, c + m * n, 0.0);
+    if (!b_transposed) {
+        // p-i-j loop order, so that the innermost loop runs over contiguous rows of b and c
+        for (std::size_t p = 0; p < k; ++p) {
+            const double* a_col = a + p * m;
+            const double* b_row = b + p * n;
+            for (std::size_t i = 0; i < m; ++i) {
+                const double a_ip = a_col[i];
+                double* c_row = c + i * n;
+                for (std::size_t j = 0; j < n; ++j)
+                    c_row[j] += a_ip * b_row[j];
+            }
+        }
+        return;
+    }
+    // with b stored transposed, every element of c is a dot product with a contiguous row of b
+    for (std::size_t i = 0; i < m; ++i) {
+        double* c_row = c + i * n;
+        for (std::size_t j = 0; j < n; ++j) {
+            const double* b_col = b + j * k;
+            double sum = 0;
+            if (a_transposed) {
+                for (std::size_t p = 0; p < k; ++p)
+                    sum += a[p * m + i] * b_col[p];
+            } else {
+                const double* a_row = a + i * k;
+                for (std::size_t p = 0; p < k; ++p)
+                    sum += a_row[p] * b_col[p];
+            }
+            c_row[j] = sum;
+        }
+    }
+}
+
+} // end namespace kernels
+
 } // end namespace para
 } // end namespace graph
 
@@ -16,13 +16,47 @@
 
 #include <para/graph/ml_graph.h>
 #include <para/graph/exception.h>
+#include "kernels.h"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
 #include <sstream>
 
 namespace {
 using namespace para::graph;
 
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+double num_elements(const tensor::N_vector& dims) {
+    return std::accumulate(dims.begin(), dims.end(), 1.0, [](double acc, tensor::N dim) {return acc * dim;});
+}
+
+N_vector_vec input_dimensionalities(const tensor_cptr_vec& tv) {
+    N_vector_vec result;
+    for (const auto& t : tv)
+        result.push_back(t->dimensionalities);
+    return result;
+}
+
+/** The tensor itself if it is stored row-major, otherwise a row-major copy. */
+tensor_cptr as_row_major(const tensor_cptr& t) {
+    if (t->layout == tensor_layout::row_major)
+        return t;
+    return tensor_cptr(new tensor(tensor::to_layout(*t, tensor_layout::row_major)));
+}
+
+/** Shape rule for functions that work element-wise on a fixed number of inputs of identical dimensionalities. */
+bool infer_element_wise_dimensionalities(const char* name, std::size_t num_inputs, const N_vector_vec& idims,
+        tensor::N_vector& odims) {
+    assert(idims.size() == num_inputs, name, " expects ", num_inputs, " inputs, found ", idims.size());
+    for (const auto& idim : idims)
+        assert(idim == idims[0], name, " expects all inputs to have the same dimensionalities.");
+    odims = idims[0];
+    return true;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 //-------------------------------------- tensor_function_chain_multiplication ------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
@@ -68,8 +102,10 @@ struct tensor_function_chain_multiplication: tensor_function {
          *
          *                = dCdB[k,l,i,j]
          */
-        const tensor& A = *inputs[0];
-        const tensor& B = *inputs[1];
+        // the loops below index A and B by their row-major offsets
+        tensor_cptr a_row_major = as_row_major(inputs[0]), b_row_major = as_row_major(inputs[1]);
+        const tensor& A = *a_row_major;
+        const tensor& B = *b_row_major;
         const tensor& C = *v;
 
         auto calc_size = [](tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
@@ -131,40 +167,173 @@ struct tensor_function_chain_multiplication: tensor_function {
 
         return derivative { v, tensor_cptr_vec { d1, d2 } };
     }
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 2, "chain_multiplication expects two inputs, found ", idims.size());
+        const tensor::N_vector& ldim = idims[0];
+        const tensor::N_vector& rdim = idims[1];
+        tensor::N ncd = static_cast<tensor::N>(num_common_dims);
+        assert(num_common_dims >= 0 && ldim.size() >= ncd && rdim.size() >= ncd,
+                "chain_multiplication cannot chain ", num_common_dims, " dimensions of inputs with orders ",
+                ldim.size(), " and ", rdim.size());
+        assert(std::equal(ldim.end() - ncd, ldim.end(), rdim.begin()),
+                "chain_multiplication expects chained dimensionalities of lhs and rhs to match.");
+        odims.assign(ldim.begin(), ldim.end() - ncd);
+        odims.insert(odims.end(), rdim.begin() + ncd, rdim.end());
+        return true;
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        // one multiplication and one addition for every combination of lhs and rhs positions that are chained
+        return 2.0 * num_elements(idims[0]) * num_elements(idims[1])
+                / num_elements(tensor::N_vector(idims[1].begin(), idims[1].begin() + num_common_dims));
+    }
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override;
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        // tensor::chain_multiplication reads column-major matrices in place, and repacks other operands itself
+        return true;
+    }
+    tensor_function_csptr quantized(std::size_t weight_index, const tensor& weight,
+            const std::vector<double>& input_ranges) const override {
+        // only dense layers W x, with a weight matrix as the lhs
+        if (weight_index != 0 || num_common_dims != 1 || weight.dimensionalities.size() != 2)
+            return nullptr;
+        return tensor_function_factory::quantized_chain_multiplication(weight, input_ranges[1]);
+    }
 };
 // end struct tensor_function_chain_multiplication
 
+//----------------------------------------------------------------------------------------------------------------------
+//-------------------------------- tensor_function_batched_chain_multiplication ----------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * A chain_multiplication over a batch of examples, where the rhs has a leading batch axis,
+ *   and the lhs may have one too.
+ * It is evaluated as an einsum whose subscripts depend on the orders of the inputs,
+ *   so that the examples become the batch axis of a batched matrix multiplication.
+ */
+struct tensor_function_batched_chain_multiplication: tensor_function {
+    int num_common_dims;
+    bool lhs_batched;
+    tensor_function_batched_chain_multiplication(int ncd, bool lb) :
+                    num_common_dims(ncd),
+                    lhs_batched(lb) {
+    }
+
+    tensor_function_csptr as_einsum(const N_vector_vec& idims) const {
+        assert(idims.size() == 2, "batched chain_multiplication expects two inputs, found ", idims.size());
+        std::size_t ncd = static_cast<std::size_t>(num_common_dims);
+        std::size_t lhs_order = idims[0].size() - (lhs_batched ? 1 : 0);
+        assert(num_common_dims >= 0 && idims[0].size() >= (lhs_batched ? 1 : 0) + ncd && idims[1].size() >= 1 + ncd,
+                "batched chain_multiplication cannot chain ", num_common_dims, " dimensions of inputs with orders ",
+                idims[0].size(), " and ", idims[1].size());
+        std::size_t lhs_free = lhs_order - ncd;
+        std::size_t rhs_free = idims[1].size() - 1 - ncd;
+        assert(1 + lhs_free + ncd + rhs_free <= 52, "batched chain_multiplication supports at most 52 axes.");
+
+        // label 0 indexes the examples, followed by the free lhs axes, the chained axes, and the free rhs axes
+        auto letter = [](std::size_t label) {return static_cast<char>(label < 26 ? 'a' + label : 'A' + label - 26);};
+        std::string lhs(lhs_batched ? 1 : 0, letter(0)), rhs(1, letter(0)), out(1, letter(0));
+        for (std::size_t i = 0; i < lhs_free; ++i) {
+            lhs += letter(1 + i);
+            out += letter(1 + i);
+        }
+        for (std::size_t i = 0; i < ncd; ++i) {
+            lhs += letter(1 + lhs_free + i);
+            rhs += letter(1 + lhs_free + i);
+        }
+        for (std::size_t i = 0; i < rhs_free; ++i) {
+            rhs += letter(1 + lhs_free + ncd + i);
+            out += letter(1 + lhs_free + ncd + i);
+        }
+        return tensor_function_factory::einsum(lhs + "," + rhs + "->" + out);
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        return as_einsum(input_dimensionalities(tv))->value(tv);
+    }
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        return as_einsum(input_dimensionalities(tv))->deriv(tv);
+    }
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        return as_einsum(idims)->infer_dimensionalities(idims, odims);
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        return as_einsum(idims)->flop_count(idims);
+    }
+};
+// end struct tensor_function_batched_chain_multiplication
+
+tensor_function_csptr tensor_function_chain_multiplication::batched(const std::vector<bool>& is_batched) const {
+    assert(is_batched.size() == 2, "chain_multiplication expects two inputs, found ", is_batched.size());
+    // with only the lhs batched, the examples are just another free axis of the lhs
+    if (!is_batched[1])
+        return tensor_function_csptr(new tensor_function_chain_multiplication(num_common_dims));
+    return tensor_function_csptr(new tensor_function_batched_chain_multiplication(num_common_dims, is_batched[0]));
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 //------------------------------------------- tensor_function_softmax --------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 struct tensor_function_softmax: tensor_function {
-    typedef std::pair<double, tensor_cptr> DxT;
-    DxT C_and_F(const tensor_cptr_vec& tv) const {
+    /** The axis (after the batch axes) along which values are normalized together, or -1 for all of them. */
+    int axis;
+    /** The number of leading axes indexing independent softmaxes, e.g., over the examples of a batch. */
+    std::size_t num_batch_axes;
+    tensor_function_softmax(int v_axis, std::size_t nba) :
+                    axis(v_axis),
+                    num_batch_axes(nba) {
+    }
+
+    /**
+     * The input is viewed as (l, c, r), where the c values at every (l, r) are normalized together.
+     * Normalizing over all the axes corresponds to r = 1.
+     */
+    void sizes(const tensor::N_vector& dims, std::size_t& l, std::size_t& c, std::size_t& r) const {
+        const std::size_t a = num_batch_axes + (axis < 0 ? 0 : axis);
+        assert(axis >= -1 && dims.size() >= a + (axis < 0 ? 0 : 1), "softmax cannot normalize axis ", axis,
+                " of input with order ", dims.size());
+        auto mult_func = [](std::size_t acc, tensor::N dim) {return acc * dim;};
+        l = std::accumulate(dims.begin(), dims.begin() + a, std::size_t(1), mult_func);
+        c = axis < 0 ? std::accumulate(dims.begin() + a, dims.end(), std::size_t(1), mult_func) : dims[a];
+        r = axis < 0 ? 1 : std::accumulate(dims.begin() + a + 1, dims.end(), std::size_t(1), mult_func);
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
         /*
          * Let F be the softmax of input V
          * Then
-         *   F_i = exp( V_i ) / C
+         *   F_i = exp( V_i - M ) / C
          * Where
          *          n
-         *    C  =  ∑ exp( V_k )
+         *    C  =  ∑ exp( V_k - M )
          *         k=1
+         * and M is the maximum of V, which cancels out but keeps exp from overflowing.
+         * The loops run over the contiguous trailing positions r innermost, so that they can be vectorized.
          */
         assert(tv.size() == 1, "softmax only works on a single input.");
-        std::vector<double> F;
         auto const & V = *tv[0];
-        F.reserve(V.size());
-        double C = 0;
-        std::transform(V.begin(), V.end(), std::back_inserter(F), [&C](const double in) {
-            const double inexp = std::exp(in);
-            C += inexp;
-            return inexp;
-        });
-        std::for_each(F.begin(), F.end(), [C](double &in) {in /= C;});
-        return std::move(DxT(C, tensor_cptr(new tensor(tv[0]->dimensionalities, std::move(F)))));
-    }
-
-    tensor_cptr value(const tensor_cptr_vec& tv) const override {
-        return std::move(C_and_F(tv).second);
+        std::size_t l, c, r;
+        sizes(V.dimensionalities, l, c, r);
+        std::vector<double> F(V.size());
+        std::vector<double> M(r), C(r);
+        for (std::size_t i_l = 0; i_l < l; ++i_l) {
+            const std::size_t base = i_l * c * r;
+            std::fill(M.begin(), M.end(), -std::numeric_limits<double>::infinity());
+            for (std::size_t i_c = 0, i = base; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    M[i_r] = std::max(M[i_r], V[i]);
+            for (std::size_t i_c = 0, i = base; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    F[i] = V[i] - M[i_r];
+            kernels::precise_exp(F.data() + base, F.data() + base, c * r);
+            std::fill(C.begin(), C.end(), 0.0);
+            for (std::size_t i_c = 0, i = base; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    C[i_r] += F[i];
+            for (std::size_t i_c = 0, i = base; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    F[i] /= C[i_r];
+        }
+        return tensor_cptr(new tensor(V.dimensionalities, std::move(F)));
     }
 
     derivative deriv(const tensor_cptr_vec& tv) const override {
@@ -183,7 +352,7 @@ struct tensor_function_softmax: tensor_function {
          *               C^2                              C
          *                        -              -
          *           exp(V_i)    |      exp(V_i)  |
-         *        = ---------- x | 1 - ---------- |
+         *        = ---------- x | 1 - ---------- |   =   F_i x (1 - F_i)
          *              C        |         C      |
          *                        -              -
          * And for i != j, we get:
@@ -191,34 +360,249 @@ struct tensor_function_softmax: tensor_function {
          *   D_ij = exp(V_j) x ----- ----        +    --- x 0
          *                      C^2  ∂V_i              C
          *             - exp(V_i + V_j)
-         *        =  --------------------
+         *        =  --------------------             =  - F_i x F_j
          *                     C^2
+         * D_ij is 0 when V_i and V_j are not normalized together.
          */
-        auto const cf = C_and_F(tv);
-        auto const C = cf.first;
-        auto const & F = cf.second;
-        auto const & V = *tv[0];
+        tensor_cptr F = value(tv);
+        std::size_t l, c, r;
+        sizes(F->dimensionalities, l, c, r);
         auto const f_size = F->size();
-        auto const d_size = f_size * f_size;
-        auto const Csq = C * C;
-        std::vector<double> D(d_size);
-        for (std::size_t ij = 0; ij < d_size; ++ij) {
-            auto const i = ij / f_size;
-            auto const j = ij % f_size;
-            if (i == j) {
-                auto const evi_by_c = std::exp(V[i]) / C;
-                D[ij] = evi_by_c * (1 - evi_by_c);
-            } else {
-                D[ij] = -std::exp(V[i] + V[j]) / Csq;
+        std::vector<double> D(f_size * f_size, 0);
+        for (std::size_t i_l = 0; i_l < l; ++i_l)
+            for (std::size_t i_r = 0; i_r < r; ++i_r) {
+                const std::size_t first = i_l * c * r + i_r;
+                for (std::size_t i = first; i < first + c * r; i += r)
+                    for (std::size_t j = first; j < first + c * r; j += r)
+                        D[i * f_size + j] = (i == j) ? (*F)[i] * (1 - (*F)[i]) : -(*F)[i] * (*F)[j];
             }
-        }
         auto D_dim = F->dimensionalities;
         D_dim.insert(D_dim.end(), F->dimensionalities.begin(), F->dimensionalities.end());
         return derivative { F, tensor_cptr_vec(1, tensor_cptr(new tensor(std::move(D_dim), std::move(D)))) };
     }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& F, std::size_t input_index,
+            const tensor& U) const override {
+        /*
+         * Chaining a derivative U w.r.t. some X through D, for every position x of X:
+         *   ∑ U_xi D_ij  =  ∑ U_xi F_j (δ_ij - F_i)  =  F_j x (U_xj - ∑ U_xi F_i)
+         *   i               i                                      i
+         * with the sums over the values normalized together,
+         *   so that it takes O(n) instead of O(n^2) per normalized row.
+         */
+        assert(input_index == 0, "softmax only works on a single input.");
+        std::size_t l, c, r;
+        sizes(F.dimensionalities, l, c, r);
+        const std::size_t f_size = F.size();
+        assert(f_size > 0 && U.size() % f_size == 0, "softmax cannot chain derivative of incompatible size.");
+        // the input and the output have the same dimensionalities, so the result has those of U
+        tensor result(U.dimensionalities, std::vector<double>(U.size()));
+        std::vector<double> S(r);
+        for (std::size_t base = 0; base < U.size(); base += c * r) {
+            const std::size_t f_base = base % f_size;
+            std::fill(S.begin(), S.end(), 0.0);
+            for (std::size_t i_c = 0, i = 0; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    S[i_r] += U[base + i] * F[f_base + i];
+            for (std::size_t i_c = 0, i = 0; i_c < c; ++i_c)
+                for (std::size_t i_r = 0; i_r < r; ++i_r, ++i)
+                    result[base + i] = F[f_base + i] * (U[base + i] - S[i_r]);
+        }
+        return result;
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        infer_element_wise_dimensionalities("softmax", 1, idims, odims);
+        std::size_t l, c, r;
+        sizes(odims, l, c, r);
+        return true;
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        // maximum, subtraction and exponentiation, accumulation, and normalization
+        return 5 * num_elements(idims[0]);
+    }
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        return tensor_function_csptr(new tensor_function_softmax(axis, num_batch_axes + 1));
+    }
 };
 // end struct tensor_function_softmax
 
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------ tensor_function_softmax_cross_entropy -------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+struct tensor_function_softmax_cross_entropy: tensor_function {
+    typedef std::size_t N;
+    /** The axis (after the batch axes) of the logits along which the softmax is taken. */
+    int axis;
+    /** The number of leading axes indexing independent losses, e.g., over the examples of a batch. */
+    N num_batch_axes;
+    tensor_function_softmax_cross_entropy(int v_axis, N nba) :
+                    axis(v_axis),
+                    num_batch_axes(nba) {
+    }
+
+    /**
+     * The logits are viewed as (b, l, c, r): b independent losses,
+     *   each summing the cross entropies of l x r rows of c values.
+     */
+    void sizes(const tensor::N_vector& dims, N& b, N& l, N& c, N& r) const {
+        const N a = num_batch_axes + axis;
+        assert(axis >= 0 && dims.size() > a, "softmax_cross_entropy cannot normalize axis ", axis,
+                " of input with order ", dims.size());
+        auto mult_func = [](N acc, tensor::N dim) {return acc * dim;};
+        b = std::accumulate(dims.begin(), dims.begin() + num_batch_axes, N(1), mult_func);
+        l = std::accumulate(dims.begin() + num_batch_axes, dims.begin() + a, N(1), mult_func);
+        c = dims[a];
+        r = std::accumulate(dims.begin() + a + 1, dims.end(), N(1), mult_func);
+    }
+
+    void check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 2, "softmax_cross_entropy expects logits and labels, found ", tv.size(), " inputs.");
+        assert(tv[0]->dimensionalities == tv[1]->dimensionalities,
+                "softmax_cross_entropy expects logits and labels with the same dimensionalities.");
+    }
+
+    /**
+     * Visit every row of c values normalized together,
+     *   with the offset of its first value, the number of the loss it belongs to,
+     *   and L = log ∑ exp(V) over the row, computed after subtracting the maximum of the row.
+     */
+    template<typename t_visitor>
+    void visit_rows(const tensor& V, t_visitor visitor) const {
+        N b, l, c, r;
+        sizes(V.dimensionalities, b, l, c, r);
+        // the exponentials of the c x r values of l x r rows at once, with the rows innermost
+        std::vector<double> M(r), S(r), E(c * r);
+        for (N i_bl = 0; i_bl < b * l; ++i_bl) {
+            const N base = i_bl * c * r;
+            std::fill(M.begin(), M.end(), -std::numeric_limits<double>::infinity());
+            for (N i_c = 0, i = 0; i_c < c; ++i_c)
+                for (N i_r = 0; i_r < r; ++i_r, ++i)
+                    M[i_r] = std::max(M[i_r], V[base + i]);
+            for (N i_c = 0, i = 0; i_c < c; ++i_c)
+                for (N i_r = 0; i_r < r; ++i_r, ++i)
+                    E[i] = V[base + i] - M[i_r];
+            kernels::precise_exp(E.data(), E.data(), c * r);
+            std::fill(S.begin(), S.end(), 0.0);
+            for (N i_c = 0, i = 0; i_c < c; ++i_c)
+                for (N i_r = 0; i_r < r; ++i_r, ++i)
+                    S[i_r] += E[i];
+            for (N i_r = 0; i_r < r; ++i_r)
+                visitor(base + i_r, base + i_r + c * r, r, i_bl / l, M[i_r] + std::log(S[i_r]));
+        }
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        /*
+         * For every row of logits V and labels Y,
+         *   J = - ∑ Y_i log F_i = ∑ Y_i (L - V_i),   where L = log ∑ exp(V_k)
+         * so the log probabilities are never materialized.
+         */
+        check_inputs(tv);
+        const tensor& V = *tv[0];
+        const tensor& Y = *tv[1];
+        tensor::N_vector odims(V.dimensionalities.begin(), V.dimensionalities.begin() + num_batch_axes);
+        std::vector<double> J(num_elements(odims), 0);
+        visit_rows(V, [&](N first, N last, N step, N i_loss, double L) {
+            for (N i = first; i < last; i += step)
+                J[i_loss] += Y[i] * (L - V[i]);
+        });
+        return tensor_cptr(new tensor(std::move(odims), std::move(J)));
+    }
+
+    /**
+     * The gradient of the loss that each value belongs to, w.r.t. every value of an input:
+     *   ∂J/∂V_i = F_i ∑ Y_k - Y_i   (i.e., F - Y for labels that sum to 1)
+     *   ∂J/∂Y_i = L - V_i
+     */
+    std::vector<double> gradient(const tensor_cptr_vec& tv, N input_index, std::vector<N>& loss_index) const {
+        assert(input_index < 2, "softmax_cross_entropy expects logits and labels.");
+        const tensor& V = *tv[0];
+        const tensor& Y = *tv[1];
+        std::vector<double> result(V.size());
+        loss_index.resize(V.size());
+        std::vector<double> F;  // the softmax of a row
+        visit_rows(V, [&](N first, N last, N step, N i_loss, double L) {
+            double sum_Y = 0;
+            if (input_index == 0) {
+                F.clear();
+                for (N i = first; i < last; i += step) {
+                    sum_Y += Y[i];
+                    F.push_back(V[i] - L);
+                }
+                kernels::precise_exp(F.data(), F.data(), F.size());
+            }
+            for (N i = first, k = 0; i < last; i += step, ++k) {
+                result[i] = input_index == 0 ? F[k] * sum_Y - Y[i] : L - V[i];
+                loss_index[i] = i_loss;
+            }
+        });
+        return result;
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr J = value(tv);
+        derivative result { J, tensor_cptr_vec() };
+        for (N input_index = 0; input_index < 2; ++input_index)
+            result.node_derivative.push_back(tensor_cptr(new tensor(std::move(derivative_wrt_input(tv, *J,
+                    input_index)))));
+        return result;
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& J, std::size_t input_index) const override {
+        check_inputs(tv);
+        std::vector<N> loss_index;
+        std::vector<double> g = gradient(tv, input_index, loss_index);
+        tensor d(std::move(tensor::zero_derivative(J.dimensionalities, tv[input_index]->dimensionalities)));
+        for (N i = 0; i < g.size(); ++i)
+            d[i * J.size() + loss_index[i]] = g[i];
+        return d;
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& J, std::size_t input_index,
+            const tensor& U) const override {
+        check_inputs(tv);
+        std::vector<N> loss_index;
+        std::vector<double> g = gradient(tv, input_index, loss_index);
+        const N n = g.size();
+        assert(n > 0 && U.size() % n == 0, "softmax_cross_entropy cannot chain derivative of incompatible size.");
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - tv[0]->dimensionalities.size());
+        rdims.insert(rdims.end(), J.dimensionalities.begin(), J.dimensionalities.end());
+        std::vector<double> result(U.size() / n * J.size(), 0);
+        for (N x = 0; x < U.size() / n; ++x)
+            for (N i = 0; i < n; ++i)
+                result[x * J.size() + loss_index[i]] += U[x * n + i] * g[i];
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        tensor::N_vector logits_dims;
+        infer_element_wise_dimensionalities("softmax_cross_entropy", 2, idims, logits_dims);
+        N b, l, c, r;
+        sizes(logits_dims, b, l, c, r);
+        odims.assign(logits_dims.begin(), logits_dims.begin() + num_batch_axes);
+        return true;
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        // maximum, subtraction and exponentiation, accumulation, and the weighted sum
+        return 6 * num_elements(idims[0]);
+    }
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        if (!is_batched[0] || !is_batched[1])
+            return nullptr;
+        return tensor_function_csptr(new tensor_function_softmax_cross_entropy(axis, num_batch_axes + 1));
+    }
+};
+// end struct tensor_function_softmax_cross_entropy
+
 //----------------------------------------------------------------------------------------------------------------------
 //------------------------------------------- ml_graph_builder_impl ----------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
@@ -233,10 +617,25 @@ struct ml_graph_builder_impl: ml_graph_builder {
     variable add_variable(const std::string& name) override {
         return gb->add_variable(name);
     }
+    variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities) override {
+        return gb->add_variable(name, dimensionalities);
+    }
+    variable add_variable(const std::string& name, const tensor::N_vector& dimensionalities, tensor_layout layout)
+            override {
+        return gb->add_variable(name, dimensionalities, layout);
+    }
     operation add_operation(const std::string& name, const tensor_function_csptr& function,
             const std::vector<node>& dependencies) override {
         return gb->add_operation(name, function, dependencies);
     }
+    operation add_scan(const std::string& name, const scan_body& body, const std::vector<node>& initial_states,
+            const std::vector<node>& sequences, const std::vector<node>& constants) override {
+        return gb->add_scan(name, body, initial_states, sequences, constants);
+    }
+    operation add_conditional(const std::string& name, node predicate, const std::vector<conditional_branch>& branches,
+            const std::vector<node>& operands) override {
+        return gb->add_conditional(name, predicate, branches, operands);
+    }
     operation add(node lhs, node rhs) override {
         return add_operation(uid("add"), tensor_function_factory::add(), node_vec { lhs, rhs });
     }
@@ -244,11 +643,33 @@ struct ml_graph_builder_impl: ml_graph_builder {
         return add_operation(uid("chain_multiplication"),
                 tensor_function_factory::chain_multiplication(num_common_dims), node_vec { lhs, rhs });
     }
+    operation activation(node n, tensor_function_factory::activation_type type,
+            tensor_function_factory::activation_accuracy accuracy) override {
+        return add_operation(uid("activation"), tensor_function_factory::activation(type, accuracy), node_vec { n });
+    }
     operation sigmoid(node n) override {
         return add_operation(uid("sigmoid"), tensor_function_factory::sigmoid(), node_vec { n });
     }
-    operation reduce_sum(node n, int axis) override {
-        return add_operation(uid("reduce_sum"), tensor_function_factory::reduce_sum(axis), node_vec { n });
+    operation tanh(node n) override {
+        return add_operation(uid("tanh"), tensor_function_factory::tanh(), node_vec { n });
+    }
+    operation relu(node n) override {
+        return add_operation(uid("relu"), tensor_function_factory::relu(), node_vec { n });
+    }
+    operation leaky_relu(node n, double negative_slope) override {
+        return add_operation(uid("leaky_relu"), tensor_function_factory::leaky_relu(negative_slope), node_vec { n });
+    }
+    operation gelu(node n) override {
+        return add_operation(uid("gelu"), tensor_function_factory::gelu(), node_vec { n });
+    }
+    operation exp(node n) override {
+        return add_operation(uid("exp"), tensor_function_factory::exp(), node_vec { n });
+    }
+    operation reduce_sum(node n, const std::vector<int>& axes) override {
+        return add_operation(uid("reduce_sum"), tensor_function_factory::reduce_sum(axes), node_vec { n });
+    }
+    operation reduce(node n, tensor_function_factory::reduction_type type, const std::vector<int>& axes) override {
+        return add_operation(uid("reduce"), tensor_function_factory::reduce(type, axes), node_vec { n });
     }
     operation log(node n) override {
         return add_operation(uid("log"), tensor_function_factory::log(), node_vec { n });
@@ -263,6 +684,93 @@ struct ml_graph_builder_impl: ml_graph_builder {
     operation softmax(node n) override {
         return add_operation(uid("softmax"), tensor_function_factory::softmax(), node_vec { n });
     }
+    operation softmax(node n, int axis) override {
+        return add_operation(uid("softmax"), tensor_function_factory::softmax(axis), node_vec { n });
+    }
+    operation softmax_cross_entropy(node logits, node labels, int axis) override {
+        return add_operation(uid("softmax_cross_entropy"), tensor_function_factory::softmax_cross_entropy(axis),
+                node_vec { logits, labels });
+    }
+    operation linear_softmax_cross_entropy(node weights, node points, node labels, std::size_t tile_size) override {
+        return add_operation(uid("linear_softmax_cross_entropy"),
+                tensor_function_factory::linear_softmax_cross_entropy(tile_size), node_vec { weights, points, labels });
+    }
+    operation conv2d(node images, node kernels, std::size_t stride, std::size_t padding, std::size_t dilation,
+            std::size_t groups) override {
+        return add_operation(uid("conv2d"), tensor_function_factory::conv2d(stride, padding, dilation, groups),
+                node_vec { images, kernels });
+    }
+    operation max_pool(node n, std::size_t window, std::size_t stride, std::size_t padding) override {
+        return add_operation(uid("max_pool"), tensor_function_factory::max_pool(window, stride, padding),
+                node_vec { n });
+    }
+    operation avg_pool(node n, std::size_t window, std::size_t stride, std::size_t padding) override {
+        return add_operation(uid("avg_pool"), tensor_function_factory::avg_pool(window, stride, padding),
+                node_vec { n });
+    }
+    operation einsum(const std::string& subscripts, const std::vector<node>& operands) override {
+        return add_operation(uid("einsum"), tensor_function_factory::einsum(subscripts), operands);
+    }
+    operation gather(node table, node indices) override {
+        return add_operation(uid("gather"), tensor_function_factory::gather(), node_vec { table, indices });
+    }
+    operation attention(node queries, node keys, node values, std::size_t tile_size) override {
+        return add_operation(uid("attention"), tensor_function_factory::attention(tile_size),
+                node_vec { queries, keys, values });
+    }
+    operation attention(node queries, node keys, node values, node mask, std::size_t tile_size) override {
+        return add_operation(uid("attention"), tensor_function_factory::attention(tile_size),
+                node_vec { queries, keys, values, mask });
+    }
+    operation layer_norm(node n, node scale, node shift, int num_normalized_dims, double epsilon) override {
+        return add_operation(uid("layer_norm"), tensor_function_factory::layer_norm(num_normalized_dims, epsilon),
+                node_vec { n, scale, shift });
+    }
+    operation batch_norm(node n, node scale, node shift, int axis, double epsilon) override {
+        return add_operation(uid("batch_norm"), tensor_function_factory::batch_norm(axis, epsilon),
+                node_vec { n, scale, shift });
+    }
+    operation bias_add(node n, node bias, int axis) override {
+        return add_operation(uid("bias_add"), tensor_function_factory::bias_add(axis), node_vec { n, bias });
+    }
+    operation sparse_dense_chain_multiplication(node lhs_offsets, node lhs_values,
+            const tensor::N_vector& lhs_dimensionalities, node rhs, int num_common_dims) override {
+        return add_operation(uid("sparse_chain_multiplication"),
+                tensor_function_factory::sparse_chain_multiplication(lhs_dimensionalities, num_common_dims, true),
+                node_vec { lhs_offsets, lhs_values, rhs });
+    }
+    operation dense_sparse_chain_multiplication(node lhs, node rhs_offsets, node rhs_values,
+            const tensor::N_vector& rhs_dimensionalities, int num_common_dims) override {
+        return add_operation(uid("sparse_chain_multiplication"),
+                tensor_function_factory::sparse_chain_multiplication(rhs_dimensionalities, num_common_dims, false),
+                node_vec { lhs, rhs_offsets, rhs_values });
+    }
+    operation quantize(node n, double scale) override {
+        return add_operation(uid("quantize"), tensor_function_factory::quantize(scale), node_vec { n });
+    }
+    operation dequantize(node n, double scale) override {
+        return add_operation(uid("dequantize"), tensor_function_factory::dequantize(scale), node_vec { n });
+    }
+    operation dropout(node n, double rate, std::uint64_t seed) override {
+        return add_operation(uid("dropout"), tensor_function_factory::dropout(rate, seed), node_vec { n });
+    }
+    operation dropout(node n, node offset, double rate, std::uint64_t seed) override {
+        return add_operation(uid("dropout"), tensor_function_factory::dropout(rate, seed), node_vec { n, offset });
+    }
+    operation random_uniform(node offset, const tensor::N_vector& dimensionalities, double low, double high,
+            std::uint64_t seed) override {
+        return add_operation(uid("random_uniform"),
+                tensor_function_factory::random_uniform(dimensionalities, low, high, seed), node_vec { offset });
+    }
+    operation random_normal(node offset, const tensor::N_vector& dimensionalities, double mean,
+            double standard_deviation, std::uint64_t seed) override {
+        return add_operation(uid("random_normal"),
+                tensor_function_factory::random_normal(dimensionalities, mean, standard_deviation, seed),
+                node_vec { offset });
+    }
+    operation to_layout(node n, tensor_layout layout) override {
+        return add_operation(uid("to_layout"), layout_conversion(layout), node_vec { n });
+    }
 
     graph_cuptr build_graph() const override {
         return gb->build_graph();
@@ -306,122 +814,25 @@ tensor_function_csptr tensor_function_factory::add() {
             tensor_cptr d(new tensor(std::move(tensor::identity_derivative(tv[0]->dimensionalities))));
             return derivative { v, tensor_cptr_vec { d, d } };
         }
-    };
-    return tensor_function_csptr(new tensor_function_add);
-}
 
-tensor_function_csptr tensor_function_factory::chain_multiplication(int num_common_dims) {
-    return tensor_function_csptr(new tensor_function_chain_multiplication(num_common_dims));
-}
-
-tensor_function_csptr tensor_function_factory::sigmoid() {
-    struct tensor_function_sigmoid: tensor_function {
-        tensor_cptr value(const tensor_cptr_vec& tv) const override {
-            assert(tv.size() == 1, "sigmoid only works on a single input.");
-            std::vector<double> data(tv[0]->cbegin(), tv[0]->cend());
-            std::for_each(data.begin(), data.end(), [](double& d) {d = 1.0 / (1 + std::exp(-d));});
-            return tensor_cptr(new tensor(tv[0]->dimensionalities, std::move(data)));
-        }
-        derivative deriv(const tensor_cptr_vec& tv) const override {
-            tensor_cptr v = value(tv);
-            tensor d(std::move(tensor::zero_derivative(v->dimensionalities, tv[0]->dimensionalities)));
-            const std::size_t step_size = tv[0]->size() + 1;
-            const std::size_t max_size = d.size();
-            for (std::size_t i_d = 0, i_tv = 0, i_v = 0; i_d < max_size; i_d += step_size, ++i_tv, ++i_v) {
-                d[i_d] = std::exp(-tv[0]->at(i_tv)) * v->at(i_v) * v->at(i_v);
-            }
-            return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
-        }
-    };
-    return tensor_function_csptr(new tensor_function_sigmoid);
-}
-
-tensor_function_csptr tensor_function_factory::reduce_sum(int axis) {
-    struct tensor_function_reduce_sum: tensor_function {
-        int axis;
-        tensor_function_reduce_sum(int v_axis) :
-                        axis(v_axis) {
+        bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+            return infer_element_wise_dimensionalities("tensor_function_add", 2, idims, odims);
         }
-        tensor_cptr value(const tensor_cptr_vec& tv) const override {
-            assert(tv.size() == 1, "reduce_sum only works on a single input.");
-            const tensor& input = *tv[0];
-            assert(0 <= axis && input.dimensionalities.size() > static_cast<tensor::N>(axis),
-                    "reduce_sum cannot reduce input with order ", input.dimensionalities.size(), " on axis ", axis);
-
-            auto mult_func = [](tensor::N acc, tensor::N elem) {return acc * elem;};
-            typedef const std::size_t N;
-            using std::accumulate;
-            const tensor::N_vector& idims = input.dimensionalities;
-            N r_size = accumulate(idims.begin() + axis + 1, idims.end(), 1, mult_func);
-            N l_size = accumulate(idims.begin(), idims.begin() + axis, 1, mult_func);
-            N c_size = idims[axis];
-            N input_size = input.size();
-            std::vector<double> data(r_size * l_size, 0);
-            for (std::size_t i_input = 0; i_input < input_size; ++i_input) {
-                N i_data_right = i_input % r_size;
-                N i_data_left = i_input / r_size / c_size;
-                N i_data = i_data_right + i_data_left * r_size;
-                data[i_data] += input[i_input];
-            }
-            tensor::N_vector odims(idims);
-            odims.erase(odims.begin() + axis);
-            return tensor_cptr(new tensor(std::move(odims), std::move(data)));
+        double flop_count(const N_vector_vec& idims) const override {
+            return num_elements(idims[0]);
         }
-        derivative deriv(const tensor_cptr_vec& tv) const override {
-            assert(tv.size() == 1, "reduce_sum only works on a single input.");
-            const tensor& input = *tv[0];
-            assert(0 <= axis && input.dimensionalities.size() > static_cast<tensor::N>(axis),
-                    "reduce_sum cannot reduce input with order ", input.dimensionalities.size(), " on axis ", axis);
-
-            auto mult_func = [](tensor::N acc, tensor::N elem) {return acc * elem;};
-            typedef const std::size_t N;
-            using std::accumulate;
-            const tensor::N_vector& idims = input.dimensionalities;
-            N r_size = accumulate(idims.begin() + axis + 1, idims.end(), 1, mult_func);
-            N l_size = accumulate(idims.begin(), idims.begin() + axis, 1, mult_func);
-            N c_size = idims[axis];
-
-            N v_size = r_size * l_size * c_size;
-            N o_size = r_size * l_size;
-            std::vector<double> data(v_size * o_size, 0);
-            for (std::size_t v_offset = 0; v_offset < v_size; ++v_offset) {
-                N o_offset_l = v_offset / (r_size * c_size);
-                N o_offset_r = v_offset % r_size;
-                N o_offset = o_offset_l * r_size + o_offset_r;
-                N offset = v_offset * o_size + o_offset;
-                data[offset] = 1;
-            }
-            tensor::N_vector odims(idims.size() * 2 - 1);
-            std::copy(idims.begin(), idims.end(), odims.begin());
-            std::copy(idims.begin(), idims.begin() + axis, odims.begin() + idims.size());
-            std::copy(idims.begin() + axis + 1, idims.end(), odims.begin() + idims.size() + axis);
-            return derivative { value(tv),
-                    tensor_cptr_vec { tensor_cptr(new tensor(std::move(odims), std::move(data))) } };
+        tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+            // element-wise functions do not care about the batch axis, as long as both inputs have it
+            if (std::all_of(is_batched.begin(), is_batched.end(), [](bool b) {return b;}))
+                return tensor_function_csptr(new tensor_function_add);
+            return nullptr;
         }
     };
-    return tensor_function_csptr(new tensor_function_reduce_sum { axis });
+    return tensor_function_csptr(new tensor_function_add);
 }
 
-tensor_function_csptr tensor_function_factory::log() {
-    struct tensor_function_log: tensor_function {
-        tensor_cptr value(const tensor_cptr_vec& tv) const override {
-            assert(tv.size() == 1, "log only works on a single input.");
-            std::vector<double> data(tv[0]->cbegin(), tv[0]->cend());
-            std::for_each(data.begin(), data.end(), [](double& d) {d = std::log(d);});
-            return tensor_cptr(new tensor(tv[0]->dimensionalities, std::move(data)));
-        }
-        derivative deriv(const tensor_cptr_vec& tv) const override {
-            tensor_cptr v = value(tv);
-            tensor d(std::move(tensor::zero_derivative(v->dimensionalities, tv[0]->dimensionalities)));
-            const std::size_t step_size = tv[0]->size() + 1;
-            const std::size_t max_size = d.size();
-            for (std::size_t i_d = 0, i_tv = 0; i_d < max_size; i_d += step_size, ++i_tv) {
-                d[i_d] = 1 / tv[0]->at(i_tv);
-            }
-            return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
-        }
-    };
-    return tensor_function_csptr(new tensor_function_log);
+tensor_function_csptr tensor_function_factory::chain_multiplication(int num_common_dims) {
+    return tensor_function_csptr(new tensor_function_chain_multiplication(num_common_dims));
 }
 
 tensor_function_csptr tensor_function_factory::element_wise_multiplication() {
@@ -454,6 +865,19 @@ tensor_function_csptr tensor_function_factory::element_wise_multiplication() {
             }
             return tensor_cptr(new tensor(std::move(odim), std::move(odata)));
         }
+
+        bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+            return infer_element_wise_dimensionalities("element wise multiplication", 2, idims, odims);
+        }
+        double flop_count(const N_vector_vec& idims) const override {
+            return num_elements(idims[0]);
+        }
+        tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+            // element-wise functions do not care about the batch axis, as long as both inputs have it
+            if (std::all_of(is_batched.begin(), is_batched.end(), [](bool b) {return b;}))
+                return tensor_function_csptr(new tensor_function_ewmult);
+            return nullptr;
+        }
     };
     return tensor_function_csptr(new tensor_function_ewmult);
 }
@@ -473,12 +897,33 @@ tensor_function_csptr tensor_function_factory::negative() {
                 d_value *= -1;
             return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
         }
+
+        bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+            return infer_element_wise_dimensionalities("negative", 1, idims, odims);
+        }
+        double flop_count(const N_vector_vec& idims) const override {
+            return num_elements(idims[0]);
+        }
+        tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+            // element-wise functions do not care about the batch axis
+            return tensor_function_csptr(new tensor_function_negative);
+        }
     };
     return tensor_function_csptr(new tensor_function_negative);
 }
 
 tensor_function_csptr tensor_function_factory::softmax() {
-    return tensor_function_csptr(new tensor_function_softmax);
+    return tensor_function_csptr(new tensor_function_softmax(-1, 0));
+}
+
+tensor_function_csptr tensor_function_factory::softmax(int axis) {
+    assert(axis >= 0, "softmax cannot normalize along axis ", axis);
+    return tensor_function_csptr(new tensor_function_softmax(axis, 0));
+}
+
+tensor_function_csptr tensor_function_factory::softmax_cross_entropy(int axis) {
+    assert(axis >= 0, "softmax_cross_entropy cannot normalize along axis ", axis);
+    return tensor_function_csptr(new tensor_function_softmax_cross_entropy(axis, 0));
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,419 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** The smallest number of elements for which normalizations use the thread pool. */
+const N min_parallel_size = 1 << 16;
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+/** Invoke func(unit) for units [0, num_units), on the thread pool if there are enough elements. */
+void for_each_unit(N num_units, N num_elements, const std::function<void(N)>& func) {
+    auto units = [&](N begin, N end) {
+        for (N unit = begin; unit < end; ++unit)
+            func(unit);
+    };
+    if (num_elements >= min_parallel_size)
+        parallel_for(num_units, units);
+    else
+        units(0, num_units);
+}
+
+/**
+ * A tensor viewed as {outer, channels, inner}, with one scale and one shift per channel.
+ * The normalized groups of elements are
+ *   either every outer position (over all its channels, for layer normalization)
+ *   or every channel (over all the outer and inner positions, for batch normalization).
+ */
+struct channel_view {
+    N outer, channels, inner;
+    bool groups_are_outer;
+
+    N num_groups() const {
+        return groups_are_outer ? outer : channels;
+    }
+
+    N group_size() const {
+        return groups_are_outer ? channels * inner : outer * inner;
+    }
+
+    /** Invoke func(offset, channel) for the elements of a group, in increasing order of offsets. */
+    template<typename t_func>
+    void for_each_in_group(N group, t_func func) const {
+        if (groups_are_outer) {
+            for (N c = 0; c < channels; ++c)
+                for (N i = 0; i < inner; ++i)
+                    func((group * channels + c) * inner + i, c);
+        } else {
+            for (N o = 0; o < outer; ++o)
+                for (N i = 0; i < inner; ++i)
+                    func((o * channels + group) * inner + i, group);
+        }
+    }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_normalization --------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Normalization of groups of elements of x (the first input) to zero mean and unit variance,
+ *   followed by a per-channel affine transform with a scale (the second input) and a shift (the third input):
+ *       y = scale * (x - mean) / sqrt(variance + epsilon) + shift
+ * Layer normalization normalizes the trailing num_dims axes of every position along the leading ones,
+ *   with a scale and a shift of the dimensionalities of the trailing axes.
+ * Batch normalization normalizes every position along an axis over all the other axes,
+ *   with a scale and a shift of the size of that axis.
+ * The statistics of every group are computed in a single pass with Welford's algorithm,
+ *   and groups are processed in parallel.
+ */
+struct tensor_function_normalization: tensor_function {
+    bool is_layer_norm;
+    int dims_or_axis;
+    double epsilon;
+
+    tensor_function_normalization(bool v_is_layer_norm, int v_dims_or_axis, double v_epsilon) :
+                    is_layer_norm(v_is_layer_norm),
+                    dims_or_axis(v_dims_or_axis),
+                    epsilon(v_epsilon) {
+    }
+
+    const char* name() const {
+        return is_layer_norm ? "layer_norm" : "batch_norm";
+    }
+
+    /** The view of x, and the dimensionalities of the scale and the shift. */
+    channel_view view(const tensor::N_vector& xdims, tensor::N_vector& pdims) const {
+        const int nd = static_cast<int>(xdims.size());
+        if (is_layer_norm) {
+            assert(dims_or_axis >= 1 && dims_or_axis <= nd, "layer_norm cannot normalize ", dims_or_axis,
+                    " trailing axes of a tensor with ", nd, " axes.");
+            pdims.assign(xdims.end() - dims_or_axis, xdims.end());
+            return channel_view { product(xdims.begin(), xdims.end() - dims_or_axis), product(pdims.begin(),
+                    pdims.end()), 1, true };
+        }
+        assert(dims_or_axis >= 0 && dims_or_axis < nd, "batch_norm cannot normalize axis ", dims_or_axis,
+                " of a tensor with ", nd, " axes.");
+        pdims.assign(1, xdims[dims_or_axis]);
+        return channel_view { product(xdims.begin(), xdims.begin() + dims_or_axis), xdims[dims_or_axis], product(
+                xdims.begin() + dims_or_axis + 1, xdims.end()), false };
+    }
+
+    channel_view check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 3, name(), " expects an input, a scale and a shift, found ", tv.size(), " inputs.");
+        tensor::N_vector pdims;
+        channel_view result = view(tv[0]->dimensionalities, pdims);
+        assert(tv[1]->dimensionalities == pdims && tv[2]->dimensionalities == pdims, name(),
+                " expects a scale and a shift with the dimensionalities of the normalized channels.");
+        return result;
+    }
+
+    /** The mean and the reciprocal of the standard deviation of a group, in a single pass (Welford's algorithm). */
+    void group_moments(const channel_view& cv, const tensor& x, N g, double& mean, double& inv_std) const {
+        N count = 0;
+        double m2 = 0;
+        mean = 0;
+        cv.for_each_in_group(g, [&](N offset, N) {
+            const double delta = x[offset] - mean;
+            mean += delta / ++count;
+            m2 += delta * (x[offset] - mean);
+        });
+        inv_std = 1 / std::sqrt(m2 / count + epsilon);
+    }
+
+    /** The moments of every group, computed once to be shared by the derivatives w.r.t. all the inputs. */
+    void all_group_moments(const channel_view& cv, const tensor& x, std::vector<double>& means,
+            std::vector<double>& inv_stds) const {
+        means.resize(cv.num_groups());
+        inv_stds.resize(cv.num_groups());
+        for_each_unit(cv.num_groups(), x.size(), [&](N g) {group_moments(cv, x, g, means[g], inv_stds[g]);});
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        channel_view cv = check_inputs(tv);
+        const tensor& x = *tv[0], &scale = *tv[1], &shift = *tv[2];
+        std::vector<double> result(x.size());
+        for_each_unit(cv.num_groups(), x.size(), [&](N g) {
+            double mean, inv_std;
+            group_moments(cv, x, g, mean, inv_std);
+            cv.for_each_in_group(g, [&](N offset, N c) {
+                result[offset] = scale[c] * (x[offset] - mean) * inv_std + shift[c];
+            });
+        });
+        return tensor_cptr(new tensor(x.dimensionalities, std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        channel_view cv = check_inputs(tv);
+        const tensor& x = *tv[0], &scale = *tv[1], &shift = *tv[2];
+        std::vector<double> means, inv_stds;
+        all_group_moments(cv, x, means, inv_stds);
+        std::vector<double> result(x.size());
+        for_each_unit(cv.num_groups(), x.size(), [&](N g) {
+            cv.for_each_in_group(g, [&](N offset, N c) {
+                result[offset] = scale[c] * (x[offset] - means[g]) * inv_stds[g] + shift[c];
+            });
+        });
+        tensor_cptr v(new tensor(x.dimensionalities, std::move(result)));
+        tensor_cptr_vec derivatives;
+        for (N i_input = 0; i_input < tv.size(); ++i_input)
+            derivatives.push_back(tensor_cptr(new tensor(std::move(chain_derivative(cv, tv, *v, i_input,
+                    tensor::identity_derivative(tv[i_input]->dimensionalities), means, inv_stds)))));
+        return derivative { v, derivatives };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        // chain the identity: the output is as large as x, and larger than the scale and the shift
+        assert(input_index < tv.size(), name(), " expects an input, a scale and a shift.");
+        return chain_derivative(tv, value, input_index, tensor::identity_derivative(tv[input_index]->dimensionalities));
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        channel_view cv = check_inputs(tv);
+        assert(input_index < 3, name(), " expects an input, a scale and a shift.");
+        // the derivative w.r.t. the shift does not depend on the moments
+        std::vector<double> means, inv_stds;
+        if (input_index < 2)
+            all_group_moments(cv, *tv[0], means, inv_stds);
+        return chain_derivative(cv, tv, value, input_index, U, means, inv_stds);
+    }
+
+    /** chain_derivative, given the moments of the groups (which are not needed w.r.t. the shift). */
+    tensor chain_derivative(const channel_view& cv, const tensor_cptr_vec& tv, const tensor& value,
+            std::size_t input_index, const tensor& U, const std::vector<double>& means,
+            const std::vector<double>& inv_stds) const {
+        /*
+         * With x^ = (x - mean) / sqrt(variance + epsilon), along a direction u:
+         *   w.r.t. x:      dy = scale * (u - mean(u) - x^ mean(u x^)) / sqrt(variance + epsilon)
+         *   w.r.t. scale:  dy = u * x^
+         *   w.r.t. shift:  dy = u
+         */
+        const tensor& x = *tv[0], &scale = *tv[1];
+        const tensor& input = *tv[input_index];
+        assert(input.size() > 0 && U.size() % input.size() == 0, name(),
+                " cannot chain derivative of incompatible size.");
+        const N x_size = U.size() / input.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+
+        const N num_groups = cv.num_groups(), group_size = cv.group_size();
+        std::vector<double> result(x_size * x.size());
+        for_each_unit(x_size * num_groups, result.size(), [&](N unit) {
+            const N i_x = unit / num_groups, g = unit % num_groups;
+            const double* u = &U[i_x * input.size()];
+            double* r = &result[i_x * x.size()];
+            if (input_index == 2) {
+                cv.for_each_in_group(g, [&](N offset, N c) {r[offset] = u[c];});
+                return;
+            }
+            const double mean = means[g], inv_std = inv_stds[g];
+            if (input_index == 0) {
+                double sum_u = 0, sum_ux = 0;
+                cv.for_each_in_group(g, [&](N offset, N) {
+                    sum_u += u[offset];
+                    sum_ux += u[offset] * (x[offset] - mean) * inv_std;
+                });
+                const double mean_u = sum_u / group_size, mean_ux = sum_ux / group_size;
+                cv.for_each_in_group(g, [&](N offset, N c) {
+                    const double x_hat = (x[offset] - mean) * inv_std;
+                    r[offset] = scale[c] * inv_std * (u[offset] - mean_u - x_hat * mean_ux);
+                });
+            } else {
+                cv.for_each_in_group(g, [&](N offset, N c) {r[offset] = u[c] * (x[offset] - mean) * inv_std;});
+            }
+        });
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 3, name(), " expects an input, a scale and a shift, found ", idims.size(), " inputs.");
+        tensor::N_vector pdims;
+        view(idims[0], pdims);
+        assert(idims[1] == pdims && idims[2] == pdims, name(),
+                " expects a scale and a shift with the dimensionalities of the normalized channels.");
+        odims = idims[0];
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // statistics, then normalization and the affine transform
+        return 8.0 * product(idims[0].begin(), idims[0].end());
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // the statistics of batch normalization would mix the examples, and parameters cannot be batched
+        if (!is_layer_norm || !is_batched[0] || is_batched[1] || is_batched[2])
+            return nullptr;
+        return tensor_function_csptr(new tensor_function_normalization(true, dims_or_axis, epsilon));
+    }
+};
+// end struct tensor_function_normalization
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_bias_add -------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Adds a bias {channels} (the second input) to every position along an axis of x (the first input),
+ *   e.g., to the rows of the {out, points} output of a dense layer.
+ */
+struct tensor_function_bias_add: tensor_function {
+    int axis;
+    tensor_function_bias_add(int v_axis) :
+                    axis(v_axis) {
+    }
+
+    channel_view view(const N_vector_vec& idims) const {
+        assert(idims.size() == 2, "bias_add expects an input and a bias, found ", idims.size(), " inputs.");
+        const tensor::N_vector& xdims = idims[0];
+        assert(axis >= 0 && axis < static_cast<int>(xdims.size()), "bias_add cannot add along axis ", axis,
+                " of a tensor with ", xdims.size(), " axes.");
+        assert(idims[1] == tensor::N_vector { xdims[axis] }, "bias_add expects a bias of size ", xdims[axis]);
+        return channel_view { product(xdims.begin(), xdims.begin() + axis), xdims[axis], product(
+                xdims.begin() + axis + 1, xdims.end()), false };
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        channel_view cv = view(N_vector_vec { tv[0]->dimensionalities, tv[1]->dimensionalities });
+        const tensor& x = *tv[0], &bias = *tv[1];
+        std::vector<double> result(x.size());
+        for (N c = 0; c < cv.channels; ++c)
+            cv.for_each_in_group(c, [&](N offset, N) {result[offset] = x[offset] + bias[c];});
+        return tensor_cptr(new tensor(x.dimensionalities, std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        tensor_cptr d_x(new tensor(std::move(derivative_wrt_input(tv, *v, 0))));
+        tensor_cptr d_bias(new tensor(std::move(derivative_wrt_input(tv, *v, 1))));
+        return derivative { v, tensor_cptr_vec { d_x, d_bias } };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        assert(input_index < 2, "bias_add expects an input and a bias.");
+        if (input_index == 0)
+            return tensor::identity_derivative(tv[0]->dimensionalities);
+        return chain_derivative(tv, value, 1, tensor::identity_derivative(tv[1]->dimensionalities));
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        // the derivative w.r.t. x is the identity, and the bias is broadcast along the other axes
+        channel_view cv = view(N_vector_vec { tv[0]->dimensionalities, tv[1]->dimensionalities });
+        assert(input_index < 2, "bias_add expects an input and a bias.");
+        if (input_index == 0)
+            return U;
+        const tensor& bias = *tv[1];
+        assert(U.size() % bias.size() == 0, "bias_add cannot chain derivative of incompatible size.");
+        const N x_size = U.size() / bias.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - 1);
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        std::vector<double> result(x_size * value.size());
+        for (N i_x = 0; i_x < x_size; ++i_x) {
+            const double* u = &U[i_x * cv.channels];
+            double* r = &result[i_x * value.size()];
+            for (N c = 0; c < cv.channels; ++c)
+                cv.for_each_in_group(c, [&](N offset, N) {r[offset] = u[c];});
+        }
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        view(idims);
+        odims = idims[0];
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        return product(idims[0].begin(), idims[0].end());
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // a batched input shifts the axis, a batched bias would need a bias per example
+        if (is_batched[1])
+            return nullptr;
+        return tensor_function_csptr(new tensor_function_bias_add(is_batched[0] ? axis + 1 : axis));
+    }
+};
+// end struct tensor_function_bias_add
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::layer_norm(int num_normalized_dims, double epsilon) {
+    assert(epsilon >= 0, "layer_norm expects a non-negative epsilon.");
+    return tensor_function_csptr(new tensor_function_normalization(true, num_normalized_dims, epsilon));
+}
+
+tensor_function_csptr tensor_function_factory::batch_norm(int axis, double epsilon) {
+    assert(epsilon >= 0, "batch_norm expects a non-negative epsilon.");
+    return tensor_function_csptr(new tensor_function_normalization(false, axis, epsilon));
+}
+
+tensor_function_csptr tensor_function_factory::bias_add(int axis) {
+    return tensor_function_csptr(new tensor_function_bias_add(axis));
+}
+
+folded_dense_layer tensor_function_factory::fold_batch_norm(const tensor& weights, const tensor& scale,
+        const tensor& shift, const tensor& mean, const tensor& variance, double epsilon) {
+    assert(weights.dimensionalities.size() == 2, "fold_batch_norm expects weights {out, in}.");
+    const N out = weights.dimensionalities[0], in = weights.dimensionalities[1];
+    const tensor::N_vector cdims { out };
+    assert(scale.dimensionalities == cdims && shift.dimensionalities == cdims && mean.dimensionalities == cdims
+            && variance.dimensionalities == cdims, "fold_batch_norm expects a scale, a shift, a mean and a variance"
+            " of size ", out);
+    tensor w = tensor::to_layout(weights, tensor_layout::row_major);
+    std::vector<double> bias(out);
+    for (N o = 0; o < out; ++o) {
+        // scale * (W x - mean) / std + shift = (scale / std) W x + (shift - scale * mean / std)
+        const double factor = scale[o] / std::sqrt(variance[o] + epsilon);
+        for (N i = 0; i < in; ++i)
+            w[o * in + i] *= factor;
+        bias[o] = shift[o] - factor * mean[o];
+    }
+    return folded_dense_layer { std::move(w), tensor(cdims, std::move(bias)) };
+}
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,208 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/parallel.h>
+#include <para/graph/exception.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/** Whether the current thread is processing a chunk of a parallel_for. */
+thread_local bool in_parallel_region = false;
+
+/**
+ * A fixed set of worker threads processing tasks from a shared queue.
+ */
+class thread_pool {
+public:
+    typedef std::function<void()> task;
+
+    thread_pool(std::size_t num_workers) :
+                    stopping(false) {
+        for (std::size_t i = 0; i < num_workers; ++i)
+            workers.push_back(std::thread([this]() {work();}));
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        has_tasks.notify_all();
+        for (auto& w : workers)
+            w.join();
+    }
+
+    std::size_t num_workers() const {
+        return workers.size();
+    }
+
+    void submit(task t) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(t));
+        }
+        has_tasks.notify_one();
+    }
+
+    /** Run one queued task on the calling thread, if there is one. */
+    bool run_one() {
+        task t;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (tasks.empty())
+                return false;
+            t = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        t();
+        return true;
+    }
+
+private:
+    void work() {
+        while (true) {
+            task t;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                has_tasks.wait(lock, [this]() {return stopping || !tasks.empty();});
+                if (tasks.empty())
+                    return;
+                t = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            t();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<task> tasks;
+    std::mutex mutex;
+    std::condition_variable has_tasks;
+    bool stopping;
+};
+
+std::size_t default_num_threads() {
+    return std::max<std::size_t>(1, std::thread::hardware_concurrency());
+}
+
+std::size_t& num_threads() {
+    static std::size_t result = default_num_threads();
+    return result;
+}
+
+std::unique_ptr<thread_pool>& pool() {
+    static std::unique_ptr<thread_pool> result;
+    return result;
+}
+
+std::mutex& pool_mutex() {
+    static std::mutex result;
+    return result;
+}
+
+/** The pool with num_threads() - 1 workers, created on first use. */
+thread_pool& get_pool() {
+    std::lock_guard<std::mutex> lock(pool_mutex());
+    if (!pool() || pool()->num_workers() != num_threads() - 1)
+        pool().reset(new thread_pool(num_threads() - 1));
+    return *pool();
+}
+
+/** Book-keeping for the chunks of one parallel_for. */
+struct parallel_for_state {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::size_t remaining;
+    std::exception_ptr error;
+};
+
+void run_chunk(const std::function<void(std::size_t, std::size_t)>& func, std::size_t begin, std::size_t end,
+        parallel_for_state& state) {
+    bool was_in_parallel_region = in_parallel_region;
+    in_parallel_region = true;
+    std::exception_ptr error;
+    try {
+        func(begin, end);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    in_parallel_region = was_in_parallel_region;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (error && !state.error)
+        state.error = error;
+    if (--state.remaining == 0)
+        state.done.notify_all();
+}
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+std::size_t get_num_threads() {
+    return num_threads();
+}
+
+void set_num_threads(std::size_t n) {
+    assert(n > 0, "Number of threads must be positive.");
+    std::lock_guard<std::mutex> lock(pool_mutex());
+    num_threads() = n;
+}
+
+void parallel_for(std::size_t n, const std::function<void(std::size_t begin, std::size_t end)>& func) {
+    const std::size_t num_chunks = std::min(n, num_threads());
+    if (num_chunks <= 1 || in_parallel_region) {
+        if (n > 0)
+            func(0, n);
+        return;
+    }
+    thread_pool& tp = get_pool();
+    parallel_for_state state;
+    state.remaining = num_chunks;
+    auto chunk_begin = [n, num_chunks](std::size_t chunk) {return n * chunk / num_chunks;};
+    for (std::size_t chunk = 1; chunk < num_chunks; ++chunk) {
+        std::size_t begin = chunk_begin(chunk), end = chunk_begin(chunk + 1);
+        tp.submit([&func, &state, begin, end]() {run_chunk(func, begin, end, state);});
+    }
+    run_chunk(func, 0, chunk_begin(1), state);
+    // help with queued chunks while waiting for the others to complete
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.remaining == 0)
+                break;
+        }
+        if (!tp.run_one()) {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.done.wait(lock, [&state]() {return state.remaining == 0;});
+            break;
+        }
+    }
+    if (state.error)
+        std::rethrow_exception(state.error);
+}
+
+} // end namespace graph
+} // end namespace para
@@ -0,0 +1,374 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/quantization.h>
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+#ifdef __AVX512VNNI__
+#include <immintrin.h>
+#endif
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** The largest magnitude of a symmetric int8 value; -128 is not used, so that negation is exact. */
+const double int8_max = 127;
+
+/** The scale mapping [-range, range] onto [-127, 127]. */
+double scale_for_range(double range) {
+    return range > 0 ? range / int8_max : 1;
+}
+
+std::int8_t quantize_value(double x, double scale) {
+    return static_cast<std::int8_t>(std::max(-int8_max, std::min(int8_max, std::round(x / scale))));
+}
+
+double max_abs(const tensor& t) {
+    double result = 0;
+    for (double x : t)
+        result = std::max(result, std::abs(x));
+    return result;
+}
+
+tensor_cptr as_row_major(const tensor_cptr& t) {
+    if (t->layout == tensor_layout::row_major)
+        return t;
+    return tensor_cptr(new tensor(tensor::to_layout(*t, tensor_layout::row_major)));
+}
+
+/** Whether two tensors hold the same values at every position, whatever their layouts. */
+bool same_values(const tensor_cptr& a, const tensor_cptr& b) {
+    if (a == b)
+        return true;
+    if (a->dimensionalities != b->dimensionalities)
+        return false;
+    tensor_cptr ra = as_row_major(a), rb = as_row_major(b);
+    return std::equal(ra->begin(), ra->end(), rb->begin());
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_quantize -------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Maps x to round(x / scale), clamped to the symmetric int8 range,
+ *   or (if dequantize) x to x * scale.
+ * The values stay doubles, so that they can flow through a graph.
+ */
+struct tensor_function_quantize: tensor_function {
+    double scale;
+    bool dequantize;
+    tensor_function_quantize(double s, bool d) :
+                    scale(s),
+                    dequantize(d) {
+    }
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 1, dequantize ? "dequantize" : "quantize", " expects one input, found ", tv.size());
+        tensor result(*as_row_major(tv[0]));
+        for (double& x : result)
+            x = dequantize ? x * scale : quantize_value(x, scale);
+        return tensor_cptr(new tensor(std::move(result)));
+    }
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        assert(false, dequantize ? "dequantize" : "quantize", " is for inference only, and has no derivative.");
+        return derivative();
+    }
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, dequantize ? "dequantize" : "quantize", " expects one input, found ", idims.size());
+        odims = idims[0];
+        return true;
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        return std::accumulate(idims[0].begin(), idims[0].end(), 1.0,
+                [](double acc, tensor::N dim) {return acc * dim;});
+    }
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        return true;
+    }
+};
+// end struct tensor_function_quantize
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------ tensor_function_quantized_chain_multiplication ----------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * chain_multiplication(W, x, 1) for weights W {out, in} frozen to int8 with one scale per row,
+ *   and inputs x {in, ...} quantized to int8 on every call with a fixed scale,
+ *   multiplied with int8 x int8 -> int32 kernels and scaled back to doubles.
+ */
+struct tensor_function_quantized_chain_multiplication: tensor_function {
+    N out, in;
+    std::vector<std::int8_t> weights;
+    std::vector<double> weight_scales;
+    double input_scale;
+
+    tensor_function_quantized_chain_multiplication(const tensor& w, double input_range) :
+                    out(w.dimensionalities[0]),
+                    in(w.dimensionalities[1]),
+                    weights(out * in),
+                    weight_scales(out),
+                    input_scale(scale_for_range(input_range)) {
+        tensor rw = tensor::to_layout(w, tensor_layout::row_major);
+        for (N i = 0; i < out; ++i) {
+            const double* row = &rw[i * in];
+            double range = 0;
+            for (N p = 0; p < in; ++p)
+                range = std::max(range, std::abs(row[p]));
+            weight_scales[i] = scale_for_range(range);
+            for (N p = 0; p < in; ++p)
+                weights[i * in + p] = quantize_value(row[p], weight_scales[i]);
+        }
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 1, "quantized chain_multiplication expects one input, found ", tv.size());
+        tensor::N_vector odims;
+        infer_dimensionalities( { tv[0]->dimensionalities }, odims);
+        tensor_cptr x = as_row_major(tv[0]);
+        const N n = x->size() / in;
+        std::vector<std::int8_t> xq(x->size());
+        for (N i = 0; i < xq.size(); ++i)
+            xq[i] = quantize_value((*x)[i], input_scale);
+        std::vector<std::int32_t> acc(out * n);
+        kernels::gemm_s8(weights.data(), xq.data(), acc.data(), out, in, n);
+        std::vector<double> result(out * n);
+        for (N i = 0; i < out; ++i) {
+            const double scale = weight_scales[i] * input_scale;
+            for (N j = 0; j < n; ++j)
+                result[i * n + j] = acc[i * n + j] * scale;
+        }
+        return tensor_cptr(new tensor(std::move(odims), std::move(result)));
+    }
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        assert(false, "quantized chain_multiplication is for inference only, and has no derivative.");
+        return derivative();
+    }
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "quantized chain_multiplication expects one input, found ", idims.size());
+        assert(!idims[0].empty() && idims[0][0] == in, "quantized chain_multiplication expects inputs {", in,
+                ", ...}.");
+        odims.assign(1, out);
+        odims.insert(odims.end(), idims[0].begin() + 1, idims[0].end());
+        return true;
+    }
+    double flop_count(const N_vector_vec& idims) const override {
+        return 2.0 * out * std::accumulate(idims[0].begin(), idims[0].end(), 1.0,
+                [](double acc, tensor::N dim) {return acc * dim;});
+    }
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        return true;
+    }
+};
+// end struct tensor_function_quantized_chain_multiplication
+
+#ifdef __AVX512VNNI__
+/**
+ * gemm_s8 with AVX-512 VNNI, 16 columns of c at a time.
+ * vpdpbusd multiplies unsigned with signed bytes, so a is shifted by 128 into unsigned bytes,
+ *   and 128 times the column sums of b are subtracted at the end.
+ * b is packed so that each 64-byte vector holds 4 consecutive rows of 16 consecutive columns,
+ *   interleaved by column, with zeros padding k to a multiple of 4 and n to a multiple of 16.
+ */
+void gemm_s8_vnni(const std::int8_t* a, const std::int8_t* b, std::int32_t* c, N m, N k, N n) {
+    const N k4 = (k + 3) / 4, n16 = (n + 15) / 16;
+    std::vector<std::int8_t> packed(n16 * k4 * 64, 0);
+    std::vector<std::int32_t> correction(n16 * 16, 0);
+    for (N p = 0; p < k; ++p)
+        for (N j = 0; j < n; ++j) {
+            packed[((j / 16) * k4 + p / 4) * 64 + (j % 16) * 4 + p % 4] = b[p * n + j];
+            correction[j] += 128 * b[p * n + j];
+        }
+    parallel_for(m, [&](N i_begin, N i_end) {
+        std::vector<std::uint8_t> a_row(k4 * 4, 128);
+        for (N i = i_begin; i < i_end; ++i) {
+            for (N p = 0; p < k; ++p)
+                a_row[p] = static_cast<std::uint8_t>(a[i * k + p] + 128);
+            const std::int32_t* a_quads = reinterpret_cast<const std::int32_t*>(a_row.data());
+            for (N jb = 0; jb < n16; ++jb) {
+                __m512i acc = _mm512_setzero_si512();
+                const std::int8_t* b_block = &packed[jb * k4 * 64];
+                for (N pq = 0; pq < k4; ++pq)
+                    acc = _mm512_dpbusd_epi32(acc, _mm512_set1_epi32(a_quads[pq]),
+                            _mm512_loadu_si512(b_block + pq * 64));
+                acc = _mm512_sub_epi32(acc, _mm512_loadu_si512(&correction[jb * 16]));
+                const N width = std::min<N>(16, n - jb * 16);
+                _mm512_mask_storeu_epi32(c + i * n + jb * 16, static_cast<__mmask16>((1u << width) - 1), acc);
+            }
+        }
+    });
+}
+#endif
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+double quantization_report::speedup() const {
+    return reference_seconds / quantized_seconds;
+}
+
+tensor_function_csptr tensor_function_factory::quantize(double scale) {
+    assert(scale > 0, "quantize needs a positive scale, found ", scale);
+    return tensor_function_csptr(new tensor_function_quantize(scale, false));
+}
+
+tensor_function_csptr tensor_function_factory::dequantize(double scale) {
+    assert(scale > 0, "dequantize needs a positive scale, found ", scale);
+    return tensor_function_csptr(new tensor_function_quantize(scale, true));
+}
+
+tensor_function_csptr tensor_function_factory::quantized_chain_multiplication(const tensor& weights,
+        double input_range) {
+    assert(weights.dimensionalities.size() == 2, "quantized chain_multiplication expects weights {out, in}.");
+    return tensor_function_csptr(new tensor_function_quantized_chain_multiplication(weights, input_range));
+}
+
+graph_cuptr quantize(const graph& g, const std::vector<variable>& weights,
+        const std::vector<tensor_cptr_vec>& calibration_inputs, const std::vector<node>& outputs,
+        quantization_report& report) {
+    assert(!calibration_inputs.empty(), "quantize needs calibration inputs.");
+    std::vector<bool> is_weight(g.num_variables(), false);
+    for (variable w : weights) {
+        assert(w.index >= 0 && static_cast<std::size_t>(w.index) < g.num_variables(), "Invalid weight index ",
+                w.index);
+        is_weight[w.index] = true;
+    }
+    const tensor_cptr_vec& frozen = calibration_inputs[0];
+
+    // the operations consuming exactly one weight, and the ranges of all their inputs over the calibration inputs
+    std::vector<int> weight_dependency(g.num_operations(), -1);
+    std::vector<node> calibrated_nodes;
+    for (std::size_t i_op = 0; i_op < g.num_operations(); ++i_op) {
+        std::vector<node> deps = g.get_dependencies(operation(i_op));
+        auto is_weight_node = [&](node n) {return n.type == node::nt_variable && is_weight[n.index];};
+        if (std::count_if(deps.begin(), deps.end(), is_weight_node) != 1)
+            continue;
+        weight_dependency[i_op] = std::find_if(deps.begin(), deps.end(), is_weight_node) - deps.begin();
+        calibrated_nodes.insert(calibrated_nodes.end(), deps.begin(), deps.end());
+    }
+    std::vector<double> ranges(calibrated_nodes.size(), 0.0);
+    for (const tensor_cptr_vec& inputs : calibration_inputs) {
+        for (variable w : weights)
+            assert(same_values(inputs[w.index], frozen[w.index]),
+                    "quantize expects the same weights in all calibration inputs.");
+        tensor_cptr_vec values = g.value(calibrated_nodes, inputs);
+        for (std::size_t i = 0; i < values.size(); ++i)
+            ranges[i] = std::max(ranges[i], max_abs(*values[i]));
+    }
+
+    // the same variables and operations, with the quantizable operations replaced
+    graph_builder_uptr gb = graph_builder::empty();
+    for (std::size_t i_v = 0; i_v < g.num_variables(); ++i_v) {
+        variable v(i_v);
+        if (g.has_dimensionalities(v))
+            gb->add_variable(g.get_variable_name(v), g.get_dimensionalities(v), g.get_layout(v));
+        else
+            gb->add_variable(g.get_variable_name(v));
+    }
+    std::vector<node> operation_nodes;
+    std::size_t i_range = 0;
+    report.num_quantized_operations = 0;
+    for (std::size_t i_op = 0; i_op < g.num_operations(); ++i_op) {
+        operation op(i_op);
+        std::vector<node> deps = g.get_dependencies(op);
+        tensor_function_csptr function = g.get_function(op);
+        if (weight_dependency[i_op] >= 0) {
+            std::size_t i_weight = weight_dependency[i_op];
+            std::vector<double> op_ranges(ranges.begin() + i_range, ranges.begin() + i_range + deps.size());
+            i_range += deps.size();
+            tensor_function_csptr q = function->quantized(i_weight, *frozen[deps[i_weight].index], op_ranges);
+            if (q) {
+                function = q;
+                deps.erase(deps.begin() + i_weight);
+                ++report.num_quantized_operations;
+            }
+        }
+        for (node& dep : deps)
+            if (dep.type == node::nt_operation)
+                dep = operation_nodes[dep.index];
+        operation_nodes.push_back(gb->add_operation(g.get_operation_name(op), function, deps));
+    }
+    graph_cuptr result = gb->build_graph();
+
+    // compare the outputs, and the time taken to compute them
+    std::vector<node> quantized_outputs;
+    for (node out : outputs)
+        quantized_outputs.push_back(out.type == node::nt_operation ? operation_nodes[out.index] : out);
+    std::vector<tensor_cptr_vec> reference_values, quantized_values;
+    auto start = std::chrono::steady_clock::now();
+    for (const tensor_cptr_vec& inputs : calibration_inputs)
+        reference_values.push_back(g.value(outputs, inputs));
+    auto middle = std::chrono::steady_clock::now();
+    for (const tensor_cptr_vec& inputs : calibration_inputs)
+        quantized_values.push_back(result->value(quantized_outputs, inputs));
+    auto end = std::chrono::steady_clock::now();
+    report.reference_seconds = std::chrono::duration<double>(middle - start).count();
+    report.quantized_seconds = std::chrono::duration<double>(end - middle).count();
+    double error_norm = 0, reference_norm = 0;
+    report.max_absolute_error = 0;
+    for (std::size_t i_input = 0; i_input < calibration_inputs.size(); ++i_input)
+        for (std::size_t i_out = 0; i_out < outputs.size(); ++i_out) {
+            tensor reference = tensor::to_layout(*reference_values[i_input][i_out], tensor_layout::row_major);
+            tensor quantized = tensor::to_layout(*quantized_values[i_input][i_out], tensor_layout::row_major);
+            for (std::size_t i = 0; i < reference.size(); ++i) {
+                double error = std::abs(quantized[i] - reference[i]);
+                report.max_absolute_error = std::max(report.max_absolute_error, error);
+                error_norm += error * error;
+                reference_norm += reference[i] * reference[i];
+            }
+        }
+    report.relative_error = reference_norm > 0 ? std::sqrt(error_norm / reference_norm) : std::sqrt(error_norm);
+    return result;
+}
+
+namespace kernels {
+
+void gemm_s8(const std::int8_t* a, const std::int8_t* b, std::int32_t* c, std::size_t m, std::size_t k,
+        std::size_t n) {
+#ifdef __AVX512VNNI__
+    gemm_s8_vnni(a, b, c, m, k, n);
+#else
+    // i-k-j loop order, so that the innermost loop runs over contiguous rows of b and c
+    std::fill(c, c + m * n, 0);
+    for (std::size_t i = 0; i < m; ++i) {
+        std::int32_t* c_row = c + i * n;
+        const std::int8_t* a_row = a + i * k;
+        for (std::size_t p = 0; p < k; ++p) {
+            const std::int32_t a_ip = a_row[p];
+            const std::int8_t* b_row = b + p * n;
+            for (std::size_t j = 0; j < n; ++j)
+                c_row[j] += a_ip * b_row[j];
+        }
+    }
+#endif
+}
+
+} // end namespace kernels
+
+} // end namespace graph
+} // end namespace para
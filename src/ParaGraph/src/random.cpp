@@ -0,0 +1,316 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** The number of random words generated at a time by philox. */
+const N words_per_block = 4;
+/** The smallest number of elements for which random functions use the thread pool. */
+const N min_parallel_size = 1 << 16;
+
+/**
+ * The Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"):
+ *   four random 32 bit words that depend only on a 64 bit key and a 128 bit counter,
+ *   so any block of a random sequence can be generated independently of the others.
+ */
+void philox(std::uint64_t key, std::uint64_t counter_lo, std::uint64_t counter_hi, std::uint32_t* words) {
+    std::uint32_t c[4] = { std::uint32_t(counter_lo), std::uint32_t(counter_lo >> 32), std::uint32_t(counter_hi),
+            std::uint32_t(counter_hi >> 32) };
+    std::uint32_t k[2] = { std::uint32_t(key), std::uint32_t(key >> 32) };
+    for (int round = 0; round < 10; ++round) {
+        const std::uint64_t p0 = std::uint64_t(0xD2511F53) * c[0];
+        const std::uint64_t p1 = std::uint64_t(0xCD9E8D57) * c[2];
+        const std::uint32_t next[4] = { std::uint32_t(p1 >> 32) ^ c[1] ^ k[0], std::uint32_t(p1),
+                std::uint32_t(p0 >> 32) ^ c[3] ^ k[1], std::uint32_t(p0) };
+        std::copy(next, next + 4, c);
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+    }
+    std::copy(c, c + 4, words);
+}
+
+/** A uniform sample in (0, 1) from a random word. */
+inline double to_unit(std::uint32_t word) {
+    return (word + 0.5) / 4294967296.0;
+}
+
+/** The offset of the random sequence, from the optional input at index i. */
+std::uint64_t read_offset(const tensor_cptr_vec& tv, N i, const char* name) {
+    if (tv.size() <= i)
+        return 0;
+    assert(tv[i]->size() == 1, name, " expects an offset with a single value.");
+    const double offset = (*tv[i])[0];
+    assert(offset >= 0 && offset == std::floor(offset), name, " expects a non-negative integral offset, found ",
+            offset);
+    return static_cast<std::uint64_t>(offset);
+}
+
+/**
+ * Invoke func(block, words) for the blocks of random words of a sequence covering n elements,
+ *   with the words of element i being words[i % words_per_block] of block i / words_per_block,
+ *   on the thread pool for large sizes.
+ * The words depend on the seed, the offset and the element only, and not on the number of threads.
+ */
+void for_each_random_block(N n, std::uint64_t seed, std::uint64_t offset,
+        const std::function<void(N, const std::uint32_t*)>& func) {
+    auto blocks = [&](N begin, N end) {
+        std::uint32_t words[words_per_block];
+        for (N b = begin; b < end; ++b) {
+            philox(seed, b, offset, words);
+            func(b, words);
+        }
+    };
+    const N num_blocks = (n + words_per_block - 1) / words_per_block;
+    if (n >= min_parallel_size)
+        parallel_for(num_blocks, blocks);
+    else
+        blocks(0, num_blocks);
+}
+
+/** The derivative w.r.t. an offset, chained: zeros of dimensionalities (U leading..., output...). */
+tensor zero_chain_derivative(const tensor& offset, const tensor::N_vector& output_dimensionalities, const tensor& U) {
+    tensor::N_vector dims(U.dimensionalities.begin(), U.dimensionalities.end() - offset.dimensionalities.size());
+    dims.insert(dims.end(), output_dimensionalities.begin(), output_dimensionalities.end());
+    return tensor::zero(dims);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_dropout --------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * x * mask / (1 - rate) of its first input x, with a mask of zeros (with probability rate) and ones,
+ *   drawn from the seed and the optional second input, the offset.
+ * The mask is regenerated wherever it is needed (values and derivatives) instead of being stored.
+ */
+struct tensor_function_dropout: tensor_function {
+    double rate;
+    std::uint64_t seed;
+
+    tensor_function_dropout(double v_rate, std::uint64_t v_seed) :
+                    rate(v_rate),
+                    seed(v_seed) {
+        assert(rate >= 0 && rate < 1, "dropout expects a rate in [0, 1), found ", rate);
+    }
+
+    /** The factor of every element of x: 0 if dropped, and 1 / (1 - rate) otherwise. */
+    std::vector<double> factors(const tensor_cptr_vec& tv) const {
+        check_inputs(tv);
+        const N n = tv[0]->size();
+        const double keep_factor = 1 / (1 - rate);
+        std::vector<double> result(n);
+        for_each_random_block(n, seed, read_offset(tv, 1, "dropout"), [&](N b, const std::uint32_t* words) {
+            const N first = b * words_per_block, last = std::min(first + words_per_block, n);
+            for (N i = first; i < last; ++i)
+                result[i] = to_unit(words[i - first]) < rate ? 0 : keep_factor;
+        });
+        return result;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        std::vector<double> result = factors(tv);
+        const tensor& x = *tv[0];
+        for (N i = 0; i < result.size(); ++i)
+            result[i] *= x[i];
+        return tensor_cptr(new tensor(x.dimensionalities, std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        std::vector<double> f = factors(tv);
+        const tensor& x = *tv[0];
+        std::vector<double> result(f.size());
+        tensor d(std::move(tensor::zero_derivative(x.dimensionalities, x.dimensionalities)));
+        for (N i = 0; i < f.size(); ++i) {
+            result[i] = f[i] * x[i];
+            d[i * (f.size() + 1)] = f[i];
+        }
+        tensor_cptr v(new tensor(x.dimensionalities, std::move(result)));
+        tensor_cptr_vec node_derivative { tensor_cptr(new tensor(std::move(d))) };
+        if (tv.size() == 2)
+            node_derivative.push_back(tensor_cptr(new tensor(tensor::zero_derivative(x.dimensionalities,
+                    tv[1]->dimensionalities))));
+        return derivative { v, node_derivative };
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        check_inputs(tv);
+        if (input_index == 1)
+            return zero_chain_derivative(*tv[1], value.dimensionalities, U);
+        // the derivative is diagonal, so chaining U just scales every row of U element-wise
+        const tensor& x = *tv[0];
+        assert(x.size() > 0 && U.size() % x.size() == 0, "dropout cannot chain derivative of incompatible size.");
+        std::vector<double> f = factors(tv);
+        std::vector<double> result(U.size());
+        for (N i = 0; i < U.size(); ++i)
+            result[i] = U[i] * f[i % f.size()];
+        return tensor(U.dimensionalities, std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        // dropout of the stacked examples, so that every example draws its own part of the sequence;
+        //   per-example offsets are left to the fallback, which draws every example at its offset
+        if (is_batched[0] && (is_batched.size() == 1 || !is_batched[1]))
+            return tensor_function_csptr(new tensor_function_dropout(rate, seed));
+        return nullptr;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1 || idims.size() == 2, "dropout expects an input and an optional offset.");
+        odims = idims[0];
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // a round of philox is two multiplications and four other operations, for four elements
+        const double num_elements = std::accumulate(idims[0].begin(), idims[0].end(), 1.0,
+                [](double acc, tensor::N dim) {return acc * dim;});
+        return (10 * 6 / 4.0 + 3) * num_elements;
+    }
+
+    void check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 1 || tv.size() == 2, "dropout expects an input and an optional offset.");
+    }
+};
+// end struct tensor_function_dropout
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_random ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * A tensor of fixed dimensionalities with independent random elements,
+ *   either uniform in (low, high) or normal with a mean and a standard deviation,
+ *   drawn from the seed and the offset (the only input).
+ * Normal samples are generated in pairs from pairs of uniform samples by the Box-Muller transform.
+ */
+struct tensor_function_random: tensor_function {
+    tensor::N_vector dimensionalities;
+    bool is_normal;
+    double location;    // low, or the mean
+    double scale;       // high - low, or the standard deviation
+    std::uint64_t seed;
+
+    tensor_function_random(const tensor::N_vector& v_dimensionalities, bool v_is_normal, double v_location,
+            double v_scale, std::uint64_t v_seed) :
+                    dimensionalities(v_dimensionalities),
+                    is_normal(v_is_normal),
+                    location(v_location),
+                    scale(v_scale),
+                    seed(v_seed) {
+        assert(scale >= 0, is_normal ? "random_normal expects a non-negative standard deviation." :
+                "random_uniform expects low <= high.");
+    }
+
+    const char* name() const {
+        return is_normal ? "random_normal" : "random_uniform";
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        check_inputs(tv);
+        const N n = std::accumulate(dimensionalities.begin(), dimensionalities.end(), N(1), std::multiplies<N>());
+        std::vector<double> result(n);
+        const double two_pi = 6.283185307179586477;
+        for_each_random_block(n, seed, read_offset(tv, 0, name()), [&](N b, const std::uint32_t* words) {
+            const N first = b * words_per_block, last = std::min(first + words_per_block, n);
+            double samples[words_per_block];
+            for (N w = 0; w < words_per_block; ++w)
+                samples[w] = to_unit(words[w]);
+            if (is_normal) {
+                for (N w = 0; w < words_per_block; w += 2) {
+                    const double radius = std::sqrt(-2 * std::log(samples[w])), angle = two_pi * samples[w + 1];
+                    samples[w] = radius * std::cos(angle);
+                    samples[w + 1] = radius * std::sin(angle);
+                }
+            }
+            for (N i = first; i < last; ++i)
+                result[i] = location + scale * samples[i - first];
+        });
+        return tensor_cptr(new tensor(dimensionalities, std::move(result)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(tensor::zero_derivative(dimensionalities,
+                tv[0]->dimensionalities))) } };
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        check_inputs(tv);
+        return zero_chain_derivative(*tv[0], dimensionalities, U);
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, name(), " expects a single input, the offset.");
+        odims = dimensionalities;
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        const double num_elements = std::accumulate(dimensionalities.begin(), dimensionalities.end(), 1.0,
+                [](double acc, tensor::N dim) {return acc * dim;});
+        return (10 * 6 / 4.0 + (is_normal ? 20 : 3)) * num_elements;
+    }
+
+    void check_inputs(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 1, name(), " expects a single input, the offset.");
+    }
+};
+// end struct tensor_function_random
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::dropout(double rate, std::uint64_t seed) {
+    return tensor_function_csptr(new tensor_function_dropout(rate, seed));
+}
+
+tensor_function_csptr tensor_function_factory::random_uniform(const tensor::N_vector& dimensionalities, double low,
+        double high, std::uint64_t seed) {
+    return tensor_function_csptr(new tensor_function_random(dimensionalities, false, low, high - low, seed));
+}
+
+tensor_function_csptr tensor_function_factory::random_normal(const tensor::N_vector& dimensionalities, double mean,
+        double standard_deviation, std::uint64_t seed) {
+    return tensor_function_csptr(new tensor_function_random(dimensionalities, true, mean, standard_deviation, seed));
+}
+
+} // end namespace graph
+} // end namespace para
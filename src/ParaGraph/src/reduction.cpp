@@ -0,0 +1,366 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** Inputs with at least this many values are reduced in parallel. */
+const N min_parallel_reduction_size = 1 << 16;
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- reduction_plan -----------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * How the values of an input map to the values of the output of a reduction.
+ * Consecutive axes that are all reduced (or all kept) are merged,
+ *   so that the input is a sequence of blocks of the innermost merged axis, of contiguous values.
+ * The offset table holds the output offset of the first value of every block;
+ *   the values within a block map to consecutive output offsets if the innermost axis is kept,
+ *   or all to the same one if it is reduced.
+ */
+struct reduction_plan {
+    tensor::N_vector output_dimensionalities;
+    N input_size;
+    N output_size;
+    /** The number of input values reduced into each output value. */
+    N count;
+    N inner;
+    bool inner_kept;
+    std::vector<N> block_output_offsets;
+
+    reduction_plan(const tensor::N_vector& idims, const std::vector<bool>& reduced) :
+                    input_size(1),
+                    output_size(1),
+                    count(1),
+                    inner(1),
+                    inner_kept(true) {
+        // merge consecutive axes with the same treatment
+        tensor::N_vector sizes;
+        std::vector<bool> kept;
+        for (N axis = 0; axis < idims.size(); ++axis) {
+            input_size *= idims[axis];
+            if (reduced[axis])
+                count *= idims[axis];
+            else {
+                output_size *= idims[axis];
+                output_dimensionalities.push_back(idims[axis]);
+            }
+            if (!kept.empty() && kept.back() == !reduced[axis])
+                sizes.back() *= idims[axis];
+            else {
+                sizes.push_back(idims[axis]);
+                kept.push_back(!reduced[axis]);
+            }
+        }
+        if (!sizes.empty()) {
+            inner = sizes.back();
+            inner_kept = kept.back();
+            sizes.pop_back();
+            kept.pop_back();
+        }
+
+        // output strides of the outer merged axes, 0 for the reduced ones
+        std::vector<N> strides(sizes.size(), 0);
+        for (N axis = sizes.size(), stride = inner_kept ? inner : 1; axis-- > 0;)
+            if (kept[axis]) {
+                strides[axis] = stride;
+                stride *= sizes[axis];
+            }
+        N num_blocks = inner == 0 ? 0 : input_size / inner;
+        block_output_offsets.resize(num_blocks);
+        std::vector<N> position(sizes.size(), 0);
+        for (N block = 0, offset = 0; block < num_blocks; ++block) {
+            block_output_offsets[block] = offset;
+            // odometer over the outer merged axes
+            for (N axis = sizes.size(); axis-- > 0;) {
+                offset += strides[axis];
+                if (++position[axis] < sizes[axis])
+                    break;
+                offset -= strides[axis] * sizes[axis];
+                position[axis] = 0;
+            }
+        }
+    }
+
+    /**
+     * Visit the input values of the blocks [block_begin, block_end) with the output offsets they map to:
+     *   visitor(accumulator, input value, output offset).
+     * The loops within each block are contiguous, so that they can be vectorized.
+     */
+    template<typename t_visitor>
+    void visit(const tensor& input, double* output, N block_begin, N block_end, t_visitor visitor) const {
+        for (N block = block_begin; block < block_end; ++block) {
+            const double* in = &input[block * inner];
+            const N o = block_output_offsets[block];
+            if (inner_kept) {
+                double* out = output + o;
+                for (N j = 0; j < inner; ++j)
+                    visitor(out[j], in[j], o + j);
+            } else {
+                double acc = output[o];
+                for (N j = 0; j < inner; ++j)
+                    visitor(acc, in[j], o);
+                output[o] = acc;
+            }
+        }
+    }
+
+    /** The output offset of every input value. */
+    std::vector<N> output_offsets() const {
+        std::vector<N> result(input_size);
+        for (N block = 0, i = 0; block < block_output_offsets.size(); ++block)
+            for (N j = 0; j < inner; ++j, ++i)
+                result[i] = block_output_offsets[block] + (inner_kept ? j : 0);
+        return result;
+    }
+};
+
+/**
+ * Accumulate all the input values into an output initialized with the given identity,
+ *   splitting large inputs over the thread pool, each thread accumulating into its own copy of the output,
+ *   and merging the copies with the given function.
+ */
+template<typename t_visitor, typename t_merge>
+std::vector<double> accumulate(const reduction_plan& plan, const tensor& input, double identity, t_visitor visitor,
+        t_merge merge) {
+    std::vector<double> result(plan.output_size, identity);
+    const N num_blocks = plan.block_output_offsets.size();
+    const N num_chunks = std::min(get_num_threads(), num_blocks);
+    if (plan.input_size < min_parallel_reduction_size || num_chunks <= 1
+            || plan.output_size * num_chunks > plan.input_size) {
+        plan.visit(input, result.data(), 0, num_blocks, visitor);
+        return result;
+    }
+    std::vector<std::vector<double>> partial(num_chunks);
+    parallel_for(num_chunks, [&](N chunk_begin, N chunk_end) {
+        for (N chunk = chunk_begin; chunk < chunk_end; ++chunk) {
+            partial[chunk].assign(plan.output_size, identity);
+            plan.visit(input, partial[chunk].data(), num_blocks * chunk / num_chunks,
+                    num_blocks * (chunk + 1) / num_chunks, visitor);
+        }
+    });
+    for (const auto& p : partial)
+        for (N o = 0; o < result.size(); ++o)
+            result[o] = merge(result[o], p[o]);
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_reduce ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+struct tensor_function_reduce: tensor_function {
+    typedef tensor_function_factory::reduction_type reduction_type;
+    reduction_type type;
+    /** The reduced axes (after the batch axes), or empty for all of them. */
+    std::vector<int> axes;
+    /** The number of leading axes indexing independent reductions, e.g., over the examples of a batch. */
+    N num_batch_axes;
+    tensor_function_reduce(reduction_type v_type, const std::vector<int>& v_axes, N nba) :
+                    type(v_type),
+                    axes(v_axes),
+                    num_batch_axes(nba) {
+    }
+
+    reduction_plan plan(const tensor::N_vector& idims) const {
+        assert(idims.size() >= num_batch_axes, "reduction with ", num_batch_axes,
+                " batch axes cannot work on input with order ", idims.size());
+        std::vector<bool> reduced(idims.size(), axes.empty());
+        std::fill(reduced.begin(), reduced.begin() + num_batch_axes, false);
+        for (int axis : axes) {
+            assert(axis >= 0 && num_batch_axes + axis < idims.size(), "reduction cannot reduce input with order ",
+                    idims.size(), " on axis ", axis);
+            assert(!reduced[num_batch_axes + axis], "reduction cannot reduce axis ", axis, " twice.");
+            reduced[num_batch_axes + axis] = true;
+        }
+        return reduction_plan(idims, reduced);
+    }
+
+    static const tensor& single_input(const tensor_cptr_vec& tv) {
+        assert(tv.size() == 1, "reduction only works on a single input.");
+        return *tv[0];
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        const tensor& input = single_input(tv);
+        reduction_plan p = plan(input.dimensionalities);
+        return tensor_cptr(new tensor(p.output_dimensionalities, reduce(p, input)));
+    }
+
+    std::vector<double> reduce(const reduction_plan& p, const tensor& input) const {
+        const double infinity = std::numeric_limits<double>::infinity();
+        auto sum = [](double& acc, double x, N) {acc += x;};
+        auto add = [](double a, double b) {return a + b;};
+        auto max = [](double& acc, double x, N) {acc = std::max(acc, x);};
+        auto min = [](double& acc, double x, N) {acc = std::min(acc, x);};
+        auto larger = [](double a, double b) {return std::max(a, b);};
+        auto smaller = [](double a, double b) {return std::min(a, b);};
+        switch (type) {
+        case reduction_type::sum:
+            return accumulate(p, input, 0, sum, add);
+        case reduction_type::mean: {
+            std::vector<double> result = accumulate(p, input, 0, sum, add);
+            for (double& r : result)
+                r /= p.count;
+            return result;
+        }
+        case reduction_type::max:
+            return accumulate(p, input, -infinity, max, larger);
+        case reduction_type::min:
+            return accumulate(p, input, infinity, min, smaller);
+        case reduction_type::log_sum_exp: {
+            // subtract the maximum before exponentiating, so that exp does not overflow
+            std::vector<double> M = accumulate(p, input, -infinity, max, larger);
+            for (double& m : M)
+                if (std::isinf(m))
+                    m = 0;
+            const double* m = M.data();
+            std::vector<double> S = accumulate(p, input, 0,
+                    [m](double& acc, double x, N o) {acc += std::exp(x - m[o]);}, add);
+            for (N o = 0; o < S.size(); ++o)
+                S[o] = M[o] + std::log(S[o]);
+            return S;
+        }
+        }
+        throw std::logic_error("Unreachable code.");
+    }
+
+    /**
+     * The derivative of the output value that each input value is reduced into, w.r.t. that input value:
+     *   1 for sum, 1/count for mean, exp(x - log_sum_exp) for log_sum_exp,
+     *   and, for max and min, 1 for the first input value attaining the extremum and 0 otherwise.
+     */
+    std::vector<double> weights(const reduction_plan& p, const tensor& input, const std::vector<double>& output,
+            const std::vector<N>& output_offsets) const {
+        std::vector<double> result(input.size());
+        switch (type) {
+        case reduction_type::sum:
+            std::fill(result.begin(), result.end(), 1.0);
+            break;
+        case reduction_type::mean:
+            std::fill(result.begin(), result.end(), 1.0 / p.count);
+            break;
+        case reduction_type::max:
+        case reduction_type::min: {
+            std::vector<bool> found(output.size(), false);
+            for (N i = 0; i < input.size(); ++i) {
+                N o = output_offsets[i];
+                result[i] = (!found[o] && input[i] == output[o]) ? 1 : 0;
+                found[o] = found[o] || input[i] == output[o];
+            }
+            break;
+        }
+        case reduction_type::log_sum_exp:
+            for (N i = 0; i < input.size(); ++i)
+                result[i] = std::exp(input[i] - output[output_offsets[i]]);
+            break;
+        }
+        return result;
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(derivative_wrt_input(tv, *v, 0))) } };
+    }
+
+    tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+            override {
+        // every input value only moves the output value it is reduced into, by its weight
+        const tensor& input = single_input(tv);
+        assert(input_index == 0, "reduction only works on a single input.");
+        reduction_plan p = plan(input.dimensionalities);
+        std::vector<double> output(value.cbegin(), value.cend());
+        std::vector<N> output_offsets = p.output_offsets();
+        std::vector<double> w = weights(p, input, output, output_offsets);
+        tensor d(std::move(tensor::zero_derivative(value.dimensionalities, input.dimensionalities)));
+        for (N i = 0; i < input.size(); ++i)
+            d[i * p.output_size + output_offsets[i]] = w[i];
+        return d;
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        // every row of U is reduced like the input, with each value scaled by its weight
+        const tensor& input = single_input(tv);
+        assert(input_index == 0, "reduction only works on a single input.");
+        reduction_plan p = plan(input.dimensionalities);
+        std::vector<double> output(value.cbegin(), value.cend());
+        std::vector<N> output_offsets = p.output_offsets();
+        std::vector<double> w = weights(p, input, output, output_offsets);
+        const N n = input.size();
+        assert(n > 0 && U.size() % n == 0, "reduction cannot chain derivative of incompatible size.");
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        std::vector<double> result(U.size() / n * p.output_size, 0);
+        for (N x = 0; x < U.size() / n; ++x) {
+            double* out = &result[x * p.output_size];
+            const double* u = &U[x * n];
+            for (N i = 0; i < n; ++i)
+                out[output_offsets[i]] += u[i] * w[i];
+        }
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "reduction only works on a single input.");
+        odims = plan(idims[0]).output_dimensionalities;
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        double n = 1;
+        for (tensor::N dim : idims[0])
+            n *= dim;
+        // log_sum_exp finds the maximum, then subtracts, exponentiates and accumulates
+        return type == reduction_type::log_sum_exp ? 4 * n : n;
+    }
+
+    tensor_function_csptr batched(const std::vector<bool>& is_batched) const override {
+        return tensor_function_csptr(new tensor_function_reduce(type, axes, num_batch_axes + 1));
+    }
+};
+// end struct tensor_function_reduce
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr tensor_function_factory::reduce(reduction_type type, const std::vector<int>& axes) {
+    return tensor_function_csptr(new tensor_function_reduce(type, axes, 0));
+}
+
+tensor_function_csptr tensor_function_factory::reduce_sum(const std::vector<int>& axes) {
+    return reduce(reduction_type::sum, axes);
+}
+
+} // end namespace graph
+} // end namespace para
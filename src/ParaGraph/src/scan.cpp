@@ -0,0 +1,271 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/graph.h>
+#include <para/graph/exception.h>
+#include "subgraph.h"
+
+#include <algorithm>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------- tensor_function_scan -----------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Evaluates a scan_body step by step, with one evaluation_context reused by all the steps.
+ * The derivatives of the output w.r.t. the states are accumulated backwards from the last step:
+ *     d out / d state_t = d out_t / d state_t + ∑ d next_k / d state_t . d out / d state_{t+1, k}
+ *                                             k
+ *   and similarly w.r.t. the sequence slices and the constants,
+ *   with the states of every step recomputed from the nearest retained checkpoint.
+ */
+struct tensor_function_scan: tensor_function {
+    scan_body body;
+    /** The body variables in the order of the inputs of the scan. */
+    std::vector<variable> body_variables;
+    /** The body nodes evaluated at every step: the next states, then the output. */
+    std::vector<node> step_nodes;
+
+    tensor_function_scan(const scan_body& b) :
+                    body(b) {
+        assert(body.subgraph != nullptr, "scan expects a body graph.");
+        assert(body.next_states.size() == body.states.size(), "scan expects as many next states (",
+                body.next_states.size(), ") as states (", body.states.size(), ")");
+        body_variables = body.states;
+        body_variables.insert(body_variables.end(), body.sequence_slices.begin(), body.sequence_slices.end());
+        body_variables.insert(body_variables.end(), body.constants.begin(), body.constants.end());
+        assert(binds_every_variable_once(*body.subgraph, body_variables),
+                "scan expects every variable of the body to be exactly one of its states,",
+                " sequence slices or constants.");
+        step_nodes = body.next_states;
+        step_nodes.push_back(body.output);
+    }
+
+    N num_states() const {
+        return body.states.size();
+    }
+
+    N num_sequences() const {
+        return body.sequence_slices.size();
+    }
+
+    /** The number of steps, given the dimensionalities of the inputs. */
+    N num_steps(const N_vector_vec& idims) const {
+        assert(idims.size() == body_variables.size(), "scan expects ", body_variables.size(), " inputs, found ",
+                idims.size());
+        if (num_sequences() == 0)
+            return body.num_steps;
+        N result = 0;
+        for (N i_seq = 0; i_seq < num_sequences(); ++i_seq) {
+            const tensor::N_vector& sdims = idims[num_states() + i_seq];
+            assert(!sdims.empty(), "scan expects sequences with a leading axis of steps.");
+            assert(i_seq == 0 || sdims[0] == result, "scan expects sequences of the same number of steps.");
+            result = sdims[0];
+        }
+        return result;
+    }
+
+    N num_steps(const tensor_cptr_vec& tv) const {
+        N_vector_vec idims;
+        for (const auto& t : tv)
+            idims.push_back(t->dimensionalities);
+        N result = num_steps(idims);
+        assert(result > 0, "scan expects at least one step.");
+        return result;
+    }
+
+    /** The values of the body variables at a step, given the states at that step. */
+    tensor_cptr_vec step_inputs(const tensor_cptr_vec& tv, const tensor_cptr_vec& states, N step) const {
+        tensor_cptr_vec result(body_variables.size());
+        for (N i = 0; i < num_states(); ++i)
+            result[body.states[i].index] = states[i];
+        for (N i_seq = 0; i_seq < num_sequences(); ++i_seq) {
+            const tensor& sequence = *tv[num_states() + i_seq];
+            const N slice_size = sequence.size() / sequence.dimensionalities[0];
+            const double* slice = &sequence[0] + step * slice_size;
+            result[body.sequence_slices[i_seq].index] = tensor_cptr(new tensor(tensor::N_vector(
+                    sequence.dimensionalities.begin() + 1, sequence.dimensionalities.end()), std::vector<double>(
+                    slice, slice + slice_size)));
+        }
+        for (N i = num_states() + num_sequences(); i < tv.size(); ++i)
+            result[body_variables[i].index] = tv[i];
+        return result;
+    }
+
+    /** The output dimensionalities, given the dimensionalities of the output of a step. */
+    tensor::N_vector output_dimensionalities(const tensor::N_vector& step_output_dims, N steps) const {
+        tensor::N_vector result(step_output_dims);
+        if (body.stack_outputs)
+            result.insert(result.begin(), steps);
+        return result;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        const N steps = num_steps(tv);
+        evaluation_context_uptr context = body.subgraph->create_context();
+        tensor_cptr_vec states(tv.begin(), tv.begin() + num_states());
+        std::vector<double> stacked;
+        tensor_cptr output;
+        for (N step = 0; step < steps; ++step) {
+            tensor_cptr_vec values = body.subgraph->value(step_nodes, step_inputs(tv, states, step), *context);
+            output = values.back();
+            std::copy(values.begin(), values.begin() + num_states(), states.begin());
+            if (body.stack_outputs)
+                stacked.insert(stacked.end(), output->cbegin(), output->cend());
+        }
+        if (!body.stack_outputs)
+            return output;
+        return tensor_cptr(new tensor(output_dimensionalities(output->dimensionalities, steps), std::move(stacked)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        const N steps = num_steps(tv);
+        const N interval = std::max(body.checkpoint_interval, N(1));
+        // one context per set of evaluated nodes, so that each keeps its schedule
+        evaluation_context_uptr context = body.subgraph->create_context();
+        evaluation_context_uptr state_context = body.subgraph->create_context();
+        const std::vector<node> state_nodes(body.next_states);
+
+        // forward: the value, and the states at the start of every interval
+        std::vector<tensor_cptr_vec> checkpoints;
+        tensor_cptr_vec states(tv.begin(), tv.begin() + num_states());
+        std::vector<double> stacked;
+        tensor_cptr last_output;
+        for (N step = 0; step < steps; ++step) {
+            if (step % interval == 0)
+                checkpoints.push_back(states);
+            tensor_cptr_vec values = body.subgraph->value(step_nodes, step_inputs(tv, states, step), *context);
+            last_output = values.back();
+            std::copy(values.begin(), values.begin() + num_states(), states.begin());
+            if (body.stack_outputs)
+                stacked.insert(stacked.end(), last_output->cbegin(), last_output->cend());
+        }
+        const tensor::N_vector& step_dims = last_output->dimensionalities;
+        const N step_size = last_output->size();
+        tensor_cptr v = body.stack_outputs ? tensor_cptr(new tensor(output_dimensionalities(step_dims, steps),
+                std::move(stacked))) : last_output;
+
+        // backward: d out / d (next) states, and the accumulated derivatives w.r.t. the inputs
+        std::vector<tensor> d_next;     // empty while the states of the step after do not influence the output
+        std::vector<tensor> d_inputs;
+        for (const auto& input : tv)
+            d_inputs.push_back(tensor::zero_derivative(v->dimensionalities, input->dimensionalities));
+        for (N i_checkpoint = checkpoints.size(); i_checkpoint-- > 0;) {
+            // recompute the states at every step of the interval
+            const N first = i_checkpoint * interval, last = std::min(first + interval, steps);
+            std::vector<tensor_cptr_vec> interval_states { checkpoints[i_checkpoint] };
+            for (N step = first; step + 1 < last; ++step)
+                interval_states.push_back(body.subgraph->value(state_nodes, step_inputs(tv, interval_states.back(),
+                        step), *state_context));
+
+            for (N step = last; step-- > first;) {
+                tensor_cptr_vec body_inputs = step_inputs(tv, interval_states[step - first], step);
+                std::vector<derivative> jacobians = body.subgraph->partial_gradient(step_nodes, body_variables,
+                        body_inputs);
+                std::vector<tensor> d_current;
+                for (N i_var = 0; i_var < body_variables.size(); ++i_var) {
+                    tensor d_var = tensor::zero_derivative(v->dimensionalities,
+                            body_inputs[body_variables[i_var].index]->dimensionalities);
+                    for (N k = 0; k < d_next.size(); ++k)
+                        d_var = tensor::add(d_var, tensor::chain_multiplication(*jacobians[k].node_derivative[i_var],
+                                d_next[k], jacobians[k].node_value->dimensionalities.size()));
+                    const tensor& d_output = *jacobians.back().node_derivative[i_var];
+                    if (body.stack_outputs)
+                        place_step(d_output, step, steps, step_size, d_var);
+                    else if (step + 1 == steps)
+                        d_var = tensor::add(d_var, d_output);
+
+                    if (i_var < num_states()) {
+                        d_current.push_back(std::move(d_var));
+                    } else if (i_var < num_states() + num_sequences()) {
+                        // the derivative w.r.t. the sequence has the steps leading: (steps, slice..., out...)
+                        std::copy(d_var.cbegin(), d_var.cend(), &d_inputs[i_var][0] + step * d_var.size());
+                    } else {
+                        d_inputs[i_var] = tensor::add(d_inputs[i_var], d_var);
+                    }
+                }
+                d_next = std::move(d_current);
+            }
+        }
+        for (N i = 0; i < num_states(); ++i)
+            d_inputs[i] = std::move(d_next[i]);
+
+        tensor_cptr_vec node_derivative;
+        for (auto& d : d_inputs)
+            node_derivative.push_back(tensor_cptr(new tensor(std::move(d))));
+        return derivative { v, node_derivative };
+    }
+
+    /**
+     * Add the derivative of the output of a step w.r.t. a variable, of dimensionalities (var..., step_out...),
+     *   at the position of the step in the derivative of the stacked outputs, of dimensionalities
+     *   (var..., steps, step_out...).
+     */
+    static void place_step(const tensor& d_output, N step, N steps, N step_size, tensor& d_var) {
+        const N var_size = d_output.size() / step_size;
+        for (N i = 0; i < var_size; ++i)
+            for (N e = 0; e < step_size; ++e)
+                d_var[(i * steps + step) * step_size + e] += d_output[i * step_size + e];
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        const N steps = num_steps(idims);
+        const graph& g = *body.subgraph;
+        for (N i = 0; i < idims.size(); ++i) {
+            if (!g.has_dimensionalities(body_variables[i]))
+                continue;
+            const bool is_sequence = i >= num_states() && i < num_states() + num_sequences();
+            tensor::N_vector expected = g.get_dimensionalities(body_variables[i]);
+            if (is_sequence)
+                expected.insert(expected.begin(), steps);
+            assert(idims[i] == expected, "scan input ", i, " does not have the dimensionalities declared by the body.");
+        }
+        if (!g.has_dimensionalities(body.output))
+            return false;
+        odims = output_dimensionalities(g.get_dimensionalities(body.output), steps);
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        // an estimate: the nodes of a step are counted once for every node of the step that depends on them
+        double per_step = 0;
+        for (node n : step_nodes) {
+            if (!body.subgraph->has_dimensionalities(n))
+                return 0;
+            per_step += body.subgraph->flop_count(n);
+        }
+        return per_step * num_steps(idims);
+    }
+};
+// end struct tensor_function_scan
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+tensor_function_csptr scan(const scan_body& body) {
+    return tensor_function_csptr(new tensor_function_scan(body));
+}
+
+} // end namespace graph
+} // end namespace para
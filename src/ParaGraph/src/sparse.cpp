@@ -0,0 +1,414 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <para/graph/ml_graph.h>
+#include <para/graph/exception.h>
+#include <para/graph/parallel.h>
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+/** The smallest number of multiply-adds for which sparse kernels use the thread pool. */
+const N min_parallel_work = 1 << 16;
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+/** Invoke func(begin, end) on [0, n), on the thread pool if there is enough work. */
+void maybe_parallel_for(N n, N work, const std::function<void(N, N)>& func) {
+    if (work >= min_parallel_work)
+        parallel_for(n, func);
+    else
+        func(0, n);
+}
+
+tensor_cptr as_row_major(const tensor_cptr& t) {
+    if (t->layout == tensor_layout::row_major)
+        return t;
+    return tensor_cptr(new tensor(tensor::to_layout(*t, tensor_layout::row_major)));
+}
+
+/**
+ * The sizes of the free axes of the lhs (m), the chained axes (k) and the free axes of the rhs (n)
+ *   of a chain multiplication, and the dimensionalities of its result.
+ */
+struct chain_shape {
+    N m, k, n;
+    tensor::N_vector result_dimensionalities;
+
+    chain_shape(const tensor::N_vector& ldim, const tensor::N_vector& rdim, int num_common_dims) {
+        assert(num_common_dims >= 0, "Number of dimensions to be chained must be greater than or equal to 0");
+        N ncd = static_cast<N>(num_common_dims);
+        assert(ldim.size() >= ncd && rdim.size() >= ncd, "Cannot chain ", ncd, " dimensions of tensors of orders ",
+                ldim.size(), " and ", rdim.size());
+        assert(std::equal(ldim.end() - ncd, ldim.end(), rdim.begin()),
+                "Chained dimensionalities of lhs and rhs are not matching while requesting chain multiplication.");
+        m = product(ldim.begin(), ldim.end() - ncd);
+        k = product(rdim.begin(), rdim.begin() + ncd);
+        n = product(rdim.begin() + ncd, rdim.end());
+        result_dimensionalities.assign(ldim.begin(), ldim.end() - ncd);
+        result_dimensionalities.insert(result_dimensionalities.end(), rdim.begin() + ncd, rdim.end());
+    }
+};
+
+/** The column (w.r.t. num_columns columns) of every stored value of a sparse tensor. */
+std::vector<N> columns(const sparse_tensor& s, N num_columns) {
+    std::vector<N> result(s.nnz());
+    for (N z = 0; z < s.nnz(); ++z)
+        result[z] = s.offsets[z] % num_columns;
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//-------------------------------------- tensor_function_sparse_chain_multiplication -----------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * chain_multiplication where one of the operands is a sparse tensor of fixed dimensionalities,
+ *   given as two inputs: its offsets and its values (see sparse_tensor::offset_tensor and value_tensor).
+ * The inputs are (offsets, values, dense) for a sparse lhs, and (dense, offsets, values) for a sparse rhs.
+ * The derivative w.r.t. the sparse operand is w.r.t. its stored values only, and zero w.r.t. its offsets.
+ */
+struct tensor_function_sparse_chain_multiplication: tensor_function {
+    tensor::N_vector sparse_dimensionalities;
+    int num_common_dims;
+    bool sparse_is_lhs;
+    N i_offsets, i_values, i_dense;
+
+    tensor_function_sparse_chain_multiplication(const tensor::N_vector& sdims, int ncd, bool sil) :
+                    sparse_dimensionalities(sdims),
+                    num_common_dims(ncd),
+                    sparse_is_lhs(sil),
+                    i_offsets(sil ? 0 : 1),
+                    i_values(sil ? 1 : 2),
+                    i_dense(sil ? 2 : 0) {
+    }
+
+    chain_shape shape(const tensor::N_vector& dense_dims) const {
+        return sparse_is_lhs ?
+                chain_shape(sparse_dimensionalities, dense_dims, num_common_dims) :
+                chain_shape(dense_dims, sparse_dimensionalities, num_common_dims);
+    }
+
+    sparse_tensor sparse_input(const tensor_cptr_vec& tv) const {
+        assert(tv.size() == 3, "sparse chain_multiplication expects offsets, values and a dense tensor, found ",
+                tv.size(), " inputs.");
+        return sparse_tensor::from_tensors(sparse_dimensionalities, *tv[i_offsets], *tv[i_values]);
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        sparse_tensor s = sparse_input(tv);
+        return tensor_cptr(new tensor(sparse_is_lhs ?
+                sparse_tensor::chain_multiplication(s, *tv[i_dense], num_common_dims) :
+                sparse_tensor::chain_multiplication(*tv[i_dense], s, num_common_dims)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        sparse_tensor s = sparse_input(tv);
+        tensor_cptr dense = as_row_major(tv[i_dense]);
+        tensor_cptr v = value(tv);
+        chain_shape cs = shape(dense->dimensionalities);
+        const N m = cs.m, k = cs.k, n = cs.n, out = m * n;
+        std::vector<N> cols = columns(s, sparse_is_lhs ? k : n);
+
+        tensor d_dense = tensor::zero_derivative(v->dimensionalities, dense->dimensionalities);
+        tensor d_values = tensor::zero_derivative(v->dimensionalities, { s.nnz() });
+        for (N z = 0; z < s.nnz(); ++z) {
+            const N row = s.offsets[z] / (sparse_is_lhs ? k : n), col = cols[z];
+            if (sparse_is_lhs) {
+                // C[i, j] = Σ S[i, p] B[p, j]: dC[row, j] / dB[col, j] = S[row, col], dC[row, j] / dS_z = B[col, j]
+                for (N j = 0; j < n; ++j) {
+                    d_dense[(col * n + j) * out + row * n + j] = s.values[z];
+                    d_values[z * out + row * n + j] = (*dense)[col * n + j];
+                }
+            } else {
+                // C[i, j] = Σ A[i, p] S[p, j]: dC[i, col] / dA[i, row] = S[row, col], dC[i, col] / dS_z = A[i, row]
+                for (N i = 0; i < m; ++i) {
+                    d_dense[(i * k + row) * out + i * n + col] = s.values[z];
+                    d_values[z * out + i * n + col] = (*dense)[i * k + row];
+                }
+            }
+        }
+        tensor_cptr_vec d(3);
+        d[i_offsets] = tensor_cptr(new tensor(tensor::zero_derivative(v->dimensionalities, { s.nnz() })));
+        d[i_values] = tensor_cptr(new tensor(std::move(d_values)));
+        d[i_dense] = tensor_cptr(new tensor(std::move(d_dense)));
+        return derivative { v, d };
+    }
+
+    tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+            const tensor& U) const override {
+        /*
+         * Since the product is linear in each operand,
+         *   chaining a derivative U w.r.t. some X through it
+         *   multiplies every row of U in place of that operand.
+         */
+        sparse_tensor s = sparse_input(tv);
+        tensor_cptr dense = as_row_major(tv[i_dense]);
+        chain_shape cs = shape(dense->dimensionalities);
+        const N m = cs.m, k = cs.k, n = cs.n;
+        const tensor& input = *tv[input_index];
+        assert(input.size() > 0 && U.size() % input.size() == 0,
+                "sparse chain_multiplication cannot chain derivative of incompatible size.");
+        const N x_size = U.size() / input.size();
+        tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - input.dimensionalities.size());
+        rdims.insert(rdims.end(), value.dimensionalities.begin(), value.dimensionalities.end());
+        std::vector<double> result(x_size * m * n, 0.0);
+        if (input_index == i_offsets)
+            return tensor(std::move(rdims), std::move(result));
+
+        std::vector<N> pointers = s.row_pointers(sparse_is_lhs ? sparse_dimensionalities.size() - num_common_dims
+                : num_common_dims);
+        std::vector<N> cols = columns(s, sparse_is_lhs ? k : n);
+        if (input_index == i_dense) {
+            if (sparse_is_lhs) {
+                for (N x = 0; x < x_size; ++x)
+                    kernels::csr_dense_gemm(pointers.data(), cols.data(), s.values.data(), &U[x * k * n],
+                            &result[x * m * n], m, k, n);
+            } else {
+                // the rows of U are just more rows of the dense lhs
+                kernels::dense_csr_gemm(&U[0], pointers.data(), cols.data(), s.values.data(), result.data(),
+                        x_size * m, k, n);
+            }
+        } else {
+            const N nnz = s.nnz();
+            maybe_parallel_for(x_size, x_size * nnz * (sparse_is_lhs ? n : m), [&](N x_begin, N x_end) {
+                for (N x = x_begin; x < x_end; ++x) {
+                    const double* u_x = &U[x * nnz];
+                    double* r_x = &result[x * m * n];
+                    for (N z = 0; z < nnz; ++z) {
+                        const N row = s.offsets[z] / (sparse_is_lhs ? k : n), col = cols[z];
+                        if (sparse_is_lhs) {
+                            for (N j = 0; j < n; ++j)
+                                r_x[row * n + j] += u_x[z] * (*dense)[col * n + j];
+                        } else {
+                            for (N i = 0; i < m; ++i)
+                                r_x[i * n + col] += u_x[z] * (*dense)[i * k + row];
+                        }
+                    }
+                }
+            });
+        }
+        return tensor(std::move(rdims), std::move(result));
+    }
+
+    bool prefers_chain_derivative() const override {
+        return true;
+    }
+
+    bool accepts_layout(std::size_t input_index, tensor_layout layout) const override {
+        // the dense operand is repacked when needed, the sparse one is only stored row-major
+        return input_index == i_dense || layout == tensor_layout::row_major;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 3, "sparse chain_multiplication expects offsets, values and a dense tensor, found ",
+                idims.size(), " inputs.");
+        assert(idims[i_offsets].size() == 1 && idims[i_offsets] == idims[i_values],
+                "sparse chain_multiplication expects offsets and values of dimensionalities {nnz}.");
+        odims = shape(idims[i_dense]).result_dimensionalities;
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        chain_shape cs = shape(idims[i_dense]);
+        return 2.0 * idims[i_values][0] * (sparse_is_lhs ? cs.n : cs.m);
+    }
+};
+// end struct tensor_function_sparse_chain_multiplication
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+sparse_tensor::sparse_tensor(const N_vector& _dimensionalities, std::vector<N>&& _offsets,
+        std::vector<double>&& _values) :
+                dimensionalities(_dimensionalities),
+                offsets(std::move(_offsets)),
+                values(std::move(_values)) {
+    assert(offsets.size() == values.size(), "sparse_tensor needs as many offsets as values, found ", offsets.size(),
+            " offsets and ", values.size(), " values.");
+    const N size = product(dimensionalities.begin(), dimensionalities.end());
+    for (N z = 0; z < offsets.size(); ++z)
+        assert(offsets[z] < size && (z == 0 || offsets[z - 1] < offsets[z]),
+                "sparse_tensor offsets must be strictly increasing and smaller than ", size);
+}
+
+sparse_tensor sparse_tensor::from_coo(const N_vector& dimensionalities, const std::vector<N_vector>& positions,
+        const std::vector<double>& values) {
+    assert(positions.size() == values.size(), "sparse_tensor needs as many positions as values, found ",
+            positions.size(), " positions and ", values.size(), " values.");
+    std::vector<std::pair<N, double> > entries;
+    entries.reserve(values.size());
+    for (N z = 0; z < positions.size(); ++z) {
+        const N_vector& position = positions[z];
+        assert(position.size() == dimensionalities.size(), "Cannot place a ", position.size(),
+                "-D position in a sparse tensor of order ", dimensionalities.size());
+        N offset = 0;
+        for (N d = 0; d < position.size(); ++d) {
+            assert(position[d] < dimensionalities[d], "Position out of range along axis ", d, " of sparse tensor.");
+            offset = offset * dimensionalities[d] + position[d];
+        }
+        entries.push_back(std::make_pair(offset, values[z]));
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+            [](const std::pair<N, double>& lhs, const std::pair<N, double>& rhs) {return lhs.first < rhs.first;});
+    std::vector<N> result_offsets;
+    std::vector<double> result_values;
+    for (const auto& entry : entries) {
+        if (!result_offsets.empty() && result_offsets.back() == entry.first)
+            result_values.back() += entry.second;
+        else {
+            result_offsets.push_back(entry.first);
+            result_values.push_back(entry.second);
+        }
+    }
+    return sparse_tensor(dimensionalities, std::move(result_offsets), std::move(result_values));
+}
+
+sparse_tensor sparse_tensor::from_dense(const tensor& t) {
+    tensor row_major = tensor::to_layout(t, tensor_layout::row_major);
+    std::vector<N> result_offsets;
+    std::vector<double> result_values;
+    for (N offset = 0; offset < row_major.size(); ++offset)
+        if (row_major[offset] != 0) {
+            result_offsets.push_back(offset);
+            result_values.push_back(row_major[offset]);
+        }
+    return sparse_tensor(t.dimensionalities, std::move(result_offsets), std::move(result_values));
+}
+
+tensor sparse_tensor::to_dense() const {
+    tensor result = tensor::zero(dimensionalities);
+    for (N z = 0; z < offsets.size(); ++z)
+        result[offsets[z]] = values[z];
+    return result;
+}
+
+std::vector<sparse_tensor::N> sparse_tensor::row_pointers(std::size_t num_row_axes) const {
+    assert(num_row_axes <= dimensionalities.size(), "Cannot take ", num_row_axes,
+            " row axes of a sparse tensor of order ", dimensionalities.size());
+    const N num_rows = product(dimensionalities.begin(), dimensionalities.begin() + num_row_axes);
+    const N num_columns = product(dimensionalities.begin() + num_row_axes, dimensionalities.end());
+    std::vector<N> result(num_rows + 1, 0);
+    // count the values of every row, then accumulate the counts
+    for (N offset : offsets)
+        ++result[offset / num_columns + 1];
+    std::partial_sum(result.begin(), result.end(), result.begin());
+    return result;
+}
+
+tensor sparse_tensor::offset_tensor() const {
+    return tensor(N_vector { offsets.size() }, std::vector<double>(offsets.begin(), offsets.end()));
+}
+
+tensor sparse_tensor::value_tensor() const {
+    return tensor(N_vector { values.size() }, values);
+}
+
+sparse_tensor sparse_tensor::from_tensors(const N_vector& dimensionalities, const tensor& offsets,
+        const tensor& values) {
+    assert(offsets.dimensionalities.size() == 1 && offsets.dimensionalities == values.dimensionalities,
+            "sparse_tensor expects offsets and values of dimensionalities {nnz}.");
+    std::vector<N> result_offsets(offsets.size());
+    for (N z = 0; z < offsets.size(); ++z) {
+        assert(offsets[z] >= 0 && offsets[z] == std::floor(offsets[z]),
+                "sparse_tensor expects non-negative integer offsets, found ", offsets[z]);
+        result_offsets[z] = static_cast<N>(offsets[z]);
+    }
+    return sparse_tensor(dimensionalities, std::move(result_offsets), std::vector<double>(values.begin(),
+            values.end()));
+}
+
+tensor sparse_tensor::chain_multiplication(const sparse_tensor& lhs, const tensor& rhs, int num_common_dims) {
+    chain_shape cs(lhs.dimensionalities, rhs.dimensionalities, num_common_dims);
+    tensor dense = tensor::to_layout(rhs, tensor_layout::row_major);
+    std::vector<N> pointers = lhs.row_pointers(lhs.dimensionalities.size() - num_common_dims);
+    std::vector<N> cols = columns(lhs, cs.k);
+    std::vector<double> data(cs.m * cs.n);
+    kernels::csr_dense_gemm(pointers.data(), cols.data(), lhs.values.data(), &dense[0], data.data(), cs.m, cs.k,
+            cs.n);
+    return tensor(std::move(cs.result_dimensionalities), std::move(data));
+}
+
+tensor sparse_tensor::chain_multiplication(const tensor& lhs, const sparse_tensor& rhs, int num_common_dims) {
+    chain_shape cs(lhs.dimensionalities, rhs.dimensionalities, num_common_dims);
+    tensor dense = tensor::to_layout(lhs, tensor_layout::row_major);
+    std::vector<N> pointers = rhs.row_pointers(num_common_dims);
+    std::vector<N> cols = columns(rhs, cs.n);
+    std::vector<double> data(cs.m * cs.n);
+    kernels::dense_csr_gemm(&dense[0], pointers.data(), cols.data(), rhs.values.data(), data.data(), cs.m, cs.k,
+            cs.n);
+    return tensor(std::move(cs.result_dimensionalities), std::move(data));
+}
+
+tensor_function_csptr tensor_function_factory::sparse_chain_multiplication(
+        const tensor::N_vector& sparse_dimensionalities, int num_common_dims, bool sparse_is_lhs) {
+    assert(num_common_dims >= 0 && static_cast<N>(num_common_dims) <= sparse_dimensionalities.size(),
+            "sparse chain_multiplication cannot chain ", num_common_dims, " dimensions of a sparse tensor of order ",
+            sparse_dimensionalities.size());
+    return tensor_function_csptr(
+            new tensor_function_sparse_chain_multiplication(sparse_dimensionalities, num_common_dims, sparse_is_lhs));
+}
+
+namespace kernels {
+
+void csr_dense_gemm(const std::size_t* row_pointers, const std::size_t* columns, const double* values, const double* b,
+        double* c, std::size_t m, std::size_t k, std::size_t n) {
+    maybe_parallel_for(m, row_pointers[m] * n, [&](N i_begin, N i_end) {
+        for (N i = i_begin; i < i_end; ++i) {
+            double* c_row = c + i * n;
+            std::fill(c_row, c_row + n, 0.0);
+            for (N z = row_pointers[i]; z < row_pointers[i + 1]; ++z) {
+                const double a_ip = values[z];
+                const double* b_row = b + columns[z] * n;
+                for (N j = 0; j < n; ++j)
+                    c_row[j] += a_ip * b_row[j];
+            }
+        }
+    });
+}
+
+void dense_csr_gemm(const double* a, const std::size_t* row_pointers, const std::size_t* columns, const double* values,
+        double* c, std::size_t m, std::size_t k, std::size_t n) {
+    maybe_parallel_for(m, m * row_pointers[k], [&](N i_begin, N i_end) {
+        for (N i = i_begin; i < i_end; ++i) {
+            double* c_row = c + i * n;
+            std::fill(c_row, c_row + n, 0.0);
+            const double* a_row = a + i * k;
+            for (N p = 0; p < k; ++p) {
+                const double a_ip = a_row[p];
+                for (N z = row_pointers[p]; z < row_pointers[p + 1]; ++z)
+                    c_row[columns[z]] += a_ip * values[z];
+            }
+        }
+    });
+}
+
+} // end namespace kernels
+
+} // end namespace graph
+} // end namespace para
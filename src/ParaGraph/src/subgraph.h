@@ -0,0 +1,36 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PARA_GRAPH_SUBGRAPH_H_
+#define PARA_GRAPH_SUBGRAPH_H_
+
+#include <para/graph/graph.h>
+
+#include <vector>
+
+namespace para {
+namespace graph {
+
+/**
+ * Whether the given variables are exactly the variables of the subgraph, each of them once,
+ *   as needed by functions evaluating a subgraph on their inputs (e.g., scan and conditional).
+ */
+bool binds_every_variable_once(const graph& subgraph, const std::vector<variable>& variables);
+
+} // end namespace graph
+} // end namespace para
+
+#endif /* PARA_GRAPH_SUBGRAPH_H_ */
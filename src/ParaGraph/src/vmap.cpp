@@ -0,0 +1,292 @@
+/**
+ * Copyright 2018 Parakram Majumdar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <para/graph/graph.h>
+#include <para/graph/exception.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+using namespace para::graph;
+
+typedef std::size_t N;
+typedef std::vector<tensor::N_vector> N_vector_vec;
+
+N product(tensor::N_vector::const_iterator begin, tensor::N_vector::const_iterator end) {
+    return std::accumulate(begin, end, N(1), [](N acc, tensor::N dim) {return acc * dim;});
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------- tensor_function_move_axis_to_front ---------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/** Moves one axis of its input to the front, keeping the order of the other axes. */
+struct tensor_function_move_axis_to_front: tensor_function {
+    int axis;
+    tensor_function_move_axis_to_front(int v_axis) :
+                    axis(v_axis) {
+    }
+
+    /** The input is viewed as (l, c, r), with c the moved axis, and the output as (c, l, r). */
+    void sizes(const tensor::N_vector& idims, N& l, N& c, N& r) const {
+        assert(axis >= 0 && idims.size() > static_cast<tensor::N>(axis), "Cannot move axis ", axis,
+                " of input with order ", idims.size(), " to the front.");
+        l = product(idims.begin(), idims.begin() + axis);
+        c = idims[axis];
+        r = product(idims.begin() + axis + 1, idims.end());
+    }
+
+    /** The offset in the output of every offset in the input. */
+    std::vector<N> output_offsets(const tensor::N_vector& idims) const {
+        N l, c, r;
+        sizes(idims, l, c, r);
+        std::vector<N> result(l * c * r);
+        for (N i_l = 0, i_in = 0; i_l < l; ++i_l)
+            for (N i_c = 0; i_c < c; ++i_c)
+                for (N i_r = 0; i_r < r; ++i_r, ++i_in)
+                    result[i_in] = (i_c * l + i_l) * r + i_r;
+        return result;
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        assert(tv.size() == 1, "move_axis_to_front only works on a single input.");
+        const tensor& input = *tv[0];
+        std::vector<N> offsets = output_offsets(input.dimensionalities);
+        std::vector<double> data(input.size());
+        for (N i_in = 0; i_in < offsets.size(); ++i_in)
+            data[offsets[i_in]] = input[i_in];
+        tensor::N_vector odims;
+        infer_dimensionalities(N_vector_vec { input.dimensionalities }, odims);
+        return tensor_cptr(new tensor(std::move(odims), std::move(data)));
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        tensor_cptr v = value(tv);
+        std::vector<N> offsets = output_offsets(tv[0]->dimensionalities);
+        tensor d(std::move(tensor::zero_derivative(v->dimensionalities, tv[0]->dimensionalities)));
+        for (N i_in = 0; i_in < offsets.size(); ++i_in)
+            d[i_in * offsets.size() + offsets[i_in]] = 1;
+        return derivative { v, tensor_cptr_vec { tensor_cptr(new tensor(std::move(d))) } };
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        assert(idims.size() == 1, "move_axis_to_front only works on a single input.");
+        N l, c, r;
+        sizes(idims[0], l, c, r);
+        odims = idims[0];
+        odims.erase(odims.begin() + axis);
+        odims.insert(odims.begin(), c);
+        return true;
+    }
+};
+// end struct tensor_function_move_axis_to_front
+
+//----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------ tensor_function_vmapped ---------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+/**
+ * The fallback batched version of a function without a native one:
+ *   slices the batched inputs into examples, invokes the function on each example,
+ *   and stacks the results.
+ */
+struct tensor_function_vmapped: tensor_function {
+    tensor_function_csptr function;
+    std::vector<bool> is_batched;
+    tensor_function_vmapped(const tensor_function_csptr& f, const std::vector<bool>& b) :
+                    function(f),
+                    is_batched(b) {
+    }
+
+    N batch_size(const N_vector_vec& idims) const {
+        assert(idims.size() == is_batched.size(), "Batched function expects ", is_batched.size(),
+                " inputs, found ", idims.size());
+        N result = 0;
+        bool found = false;
+        for (std::size_t i = 0; i < idims.size(); ++i) {
+            if (!is_batched[i])
+                continue;
+            assert(!idims[i].empty(), "Batched input ", i, " needs a batch axis.");
+            assert(!found || idims[i][0] == result, "Batched inputs have different batch sizes.");
+            result = idims[i][0];
+            found = true;
+        }
+        return result;
+    }
+
+    /** The inputs of one example. */
+    tensor_cptr_vec example(const tensor_cptr_vec& tv, N i_example) const {
+        tensor_cptr_vec result(tv);
+        for (std::size_t i = 0; i < tv.size(); ++i) {
+            if (!is_batched[i])
+                continue;
+            const tensor& input = *tv[i];
+            tensor::N_vector dims(input.dimensionalities.begin() + 1, input.dimensionalities.end());
+            N size = input.size() / input.dimensionalities[0];
+            auto begin = input.cbegin() + i_example * size;
+            result[i] = tensor_cptr(new tensor(std::move(dims), std::vector<double>(begin, begin + size)));
+        }
+        return result;
+    }
+
+    /** Stack the values of all the examples along a new leading axis. */
+    static tensor_cptr stack(const tensor_cptr_vec& values, N batch) {
+        assert(batch > 0, "Cannot evaluate a function over an empty batch.");
+        tensor::N_vector dims(values[0]->dimensionalities);
+        dims.insert(dims.begin(), batch);
+        std::vector<double> data;
+        data.reserve(batch * values[0]->size());
+        for (const auto& v : values)
+            data.insert(data.end(), v->cbegin(), v->cend());
+        return tensor_cptr(new tensor(std::move(dims), std::move(data)));
+    }
+
+    tensor_cptr value(const tensor_cptr_vec& tv) const override {
+        N batch = batch_size(input_dimensionalities(tv));
+        tensor_cptr_vec values(batch);
+        for (N b = 0; b < batch; ++b)
+            values[b] = function->value(example(tv, b));
+        return stack(values, batch);
+    }
+
+    derivative deriv(const tensor_cptr_vec& tv) const override {
+        /*
+         * The example b of the output only depends on the example b of the batched inputs, so
+         *   d out[b', o] / d in[b, i]  =  d out_b[o] / d in_b[i]   if b == b', 0 otherwise
+         * for batched inputs, and
+         *   d out[b, o] / d in[i]  =  d out_b[o] / d in[i]
+         * for shared inputs.
+         */
+        N batch = batch_size(input_dimensionalities(tv));
+        std::vector<derivative> examples(batch);
+        tensor_cptr_vec values(batch);
+        for (N b = 0; b < batch; ++b) {
+            examples[b] = function->deriv(example(tv, b));
+            values[b] = examples[b].node_value;
+        }
+        derivative result { stack(values, batch), tensor_cptr_vec() };
+        const N o_size = values[0]->size();
+        for (std::size_t i = 0; i < tv.size(); ++i) {
+            const N i_size = tv[i]->size() / (is_batched[i] ? batch : 1);
+            tensor d(std::move(tensor::zero_derivative(result.node_value->dimensionalities, tv[i]->dimensionalities)));
+            for (N b = 0; b < batch; ++b) {
+                const tensor& db = *examples[b].node_derivative[i];
+                const N i_offset = is_batched[i] ? b * i_size : 0;
+                for (N i_in = 0; i_in < i_size; ++i_in) {
+                    auto begin = db.cbegin() + i_in * o_size;
+                    std::copy(begin, begin + o_size, d.begin() + ((i_offset + i_in) * batch + b) * o_size);
+                }
+            }
+            result.node_derivative.push_back(tensor_cptr(new tensor(std::move(d))));
+        }
+        return result;
+    }
+
+    bool infer_dimensionalities(const N_vector_vec& idims, tensor::N_vector& odims) const override {
+        N batch = batch_size(idims);
+        if (!function->infer_dimensionalities(example_dimensionalities(idims), odims))
+            return false;
+        odims.insert(odims.begin(), batch);
+        return true;
+    }
+
+    double flop_count(const N_vector_vec& idims) const override {
+        return batch_size(idims) * function->flop_count(example_dimensionalities(idims));
+    }
+
+    N_vector_vec example_dimensionalities(const N_vector_vec& idims) const {
+        N_vector_vec result(idims);
+        for (std::size_t i = 0; i < idims.size(); ++i)
+            if (is_batched[i])
+                result[i].erase(result[i].begin());
+        return result;
+    }
+
+    static N_vector_vec input_dimensionalities(const tensor_cptr_vec& tv) {
+        N_vector_vec result;
+        for (const auto& t : tv)
+            result.push_back(t->dimensionalities);
+        return result;
+    }
+};
+// end struct tensor_function_vmapped
+
+} // end anonymous namespace
+
+namespace para {
+namespace graph {
+
+graph_cuptr vmap(const graph& g, const std::map<variable, int>& batch_axes) {
+    graph_builder_uptr gb = graph_builder::empty();
+    const int num_variables = static_cast<int>(g.num_variables());
+    for (const auto& va : batch_axes) {
+        assert(va.first.index >= 0 && va.first.index < num_variables, "Cannot batch variable with index ",
+                va.first.index);
+        assert(va.second >= 0, "Cannot batch variable ", g.get_variable_name(va.first), " on axis ", va.second);
+        assert(!g.has_dimensionalities(va.first)
+                || static_cast<tensor::N>(va.second) <= g.get_dimensionalities(va.first).size(), "Cannot batch variable ",
+                g.get_variable_name(va.first), " on axis ", va.second);
+    }
+
+    // variables keep their indices, so they are all added before any operation
+    // batched variables lose their declared dimensionalities, since the batch size is not known yet
+    std::vector<node> variable_nodes;
+    std::vector<bool> is_batched_variable(num_variables, false);
+    for (int i_v = 0; i_v < num_variables; ++i_v) {
+        variable v(i_v);
+        const std::string name = g.get_variable_name(v);
+        is_batched_variable[i_v] = batch_axes.count(v) > 0;
+        if (!is_batched_variable[i_v] && g.has_dimensionalities(v))
+            variable_nodes.push_back(gb->add_variable(name, g.get_dimensionalities(v), g.get_layout(v)));
+        else
+            variable_nodes.push_back(gb->add_variable(name));
+    }
+    for (const auto& va : batch_axes)
+        if (va.second != 0)
+            variable_nodes[va.first.index] = gb->add_operation(g.get_variable_name(va.first) + "_batch_axis_to_front",
+                    tensor_function_csptr(new tensor_function_move_axis_to_front(va.second)),
+                    std::vector<node> { variable_nodes[va.first.index] });
+
+    std::vector<node> operation_nodes;
+    std::vector<bool> is_batched_operation;
+    for (std::size_t i_op = 0; i_op < g.num_operations(); ++i_op) {
+        operation op(i_op);
+        std::vector<node> dependencies = g.get_dependencies(op);
+        std::vector<bool> is_batched(dependencies.size());
+        for (std::size_t i_dep = 0; i_dep < dependencies.size(); ++i_dep) {
+            node& dep = dependencies[i_dep];
+            if (dep.type == node::nt_variable) {
+                is_batched[i_dep] = is_batched_variable[dep.index];
+                dep = variable_nodes[dep.index];
+            } else {
+                is_batched[i_dep] = is_batched_operation[dep.index];
+                dep = operation_nodes[dep.index];
+            }
+        }
+        tensor_function_csptr function = g.get_function(op);
+        const bool batched = std::any_of(is_batched.begin(), is_batched.end(), [](bool b) {return b;});
+        if (batched) {
+            tensor_function_csptr batched_function = function->batched(is_batched);
+            function = batched_function ?
+                    batched_function : tensor_function_csptr(new tensor_function_vmapped(function, is_batched));
+        }
+        operation_nodes.push_back(gb->add_operation(g.get_operation_name(op), function, dependencies));
+        is_batched_operation.push_back(batched);
+    }
+    return gb->build_graph();
+}
+
+} // end namespace graph
+} // end namespace para
@@ -21,8 +21,14 @@
 #include <para/graph/graph.h>
 #include <para/graph/exception.h>
 #include <para/graph/ml_graph.h>
+#include <para/graph/parallel.h>
+#include <para/graph/quantization.h>
+#include <atomic>
 #include <algorithm>
+#include <limits>
+#include <numeric>
 #include <random>
+#include <thread>
 
 namespace {
 using namespace para::graph;
@@ -170,6 +176,913 @@ void graph_tensor_test::run() const {
 
 }
 
+std::string graph_dimensionality_test::name() const {
+    return "graph_dimensionality_test";
+}
+
+void graph_dimensionality_test::run() const {
+    std::default_random_engine dre;
+    const tensor::N_vector w_dims { 2, 3 }, x_dims { 3, 5 }, b_dims { 2, 5 };
+
+    auto gb = graph_builder::empty();
+    variable w = gb->add_variable("w", w_dims);
+    variable x = gb->add_variable("x", x_dims);
+    variable b = gb->add_variable("b", b_dims);
+    variable u = gb->add_variable("u");
+    operation wx = gb->add_operation("wx", tensor_function_factory::chain_multiplication(1), { w, x });
+    operation wxb = gb->add_operation("wx+b", tensor_function_factory::add(), { wx, b });
+    operation wxbu = gb->add_operation("wx+b+u", tensor_function_factory::add(), { wxb, u });
+    assert(is_failing([&]() {
+        gb->add_operation("wx+w", tensor_function_factory::add(), {wx, w});
+    }), "graph_builder::add_operation should reject operations with mismatching dimensionalities.");
+    graph_cuptr g = gb->build_graph();
+
+    assert(g->has_dimensionalities(w) && g->get_dimensionalities(w) == w_dims,
+            "graph should remember declared dimensionalities of variables.");
+    assert(!g->has_dimensionalities(u), "graph should not know dimensionalities of undeclared variables.");
+    assert(g->get_dimensionalities(wx) == tensor::N_vector { 2, 5 }, "graph should infer dimensionalities of wx.");
+    assert(g->get_dimensionalities(wxb) == tensor::N_vector { 2, 5 }, "graph should infer dimensionalities of wx+b.");
+    assert(!g->has_dimensionalities(wxbu),
+            "graph should not know dimensionalities of operations depending on undeclared variables.");
+    assert(is_failing([&]() {g->get_dimensionalities(wxbu);}),
+            "graph::get_dimensionalities should fail for unknown dimensionalities.");
+    assert_doubles_are_close(g->flop_count(wxb), 2 * 2 * 3 * 5 + 2 * 5, 1e-15,
+            "graph::flop_count should add flops of chain multiplication and addition.");
+    assert(is_failing([&]() {g->flop_count(wxbu);}), "graph::flop_count should fail for unknown dimensionalities.");
+
+    tensor_cptr w_val = generate_random_tensor(w_dims, dre);
+    tensor_cptr x_val = generate_random_tensor(x_dims, dre);
+    tensor_cptr b_val = generate_random_tensor(b_dims, dre);
+    tensor_cptr v = g->value(wxb, g->create_variable_values( { { w, w_val }, { x, x_val }, { b, b_val } }));
+    assert(v->dimensionalities == g->get_dimensionalities(wxb),
+            "computed value should have the inferred dimensionalities.");
+    assert(is_failing([&]() {
+        g->create_variable_values( { {w, x_val}, {x, x_val}, {b, b_val}});
+    }), "graph should reject input values that do not match declared dimensionalities.");
+}
+
+std::string graph_multiple_outputs_test::name() const {
+    return "graph_multiple_outputs_test";
+}
+
+void graph_multiple_outputs_test::run() const {
+    std::default_random_engine dre;
+    auto gb = graph_builder::empty();
+    variable w = gb->add_variable("w");
+    variable x = gb->add_variable("x");
+    variable b = gb->add_variable("b");
+    std::shared_ptr<counting_tensor_function> counted_mult(
+            new counting_tensor_function(tensor_function_factory::chain_multiplication(1)));
+    operation wx = gb->add_operation("wx", counted_mult, { w, x });
+    operation hidden = gb->add_operation("sigmoid(wx)", tensor_function_factory::sigmoid(), { wx });
+    operation predictions = gb->add_operation("sigmoid(wx)+b", tensor_function_factory::add(), { hidden, b });
+    operation loss = gb->add_operation("loss", tensor_function_factory::reduce_sum({ 0 }),
+            { gb->add_operation("reduce_sum", tensor_function_factory::reduce_sum({ 1 }), { predictions }) });
+    graph_cuptr g = gb->build_graph();
+
+    tensor_cptr_vec inputs = g->create_variable_values( { { w, generate_random_tensor( { 2, 3 }, dre) }, { x,
+            generate_random_tensor( { 3, 5 }, dre) }, { b, generate_random_tensor( { 2, 5 }, dre) } });
+    std::vector<node> outputs { loss, predictions, hidden, b };
+
+    tensor_cptr_vec values = g->value(outputs, inputs);
+    assert(*counted_mult->num_calls == 1, "graph::value should compute shared operations once for all outputs.");
+    assert(values.size() == outputs.size(), "graph::value should return one value per output.");
+    for (std::size_t i = 0; i < outputs.size(); ++i) {
+        assert_tensors_are_close(*values[i], *g->value(outputs[i], inputs), 1e-15,
+                "graph::value with multiple outputs should match single output values.");
+    }
+
+    *counted_mult->num_calls = 0;
+    std::vector<variable> moving_variables { b, w };
+    std::vector<derivative> derivs = g->partial_gradient(outputs, moving_variables, inputs);
+    assert(*counted_mult->num_calls == 1,
+            "graph::partial_gradient should compute shared operations once for all outputs.");
+    assert(derivs.size() == outputs.size(), "graph::partial_gradient should return one derivative per output.");
+    for (std::size_t i = 0; i < outputs.size(); ++i) {
+        derivative expected = g->partial_gradient(outputs[i], moving_variables, inputs);
+        assert_tensors_are_close(*derivs[i].node_value, *expected.node_value, 1e-15,
+                "graph::partial_gradient with multiple outputs should match single output values.");
+        for (std::size_t i_mv = 0; i_mv < moving_variables.size(); ++i_mv)
+            assert_tensors_are_close(*derivs[i].node_derivative[i_mv], *expected.node_derivative[i_mv], 1e-15,
+                    "graph::partial_gradient with multiple outputs should match single output derivatives.");
+    }
+}
+
+std::string graph_evaluation_session_test::name() const {
+    return "graph_evaluation_session_test";
+}
+
+void graph_evaluation_session_test::run() const {
+    std::default_random_engine dre;
+    auto gb = graph_builder::empty();
+    variable w = gb->add_variable("w");
+    variable x = gb->add_variable("x");
+    variable b = gb->add_variable("b");
+    std::shared_ptr<counting_tensor_function> counted_mult(
+            new counting_tensor_function(tensor_function_factory::chain_multiplication(1)));
+    std::shared_ptr<counting_tensor_function> counted_add(
+            new counting_tensor_function(tensor_function_factory::add()));
+    operation wx = gb->add_operation("wx", counted_mult, { w, x });
+    operation wxb = gb->add_operation("wx+b", counted_add, { wx, b });
+    graph_cuptr g = gb->build_graph();
+
+    tensor_cptr w_val = generate_random_tensor( { 2, 3 }, dre);
+    tensor_cptr x_val = generate_random_tensor( { 3, 5 }, dre);
+    tensor_cptr_vec inputs = g->create_variable_values( { { w, w_val }, { x, x_val }, { b, generate_random_tensor( {
+            2, 5 }, dre) } });
+
+    auto expected_value = [&]() {
+        return tensor::add(tensor::chain_multiplication(*inputs[w.index], *inputs[x.index], 1), *inputs[b.index]);
+    };
+
+    // a sweep over b with unlimited retention only recomputes wx+b
+    evaluation_session_uptr session = g->create_session(inputs, std::numeric_limits<std::size_t>::max());
+    assert_tensors_are_close(*session->value(wxb), expected_value(), 1e-15,
+            "evaluation_session::value should match graph::value.");
+    for (int i = 0; i < 3; ++i) {
+        inputs[b.index] = generate_random_tensor( { 2, 5 }, dre);
+        session->set_input(b, inputs[b.index]);
+        assert_tensors_are_close(*session->value(wxb), expected_value(), 1e-15,
+                "evaluation_session::value should match graph::value after updating an input.");
+    }
+    assert(*counted_mult->num_calls == 1, "evaluation_session should not recompute wx when b changes.");
+    assert(*counted_add->num_calls == 4, "evaluation_session should recompute wx+b when b changes.");
+
+    // changing w invalidates everything
+    inputs[w.index] = generate_random_tensor( { 2, 3 }, dre);
+    session->set_input(w, inputs[w.index]);
+    assert(session->num_retained_values() == 0, "evaluation_session should invalidate all consumers of w.");
+    assert_tensors_are_close(*session->value(wxb), expected_value(), 1e-15,
+            "evaluation_session::value should match graph::value after updating w.");
+
+    // with a retention cap of one, once b has changed, the session keeps wx,
+    //   which is invalidated less often than wx+b
+    *counted_mult->num_calls = 0;
+    evaluation_session_uptr capped_session = g->create_session(inputs, 1);
+    capped_session->value(wxb);
+    capped_session->set_input(b, generate_random_tensor( { 2, 5 }, dre));
+    capped_session->value(wxb);
+    capped_session->set_input(b, generate_random_tensor( { 2, 5 }, dre));
+    capped_session->value(wxb);
+    assert(capped_session->num_retained_values() == 1, "evaluation_session should respect its retention cap.");
+    assert(*counted_mult->num_calls == 2, "capped evaluation_session should retain wx across changes to b.");
+
+    // negation, counting how many of its values are alive at a time
+    struct resident_negative: tensor_function {
+        std::shared_ptr<int> num_alive { new int(0) }, peak { new int(0) };
+        tensor_cptr value(const tensor_cptr_vec& tv) const override {
+            tensor_cptr v = tensor_function_factory::negative()->value(tv);
+            *peak = std::max(*peak, ++*num_alive);
+            std::shared_ptr<int> alive = num_alive;
+            return tensor_cptr(v.get(), [v, alive](const tensor*) {--*alive;});
+        }
+        derivative deriv(const tensor_cptr_vec& tv) const override {
+            return tensor_function_factory::negative()->deriv(tv);
+        }
+    };
+    std::shared_ptr<resident_negative> counted_negative(new resident_negative());
+    const int chain_length = 16;
+    auto chain_gb = graph_builder::empty();
+    variable y = chain_gb->add_variable("y");
+    node previous = y;
+    for (int i = 0; i < chain_length; ++i)
+        previous = chain_gb->add_operation("negative", counted_negative, { previous });
+    graph_cuptr chain = chain_gb->build_graph();
+    tensor_cptr_vec chain_inputs { generate_random_tensor( { 2, 3 }, dre) };
+
+    // the intermediate values are released within the call, not just after it
+    for (std::size_t cap : { 0, 4 }) {
+        *counted_negative->peak = 0;
+        evaluation_session_uptr chain_session = chain->create_session(chain_inputs, cap);
+        tensor_cptr result = chain_session->value(previous);
+        assert_tensors_are_close(*result, *chain_inputs[0], 0,
+                "evaluation_session should negate an even number of times.");
+        assert(*counted_negative->peak <= static_cast<int>(cap) + 2,
+                "evaluation_session should not keep more than its cap alive while computing.");
+        assert(chain_session->num_retained_values() == cap, "evaluation_session should retain up to its cap.");
+    }
+    assert(*counted_negative->num_alive == 0, "evaluation_session should release every value it does not return.");
+}
+
+std::string graph_checkpoint_test::name() const {
+    return "graph_checkpoint_test";
+}
+
+void graph_checkpoint_test::run() const {
+    // a chain of sigmoids with a skip connection, scaled by w, from the middle of the chain to the output
+    const int chain_length = 16;
+    std::default_random_engine dre;
+    auto gb = graph_builder::empty();
+    variable x = gb->add_variable("x"), w = gb->add_variable("w");
+    std::shared_ptr<counting_tensor_function> counted_sigmoid(
+            new counting_tensor_function(tensor_function_factory::sigmoid()));
+    std::vector<operation> chain;
+    node previous = x;
+    for (int i = 0; i < chain_length; ++i) {
+        chain.push_back(gb->add_operation("sigmoid", counted_sigmoid, { previous }));
+        previous = chain.back();
+    }
+    operation middle = chain[chain_length / 2 - 1];
+    operation skip = gb->add_operation("skip", tensor_function_factory::element_wise_multiplication(),
+            { middle, w });
+    operation output = gb->add_operation("output", tensor_function_factory::add(), { chain.back(), skip });
+    graph_cuptr g = gb->build_graph();
+
+    tensor_cptr_vec inputs = g->create_variable_values( { { x, generate_random_tensor( { 2, 3 }, dre) }, { w,
+            generate_random_tensor( { 2, 3 }, dre) } });
+    std::vector<variable> moving_variables { x, w };
+    derivative expected = g->partial_gradient(output, moving_variables, inputs);
+    assert(*counted_sigmoid->num_calls == chain_length, "partial_gradient should compute every sigmoid once.");
+
+    auto check = [&](const checkpoint_policy& policy, const std::string& policy_name) {
+        *counted_sigmoid->num_calls = 0;
+        derivative actual = g->partial_gradient(output, moving_variables, inputs, policy);
+        assert_tensors_are_close(*actual.node_value, *expected.node_value, 1e-15,
+                "checkpointed value should match for " + policy_name);
+        assert(actual.node_derivative.size() == moving_variables.size(),
+                "checkpointed gradient should have a derivative per moving variable for " + policy_name);
+        for (std::size_t i_mv = 0; i_mv < moving_variables.size(); ++i_mv)
+            assert_tensors_are_close(*actual.node_derivative[i_mv], *expected.node_derivative[i_mv], 1e-15,
+                    "checkpointed derivatives should match those without checkpoints for " + policy_name);
+        return *counted_sigmoid->num_calls;
+    };
+
+    assert(check(checkpoint_policy { { }, false, std::numeric_limits<std::size_t>::max() }, "unlimited budget")
+            == chain_length, "an unlimited memory budget should not recompute anything.");
+    assert(check(checkpoint_policy { { middle }, false, 0 }, "explicit checkpoint") == chain_length,
+            "checkpointing the skip connection should not recompute anything.");
+    assert(check(checkpoint_policy { { }, false, 0 }, "no checkpoints") == chain_length + chain_length / 2,
+            "without checkpoints, the skip connection should be recomputed from the input.");
+    int automatic_calls = check(checkpoint_policy { { }, true, 0 }, "automatic checkpoints");
+    assert(automatic_calls > chain_length && automatic_calls <= chain_length + 4,
+            "automatic checkpoints should recompute the skip connection from the nearest checkpoint.");
+}
+
+std::string graph_concurrent_evaluation_test::name() const {
+    return "graph_concurrent_evaluation_test";
+}
+
+void graph_concurrent_evaluation_test::run() const {
+    const std::size_t num_threads = 8;
+    const std::size_t num_evaluations = 20;
+    std::default_random_engine dre;
+    auto mgb = ml_graph_builder::empty();
+    variable w = mgb->add_variable("w");
+    variable x = mgb->add_variable("x");
+    variable b = mgb->add_variable("b");
+    operation wxb = mgb->add(mgb->chain_multiplication(w, x, 1), b);
+    operation loss = mgb->reduce_sum(mgb->reduce_sum(mgb->sigmoid(wxb), { 0 }), { 0 });
+    graph_cuptr g = mgb->build_graph();
+
+    // every thread evaluates the same graph on its own inputs, using its own context
+    std::vector<tensor_cptr_vec> inputs;
+    for (std::size_t i = 0; i < num_threads * num_evaluations; ++i)
+        inputs.push_back(g->create_variable_values( { { w, generate_random_tensor( { 3, 4 }, dre) }, { x,
+                generate_random_tensor( { 4, 6 }, dre) }, { b, generate_random_tensor( { 3, 6 }, dre) } }));
+    std::vector<tensor_cptr_vec> results(inputs.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i_thread = 0; i_thread < num_threads; ++i_thread) {
+        threads.push_back(std::thread([&, i_thread]() {
+            evaluation_context_uptr context = g->create_context();
+            for (std::size_t i = i_thread; i < inputs.size(); i += num_threads) {
+                results[i].push_back(g->value(loss, inputs[i], *context));
+                results[i].push_back(g->value(std::vector<node> { wxb }, inputs[i], *context)[0]);
+            }
+        }));
+    }
+    for (auto& t : threads)
+        t.join();
+
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        assert_tensors_are_close(*results[i][0], *g->value(loss, inputs[i]), 1e-15,
+                "concurrent evaluation with a context should match graph::value.");
+        assert_tensors_are_close(*results[i][1], *g->value(wxb, inputs[i]), 1e-15,
+                "concurrent evaluation with a context should match graph::value.");
+    }
+
+    evaluation_context_uptr context = g->create_context();
+    graph_cuptr other = ml_graph_builder::empty()->build_graph();
+    assert(is_failing([&]() {other->value(loss, inputs[0], *context);}),
+            "evaluation_context should only be usable with the graph that created it.");
+}
+
+std::string graph_value_batch_test::name() const {
+    return "graph_value_batch_test";
+}
+
+void graph_value_batch_test::run() const {
+    const std::size_t original_num_threads = get_num_threads();
+    set_num_threads(4);
+
+    // parallel_for covers every index exactly once, runs nested calls serially, and propagates exceptions
+    std::vector<std::atomic<int> > hits(1000);
+    parallel_for(hits.size() / 10, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i)
+            parallel_for(10, [&](std::size_t nested_begin, std::size_t nested_end) {
+                for (std::size_t j = nested_begin; j < nested_end; ++j)
+                    ++hits[i * 10 + j];
+            });
+    });
+    assert(std::all_of(hits.begin(), hits.end(), [](const std::atomic<int>& h) {return h == 1;}),
+            "parallel_for should visit every index exactly once.");
+    assert(is_failing([]() {
+        parallel_for(100, [](std::size_t begin, std::size_t end) {
+                    if (begin <= 50 && 50 < end)
+                        throw std::runtime_error("expected failure");
+                });
+    }), "parallel_for should rethrow exceptions from its chunks.");
+
+    std::default_random_engine dre;
+    auto mgb = ml_graph_builder::empty();
+    variable w = mgb->add_variable("w");
+    variable x = mgb->add_variable("x");
+    variable b = mgb->add_variable("b");
+    operation loss = mgb->reduce_sum(
+            mgb->reduce_sum(mgb->sigmoid(mgb->add(mgb->chain_multiplication(w, x, 1), b)), { 0 }), { 0 });
+    graph_cuptr g = mgb->build_graph();
+
+    std::vector<tensor_cptr_vec> batch;
+    for (std::size_t i = 0; i < 37; ++i)
+        batch.push_back(g->create_variable_values( { { w, generate_random_tensor( { 3, 4 }, dre) }, { x,
+                generate_random_tensor( { 4, 6 }, dre) }, { b, generate_random_tensor( { 3, 6 }, dre) } }));
+    tensor_cptr_vec results = g->value_batch(loss, batch);
+    assert(results.size() == batch.size(), "value_batch should return one value per input set.");
+    for (std::size_t i = 0; i < batch.size(); ++i)
+        assert_tensors_are_close(*results[i], *g->value(loss, batch[i]), 1e-15,
+                "value_batch should match graph::value, in the order of the input sets.");
+    assert(g->value_batch(loss, { }).empty(), "value_batch of no input sets should be empty.");
+
+    batch[20].pop_back();
+    assert(is_failing([&]() {g->value_batch(loss, batch);}), "value_batch should report invalid input sets.");
+
+    set_num_threads(original_num_threads);
+}
+
+std::string graph_parallel_gradient_test::name() const {
+    return "graph_parallel_gradient_test";
+}
+
+void graph_parallel_gradient_test::run() const {
+    const std::size_t original_num_threads = get_num_threads();
+    std::default_random_engine dre;
+
+    // a two-layer network, differentiated w.r.t. all its parameters as well as its input
+    auto mgb = ml_graph_builder::empty();
+    variable x = mgb->add_variable("x");
+    std::vector<variable> parameters;
+    for (std::string name : { "w1", "b1", "w2", "b2" })
+        parameters.push_back(mgb->add_variable(name));
+    operation h = mgb->sigmoid(mgb->add(mgb->chain_multiplication(parameters[0], x, 1), parameters[1]));
+    operation y = mgb->add(mgb->chain_multiplication(parameters[2], h, 1), parameters[3]);
+    operation loss = mgb->reduce_sum(mgb->reduce_sum(mgb->sigmoid(y), { 0 }), { 0 });
+    graph_cuptr g = mgb->build_graph();
+    std::vector<variable> moving_variables = parameters;
+    moving_variables.push_back(x);
+
+    tensor_cptr_vec inputs = g->create_variable_values( { { x, generate_random_tensor( { 4, 3 }, dre) }, {
+            parameters[0], generate_random_tensor( { 5, 4 }, dre) }, { parameters[1], generate_random_tensor( { 5, 3 },
+            dre) }, { parameters[2], generate_random_tensor( { 2, 5 }, dre) }, { parameters[3],
+            generate_random_tensor( { 2, 3 }, dre) } });
+
+    set_num_threads(1);
+    derivative serial = g->partial_gradient(loss, moving_variables, inputs);
+    for (std::size_t num_threads : { 2, 3, 8 }) {
+        set_num_threads(num_threads);
+        derivative parallel = g->partial_gradient(loss, moving_variables, inputs);
+        assert_tensors_are_close(*parallel.node_value, *serial.node_value, 1e-15,
+                "parallel gradients should not change the value.");
+        assert(parallel.node_derivative.size() == moving_variables.size(),
+                "parallel gradients should have one derivative per moving variable.");
+        for (std::size_t i_mv = 0; i_mv < moving_variables.size(); ++i_mv)
+            assert_tensors_are_close(*parallel.node_derivative[i_mv], *serial.node_derivative[i_mv], 1e-15,
+                    "parallel gradients should match serial gradients.");
+    }
+    set_num_threads(original_num_threads);
+}
+
+std::string graph_vmap_test::name() const {
+    return "graph_vmap_test";
+}
+
+void graph_vmap_test::run() const {
+    const tensor::N batch = 5;
+    std::default_random_engine dre;
+
+    // a graph written for a single example x, exercising native and fallback batched functions
+    auto mgb = ml_graph_builder::empty();
+    variable w = mgb->add_variable("w", { 3, 4 });
+    variable x = mgb->add_variable("x", { 4 });
+    variable b = mgb->add_variable("b", { 3 });
+    operation h = mgb->sigmoid(mgb->add(mgb->chain_multiplication(w, x, 1), b));
+    operation p = mgb->softmax(h);
+    operation e = mgb->einsum("i,i->", { p, mgb->log(h) });
+    operation r = mgb->reduce_sum(mgb->element_wise_multiplication(p, h), { 0 });
+    operation loss = mgb->add(e, r);
+    graph_cuptr g = mgb->build_graph();
+
+    // slice an example out of a tensor, along the given axis
+    auto example = [](const tensor& t, std::size_t axis, std::size_t i_example) {
+        tensor::N_vector dims(t.dimensionalities);
+        std::size_t r = std::accumulate(dims.begin() + axis + 1, dims.end(), std::size_t(1),
+                [](std::size_t acc, tensor::N d) {return acc * d;});
+        std::size_t c = dims[axis];
+        dims.erase(dims.begin() + axis);
+        std::vector<double> data;
+        for (std::size_t i = 0; i < t.size(); ++i)
+            if (i / r % c == i_example)
+                data.push_back(t[i]);
+        return tensor_cptr(new tensor(std::move(dims), std::move(data)));
+    };
+
+    // x batched along its trailing axis, while w and b are shared
+    tensor_cptr xs = generate_random_tensor( { 4, batch }, dre);
+    tensor_cptr wv = generate_random_tensor( { 3, 4 }, dre);
+    tensor_cptr bv = generate_random_tensor( { 3 }, dre);
+    graph_cuptr bg = vmap(*g, { { x, 1 } });
+    assert(bg->num_variables() == g->num_variables(), "vmap should keep the variables of the graph.");
+    tensor_cptr_vec batch_inputs = bg->create_variable_values( { { w, wv }, { x, xs }, { b, bv } });
+    std::vector<node> outputs { h, p, e, r, loss };
+    std::vector<node> batch_outputs;
+    for (node out : outputs)
+        batch_outputs.push_back(bg->get_operation(g->get_operation_name(operation(out.index))));
+    tensor_cptr_vec batch_values = bg->value(batch_outputs, batch_inputs);
+    derivative batch_gradient = bg->partial_gradient(batch_outputs.back(), { w, b }, batch_inputs);
+    for (tensor::N i_example = 0; i_example < batch; ++i_example) {
+        tensor_cptr_vec inputs = g->create_variable_values( { { w, wv }, { x, example(*xs, 1, i_example) }, { b,
+                bv } });
+        tensor_cptr_vec values = g->value(outputs, inputs);
+        for (std::size_t i_out = 0; i_out < outputs.size(); ++i_out)
+            assert_tensors_are_close(*example(*batch_values[i_out], 0, i_example), *values[i_out], 1e-12,
+                    "vmap should compute the value of every example.");
+        // per-example gradients w.r.t. shared variables
+        derivative gradient = g->partial_gradient(loss, { w, b }, inputs);
+        for (std::size_t i_mv = 0; i_mv < 2; ++i_mv)
+            assert_tensors_are_close(*example(*batch_gradient.node_derivative[i_mv],
+                    batch_gradient.node_derivative[i_mv]->dimensionalities.size() - 1, i_example),
+                    *gradient.node_derivative[i_mv], 1e-12, "vmap should compute per-example gradients.");
+    }
+
+    // both operands of the chain multiplication batched, with a gradient w.r.t. the batched input
+    tensor_cptr ws = generate_random_tensor( { batch, 3, 4 }, dre);
+    bg = vmap(*g, { { w, 0 }, { x, 1 } });
+    batch_inputs = bg->create_variable_values( { { w, ws }, { x, xs }, { b, bv } });
+    operation batch_loss = bg->get_operation(g->get_operation_name(loss));
+    derivative batch_dx = bg->partial_gradient(batch_loss, { x }, batch_inputs);
+    assert((batch_dx.node_derivative[0]->dimensionalities == tensor::N_vector { 4, batch, batch }),
+            "the derivative w.r.t. a batched variable should keep its batch axis.");
+    for (tensor::N i_example = 0; i_example < batch; ++i_example) {
+        tensor_cptr_vec inputs = g->create_variable_values( { { w, example(*ws, 0, i_example) }, { x, example(*xs, 1,
+                i_example) }, { b, bv } });
+        derivative dx = g->partial_gradient(loss, { x }, inputs);
+        assert_doubles_are_close(batch_dx.node_value->at(i_example), dx.node_value->at(0), 1e-12,
+                "vmap should batch both operands of a chain multiplication.");
+        for (tensor::N i_x = 0; i_x < 4; ++i_x)
+            assert_doubles_are_close(batch_dx.node_derivative[0]->at((i_x * batch + i_example) * batch + i_example),
+                    dx.node_derivative[0]->at(i_x), 1e-12, "vmap should differentiate w.r.t. batched variables.");
+    }
+
+    assert(is_failing([&]() {vmap(*g, { { x, 2 } });}), "vmap should reject batch axes beyond declared orders.");
+}
+
+std::string graph_layout_test::name() const {
+    return "graph_layout_test";
+}
+
+void graph_layout_test::run() const {
+    std::default_random_engine dre;
+
+    // the same computation with w declared column-major and row-major
+    auto build = [](tensor_layout w_layout) {
+        auto mgb = ml_graph_builder::empty();
+        variable w = mgb->add_variable("w", { 3, 4 }, w_layout);
+        variable x = mgb->add_variable("x", { 4 });
+        operation h = mgb->chain_multiplication(w, x, 1);
+        operation s = mgb->sigmoid(w);
+        operation l = mgb->log(mgb->sigmoid(w));
+        operation c = mgb->to_layout(h, tensor_layout::column_major);
+        operation e = mgb->einsum("ij,ij->", { s, l });
+        operation r = mgb->reduce_sum(c, { 0 });
+        mgb->add(e, r);
+        return mgb->build_graph();
+    };
+    graph_cuptr g = build(tensor_layout::column_major);
+    graph_cuptr reference = build(tensor_layout::row_major);
+
+    // a single repack of w is shared by both sigmoids, while chain_multiplication reads w in place
+    variable w = g->get_variable("w"), x = g->get_variable("x");
+    assert(g->get_layout(w) == tensor_layout::column_major, "graph should keep the declared layout of variables.");
+    assert(g->num_operations() == reference->num_operations() + 1,
+            "graph_builder should repack w exactly once.");
+    operation repack = g->get_operation("w_to_row_major");
+    assert(g->get_layout(repack) == tensor_layout::row_major, "repack operations should produce row-major values.");
+    std::size_t num_consumers = 0;
+    for (std::size_t i_op = 0; i_op < g->num_operations(); ++i_op) {
+        std::vector<node> deps = g->get_dependencies(operation(i_op));
+        num_consumers += std::count_if(deps.begin(), deps.end(), [&](node n) {return n == repack;});
+        assert(std::find_if(deps.begin(), deps.end(), [&](node n) {return n == w;}) == deps.end()
+                || g->get_function(operation(i_op))->accepts_layout(0, tensor_layout::column_major),
+                "graph_builder should only feed w to operations that accept its layout.");
+    }
+    assert(num_consumers == 2, "both sigmoids should consume the repacked w.");
+    // operations h, w_to_row_major, sigmoid, sigmoid, log and then to_layout
+    operation c(5);
+    assert(g->get_layout(c) == tensor_layout::column_major, "to_layout should set the layout of its operation.");
+    assert(g->get_dependencies(operation(g->num_operations() - 2))[0] == g->get_operation(g->get_operation_name(c)
+            + "_to_row_major"), "reduce_sum should consume the repacked output of to_layout.");
+
+    // values and gradients do not depend on the layout
+    tensor_cptr wv = generate_random_tensor( { 3, 4 }, dre);
+    tensor_cptr xv = generate_random_tensor( { 4 }, dre);
+    tensor_cptr wc(new tensor(tensor::to_layout(*wv, tensor_layout::column_major)));
+    operation loss(g->num_operations() - 1), reference_loss(reference->num_operations() - 1);
+    tensor_cptr_vec inputs = g->create_variable_values( { { w, wc }, { x, xv } });
+    tensor_cptr_vec reference_inputs = reference->create_variable_values( { { w, wv }, { x, xv } });
+    derivative d = g->partial_gradient(loss, { w, x }, inputs);
+    derivative reference_d = reference->partial_gradient(reference_loss, { w, x }, reference_inputs);
+    assert_tensors_are_close(*d.node_value, *reference_d.node_value, 1e-12, "layouts should not change the value.");
+    for (std::size_t i_mv = 0; i_mv < 2; ++i_mv)
+        assert_tensors_are_close(*d.node_derivative[i_mv], *reference_d.node_derivative[i_mv], 1e-12,
+                "layouts should not change the gradient.");
+
+    assert(is_failing([&]() {g->create_variable_values( { { w, wv }, { x, xv } });}),
+            "graph should reject values that do not have the declared layout.");
+
+    // operations that consume the repack of a moving variable, with and without chaining derivatives directly
+    auto build_consumers = [](tensor_layout v_layout) {
+        auto mgb = ml_graph_builder::empty();
+        variable v = mgb->add_variable("v", { 5, 6 }, v_layout);
+        mgb->add(mgb->reduce_sum(mgb->sigmoid(v), { 1 }), mgb->reduce_sum(v, { 1 }));
+        return mgb->build_graph();
+    };
+    graph_cuptr gc = build_consumers(tensor_layout::column_major);
+    graph_cuptr reference_gc = build_consumers(tensor_layout::row_major);
+    variable v = gc->get_variable("v");
+    tensor_cptr vv = generate_random_tensor( { 5, 6 }, dre);
+    tensor_cptr vc(new tensor(tensor::to_layout(*vv, tensor_layout::column_major)));
+    derivative dc = gc->partial_gradient(operation(gc->num_operations() - 1), { v },
+            gc->create_variable_values( { { v, vc } }));
+    derivative reference_dc = reference_gc->partial_gradient(operation(reference_gc->num_operations() - 1), { v },
+            reference_gc->create_variable_values( { { v, vv } }));
+    assert_tensors_are_close(*dc.node_derivative[0], *reference_dc.node_derivative[0], 1e-12,
+            "consumers of a repacked variable should differentiate w.r.t. the variable itself.");
+}
+
+std::string graph_quantization_test::name() const {
+    return "graph_quantization_test";
+}
+
+void graph_quantization_test::run() const {
+    std::default_random_engine dre;
+
+    // a two-layer perceptron on a batch of 16 points
+    auto mgb = ml_graph_builder::empty();
+    variable w1 = mgb->add_variable("w1", { 32, 64 }), w2 = mgb->add_variable("w2", { 10, 32 });
+    variable x = mgb->add_variable("x", { 64, 16 });
+    operation h = mgb->sigmoid(mgb->chain_multiplication(w1, x, 1));
+    operation y = mgb->softmax(mgb->chain_multiplication(w2, h, 1), 0);
+    graph_cuptr g = mgb->build_graph();
+
+    tensor_cptr w1v = generate_random_tensor( { 32, 64 }, dre), w2v = generate_random_tensor( { 10, 32 }, dre);
+    std::vector<tensor_cptr_vec> calibration_inputs;
+    for (int i = 0; i < 4; ++i)
+        calibration_inputs.push_back(g->create_variable_values( { { w1, w1v }, { w2, w2v }, { x,
+                generate_random_tensor( { 64, 16 }, dre) } }));
+
+    quantization_report report;
+    graph_cuptr qg = quantize(*g, { w1, w2 }, calibration_inputs, { y }, report);
+    assert(report.num_quantized_operations == 2, "quantize should replace both dense layers, replaced ",
+            report.num_quantized_operations);
+    assert(qg->num_variables() == g->num_variables() && qg->num_operations() == g->num_operations(),
+            "quantize should keep the variables and operations of the graph.");
+    assert(report.relative_error > 0 && report.relative_error < 0.02,
+            "quantize should report a small relative error, found ", report.relative_error);
+    assert(report.reference_seconds > 0 && report.quantized_seconds > 0 && report.speedup() > 0,
+            "quantize should report the times taken by both graphs.");
+
+    // the quantized graph works on new inputs, without the weights
+    tensor_cptr xv = generate_random_tensor( { 64, 16 }, dre);
+    operation qy = qg->get_operation(g->get_operation_name(y));
+    tensor reference = *g->value(y, g->create_variable_values( { { w1, w1v }, { w2, w2v }, { x, xv } }));
+    tensor quantized = *qg->value(qy, qg->create_variable_values( { { x, xv } }));
+    for (std::size_t i = 0; i < reference.size(); ++i)
+        assert(std::abs(quantized[i] - reference[i]) < 0.01, "quantized graph should approximate the original graph.");
+    assert(is_failing([&]() {qg->partial_gradient(qy, { x }, qg->create_variable_values( { { x, xv } }));}),
+            "quantized graph should be for inference only.");
+
+    // weights are compared by value, not by identity
+    std::vector<tensor_cptr_vec> copied_weights(calibration_inputs);
+    copied_weights[1][w1.index] = tensor_cptr(new tensor(*w1v));
+    assert(quantize(*g, { w1, w2 }, copied_weights, { y }, report)->num_operations() == g->num_operations(),
+            "quantize should accept copies of the same weights.");
+    assert(is_failing([&]() {
+        std::vector<tensor_cptr_vec> different_weights(calibration_inputs);
+        different_weights[1][w1.index] = generate_random_tensor( { 32, 64 }, dre);
+        quantize(*g, { w1, w2 }, different_weights, { y }, report);
+    }), "quantize should reject calibration inputs with different weights.");
+}
+
+std::string graph_scan_test::name() const {
+    return "graph_scan_test";
+}
+
+void graph_scan_test::run() const {
+    std::default_random_engine dre;
+    const std::size_t steps = 7, size = 3;
+
+    // the recurrent cell h' = sigmoid(w h + x)
+    auto cell = ml_graph_builder::empty();
+    variable h = cell->add_variable("h", { size }), x = cell->add_variable("x", { size });
+    variable w = cell->add_variable("w", { size, size });
+    operation h_next = cell->sigmoid(cell->add(cell->chain_multiplication(w, h, 1), x));
+    graph_csptr body(cell->build_graph());
+
+    // the same recurrence, unrolled
+    auto unrolled = ml_graph_builder::empty();
+    variable uh0 = unrolled->add_variable("h0", { size }), uw = unrolled->add_variable("w", { size, size });
+    std::vector<variable> uxs;
+    std::vector<node> uhs;
+    node uh = uh0;
+    for (std::size_t t = 0; t < steps; ++t) {
+        uxs.push_back(unrolled->add_variable("x" + std::to_string(t), { size }));
+        uh = unrolled->sigmoid(unrolled->add(unrolled->chain_multiplication(uw, uh, 1), uxs.back()));
+        uhs.push_back(uh);
+    }
+    graph_cuptr ug = unrolled->build_graph();
+
+    // the recurrence as scans over a sequence {steps, size}, retaining every third state or all of them
+    auto mgb = ml_graph_builder::empty();
+    variable h0 = mgb->add_variable("h0", { size }), xs = mgb->add_variable("xs", { steps, size });
+    variable sw = mgb->add_variable("w", { size, size });
+    operation last = mgb->add_scan("rnn", scan_body { body, { h }, { x }, { w }, { h_next }, h_next, false, 0, 3 },
+            { h0 }, { xs }, { sw });
+    operation all = mgb->add_scan("rnn_stacked", scan_body { body, { h }, { x }, { w }, { h_next }, h_next, true, 0,
+            1 }, { h0 }, { xs }, { sw });
+    graph_cuptr g = mgb->build_graph();
+    assert(g->num_operations() == 2, "scan should not unroll its body.");
+    assert(g->get_dimensionalities(all) == tensor::N_vector( { steps, size }),
+            "scan should infer the dimensionalities of stacked outputs.");
+
+    tensor_cptr h0_value = generate_random_tensor( { size }, dre), w_value = generate_random_tensor( { size, size },
+            dre), xs_value = generate_random_tensor( { steps, size }, dre);
+    tensor_cptr_vec inputs = g->create_variable_values( { { h0, h0_value }, { xs, xs_value }, { sw, w_value } });
+    graph_input_map unrolled_inputs { { uh0, h0_value }, { uw, w_value } };
+    for (std::size_t t = 0; t < steps; ++t)
+        unrolled_inputs[uxs[t]] = tensor_cptr(new tensor( { size }, std::vector<double>(&(*xs_value)[t * size],
+                &(*xs_value)[(t + 1) * size])));
+    tensor_cptr_vec uinputs = ug->create_variable_values(unrolled_inputs);
+
+    // values
+    assert_tensors_are_close(*g->value(last, inputs), *ug->value(uh, uinputs), 1e-14,
+            "scan should compute the last state of the recurrence.");
+    tensor_cptr stacked = g->value(all, inputs);
+    for (std::size_t t = 0; t < steps; ++t)
+        assert_tensors_are_close(tensor( { size }, std::vector<double>(&(*stacked)[t * size],
+                &(*stacked)[(t + 1) * size])), *ug->value(uhs[t], uinputs), 1e-14,
+                "scan should stack the states of all the steps.");
+
+    // derivatives w.r.t. the initial state, the sequence and the weights
+    std::vector<variable> unrolled_moving { uh0, uw };
+    unrolled_moving.insert(unrolled_moving.end(), uxs.begin(), uxs.end());
+    derivative d = g->partial_gradient(last, { h0, xs, sw }, inputs);
+    derivative ud = ug->partial_gradient(uh, unrolled_moving, uinputs);
+    assert_tensors_are_close(*d.node_derivative[0], *ud.node_derivative[0], 1e-12,
+            "scan should differentiate w.r.t. the initial state.");
+    assert_tensors_are_close(*d.node_derivative[2], *ud.node_derivative[1], 1e-12,
+            "scan should differentiate w.r.t. the constants.");
+    for (std::size_t t = 0; t < steps; ++t)
+        assert_tensors_are_close(tensor( { size, size }, std::vector<double>(&(*d.node_derivative[1])[t * size * size],
+                &(*d.node_derivative[1])[(t + 1) * size * size])), *ud.node_derivative[2 + t], 1e-12,
+                "scan should differentiate w.r.t. every step of the sequence.");
+    derivative d_all = g->partial_gradient(all, { h0 }, inputs);
+    for (std::size_t i = 0; i < size; ++i)
+        for (std::size_t e = 0; e < size; ++e)
+            assert_doubles_are_close((*d_all.node_derivative[0])[(i * steps + steps - 1) * size + e],
+                    (*d.node_derivative[0])[i * size + e], 1e-12,
+                    "scan should differentiate stacked outputs, whatever the checkpoint interval.");
+
+    assert(is_failing([&]() {scan(scan_body {body, {h}, {x}, {}, {h_next}, h_next, false, 0, 1});}),
+            "scan should check that every variable of the body is bound.");
+    assert(is_failing([&]() {scan(scan_body {body, {h}, {x}, {variable(3)}, {h_next}, h_next, false, 0, 1});}),
+            "scan should check that the variables bound are those of the body.");
+}
+
+std::string graph_conditional_test::name() const {
+    return "graph_conditional_test";
+}
+
+void graph_conditional_test::run() const {
+    std::default_random_engine dre;
+    const std::size_t size = 4;
+
+    // branch 0 computes sigmoid(a) and ignores b, branch 1 computes a + b
+    std::shared_ptr<counting_tensor_function> counted_sigmoid(
+            new counting_tensor_function(tensor_function_factory::sigmoid()));
+    std::shared_ptr<counting_tensor_function> counted_add(
+            new counting_tensor_function(tensor_function_factory::add()));
+    auto gb0 = graph_builder::empty();
+    variable a0 = gb0->add_variable("a", { size }), b0 = gb0->add_variable("b", { size });
+    operation s0 = gb0->add_operation("sigmoid", counted_sigmoid, { a0 });
+    graph_csptr branch0(gb0->build_graph());
+    auto gb1 = graph_builder::empty();
+    variable b1 = gb1->add_variable("b", { size }), a1 = gb1->add_variable("a", { size });
+    operation s1 = gb1->add_operation("add", counted_add, { a1, b1 });
+    graph_csptr branch1(gb1->build_graph());
+
+    auto gb = graph_builder::empty();
+    variable p = gb->add_variable("p", { 1 });
+    variable a = gb->add_variable("a", { size }), b = gb->add_variable("b", { size });
+    operation c = gb->add_conditional("select", p, { { branch0, { a0, b0 }, s0 }, { branch1, { a1, b1 }, s1 } },
+            { a, b });
+    graph_cuptr g = gb->build_graph();
+    assert(g->num_operations() == 1, "conditional should not inline its branches.");
+    assert(g->get_dimensionalities(c) == tensor::N_vector( { size }),
+            "conditional should infer the dimensionalities of its output.");
+
+    tensor_cptr a_value = generate_random_tensor( { size }, dre), b_value = generate_random_tensor( { size }, dre);
+    auto inputs_for = [&](double predicate) {
+        return g->create_variable_values( { { p, tensor_cptr(new tensor( { 1 }, { predicate })) }, { a, a_value }, {
+                b, b_value } });
+    };
+    tensor_cptr_vec inputs0 = inputs_for(0), inputs1 = inputs_for(1);
+    tensor_cptr_vec branch0_inputs = branch0->create_variable_values( { { a0, a_value }, { b0, b_value } });
+    tensor_cptr_vec branch1_inputs = branch1->create_variable_values( { { a1, a_value }, { b1, b_value } });
+
+    // values: only the taken branch is evaluated
+    assert_tensors_are_close(*g->value(c, inputs0), *branch0->value(s0, branch0_inputs), 1e-15,
+            "conditional should compute the first branch for a predicate of 0.");
+    assert_tensors_are_close(*g->value(c, inputs1), *branch1->value(s1, branch1_inputs), 1e-15,
+            "conditional should compute the second branch for a predicate of 1.");
+    *counted_sigmoid->num_calls = 0;
+    *counted_add->num_calls = 0;
+    g->value(c, inputs0);
+    assert(*counted_sigmoid->num_calls == 1 && *counted_add->num_calls == 0,
+            "conditional should not evaluate the branch not taken.");
+
+    // derivatives: those of the taken branch, and zero w.r.t. the predicate
+    derivative d0 = g->partial_gradient(c, { p, a, b }, inputs0);
+    derivative e0 = branch0->partial_gradient(s0, { a0, b0 }, branch0_inputs);
+    assert(*counted_add->num_calls == 0, "conditional should not differentiate the branch not taken.");
+    derivative d1 = g->partial_gradient(c, { p, a, b }, inputs1);
+    derivative e1 = branch1->partial_gradient(s1, { a1, b1 }, branch1_inputs);
+    for (std::size_t i = 0; i < 2; ++i) {
+        assert_tensors_are_close(*d0.node_derivative[i + 1], *e0.node_derivative[i], 1e-15,
+                "conditional should differentiate the first branch.");
+        assert_tensors_are_close(*d1.node_derivative[i + 1], *e1.node_derivative[i], 1e-15,
+                "conditional should differentiate the second branch.");
+    }
+    assert_tensors_are_close(*d1.node_derivative[0], tensor::zero_derivative( { size }, { 1 }), 0,
+            "conditional should have a zero derivative w.r.t. its predicate.");
+
+    assert(is_failing([&]() {g->value(c, inputs_for(2));}), "conditional should reject out of range predicates.");
+    assert(is_failing([&]() {g->value(c, inputs_for(0.5));}), "conditional should reject fractional predicates.");
+    assert(is_failing([&]() {conditional( { { branch0, { a0 }, s0 } });}),
+            "conditional should check that every variable of a branch is bound.");
+    assert(is_failing([&]() {conditional( { { branch0, { a0, variable(2) }, s0 } });}),
+            "conditional should check that the variables bound are those of the branch.");
+
+    // the outputs of branches are compared even after a branch with unknown dimensionalities
+    auto gb2 = graph_builder::empty();
+    variable a2 = gb2->add_variable("a"), b2 = gb2->add_variable("b");
+    operation s2 = gb2->add_operation("add", tensor_function_factory::add(), { a2, b2 });
+    graph_csptr branch2(gb2->build_graph());
+    auto gb3 = graph_builder::empty();
+    variable a3 = gb3->add_variable("a", { size }), b3 = gb3->add_variable("b", { size });
+    operation s3 = gb3->add_operation("sum", tensor_function_factory::reduce_sum({ 0 }), { a3 });
+    graph_csptr branch3(gb3->build_graph());
+    auto gb4 = graph_builder::empty();
+    variable p4 = gb4->add_variable("p", { 1 });
+    variable a4 = gb4->add_variable("a", { size }), b4 = gb4->add_variable("b", { size });
+    assert(is_failing([&]() {
+        gb4->add_conditional("select", p4, { { branch2, { a2, b2 }, s2 }, { branch0, { a0, b0 }, s0 }, { branch3, {
+                a3, b3 }, s3 } }, { a4, b4 });
+    }), "conditional should reject branches with outputs of different dimensionalities.");
+}
+
+std::string graph_derivative_wrt_input_test::name() const {
+    return "graph_derivative_wrt_input_test";
+}
+
+void graph_derivative_wrt_input_test::run() const {
+    // the sum of squares of its input, chaining derivatives directly, and counting the chained rows
+    struct sum_of_squares: tensor_function {
+        std::shared_ptr<std::size_t> chained_rows { new std::size_t(0) };
+        tensor_cptr value(const tensor_cptr_vec& tv) const override {
+            double result = 0;
+            for (double x : *tv[0])
+                result += x * x;
+            return tensor_cptr(new tensor( { 1 }, { result }));
+        }
+        derivative deriv(const tensor_cptr_vec& tv) const override {
+            tensor_cptr v = value(tv);
+            return derivative { v, { tensor_cptr(new tensor(derivative_wrt_input(tv, *v, 0))) } };
+        }
+        tensor derivative_wrt_input(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index) const
+                override {
+            tensor result(tensor::zero_derivative(value.dimensionalities, tv[0]->dimensionalities));
+            for (std::size_t i = 0; i < result.size(); ++i)
+                result[i] = 2 * (*tv[0])[i];
+            return result;
+        }
+        tensor chain_derivative(const tensor_cptr_vec& tv, const tensor& value, std::size_t input_index,
+                const tensor& U) const override {
+            const tensor& x = *tv[0];
+            const std::size_t rows = U.size() / x.size();
+            *chained_rows += rows;
+            tensor::N_vector rdims(U.dimensionalities.begin(), U.dimensionalities.end() - x.dimensionalities.size());
+            rdims.push_back(1);
+            tensor result(tensor::zero(rdims));
+            for (std::size_t row = 0; row < rows; ++row)
+                for (std::size_t i = 0; i < x.size(); ++i)
+                    result[row] += 2 * x[i] * U[row * x.size() + i];
+            return result;
+        }
+        bool prefers_chain_derivative() const override {
+            return true;
+        }
+    };
+    std::shared_ptr<sum_of_squares> f(new sum_of_squares());
+
+    // a large moving variable feeding the function directly is differentiated without chaining the identity
+    const std::size_t size = 1 << 14;
+    auto gb = graph_builder::empty();
+    variable x = gb->add_variable("x");
+    operation direct = gb->add_operation("direct", f, { x });
+    operation indirect = gb->add_operation("indirect", f, { gb->add_operation("neg",
+            tensor_function_factory::negative(), { x }) });
+    graph_cuptr g = gb->build_graph();
+    tensor_cptr_vec inputs(1, tensor_cptr(new tensor( { size }, std::vector<double>(size, 0.5))));
+    derivative d = g->partial_gradient(direct, { x }, inputs);
+    assert(*f->chained_rows == 0, "partial_gradient should not chain the identity for a direct moving variable.");
+    assert_tensors_are_close(*d.node_derivative[0], tensor( { size, 1 }, std::vector<double>(size, 1)), 0,
+            "partial_gradient should use derivative_wrt_input for a direct moving variable.");
+
+    // derivatives of operations are still chained
+    tensor_cptr_vec small_inputs(1, tensor_cptr(new tensor( { 3 }, { 1, 2, 3 })));
+    derivative di = g->partial_gradient(indirect, { x }, small_inputs);
+    assert(*f->chained_rows == 3, "partial_gradient should chain the derivatives of operations.");
+    assert_tensors_are_close(*di.node_derivative[0], tensor( { 3, 1 }, { 2, 4, 6 }), 1e-15,
+            "partial_gradient should chain the derivatives of operations correctly.");
+}
+
+std::string graph_gradient_graph_test::name() const {
+    return "graph_gradient_graph_test";
+}
+
+void graph_gradient_graph_test::run() const {
+    std::default_random_engine dre;
+
+    // a dense layer feeding a sum of squares, with w also used by a second path (through a sigmoid that chains
+    //   derivatives directly), and z not used by the output
+    auto mgb = ml_graph_builder::empty();
+    variable w = mgb->add_variable("w", { 3, 4 }), x = mgb->add_variable("x", { 4, 2 });
+    variable b = mgb->add_variable("b", { 3, 2 }), z = mgb->add_variable("z", { 3 });
+    operation h = mgb->sigmoid(mgb->add(mgb->chain_multiplication(w, x, 1), b));
+    operation y = mgb->add(mgb->reduce_sum(mgb->element_wise_multiplication(h, h), { 0, 1 }),
+            mgb->reduce_sum(mgb->log(mgb->add(mgb->element_wise_multiplication(w, w), mgb->sigmoid(w))), { 0, 1 }));
+    mgb->negative(z);
+    graph_cuptr g = mgb->build_graph();
+
+    symbolic_gradient sg = gradient_graph(*g, y, { w, x, b, z });
+    const graph& gg = *sg.built_graph;
+    assert(gg.num_variables() == g->num_variables(), "gradient_graph should keep the variables.");
+    assert(gg.get_dimensionalities(sg.gradients[0]) == tensor::N_vector( { 3, 4 }),
+            "gradient_graph should infer the dimensionalities of the gradients.");
+    assert(gg.get_operation_name(operation(sg.gradients[2].index)) == "d_" + g->get_operation_name(y) + "/d_b",
+            "gradient_graph should name the derivatives after their operation and variable.");
+    std::size_t num_packed = 0, num_identities = 0;
+    for (std::size_t i_op = 0; i_op < gg.num_operations(); ++i_op) {
+        const std::string op_name = gg.get_operation_name(operation(i_op));
+        num_packed += op_name == "d_" + g->get_operation_name(y) + "/d_inputs";
+        num_identities += op_name.find("d_w/d_w") != std::string::npos || op_name.find("d_x/d_x") != std::string::npos
+                || op_name.find("d_b/d_b") != std::string::npos;
+    }
+    assert(num_packed == 1, "gradient_graph should share the derivatives of an operation across moving variables.");
+    assert(num_identities == 0, "gradient_graph should not chain the identity derivative of moving variables.");
+
+    tensor_cptr_vec inputs = g->create_variable_values( { { w, generate_random_tensor( { 3, 4 }, dre) }, { x,
+            generate_random_tensor( { 4, 2 }, dre) }, { b, generate_random_tensor( { 3, 2 }, dre) }, { z,
+            generate_random_tensor( { 3 }, dre) } });
+    derivative expected = g->partial_gradient(y, { w, x, b, z }, inputs);
+    std::vector<node> outputs(sg.gradients);
+    outputs.push_back(sg.value);
+    tensor_cptr_vec values = gg.value(outputs, inputs);
+    assert_tensors_are_close(*values.back(), *expected.node_value, 1e-14,
+            "gradient_graph should compute the value of the output.");
+    for (std::size_t i = 0; i < sg.gradients.size(); ++i)
+        assert_tensors_are_close(*values[i], *expected.node_derivative[i], 1e-12,
+                "gradient_graph should compute the same derivatives as partial_gradient.");
+
+    // derivatives of a variable
+    symbolic_gradient sgv = gradient_graph(*g, x, { x, w });
+    tensor_cptr_vec variable_derivatives = sgv.built_graph->value(sgv.gradients, inputs);
+    assert_tensors_are_close(*variable_derivatives[0], tensor::identity_derivative( { 4, 2 }), 0,
+            "gradient_graph should give the identity as the derivative of a variable w.r.t. itself.");
+    assert_tensors_are_close(*variable_derivatives[1], tensor::zero_derivative( { 4, 2 }, { 3, 4 }), 0,
+            "gradient_graph should give zero as the derivative of a variable w.r.t. another.");
+    assert(is_failing([&]() {gg.partial_gradient(sg.gradients[0], { w }, inputs);}),
+            "the derivatives of a gradient graph should not be differentiable.");
+}
+
 } // end namespace graph
 } // end namespace para
 
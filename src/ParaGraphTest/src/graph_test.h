@@ -33,6 +33,76 @@ struct graph_tensor_test: unit_test {
     void run() const override;
 };
 
+struct graph_dimensionality_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_multiple_outputs_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_evaluation_session_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_checkpoint_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_concurrent_evaluation_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_value_batch_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_parallel_gradient_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_vmap_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_layout_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_quantization_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_scan_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_conditional_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_derivative_wrt_input_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct graph_gradient_graph_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
 } // end namespace graph
 } // end namespace para
 
@@ -63,6 +63,26 @@ std::string print_tensor(const tensor& t, const std::string& name) {
     return ss.str();
 }
 
+counting_tensor_function::counting_tensor_function(const tensor_function_csptr& v_function) :
+                function(v_function),
+                num_calls(new int(0)) {
+}
+
+tensor_cptr counting_tensor_function::value(const tensor_cptr_vec& tv) const {
+    ++*num_calls;
+    return function->value(tv);
+}
+
+derivative counting_tensor_function::deriv(const tensor_cptr_vec& tv) const {
+    ++*num_calls;
+    return function->deriv(tv);
+}
+
+bool counting_tensor_function::infer_dimensionalities(const std::vector<tensor::N_vector>& input_dimensionalities,
+        tensor::N_vector& output_dimensionalities) const {
+    return function->infer_dimensionalities(input_dimensionalities, output_dimensionalities);
+}
+
 } // end namespace graph
 } // end namespace para
 
@@ -17,7 +17,7 @@
 #ifndef PARA_GRAPH_GRAPH_TEST_UTILS_H_
 #define PARA_GRAPH_GRAPH_TEST_UTILS_H_
 
-#include <para/graph/math.h>
+#include <para/graph/graph.h>
 #include <random>
 
 namespace para {
@@ -30,6 +30,20 @@ tensor_cptr generate_random_tensor(const tensor::N_vector& dims, std::default_ra
 
 std::string print_tensor(const tensor& t, const std::string& name);
 
+/**
+ * A tensor_function that forwards to another one,
+ *   counting how many times its value and deriv have been invoked.
+ */
+struct counting_tensor_function: tensor_function {
+    tensor_function_csptr function;
+    std::shared_ptr<int> num_calls;
+    counting_tensor_function(const tensor_function_csptr& function);
+    tensor_cptr value(const tensor_cptr_vec& tv) const override;
+    derivative deriv(const tensor_cptr_vec& tv) const override;
+    bool infer_dimensionalities(const std::vector<tensor::N_vector>& input_dimensionalities,
+            tensor::N_vector& output_dimensionalities) const override;
+};
+
 } // end namespace graph
 } // end namespace para
 
@@ -40,15 +40,45 @@ int main(int argc, char** argv) {
     register_test<tensor_chain_multiplication_test>(uts);
     register_test<tensor_add_test>(uts);
     register_test<tensor_iterator_test>(uts);
+    register_test<tensor_layout_test>(uts);
+    register_test<sparse_tensor_test>(uts);
     register_test<graph_scalar_test>(uts);
     register_test<graph_tensor_test>(uts);
+    register_test<graph_dimensionality_test>(uts);
+    register_test<graph_multiple_outputs_test>(uts);
+    register_test<graph_evaluation_session_test>(uts);
+    register_test<graph_checkpoint_test>(uts);
+    register_test<graph_concurrent_evaluation_test>(uts);
+    register_test<graph_value_batch_test>(uts);
+    register_test<graph_parallel_gradient_test>(uts);
+    register_test<graph_vmap_test>(uts);
+    register_test<graph_layout_test>(uts);
+    register_test<graph_quantization_test>(uts);
+    register_test<graph_scan_test>(uts);
+    register_test<graph_conditional_test>(uts);
+    register_test<graph_derivative_wrt_input_test>(uts);
+    register_test<graph_gradient_graph_test>(uts);
     register_test<tensor_function_factory_add_test>(uts);
     register_test<tensor_function_factory_chain_multiplication_test>(uts);
     register_test<tensor_function_factory_sigmoid_test>(uts);
     register_test<tensor_function_factory_reduce_sum_test>(uts);
+    register_test<tensor_function_factory_reduce_test>(uts);
     register_test<tensor_function_factory_log_test>(uts);
     register_test<tensor_function_factory_element_wise_multiplication_test>(uts);
     register_test<tensor_function_factory_negative_test>(uts);
+    register_test<tensor_function_factory_softmax_test>(uts);
+    register_test<tensor_function_factory_softmax_cross_entropy_test>(uts);
+    register_test<tensor_function_factory_linear_softmax_cross_entropy_test>(uts);
+    register_test<tensor_function_factory_conv2d_test>(uts);
+    register_test<tensor_function_factory_pool_test>(uts);
+    register_test<tensor_function_factory_gather_test>(uts);
+    register_test<tensor_function_factory_sparse_chain_multiplication_test>(uts);
+    register_test<tensor_function_factory_quantize_test>(uts);
+    register_test<tensor_function_factory_activation_test>(uts);
+    register_test<tensor_function_factory_attention_test>(uts);
+    register_test<tensor_function_factory_normalization_test>(uts);
+    register_test<tensor_function_factory_einsum_test>(uts);
+    register_test<tensor_function_factory_random_test>(uts);
     register_test<ml_graph_builder_test>(uts);
     run_unit_tests(uts);
     return 0;
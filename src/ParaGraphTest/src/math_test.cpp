@@ -18,7 +18,10 @@
 #include "math_test.h"
 #include <para/graph/math.h>
 #include <para/graph/exception.h>
+#include <para/graph/parallel.h>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <random>
 
 namespace para {
@@ -252,6 +255,147 @@ void tensor_iterator_test::run() const {
 	testIterators(t.cbegin(), t.cend(), t);
 }
 
+std::string tensor_layout_test::name() const {
+	return "tensor_layout_test";
+}
+
+void tensor_layout_test::run() const {
+	std::default_random_engine dre;
+	std::uniform_real_distribution<double> urd(-1, 1);
+	auto random_tensor = [&](const tensor::N_vector& dims) {
+		tensor t = tensor::zero(dims);
+		std::for_each(t.begin(), t.end(), [&](double& d) {d = urd(dre);});
+		return t;
+	};
+
+	// a 2x3x4 tensor stored column-major has its first axis contiguous
+	tensor r = random_tensor(tensor::N_vector { 2, 3, 4 });
+	tensor c = tensor::to_layout(r, tensor_layout::column_major);
+	assert(c.layout == tensor_layout::column_major && c.dimensionalities == r.dimensionalities,
+			"tensor::to_layout must set the layout and keep the dimensionalities.");
+	assert(c.compute_offset(tensor::N_vector { 1, 2, 3 }) == 1 + 2 * 2 + 3 * 6,
+			"tensor::compute_offset must respect the layout.");
+	assert(c.compute_position(23) == tensor::N_vector { 1, 2, 3 }, "tensor::compute_position must respect the layout.");
+	for (std::size_t offset = 0; offset < r.size(); ++offset)
+		assert(c[c.compute_offset(r.compute_position(offset))] == r[offset],
+				"tensor::to_layout must keep the value at every position.");
+	tensor rr = tensor::to_layout(c, tensor_layout::row_major);
+	assert(std::equal(rr.begin(), rr.end(), r.begin()), "tensor::to_layout must round trip.");
+
+	// column-major operands are either read in place (matrices) or repacked (higher orders)
+	auto check_chain_multiplication = [&](const tensor& lhs, const tensor& rhs, int ncd) {
+		tensor expected = tensor::chain_multiplication(lhs, rhs, ncd);
+		for (tensor_layout ll : { tensor_layout::row_major, tensor_layout::column_major })
+			for (tensor_layout rl : { tensor_layout::row_major, tensor_layout::column_major }) {
+				tensor actual = tensor::chain_multiplication(tensor::to_layout(lhs, ll), tensor::to_layout(rhs, rl), ncd);
+				assert(actual.layout == tensor_layout::row_major && actual.dimensionalities == expected.dimensionalities,
+						"tensor::chain_multiplication must return a row-major tensor.");
+				for (std::size_t i = 0; i < expected.size(); ++i)
+					assert_doubles_are_close(actual[i], expected[i], 1e-12,
+							"tensor::chain_multiplication must not depend on the layouts of its operands.");
+			}
+	};
+	check_chain_multiplication(random_tensor(tensor::N_vector { 4, 3 }), random_tensor(tensor::N_vector { 3, 5 }), 1);
+	check_chain_multiplication(random_tensor(tensor::N_vector { 4 }), random_tensor(tensor::N_vector { 4, 5 }), 1);
+	check_chain_multiplication(random_tensor(tensor::N_vector { 4, 3 }), random_tensor(tensor::N_vector { 5 }), 0);
+	check_chain_multiplication(random_tensor(tensor::N_vector { 2, 4, 3 }), random_tensor(tensor::N_vector { 4, 3, 2 }),
+			2);
+
+	// zeros times infinities are NaNs, whatever the layouts
+	const double inf = std::numeric_limits<double>::infinity();
+	tensor zeros(tensor::N_vector { 2, 2 }, std::vector<double> { 0, 1, 1, 1 });
+	tensor infinities(tensor::N_vector { 2, 2 }, std::vector<double> { inf, 1, 1, 1 });
+	for (tensor_layout ll : { tensor_layout::row_major, tensor_layout::column_major })
+		for (tensor_layout rl : { tensor_layout::row_major, tensor_layout::column_major }) {
+			tensor product = tensor::chain_multiplication(tensor::to_layout(zeros, ll), tensor::to_layout(infinities,
+					rl), 1);
+			assert(std::isnan(product[0]) && product[1] == 1 && product[2] == inf && product[3] == 2,
+					"tensor::chain_multiplication must propagate infinities and NaNs through zeros.");
+		}
+
+	assert(is_failing([&]() {tensor::add(r, c);}), "tensor::add must reject mismatching layouts.");
+	tensor sum = tensor::add(c, c);
+	assert(sum.layout == tensor_layout::column_major && sum[5] == 2 * c[5], "tensor::add must keep the layout.");
+}
+
+std::string sparse_tensor_test::name() const {
+	return "sparse_tensor_test";
+}
+
+void sparse_tensor_test::run() const {
+	std::default_random_engine dre;
+	std::uniform_real_distribution<double> urd(-1, 1);
+	// a dense tensor of the given dimensionalities, with about one value in every "sparsity" being non-zero
+	auto random_sparse_tensor = [&](const tensor::N_vector& dims, int sparsity) {
+		std::uniform_int_distribution<int> uid(0, sparsity - 1);
+		tensor t = tensor::zero(dims);
+		std::for_each(t.begin(), t.end(), [&](double& d) {d = uid(dre) == 0 ? urd(dre) : 0;});
+		return t;
+	};
+
+	// formats
+	sparse_tensor coo = sparse_tensor::from_coo( { 2, 3 }, { { 1, 2 }, { 0, 1 }, { 1, 2 }, { 1, 0 } },
+			{ 1, 2, 3, 4 });
+	assert(coo.offsets == std::vector<std::size_t> { 1, 3, 5 } && coo.values == std::vector<double> { 2, 4, 4 },
+			"sparse_tensor::from_coo must sort the values and sum repeated positions.");
+	assert(coo.row_pointers(1) == std::vector<std::size_t> { 0, 1, 3 },
+			"sparse_tensor::row_pointers must give the CSR row pointers.");
+	assert(coo.row_pointers(0) == std::vector<std::size_t> { 0, 3 } && coo.row_pointers(2).size() == 7,
+			"sparse_tensor::row_pointers must work for any number of row axes.");
+	tensor dense = random_sparse_tensor( { 3, 4, 5 }, 4);
+	sparse_tensor s = sparse_tensor::from_dense(dense);
+	assert(s.nnz() == static_cast<std::size_t>(std::count_if(dense.begin(), dense.end(), [](double d) {return d != 0;})),
+			"sparse_tensor::from_dense must keep the non-zero values only.");
+	tensor round_trip = s.to_dense();
+	assert(std::equal(round_trip.begin(), round_trip.end(), dense.begin()), "sparse_tensor::to_dense must round trip.");
+	sparse_tensor from_tensors = sparse_tensor::from_tensors(s.dimensionalities, s.offset_tensor(), s.value_tensor());
+	assert(from_tensors.offsets == s.offsets && from_tensors.values == s.values,
+			"sparse_tensor::from_tensors must round trip.");
+	assert(is_failing([]() {sparse_tensor( { 2 }, { 1, 0 }, { 1, 1 });}),
+			"sparse_tensor must reject unsorted offsets.");
+	assert(is_failing([]() {sparse_tensor( { 2 }, { 2 }, { 1 });}), "sparse_tensor must reject offsets out of range.");
+
+	// sparse x dense and dense x sparse, matching the dense chain multiplication
+	auto check = [&](const tensor& lhs, const tensor& rhs, int ncd, bool sparse_lhs) {
+		tensor expected = tensor::chain_multiplication(lhs, rhs, ncd);
+		tensor actual = sparse_lhs ?
+				sparse_tensor::chain_multiplication(sparse_tensor::from_dense(lhs), rhs, ncd) :
+				sparse_tensor::chain_multiplication(lhs, sparse_tensor::from_dense(rhs), ncd);
+		assert(actual.dimensionalities == expected.dimensionalities,
+				"sparse_tensor::chain_multiplication must return correct dimensionalities.");
+		for (std::size_t i = 0; i < expected.size(); ++i)
+			assert_doubles_are_close(actual[i], expected[i], 1e-12,
+					"sparse_tensor::chain_multiplication must match the dense chain multiplication.");
+	};
+	for (int ncd : { 0, 1, 2 }) {
+		tensor::N_vector rdims(dense.dimensionalities.end() - ncd, dense.dimensionalities.end());
+		rdims.push_back(2);
+		tensor::N_vector ldims { 2 };
+		ldims.insert(ldims.end(), dense.dimensionalities.begin(), dense.dimensionalities.begin() + ncd);
+		check(dense, random_sparse_tensor(rdims, 1), ncd, true);
+		check(random_sparse_tensor(ldims, 1), dense, ncd, false);
+	}
+	// a dense zero times a stored infinity is a NaN
+	const double inf = std::numeric_limits<double>::infinity();
+	tensor zeros(tensor::N_vector { 2 }, std::vector<double> { 0, 1 });
+	tensor infinities = sparse_tensor::chain_multiplication(zeros,
+			sparse_tensor::from_coo( { 2, 2 }, { { 0, 0 }, { 1, 1 } }, { inf, 1 }), 1);
+	assert(std::isnan(infinities[0]) && infinities[1] == 1,
+			"sparse_tensor::chain_multiplication must propagate infinities through dense zeros.");
+	// large enough to be multi-threaded, and the same as with a single thread
+	tensor big = random_sparse_tensor( { 300, 1000 }, 50);
+	tensor big_dense = random_sparse_tensor( { 1000, 40 }, 1);
+	check(big, big_dense, 1, true);
+	check(tensor::to_layout(random_sparse_tensor( { 20, 300 }, 1), tensor_layout::column_major), big, 1, false);
+	tensor threaded = sparse_tensor::chain_multiplication(sparse_tensor::from_dense(big), big_dense, 1);
+	std::size_t num_threads = get_num_threads();
+	set_num_threads(1);
+	tensor serial = sparse_tensor::chain_multiplication(sparse_tensor::from_dense(big), big_dense, 1);
+	set_num_threads(num_threads);
+	assert(std::equal(threaded.begin(), threaded.end(), serial.begin()),
+			"sparse_tensor::chain_multiplication must not depend on the number of threads.");
+}
+
 } // end namespace graph
 } // end namespace para
 
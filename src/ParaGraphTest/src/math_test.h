@@ -62,6 +62,16 @@ struct tensor_iterator_test: unit_test {
 	void run() const override;
 };
 
+struct tensor_layout_test: unit_test {
+	std::string name() const override;
+	void run() const override;
+};
+
+struct sparse_tensor_test: unit_test {
+	std::string name() const override;
+	void run() const override;
+};
+
 } // end namespace graph
 } // end namespace para
 
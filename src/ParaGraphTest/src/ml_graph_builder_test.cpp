@@ -99,18 +99,35 @@ void ml_graph_builder_test::run() const {
     auto const c = mgbu->add_variable("c");
     auto const p = mgbu->softmax(wxpb);
     auto const j = mgbu->negative(
-            mgbu->reduce_sum(mgbu->reduce_sum(mgbu->element_wise_multiplication(c, mgbu->log(p)), 0), 0));
+            mgbu->reduce_sum(mgbu->reduce_sum(mgbu->element_wise_multiplication(c, mgbu->log(p)), { 0 }), { 0 }));
 
     auto const c_val = generate_random_tensor( { num_classes, num_points }, dre);
     auto const p_val = tensor_function_factory::log()->value( { tensor_cptr(new tensor(wxpb_val)) });
     auto const j_val = tensor_function_factory::negative()->value(
-            { tensor_function_factory::reduce_sum(0)->value( { tensor_function_factory::reduce_sum(0)->value( {
+            { tensor_function_factory::reduce_sum({ 0 })->value( { tensor_function_factory::reduce_sum({ 0 })->value( {
                     tensor_function_factory::element_wise_multiplication()->value( { c_val,
                             tensor_function_factory::log()->value( { p_val }) }) }) }) });
 
     graph_input_map wxbc_input_map { { w, w_val }, { x, x_val }, { b, b_val }, { c, c_val } };
     test_graph(mgbu->build_graph(), wxbc_input_map, j, *j_val, dre, "J");
 
+// test the fused softmax cross entropy against the same loss composed of separate operations
+    auto const j_composed = mgbu->negative(
+            mgbu->reduce_sum(
+                    mgbu->reduce_sum(mgbu->element_wise_multiplication(c, mgbu->log(mgbu->softmax(wxpb, 0))), { 0 }),
+                    { 0 }));
+    auto const j_fused = mgbu->softmax_cross_entropy(wxpb, c, 0);
+    auto const g = mgbu->build_graph();
+    auto const wxbc_input_vec = g->create_variable_values(wxbc_input_map);
+    auto const composed_gradient = g->partial_gradient(j_composed, { w, b, c }, wxbc_input_vec);
+    auto const fused_gradient = g->partial_gradient(j_fused, { w, b, c }, wxbc_input_vec);
+    assert_tensors_are_close(*fused_gradient.node_value, *composed_gradient.node_value, 1e-12,
+            "fused softmax cross entropy should match the composed loss.");
+    for (std::size_t i_mv = 0; i_mv < 3; ++i_mv)
+        assert_tensors_are_close(*fused_gradient.node_derivative[i_mv], *composed_gradient.node_derivative[i_mv], 1e-10,
+                "gradient of fused softmax cross entropy should match the composed loss.");
+    test_graph(mgbu->build_graph(), wxbc_input_map, j_fused, *composed_gradient.node_value, dre, "J_fused");
+
 }
 
 } // end namespace graph
@@ -19,9 +19,13 @@
 
 #include <para/graph/ml_graph.h>
 #include <para/graph/exception.h>
+#include <para/graph/parallel.h>
 #include <random>
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
 
 namespace {
 using namespace para::graph;
@@ -41,6 +45,15 @@ void test_function(const char* name, const tensor_function_csptr& func, const te
             std::string("node_value from derivative of function ") + name + " should match expected value.");
     assert(d.node_derivative.size() == inputs.size(), "node_derivative of function ", name, " has size ",
             d.node_derivative.size(), " expected ", inputs.size());
+    std::vector<tensor::N_vector> input_dims;
+    for (const auto& input : inputs)
+        input_dims.push_back(input->dimensionalities);
+    tensor::N_vector inferred_dims;
+    assert(func->infer_dimensionalities(input_dims, inferred_dims), "function ", name,
+            " should be able to infer its dimensionalities.");
+    assert(inferred_dims == expected_value.dimensionalities, "inferred dimensionalities of function ", name,
+            " should match dimensionalities of expected value.");
+    assert(func->flop_count(input_dims) > 0, "function ", name, " should estimate a positive flop count.");
     tensor_cptr_vec bumped_inputs = inputs;
     for (std::size_t i_input = 0; i_input < inputs.size(); ++i_input) {
         const tensor& input = *inputs[i_input];
@@ -61,8 +74,60 @@ void test_function(const char* name, const tensor_function_csptr& func, const te
 
         assert_tensors_are_close(*bumped_value, projected_bumped_value, derivative_tolerance,
                 std::string("derivative for function ") + name + " failed to project");
+
+        // chaining a derivative w.r.t. some X of dimensionalities (2) through the function
+        tensor::N_vector x_dims { 2 };
+        x_dims.insert(x_dims.end(), input.dimensionalities.begin(), input.dimensionalities.end());
+        tensor_cptr input_derivative = generate_random_tensor(x_dims, dre);
+        assert_tensors_are_close(func->chain_derivative(inputs, *v, i_input, *input_derivative),
+                tensor::chain_multiplication(*input_derivative, d_wrt_input, input.dimensionalities.size()),
+                derivative_tolerance, std::string("chain_derivative of function ") + name + " failed to match deriv");
     }
 }
+/**
+ * Reference einsum, looping over all combinations of labels.
+ * Subscripts must be explicit, i.e., contain "->".
+ */
+tensor brute_force_einsum(const std::string& subscripts, const tensor_cptr_vec& inputs) {
+    std::vector<std::string> operands(1);
+    std::string::size_type arrow = subscripts.find("->");
+    for (char c : subscripts.substr(0, arrow)) {
+        if (c == ',')
+            operands.push_back("");
+        else
+            operands.back().push_back(c);
+    }
+    std::string output = subscripts.substr(arrow + 2);
+    std::map<char, tensor::N> sizes;
+    for (std::size_t i = 0; i < inputs.size(); ++i)
+        for (std::size_t d = 0; d < operands[i].size(); ++d)
+            sizes[operands[i][d]] = inputs[i]->dimensionalities[d];
+    tensor::N_vector odims;
+    for (char c : output)
+        odims.push_back(sizes[c]);
+    tensor result(std::move(tensor::zero(odims)));
+    std::vector<char> labels;
+    tensor::N_vector label_sizes;
+    for (auto kv : sizes) {
+        labels.push_back(kv.first);
+        label_sizes.push_back(kv.second);
+    }
+    tensor counter(std::move(tensor::zero(label_sizes)));
+    for (std::size_t offset = 0; offset < counter.size(); ++offset) {
+        tensor::N_vector position = counter.compute_position(offset);
+        auto label_position = [&](const std::string& subs) {
+            tensor::N_vector result;
+            for (char c : subs)
+                result.push_back(position[std::find(labels.begin(), labels.end(), c) - labels.begin()]);
+            return result;
+        };
+        double product = 1;
+        for (std::size_t i = 0; i < inputs.size(); ++i)
+            product *= inputs[i]->at(inputs[i]->compute_offset(label_position(operands[i])));
+        result[result.compute_offset(label_position(output))] += product;
+    }
+    return result;
+}
 } // end anonymous namespace
 
 namespace para {
@@ -135,7 +200,113 @@ void tensor_function_factory_reduce_sum_test::run() const {
             }
         }
     }
-    test_function("reduce_sum", tensor_function_factory::reduce_sum(1), tensor_cptr_vec { t_in }, t_out, dre);
+    test_function("reduce_sum", tensor_function_factory::reduce_sum({ 1 }), tensor_cptr_vec { t_in }, t_out, dre);
+}
+
+std::string tensor_function_factory_reduce_test::name() const {
+    return "tensor_function_factory_reduce_test";
+}
+
+void tensor_function_factory_reduce_test::run() const {
+    typedef tensor_function_factory::reduction_type reduction_type;
+    // reference reduction, combining the input values of every output position in order
+    auto brute_force_reduce = [](const tensor& t, reduction_type type, const std::vector<int>& axes) {
+        std::vector<bool> reduced(t.dimensionalities.size(), axes.empty());
+        for (int axis : axes)
+            reduced[axis] = true;
+        std::map<tensor::N_vector, std::vector<double>> groups;
+        tensor::N_vector odims;
+        for (std::size_t axis = 0; axis < reduced.size(); ++axis)
+            if (!reduced[axis])
+                odims.push_back(t.dimensionalities[axis]);
+        for (std::size_t i = 0; i < t.size(); ++i) {
+            tensor::N_vector position = t.compute_position(i), oposition;
+            for (std::size_t axis = 0; axis < reduced.size(); ++axis)
+                if (!reduced[axis])
+                    oposition.push_back(position[axis]);
+            groups[oposition].push_back(t[i]);
+        }
+        tensor result(tensor::zero(odims));
+        for (const auto& group : groups) {
+            const std::vector<double>& g = group.second;
+            double& r = result[result.compute_offset(group.first)];
+            double max = *std::max_element(g.begin(), g.end());
+            switch (type) {
+            case reduction_type::sum:
+                r = std::accumulate(g.begin(), g.end(), 0.0);
+                break;
+            case reduction_type::mean:
+                r = std::accumulate(g.begin(), g.end(), 0.0) / g.size();
+                break;
+            case reduction_type::max:
+                r = max;
+                break;
+            case reduction_type::min:
+                r = *std::min_element(g.begin(), g.end());
+                break;
+            case reduction_type::log_sum_exp:
+                for (double v : g)
+                    r += std::exp(v - max);
+                r = max + std::log(r);
+                break;
+            }
+        }
+        return result;
+    };
+
+    auto t = generate_random_tensor( { 3, 4, 5 }, dre);
+    std::vector<std::vector<int>> axis_sets { { 1 }, { 0, 2 }, { 2, 0 }, { 1, 2 }, { 0, 1, 2 }, { } };
+    for (reduction_type type : { reduction_type::sum, reduction_type::mean, reduction_type::max, reduction_type::min,
+            reduction_type::log_sum_exp })
+        for (const auto& axes : axis_sets)
+            test_function("reduce", tensor_function_factory::reduce(type, axes), { t },
+                    brute_force_reduce(*t, type, axes), dre);
+
+    // large inputs are reduced in parallel
+    const std::size_t original_num_threads = get_num_threads();
+    auto large = generate_random_tensor( { 256, 300 }, dre);
+    for (reduction_type type : { reduction_type::sum, reduction_type::max, reduction_type::log_sum_exp }) {
+        set_num_threads(1);
+        tensor_cptr serial = tensor_function_factory::reduce(type, { 1 })->value( { large });
+        set_num_threads(4);
+        tensor_cptr parallel = tensor_function_factory::reduce(type, { 1 })->value( { large });
+        assert_tensors_are_close(*parallel, *serial, 1e-12, "parallel reduction should match serial reduction.");
+        assert_tensors_are_close(*parallel, brute_force_reduce(*large, type, { 1 }), 1e-12,
+                "parallel reduction should match the reference.");
+    }
+    set_num_threads(original_num_threads);
+
+    // the gradient of a reduction of a large variable is scattered directly,
+    //   the identity derivative of the variable alone would take 2^32 values
+    auto mgb = ml_graph_builder::empty();
+    variable v = mgb->add_variable("v");
+    operation m = mgb->reduce(v, reduction_type::max, { });
+    graph_cuptr g = mgb->build_graph();
+    tensor_cptr v_value = generate_random_tensor( { 256, 256 }, dre);
+    derivative d = g->partial_gradient(m, { v }, g->create_variable_values( { { v, v_value } }));
+    std::size_t argmax = 0;
+    for (std::size_t i = 1; i < v_value->size(); ++i)
+        argmax = (*v_value)[i] > (*v_value)[argmax] ? i : argmax;
+    tensor expected_gradient(tensor::zero( { 256, 256 }));
+    expected_gradient[argmax] = 1;
+    assert_tensors_are_close(*d.node_derivative[0], expected_gradient, 1e-15,
+            "the gradient of the maximum of a large variable should pick the maximum.");
+
+    // braced lists of axes reach reduce_sum as axes, the empty one reducing all of them
+    auto sgb = ml_graph_builder::empty();
+    variable s = sgb->add_variable("s");
+    operation s_all = sgb->reduce_sum(s, { }), s_1 = sgb->reduce_sum(s, { 1 });
+    graph_cuptr sg = sgb->build_graph();
+    tensor_cptr_vec s_values = sg->value(std::vector<node> { s_all, s_1 }, sg->create_variable_values( { { s, t } }));
+    assert_tensors_are_close(*s_values[0], brute_force_reduce(*t, reduction_type::sum, { }), 1e-12,
+            "reduce_sum with no axes should reduce all the axes.");
+    assert_tensors_are_close(*s_values[1], brute_force_reduce(*t, reduction_type::sum, { 1 }), 1e-12,
+            "reduce_sum with a single axis should reduce that axis.");
+
+    assert(is_failing([&]() {tensor_function_factory::reduce(reduction_type::sum, { 1, 1 })->value( {t});}),
+            "reduce should reject repeated axes.");
+    assert(is_failing([&]() {tensor_function_factory::reduce(reduction_type::sum, { 3 })->value( {t});}),
+            "reduce should reject axes beyond the order of its input.");
 }
 
 std::string tensor_function_factory_log_test::name() const {
@@ -181,17 +352,868 @@ std::string tensor_function_factory_softmax_test::name() const {
 }
 
 void tensor_function_factory_softmax_test::run() const {
-    auto t = generate_random_tensor( { 2, 3 }, dre);
-    tensor t_out = *t;
-    double total = 0.0;
-    for (auto &t_out_value : t_out) {
-        t_out_value = std::exp(t_out_value);
-        total += t_out_value;
+    // reference softmax along one axis of a { 2, 3, 4 } tensor, or over all the values with axis -1
+    auto expected_softmax = [](const tensor& t, int axis) {
+        tensor result(t);
+        for (std::size_t i = 0; i < t.size(); ++i) {
+            tensor::N_vector position = t.compute_position(i);
+            double max = -std::numeric_limits<double>::infinity(), total = 0;
+            for (std::size_t j = 0; j < t.size(); ++j) {
+                tensor::N_vector other = t.compute_position(j);
+                if (axis >= 0)
+                    other[axis] = position[axis];
+                if (axis < 0 || other == position)
+                    max = std::max(max, t[j]);
+            }
+            for (std::size_t j = 0; j < t.size(); ++j) {
+                tensor::N_vector other = t.compute_position(j);
+                if (axis >= 0)
+                    other[axis] = position[axis];
+                if (axis < 0 || other == position)
+                    total += std::exp(t[j] - max);
+            }
+            result[i] = std::exp(t[i] - max) / total;
+        }
+        return result;
+    };
+    auto t = generate_random_tensor( { 2, 3, 4 }, dre);
+    test_function("softmax", tensor_function_factory::softmax(), { t }, expected_softmax(*t, -1), dre);
+    for (int axis = 0; axis < 3; ++axis)
+        test_function("softmax along an axis", tensor_function_factory::softmax(axis), { t },
+                expected_softmax(*t, axis), dre);
+
+    // large inputs should not overflow
+    tensor large(*t);
+    for (double& v : large)
+        v = 1000 * (v + 1);
+    tensor large_softmax = *tensor_function_factory::softmax(1)->value( { tensor_cptr(new tensor(large)) });
+    assert(std::all_of(large_softmax.begin(), large_softmax.end(), [](double v) {return std::isfinite(v);}),
+            "softmax should not overflow for large inputs.");
+    assert(is_failing([&]() {tensor_function_factory::softmax(3)->value( {t});}),
+            "softmax should reject axes beyond the order of its input.");
+}
+
+std::string tensor_function_factory_softmax_cross_entropy_test::name() const {
+    return "tensor_function_factory_softmax_cross_entropy_test";
+}
+
+void tensor_function_factory_softmax_cross_entropy_test::run() const {
+    auto logits = generate_random_tensor( { 3, 4, 2 }, dre);
+    auto labels = generate_random_tensor( { 3, 4, 2 }, dre);
+    for (int axis = 0; axis < 3; ++axis) {
+        // - ∑ labels x log(softmax(logits))
+        tensor_cptr log_p = tensor_function_factory::log()->value( {
+                tensor_function_factory::softmax(axis)->value( { logits }) });
+        double expected = 0;
+        for (std::size_t i = 0; i < labels->size(); ++i)
+            expected -= labels->at(i) * log_p->at(i);
+        test_function("softmax_cross_entropy", tensor_function_factory::softmax_cross_entropy(axis), { logits,
+                labels }, tensor( { }, { expected }), dre);
+    }
+
+    // with one-hot labels, the gradient w.r.t. the logits is softmax - labels
+    tensor one_hot(tensor::zero( { 3, 4, 2 }));
+    for (std::size_t i = 0; i < one_hot.size(); ++i) {
+        tensor::N_vector position = one_hot.compute_position(i);
+        one_hot[i] = (position[1] == (position[0] + position[2]) % 4) ? 1 : 0;
+    }
+    tensor_cptr one_hot_labels(new tensor(one_hot));
+    derivative d = tensor_function_factory::softmax_cross_entropy(1)->deriv( { logits, one_hot_labels });
+    tensor expected_gradient = tensor::add(*tensor_function_factory::softmax(1)->value( { logits }),
+            *tensor_function_factory::negative()->value( { one_hot_labels }));
+    assert_tensors_are_close(*d.node_derivative[0], expected_gradient, 1e-12,
+            "softmax_cross_entropy gradient should be softmax - labels.");
+    auto mismatching_labels = generate_random_tensor( { 3, 4 }, dre);
+    assert(is_failing([&]() {tensor_function_factory::softmax_cross_entropy(0)->value( {logits, mismatching_labels});}),
+            "softmax_cross_entropy should reject labels with different dimensionalities.");
+}
+
+std::string tensor_function_factory_linear_softmax_cross_entropy_test::name() const {
+    return "tensor_function_factory_linear_softmax_cross_entropy_test";
+}
+
+void tensor_function_factory_linear_softmax_cross_entropy_test::run() const {
+    const std::size_t classes = 7, features = 4, points = 5;
+    auto w_val = generate_random_tensor( { classes, features }, dre, 3.0);
+    auto x_val = generate_random_tensor( { features, points }, dre, 3.0);
+    tensor labels(tensor::zero( { points })), one_hot(tensor::zero( { classes, points }));
+    for (std::size_t p = 0; p < points; ++p) {
+        labels[p] = (3 * p + 1) % classes;
+        one_hot[static_cast<std::size_t>(labels[p]) * points + p] = 1;
+    }
+
+    // reference: full logits followed by softmax_cross_entropy over the classes
+    auto mgb = ml_graph_builder::empty();
+    variable w = mgb->add_variable("w"), x = mgb->add_variable("x");
+    variable y = mgb->add_variable("y"), c = mgb->add_variable("c");
+    operation reference = mgb->softmax_cross_entropy(mgb->chain_multiplication(w, x, 1), c, 0);
+    std::vector<operation> fused;
+    for (std::size_t tile_size : { 1, 3, 7, 100 })
+        fused.push_back(mgb->linear_softmax_cross_entropy(w, x, y, tile_size));
+    graph_cuptr g = mgb->build_graph();
+    tensor_cptr_vec inputs = g->create_variable_values( { { w, w_val }, { x, x_val }, { y, tensor_cptr(new tensor(
+            labels)) }, { c, tensor_cptr(new tensor(one_hot)) } });
+
+    derivative expected = g->partial_gradient(reference, { w, x }, inputs);
+    for (operation f : fused) {
+        derivative actual = g->partial_gradient(f, { w, x, y }, inputs);
+        assert_tensors_are_close(*actual.node_value, *expected.node_value, 1e-12,
+                "linear_softmax_cross_entropy should match softmax_cross_entropy of the full logits.");
+        for (std::size_t i_mv = 0; i_mv < 2; ++i_mv)
+            assert_tensors_are_close(*actual.node_derivative[i_mv], *expected.node_derivative[i_mv], 1e-10,
+                    "gradients of linear_softmax_cross_entropy should match those of the full logits.");
+        assert_tensors_are_close(*actual.node_derivative[2], tensor::zero( { points }), 1e-15,
+                "linear_softmax_cross_entropy should be locally constant w.r.t. the labels.");
+        derivative d = g->get_function(f)->deriv( { w_val, x_val, inputs[y.index] });
+        assert_tensors_are_close(*d.node_derivative[0], *expected.node_derivative[0], 1e-10,
+                "deriv of linear_softmax_cross_entropy should match the full logits.");
+        assert_tensors_are_close(*d.node_derivative[1], *expected.node_derivative[1], 1e-10,
+                "deriv of linear_softmax_cross_entropy should match the full logits.");
+        // chaining through x, for two directions at once
+        tensor_cptr u = generate_random_tensor( { 2, features, points }, dre, 1.0);
+        tensor chained = g->get_function(f)->chain_derivative( { w_val, x_val, inputs[y.index] }, *d.node_value, 1,
+                *u);
+        for (std::size_t r = 0; r < 2; ++r) {
+            double dot = 0;
+            for (std::size_t i = 0; i < features * points; ++i)
+                dot += (*u)[r * features * points + i] * (*expected.node_derivative[1])[i];
+            assert_doubles_are_close(chained[r], dot, 1e-10,
+                    "chain_derivative of linear_softmax_cross_entropy should project the gradient.");
+        }
+    }
+
+    labels[0] = 0.5;
+    assert(is_failing([&]() {g->value(fused[0], g->create_variable_values( { { w, w_val }, { x, x_val }, { y,
+                                    tensor_cptr(new tensor(labels)) }, { c, tensor_cptr(new tensor(one_hot)) } }));}),
+            "linear_softmax_cross_entropy should reject labels that are not class indices.");
+}
+
+std::string tensor_function_factory_conv2d_test::name() const {
+    return "tensor_function_factory_conv2d_test";
+}
+
+void tensor_function_factory_conv2d_test::run() const {
+    // reference convolution, looping over every output position and tap
+    auto brute_force_conv2d = [](const tensor& x, const tensor& k, int stride, int padding, int dilation, int groups) {
+        const int n = x.dimensionalities[0], c = x.dimensionalities[1], h = x.dimensionalities[2], w =
+                x.dimensionalities[3];
+        const int f = k.dimensionalities[0], cg = k.dimensionalities[1], kh = k.dimensionalities[2], kw =
+                k.dimensionalities[3];
+        const int oh = (h + 2 * padding - dilation * (kh - 1) - 1) / stride + 1;
+        const int ow = (w + 2 * padding - dilation * (kw - 1) - 1) / stride + 1;
+        tensor result(tensor::zero( { tensor::N(n), tensor::N(f), tensor::N(oh), tensor::N(ow) }));
+        for (int i_n = 0; i_n < n; ++i_n)
+            for (int i_f = 0; i_f < f; ++i_f)
+                for (int i_oh = 0; i_oh < oh; ++i_oh)
+                    for (int i_ow = 0; i_ow < ow; ++i_ow) {
+                        double& out = result[((i_n * f + i_f) * oh + i_oh) * ow + i_ow];
+                        for (int i_c = 0; i_c < cg; ++i_c)
+                            for (int i_kh = 0; i_kh < kh; ++i_kh)
+                                for (int i_kw = 0; i_kw < kw; ++i_kw) {
+                                    int ih = i_oh * stride + i_kh * dilation - padding;
+                                    int iw = i_ow * stride + i_kw * dilation - padding;
+                                    if (ih < 0 || ih >= h || iw < 0 || iw >= w)
+                                        continue;
+                                    int x_c = i_f / (f / groups) * cg + i_c;
+                                    out += x[((i_n * c + x_c) * h + ih) * w + iw]
+                                            * k[((i_f * cg + i_c) * kh + i_kh) * kw + i_kw];
+                                }
+                    }
+        return result;
+    };
+
+    struct conv2d_case {
+        int stride, padding, dilation, groups;
+    };
+    for (const conv2d_case& cc : std::vector<conv2d_case> { { 1, 0, 1, 1 }, { 2, 1, 1, 1 }, { 1, 2, 2, 1 },
+            { 1, 1, 1, 2 } }) {
+        auto x = generate_random_tensor( { 2, 4, 6, 5 }, dre);
+        auto k = generate_random_tensor( { 6, tensor::N(4 / cc.groups), 3, 2 }, dre);
+        test_function("conv2d", tensor_function_factory::conv2d(cc.stride, cc.padding, cc.dilation, cc.groups), { x,
+                k }, brute_force_conv2d(*x, *k, cc.stride, cc.padding, cc.dilation, cc.groups), dre);
+    }
+
+    auto x = generate_random_tensor( { 1, 4, 6, 5 }, dre);
+    auto k = generate_random_tensor( { 6, 3, 3, 3 }, dre);
+    assert(is_failing([&]() {tensor_function_factory::conv2d(1, 0, 1, 1)->value( {x, k});}),
+            "conv2d should reject kernels with the wrong number of channels.");
+    auto large_k = generate_random_tensor( { 6, 4, 3, 3 }, dre);
+    assert(is_failing([&]() {tensor_function_factory::conv2d(1, 0, 4, 1)->value( {x, large_k});}),
+            "conv2d should reject kernels that do not fit in the images.");
+}
+
+std::string tensor_function_factory_pool_test::name() const {
+    return "tensor_function_factory_pool_test";
+}
+
+void tensor_function_factory_pool_test::run() const {
+    // reference pooling over the two trailing axes
+    auto brute_force_pool = [](const tensor& x, bool is_max, int window, int stride, int padding) {
+        const int h = x.dimensionalities[2], w = x.dimensionalities[3];
+        const int oh = (h + 2 * padding - window) / stride + 1, ow = (w + 2 * padding - window) / stride + 1;
+        tensor result(tensor::zero( { x.dimensionalities[0], x.dimensionalities[1], tensor::N(oh), tensor::N(ow) }));
+        for (std::size_t i = 0; i < result.size(); ++i) {
+            tensor::N_vector position = result.compute_position(i);
+            double max = -std::numeric_limits<double>::infinity(), sum = 0;
+            for (int i_kh = 0; i_kh < window; ++i_kh)
+                for (int i_kw = 0; i_kw < window; ++i_kw) {
+                    int ih = position[2] * stride + i_kh - padding, iw = position[3] * stride + i_kw - padding;
+                    if (ih < 0 || ih >= h || iw < 0 || iw >= w)
+                        continue;
+                    double v = x[x.compute_offset( { position[0], position[1], tensor::N(ih), tensor::N(iw) })];
+                    max = std::max(max, v);
+                    sum += v;
+                }
+            result[i] = is_max ? max : sum / (window * window);
+        }
+        return result;
+    };
+
+    auto x = generate_random_tensor( { 2, 3, 6, 5 }, dre);
+    for (bool is_max : { true, false })
+        for (int window : { 2, 3 })
+            for (int stride : { 1, 2 })
+                for (int padding : { 0, 1 }) {
+                    auto pool =
+                            is_max ? tensor_function_factory::max_pool(window, stride, padding) :
+                                    tensor_function_factory::avg_pool(window, stride, padding);
+                    test_function(is_max ? "max_pool" : "avg_pool", pool, { x },
+                            brute_force_pool(*x, is_max, window, stride, padding), dre);
+                }
+    assert(is_failing([&]() {tensor_function_factory::max_pool(2, 1, 2)->value( {x});}),
+            "pooling should reject padding as large as the window.");
+
+    // windows of -infinity and NaN select their own taps, not those of the previous image
+    const double inf = std::numeric_limits<double>::infinity();
+    tensor_cptr special(new tensor( { 3, 1, 2, 2 }, std::vector<double> { 1, 2, 4, 3, -inf, -inf, -inf, -inf, 1,
+            std::nan(""), 5, std::nan("") }));
+    derivative d = tensor_function_factory::max_pool(2, 1, 0)->deriv( { special });
+    const tensor& v = *d.node_value;
+    assert(v[0] == 4 && v[1] == -inf && std::isnan(v[2]), "max_pool should handle infinities and NaNs.");
+    const tensor& dv = *d.node_derivative[0];
+    for (std::size_t i = 0; i < special->size(); ++i)
+        for (std::size_t o = 0; o < 3; ++o)
+            assert(dv[i * 3 + o] == ((i == 2 && o == 0) || (i == 4 && o == 1) || (i == 9 && o == 2) ? 1 : 0),
+                    "max_pool should differentiate w.r.t. the first maximum, or NaN, of every window.");
+}
+
+std::string tensor_function_factory_gather_test::name() const {
+    return "tensor_function_factory_gather_test";
+}
+
+void tensor_function_factory_gather_test::run() const {
+    // rows of a { 5, 2, 3 } table looked up by { 2, 2 } indices, with a repeated row
+    auto table = generate_random_tensor( { 5, 2, 3 }, dre);
+    tensor_cptr indices(new tensor( { 2, 2 }, std::vector<double> { 4, 0, 4, 2 }));
+    tensor one_hot = tensor::zero( { 2, 2, 5 });
+    for (std::size_t i = 0; i < indices->size(); ++i)
+        one_hot[i * 5 + static_cast<std::size_t>((*indices)[i])] = 1;
+
+    // the lookup must agree with multiplying the table by one-hot encoded indices
+    auto gather = tensor_function_factory::gather();
+    auto one_hot_product = tensor_function_factory::chain_multiplication(1);
+    tensor_cptr_vec inputs { table, indices };
+    tensor_cptr_vec one_hot_inputs { tensor_cptr(new tensor(one_hot)), table };
+    tensor_cptr v = gather->value(inputs);
+    assert_tensors_are_close(*v, *one_hot_product->value(one_hot_inputs), 1e-15,
+            "gather should look up the rows of the table.");
+    tensor::N_vector inferred_dims;
+    assert(gather->infer_dimensionalities( { table->dimensionalities, indices->dimensionalities }, inferred_dims)
+            && inferred_dims == v->dimensionalities, "gather should infer its dimensionalities.");
+    derivative d = gather->deriv(inputs);
+    derivative one_hot_d = one_hot_product->deriv(one_hot_inputs);
+    assert_tensors_are_close(*d.node_derivative[0], *one_hot_d.node_derivative[1], 1e-15,
+            "derivative of gather w.r.t. the table should match the one-hot product.");
+    assert(std::all_of(d.node_derivative[1]->begin(), d.node_derivative[1]->end(), [](double x) {return x == 0;}),
+            "derivative of gather w.r.t. the indices should be zero.");
+    for (std::size_t i_input = 0; i_input < 2; ++i_input) {
+        tensor::N_vector x_dims { 2 };
+        x_dims.insert(x_dims.end(), inputs[i_input]->dimensionalities.begin(), inputs[i_input]->dimensionalities.end());
+        tensor_cptr input_derivative = generate_random_tensor(x_dims, dre);
+        assert_tensors_are_close(gather->chain_derivative(inputs, *v, i_input, *input_derivative),
+                tensor::chain_multiplication(*input_derivative, *d.node_derivative[i_input],
+                        inputs[i_input]->dimensionalities.size()), 1e-15,
+                "chain_derivative of gather should match deriv.");
+    }
+
+    // the sparse gradient holds the looked-up rows only, summing repeated lookups
+    auto output_gradient = generate_random_tensor(v->dimensionalities, dre);
+    sparse_row_gradient sparse = tensor_function_factory::gather_gradient(table->dimensionalities, *indices,
+            *output_gradient);
+    assert(sparse.row_indices == std::vector<std::size_t> { 0, 2, 4 },
+            "gather_gradient should hold the distinct looked-up rows.");
+    assert(sparse.rows.dimensionalities == tensor::N_vector { 3, 2, 3 },
+            "gather_gradient should hold one slice per looked-up row.");
+    tensor dense = tensor::chain_multiplication(*d.node_derivative[0], *output_gradient, v->dimensionalities.size());
+    assert_tensors_are_close(sparse.to_dense(), dense, 1e-15, "gather_gradient should match the dense gradient.");
+    tensor updated(*table);
+    sparse.scatter_add(updated, -0.5);
+    for (std::size_t i = 0; i < updated.size(); ++i)
+        assert_doubles_are_close(updated[i], (*table)[i] - 0.5 * dense[i], 1e-15,
+                "scatter_add should add the scaled gradient to the table.");
+
+    for (double invalid : { -1.0, 5.0, 1.5 })
+        assert(is_failing([&]() {
+            gather->value( {table, tensor_cptr(new tensor( {1}, std::vector<double> {invalid}))});
+        }), "gather should reject indices that are not rows of the table.");
+
+    // in a graph, the derivative w.r.t. a large table is scattered from the looked-up rows, without any
+    //   derivative of the size of the table squared, and the sparse gradient is obtained from the loss directly
+    const std::size_t vocabulary = 4096, width = 16;
+    auto mgb = ml_graph_builder::empty();
+    variable tv = mgb->add_variable("table", { vocabulary, width }), iv = mgb->add_variable("indices", { 4 });
+    operation lookup = mgb->gather(tv, iv);
+    operation loss = mgb->reduce_sum(mgb->sigmoid(lookup), { 0, 1 });
+    graph_cuptr g = mgb->build_graph();
+    tensor_cptr_vec graph_inputs = g->create_variable_values( { { tv, generate_random_tensor( { vocabulary, width },
+            dre) }, { iv, tensor_cptr(new tensor( { 4 }, std::vector<double> { 7, 4095, 7, 0 })) } });
+    derivative d_loss = g->partial_gradient(loss, { tv }, graph_inputs);
+    assert(d_loss.node_derivative[0]->size() == vocabulary * width,
+            "partial_gradient w.r.t. a table should have the size of the table.");
+    sparse_row_gradient graph_sparse = tensor_function_factory::gather_gradient(*g, loss, lookup, graph_inputs);
+    assert(graph_sparse.row_indices == std::vector<std::size_t> { 0, 7, 4095 },
+            "gather_gradient of a graph should hold the distinct looked-up rows.");
+    tensor graph_dense = graph_sparse.to_dense();
+    for (std::size_t i = 0; i < graph_dense.size(); ++i)
+        assert_doubles_are_close(graph_dense[i], (*d_loss.node_derivative[0])[i], 1e-14,
+                "gather_gradient of a graph should match partial_gradient.");
+}
+
+std::string tensor_function_factory_sparse_chain_multiplication_test::name() const {
+    return "tensor_function_factory_sparse_chain_multiplication_test";
+}
+
+void tensor_function_factory_sparse_chain_multiplication_test::run() const {
+    // a { 3, 4 } sparse tensor, multiplied on either side of a dense tensor
+    sparse_tensor s = sparse_tensor::from_coo( { 3, 4 }, { { 0, 1 }, { 2, 3 }, { 2, 0 }, { 1, 1 } }, { 0.5, -1, 2, 3 });
+    tensor_cptr offsets(new tensor(s.offset_tensor())), values(new tensor(s.value_tensor()));
+    tensor_cptr sparse_as_dense(new tensor(s.to_dense()));
+    struct sparse_case {
+        bool sparse_is_lhs;
+        tensor_cptr dense;
+        int ncd;
+    };
+    std::vector<sparse_case> cases {
+        { true, generate_random_tensor( { 4, 2 }, dre), 1 },
+        { true, generate_random_tensor( { 3, 4, 2 }, dre), 2 },
+        { false, generate_random_tensor( { 2, 3 }, dre), 1 },
+        { false, generate_random_tensor( { 2 }, dre), 0 } };
+    for (const sparse_case& sc : cases) {
+        auto func = tensor_function_factory::sparse_chain_multiplication(s.dimensionalities, sc.ncd, sc.sparse_is_lhs);
+        tensor_cptr_vec inputs = sc.sparse_is_lhs ?
+                tensor_cptr_vec { offsets, values, sc.dense } : tensor_cptr_vec { sc.dense, offsets, values };
+        tensor_cptr_vec dense_inputs = sc.sparse_is_lhs ?
+                tensor_cptr_vec { sparse_as_dense, sc.dense } : tensor_cptr_vec { sc.dense, sparse_as_dense };
+        const std::size_t i_dense = sc.sparse_is_lhs ? 2 : 0, i_sparse = sc.sparse_is_lhs ? 0 : 1;
+        auto dense_func = tensor_function_factory::chain_multiplication(sc.ncd);
+
+        tensor_cptr v = func->value(inputs);
+        assert_tensors_are_close(*v, *dense_func->value(dense_inputs), 1e-15,
+                "sparse chain_multiplication should match the dense one.");
+        tensor::N_vector inferred_dims;
+        std::vector<tensor::N_vector> input_dims;
+        for (const auto& input : inputs)
+            input_dims.push_back(input->dimensionalities);
+        assert(func->infer_dimensionalities(input_dims, inferred_dims)
+                && inferred_dims == v->dimensionalities,
+                "sparse chain_multiplication should infer its dimensionalities.");
+
+        // the derivative w.r.t. the values is the dense derivative at the offsets of the values
+        derivative d = func->deriv(inputs);
+        derivative dense_d = dense_func->deriv(dense_inputs);
+        assert_tensors_are_close(*d.node_derivative[i_dense], *dense_d.node_derivative[1 - i_sparse], 1e-15,
+                "derivative w.r.t. the dense operand should match the dense chain_multiplication.");
+        const tensor& d_values = *d.node_derivative[i_sparse + 1];
+        assert(d_values.dimensionalities[0] == s.nnz(), "derivative w.r.t. the values should be per stored value.");
+        const tensor& d_sparse_as_dense = *dense_d.node_derivative[i_sparse];
+        for (std::size_t z = 0; z < s.nnz(); ++z)
+            for (std::size_t i = 0; i < v->size(); ++i)
+                assert(d_values[z * v->size() + i] == d_sparse_as_dense[s.offsets[z] * v->size() + i],
+                        "derivative w.r.t. the values should match the dense derivative.");
+        for (std::size_t i_input = 0; i_input < 3; ++i_input) {
+            tensor::N_vector x_dims { 2 };
+            x_dims.insert(x_dims.end(), inputs[i_input]->dimensionalities.begin(),
+                    inputs[i_input]->dimensionalities.end());
+            tensor_cptr input_derivative = generate_random_tensor(x_dims, dre);
+            assert_tensors_are_close(func->chain_derivative(inputs, *v, i_input, *input_derivative),
+                    tensor::chain_multiplication(*input_derivative, *d.node_derivative[i_input],
+                            inputs[i_input]->dimensionalities.size()), 1e-12,
+                    "chain_derivative of sparse chain_multiplication should match deriv.");
+        }
+    }
+
+    // as a graph input, with gradients w.r.t. the dense operand and the stored values
+    auto mgb = ml_graph_builder::empty();
+    variable so = mgb->add_variable("offsets"), sv = mgb->add_variable("values"), w = mgb->add_variable("w", { 4, 2 });
+    operation y = mgb->sparse_dense_chain_multiplication(so, sv, s.dimensionalities, w, 1);
+    graph_cuptr g = mgb->build_graph();
+    tensor_cptr wv = generate_random_tensor( { 4, 2 }, dre);
+    derivative gd = g->partial_gradient(y, { w, sv }, g->create_variable_values( { { so, offsets }, { sv, values }, {
+            w, wv } }));
+    derivative reference = tensor_function_factory::chain_multiplication(1)->deriv( { sparse_as_dense, wv });
+    assert_tensors_are_close(*gd.node_value, *reference.node_value, 1e-15,
+            "graph with a sparse input should compute the product.");
+    assert_tensors_are_close(*gd.node_derivative[0], *reference.node_derivative[1], 1e-15,
+            "graph with a sparse input should compute the gradient w.r.t. the dense operand.");
+    assert(gd.node_derivative[1]->dimensionalities == tensor::N_vector( { s.nnz(), 3, 2 }),
+            "graph with a sparse input should compute the gradient w.r.t. the stored values.");
+}
+
+std::string tensor_function_factory_quantize_test::name() const {
+    return "tensor_function_factory_quantize_test";
+}
+
+void tensor_function_factory_quantize_test::run() const {
+    tensor_cptr x(new tensor( { 5 }, std::vector<double> { -3, -0.26, 0.24, 0.5, 1 }));
+    tensor_cptr q = tensor_function_factory::quantize(0.5)->value( { x });
+    assert((std::vector<double>(q->begin(), q->end()) == std::vector<double> { -6, -1, 0, 1, 2 }),
+            "quantize should round to multiples of the scale.");
+    tensor_cptr clamped = tensor_function_factory::quantize(0.01)->value( { x });
+    assert((*clamped)[0] == -127 && (*clamped)[4] == 100, "quantize should clamp to the int8 range.");
+    tensor_cptr dq = tensor_function_factory::dequantize(0.5)->value( { q });
+    assert((*dq)[0] == -3 && (*dq)[3] == 0.5, "dequantize should multiply by the scale.");
+    assert(is_failing([&]() {tensor_function_factory::quantize(0.5)->deriv( {x});}),
+            "quantize should have no derivative.");
+
+    // integer weights and inputs within [-127, 127] with ranges of 127 are quantized exactly
+    std::uniform_int_distribution<int> uid(-127, 127);
+    tensor w = tensor::zero( { 7, 300 }), xs = tensor::zero( { 300, 3 });
+    for (double& d : w)
+        d = uid(dre);
+    for (double& d : xs)
+        d = uid(dre);
+    for (std::size_t i = 0; i < 7; ++i)
+        w[i * 300] = 127;
+    tensor_cptr wv(new tensor(w)), xv(new tensor(xs));
+    tensor exact = tensor::chain_multiplication(w, xs, 1);
+    auto qcm = tensor_function_factory::quantized_chain_multiplication(w, 127);
+    assert_tensors_are_close(*qcm->value( { xv }), exact, 1e-15,
+            "quantized chain_multiplication should be exact for int8 values.");
+    auto from_cm = tensor_function_factory::chain_multiplication(1)->quantized(0, w, { 0, 127 });
+    assert(from_cm != nullptr, "chain_multiplication should have a quantized version for dense layers.");
+    assert_tensors_are_close(*from_cm->value( { tensor_cptr(new tensor(tensor::to_layout(xs,
+            tensor_layout::column_major))) }), exact, 1e-15,
+            "quantized chain_multiplication should work with any layout of its input.");
+    assert(!tensor_function_factory::chain_multiplication(2)->quantized(0, w, { 0, 127 }),
+            "chain_multiplication should only be quantized for dense layers.");
+
+    // the int8 kernels on shapes that are not multiples of their vector widths, including the extremes of int8
+    for (const tensor::N_vector& mkn : std::vector<tensor::N_vector> { { 1, 1, 1 }, { 3, 5, 7 }, { 5, 17, 33 }, {
+            13, 61, 19 } }) {
+        tensor wo = tensor::zero( { mkn[0], mkn[1] }), xo = tensor::zero( { mkn[1], mkn[2] });
+        for (double& d : wo)
+            d = uid(dre);
+        for (double& d : xo)
+            d = uid(dre);
+        for (std::size_t i = 0; i < mkn[0]; ++i)
+            wo[i * mkn[1]] = i % 2 == 0 ? 127 : -127;
+        xo[0] = -127;
+        assert_tensors_are_close(*tensor_function_factory::quantized_chain_multiplication(wo, 127)->value( {
+                tensor_cptr(new tensor(xo)) }), tensor::chain_multiplication(wo, xo, 1), 1e-15,
+                "quantized chain_multiplication should be exact for int8 values of any shape.");
     }
-    for (auto &t_out_value : t_out) {
-        t_out_value /= total;
+
+    // real values are approximated to about the int8 resolution
+    auto wr = generate_random_tensor( { 16, 64 }, dre);
+    auto xr = generate_random_tensor( { 64, 8 }, dre);
+    tensor reference = tensor::chain_multiplication(*wr, *xr, 1);
+    tensor approximate = *tensor_function_factory::quantized_chain_multiplication(*wr, 1)->value( { xr });
+    double error = 0, norm = 0;
+    for (std::size_t i = 0; i < reference.size(); ++i) {
+        error += (approximate[i] - reference[i]) * (approximate[i] - reference[i]);
+        norm += reference[i] * reference[i];
     }
-    test_function("softmax", tensor_function_factory::softmax(), { t }, t_out, dre);
+    assert(std::sqrt(error / norm) < 0.02, "quantized chain_multiplication should be accurate, found relative error ",
+            std::sqrt(error / norm));
+    tensor::N_vector odims;
+    assert(qcm->infer_dimensionalities( { xs.dimensionalities }, odims) && odims == exact.dimensionalities,
+            "quantized chain_multiplication should infer its dimensionalities.");
+    assert(is_failing([&]() {qcm->value( {wr});}), "quantized chain_multiplication should check its input.");
+}
+
+std::string tensor_function_factory_activation_test::name() const {
+    return "tensor_function_factory_activation_test";
+}
+
+void tensor_function_factory_activation_test::run() const {
+    typedef tensor_function_factory::activation_type activation_type;
+    typedef tensor_function_factory::activation_accuracy activation_accuracy;
+    auto reference = [](activation_type type, double x) {
+        switch (type) {
+        case activation_type::sigmoid:
+            return 1 / (1 + std::exp(-x));
+        case activation_type::tanh:
+            return std::tanh(x);
+        case activation_type::relu:
+            return std::max(x, 0.0);
+        case activation_type::leaky_relu:
+            return x > 0 ? x : 0.01 * x;
+        case activation_type::gelu:
+            // 0.5 x (1 + tanh(u)), without the cancellation for negative x
+            return x / (1 + std::exp(-2 * std::sqrt(2 / M_PI) * (x + 0.044715 * x * x * x)));
+        case activation_type::exp:
+            return std::exp(x);
+        default:
+            return std::log(x);
+        }
+    };
+    std::vector<activation_type> types { activation_type::sigmoid, activation_type::tanh, activation_type::relu,
+            activation_type::leaky_relu, activation_type::gelu, activation_type::exp, activation_type::log };
+
+    // values and derivatives, on inputs of both signs (except for log)
+    for (activation_type type : types) {
+        tensor_cptr x = generate_random_tensor( { 2, 3 }, dre, 4);
+        if (type != activation_type::log)
+            x = tensor_cptr(new tensor(tensor::add(*x, tensor(x->dimensionalities,
+                    std::vector<double>(x->size(), -2)))));
+        tensor expected(std::move(tensor::zero(x->dimensionalities)));
+        std::transform(x->begin(), x->end(), expected.begin(), [&](double d) {return reference(type, d);});
+        test_function("activation", tensor_function_factory::activation(type, activation_accuracy::precise), { x },
+                expected, dre);
+    }
+    tensor_cptr x(new tensor( { 2 }, std::vector<double> { -2, 3 }));
+    assert((*tensor_function_factory::leaky_relu(0.5)->value( { x }))[0] == -1, "leaky_relu should use its slope.");
+
+    // relative errors over wide ranges of inputs, for every accuracy
+    std::vector<double> wide_inputs, positive_inputs;
+    for (int i = -3000; i <= 3000; ++i)
+        wide_inputs.push_back(i * 0.01 + 1e-4);
+    for (int i = -3000; i <= 3000; ++i)
+        positive_inputs.push_back(std::pow(10.0, i * 0.1) * (1 + 1e-3 * (i % 7)));
+    std::vector<std::pair<activation_accuracy, double> > accuracies { { activation_accuracy::fast, 1e-5 }, {
+            activation_accuracy::balanced, 1e-9 }, { activation_accuracy::precise, 1e-15 } };
+    for (const auto& accuracy : accuracies) {
+        for (activation_type type : types) {
+            const std::vector<double>& inputs = type == activation_type::log ? positive_inputs : wide_inputs;
+            tensor_cptr xs(new tensor( { inputs.size() }, std::vector<double>(inputs)));
+            tensor ys = *tensor_function_factory::activation(type, accuracy.first)->value( { xs });
+            for (std::size_t i = 0; i < inputs.size(); ++i)
+                assert_doubles_are_close(ys[i], reference(type, inputs[i]), accuracy.second,
+                        "activation should be accurate, failed at input " + std::to_string(inputs[i]));
+        }
+    }
+
+    // inputs beyond the range of the polynomials
+    const double inf = std::numeric_limits<double>::infinity();
+    tensor_cptr extremes(new tensor( { 4 }, std::vector<double> { -800, 800, 0, -1 }));
+    tensor e = *tensor_function_factory::exp()->value( { extremes });
+    tensor l = *tensor_function_factory::log()->value( { extremes });
+    assert(e[0] == 0 && e[1] == inf && e[2] == 1, "exp should handle inputs beyond the range of normal doubles.");
+    assert(l[2] == -inf && std::isnan(l[3]), "log should handle non-positive inputs.");
+    tensor t = *tensor_function_factory::tanh()->value( { extremes });
+    assert(t[0] == -1 && t[1] == 1 && t[2] == 0, "tanh should saturate.");
+    tensor_cptr saturated(new tensor( { 3 }, std::vector<double> { 30, -30, -800 }));
+    tensor sigmoid_slopes = tensor_function_factory::sigmoid()->chain_derivative( { saturated },
+            *tensor_function_factory::sigmoid()->value( { saturated }), 0, tensor( { 3 }, std::vector<double>(3, 1)));
+    const double e30 = std::exp(-30.0);
+    assert_doubles_are_close(sigmoid_slopes[0], e30 / ((1 + e30) * (1 + e30)), 1e-14,
+            "precise sigmoid derivative should not cancel for large inputs.");
+    assert_doubles_are_close(sigmoid_slopes[1], e30 / ((1 + e30) * (1 + e30)), 1e-14,
+            "precise sigmoid derivative should be accurate for large negative inputs.");
+    assert(sigmoid_slopes[2] == 0, "precise sigmoid derivative should vanish when the sigmoid underflows.");
+    tensor_cptr non_finite(new tensor( { 3 }, std::vector<double> { -inf, inf, std::nan("") }));
+    for (activation_accuracy accuracy : { activation_accuracy::fast, activation_accuracy::balanced }) {
+        e = *tensor_function_factory::activation(activation_type::exp, accuracy)->value( { extremes });
+        l = *tensor_function_factory::activation(activation_type::log, accuracy)->value( { extremes });
+        assert(e[0] == 0 && e[1] == inf && e[2] == 1 && l[2] == -inf && std::isnan(l[3]),
+                "polynomial exp and log should fall back beyond their ranges.");
+        e = *tensor_function_factory::activation(activation_type::exp, accuracy)->value( { non_finite });
+        l = *tensor_function_factory::activation(activation_type::log, accuracy)->value( { non_finite });
+        assert(e[0] == 0 && e[1] == inf && std::isnan(e[2]) && std::isnan(l[0]) && l[1] == inf && std::isnan(l[2]),
+                "polynomial exp and log should propagate infinities and NaNs.");
+    }
+
+    // large inputs are evaluated on the thread pool
+    tensor_cptr big = generate_random_tensor( { 300, 300 }, dre, 10);
+    tensor big_expected(std::move(tensor::zero(big->dimensionalities)));
+    std::transform(big->begin(), big->end(), big_expected.begin(), [](double d) {return std::exp(d);});
+    assert_tensors_are_close(*tensor_function_factory::exp()->value( { big }), big_expected, 1e-15,
+            "exp should be accurate for large inputs.");
+}
+
+/**
+ * Reference attention, materializing the scores of all the queries and keys of every leading position.
+ * The mask (if any) has dimensionalities {lq, lk}.
+ */
+tensor brute_force_attention(const tensor& q, const tensor& k, const tensor& v, const tensor* mask) {
+    const std::size_t nb = q.dimensionalities.size() - 2;
+    const std::size_t lq = q.dimensionalities[nb], lk = k.dimensionalities[nb], d = q.dimensionalities[nb + 1],
+            dv = v.dimensionalities[nb + 1], batch = q.size() / (lq * d);
+    tensor::N_vector odims(q.dimensionalities.begin(), q.dimensionalities.end() - 1);
+    odims.push_back(dv);
+    tensor result = tensor::zero(odims);
+    for (std::size_t b = 0; b < batch; ++b)
+        for (std::size_t i = 0; i < lq; ++i) {
+            std::vector<double> scores(lk);
+            std::vector<bool> kept(lk);
+            double max_score = -std::numeric_limits<double>::infinity();
+            for (std::size_t j = 0; j < lk; ++j) {
+                kept[j] = !mask || (*mask)[i * lk + j] != 0;
+                for (std::size_t e = 0; e < d; ++e)
+                    scores[j] += q[(b * lq + i) * d + e] * k[(b * lk + j) * d + e] / std::sqrt(double(d));
+                if (kept[j])
+                    max_score = std::max(max_score, scores[j]);
+            }
+            double sum = 0;
+            for (std::size_t j = 0; j < lk; ++j) {
+                scores[j] = kept[j] ? std::exp(scores[j] - max_score) : 0;
+                sum += scores[j];
+            }
+            for (std::size_t j = 0; j < lk; ++j)
+                for (std::size_t e = 0; e < dv && sum > 0; ++e)
+                    result[(b * lq + i) * dv + e] += scores[j] / sum * v[(b * lk + j) * dv + e];
+        }
+    return result;
+}
+
+std::string tensor_function_factory_attention_test::name() const {
+    return "tensor_function_factory_attention_test";
+}
+
+void tensor_function_factory_attention_test::run() const {
+    // tiles that do not divide the numbers of queries and keys
+    auto q = generate_random_tensor( { 2, 3, 4 }, dre, 2);
+    auto k = generate_random_tensor( { 2, 5, 4 }, dre, 2);
+    auto v = generate_random_tensor( { 2, 5, 3 }, dre);
+    auto attention = tensor_function_factory::attention(2);
+    test_function("attention", attention, { q, k, v }, brute_force_attention(*q, *k, *v, nullptr), dre);
+
+    // a mask, with the second query seeing no keys at all
+    tensor_cptr mask(new tensor( { 3, 5 }, std::vector<double> { 1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0 }));
+    tensor_cptr_vec inputs { q, k, v, mask };
+    tensor_cptr masked = attention->value(inputs);
+    assert_tensors_are_close(*masked, brute_force_attention(*q, *k, *v, mask.get()), 1e-14,
+            "attention should exclude the masked keys.");
+    for (std::size_t i_input = 0; i_input < 3; ++i_input) {
+        tensor delta(*generate_random_tensor(inputs[i_input]->dimensionalities, dre, 1e-6));
+        tensor_cptr_vec bumped(inputs);
+        bumped[i_input] = tensor_cptr(new tensor(tensor::add(*inputs[i_input], delta)));
+        tensor expected = tensor::add(*masked, attention->chain_derivative(inputs, *masked, i_input, delta));
+        assert_tensors_are_close(*attention->value(bumped), expected, 1e-10,
+                "chain_derivative of masked attention should project bumps of input " + std::to_string(i_input));
+    }
+    tensor d_mask = attention->chain_derivative(inputs, *masked, 3, *mask);
+    assert(std::all_of(d_mask.begin(), d_mask.end(), [](double d) {return d == 0;}),
+            "attention should have a zero derivative w.r.t. the mask.");
+
+    // examples and heads, processed in parallel
+    auto q4 = generate_random_tensor( { 2, 2, 64, 16 }, dre);
+    auto k4 = generate_random_tensor( { 2, 2, 96, 16 }, dre);
+    auto v4 = generate_random_tensor( { 2, 2, 96, 8 }, dre);
+    assert_tensors_are_close(*tensor_function_factory::attention(16)->value( { q4, k4, v4 }),
+            brute_force_attention(*q4, *k4, *v4, nullptr), 1e-13, "attention should work with examples and heads.");
+    tensor::N_vector odims;
+    assert(attention->infer_dimensionalities( { { 3, 4 }, { 5, 4 }, { 5, 2 }, { 3, 5 } }, odims)
+            && odims == tensor::N_vector( { 3, 2 }), "attention should infer its dimensionalities.");
+    assert(is_failing([&]() {attention->infer_dimensionalities( { { 3, 4 }, { 5, 3 }, { 5, 2 } }, odims);}),
+            "attention should check the sizes of queries and keys.");
+}
+
+std::string tensor_function_factory_normalization_test::name() const {
+    return "tensor_function_factory_normalization_test";
+}
+
+void tensor_function_factory_normalization_test::run() const {
+    const double epsilon = 1e-5;
+    // reference normalization of x {outer, channels, inner} with two-pass statistics,
+    // over every outer position if groups_are_outer, and over every channel otherwise
+    auto normalize = [&](const tensor& x, const tensor& scale, const tensor& shift, std::size_t outer,
+            std::size_t channels, std::size_t inner, bool groups_are_outer) {
+        tensor result = tensor::zero(x.dimensionalities);
+        const std::size_t num_groups = groups_are_outer ? outer : channels;
+        for (std::size_t g = 0; g < num_groups; ++g) {
+            std::vector<std::size_t> offsets;
+            for (std::size_t o = 0; o < outer; ++o)
+                for (std::size_t c = 0; c < channels; ++c)
+                    for (std::size_t i = 0; i < inner; ++i)
+                        if ((groups_are_outer ? o : c) == g)
+                            offsets.push_back((o * channels + c) * inner + i);
+            double mean = 0, variance = 0;
+            for (std::size_t offset : offsets)
+                mean += x[offset] / offsets.size();
+            for (std::size_t offset : offsets)
+                variance += (x[offset] - mean) * (x[offset] - mean) / offsets.size();
+            for (std::size_t offset : offsets) {
+                const std::size_t c = groups_are_outer ? offset % (channels * inner) : offset / inner % channels;
+                result[offset] = scale[c] * (x[offset] - mean) / std::sqrt(variance + epsilon) + shift[c];
+            }
+        }
+        return result;
+    };
+    // shifts away from zero, so that outputs are not subject to cancellation
+    auto shift_of = [&](const tensor::N_vector& dims) {
+        auto t = generate_random_tensor(dims, dre);
+        return tensor_cptr(new tensor(tensor::add(*t, tensor(dims, std::vector<double>(t->size(), 2)))));
+    };
+
+    auto x = generate_random_tensor( { 3, 2, 2 }, dre);
+    auto ln_scale = generate_random_tensor( { 2, 2 }, dre);
+    auto ln_shift = shift_of( { 2, 2 });
+    test_function("layer_norm", tensor_function_factory::layer_norm(2, epsilon), { x, ln_scale, ln_shift },
+            normalize(*x, *ln_scale, *ln_shift, 3, 4, 1, true), dre);
+
+    auto bn_scale = generate_random_tensor( { 2 }, dre);
+    auto bn_shift = shift_of( { 2 });
+    test_function("batch_norm", tensor_function_factory::batch_norm(1, epsilon), { x, bn_scale, bn_shift },
+            normalize(*x, *bn_scale, *bn_shift, 3, 2, 2, false), dre);
+
+    auto bias = generate_random_tensor( { 2 }, dre);
+    tensor biased(*x);
+    for (std::size_t offset = 0; offset < biased.size(); ++offset)
+        biased[offset] += (*bias)[offset / 2 % 2];
+    test_function("bias_add", tensor_function_factory::bias_add(1), { x, bias }, biased, dre);
+
+    // single-pass statistics do not lose the variance of values far from zero
+    tensor_cptr offset_x(new tensor( { 1, 4 }, std::vector<double> { 1e9 + 1, 1e9 + 2, 1e9 + 3, 1e9 + 4 }));
+    tensor_cptr unit(new tensor( { 4 }, std::vector<double>(4, 1))), zero(new tensor(tensor::zero( { 4 })));
+    tensor normalized = *tensor_function_factory::layer_norm(1, 0)->value( { offset_x, unit, zero });
+    assert_doubles_are_close(normalized[3], 3 / std::sqrt(5.0), 1e-6,
+            "layer_norm should be accurate for values far from zero.");
+
+    // folding batch_norm with frozen statistics into the preceding dense layer
+    auto w = generate_random_tensor( { 3, 4 }, dre);
+    auto points = generate_random_tensor( { 4, 5 }, dre);
+    auto mean = generate_random_tensor( { 3 }, dre), variance = generate_random_tensor( { 3 }, dre);
+    auto scale = generate_random_tensor( { 3 }, dre);
+    auto shift = shift_of( { 3 });
+    tensor dense = tensor::chain_multiplication(*w, *points, 1);
+    tensor expected = tensor::zero(dense.dimensionalities);
+    for (std::size_t o = 0; o < 3; ++o)
+        for (std::size_t p = 0; p < 5; ++p)
+            expected[o * 5 + p] = (*scale)[o] * (dense[o * 5 + p] - (*mean)[o]) / std::sqrt((*variance)[o] + epsilon)
+                    + (*shift)[o];
+    folded_dense_layer folded = tensor_function_factory::fold_batch_norm(*w, *scale, *shift, *mean, *variance,
+            epsilon);
+    tensor_cptr folded_dense(new tensor(tensor::chain_multiplication(folded.weights, *points, 1)));
+    assert_tensors_are_close(*tensor_function_factory::bias_add(0)->value( { folded_dense, tensor_cptr(new tensor(
+            folded.bias)) }), expected, 1e-13, "fold_batch_norm should give an equivalent dense layer.");
+    assert(is_failing([&]() {tensor_function_factory::batch_norm(1, epsilon)->value( {x, ln_scale, ln_shift});}),
+            "batch_norm should check the dimensionalities of its scale and shift.");
+}
+
+std::string tensor_function_factory_einsum_test::name() const {
+    return "tensor_function_factory_einsum_test";
+}
+
+void tensor_function_factory_einsum_test::run() const {
+    auto a = generate_random_tensor( { 2, 3 }, dre);
+    auto b = generate_random_tensor( { 3, 4 }, dre);
+    auto c = generate_random_tensor( { 4, 5 }, dre);
+    auto d = generate_random_tensor( { 5, 3 }, dre);
+    auto batched_a = generate_random_tensor( { 3, 2, 4 }, dre);
+    auto batched_b = generate_random_tensor( { 3, 4, 2 }, dre);
+    auto square = generate_random_tensor( { 3, 3 }, dre);
+
+    struct einsum_case {
+        std::string subscripts;
+        tensor_cptr_vec inputs;
+    };
+    std::vector<einsum_case> cases {
+        { "ij,jk->ik", { a, b } },          // plain matrix multiplication
+        { "ij,kj->ki", { a, d } },          // rhs needs to be rearranged
+        { "ij,jk,kl->il", { a, b, c } },    // contraction path over three operands
+        { "bij,bjk->bik", { batched_a, batched_b } },   // batched matrix multiplication
+        { "ij->ji", { a } },                // transposition
+        { "ij->i", { a } },                 // reduction
+        { "ii->i", { square } },            // diagonal
+        { "ij,ij->", { a, a } }             // full contraction
+    };
+    for (const auto& ec : cases) {
+        test_function(ec.subscripts.c_str(), tensor_function_factory::einsum(ec.subscripts), ec.inputs,
+                brute_force_einsum(ec.subscripts, ec.inputs), dre);
+    }
+
+    tensor implicit = *tensor_function_factory::einsum("ij,jk")->value( { a, b });
+    assert_tensors_are_close(implicit, brute_force_einsum("ij,jk->ik", { a, b }), 1e-15,
+            "einsum should support implicit output subscripts.");
+    assert(is_failing([&]() {tensor_function_factory::einsum("ij,jk->il");}),
+            "einsum should reject output labels missing from the operands.");
+    assert(is_failing([&]() {tensor_function_factory::einsum("ij,jk->ik")->value( {a, a});}),
+            "einsum should reject operands with mismatching dimensionalities.");
+}
+
+std::string tensor_function_factory_random_test::name() const {
+    return "tensor_function_factory_random_test";
+}
+
+void tensor_function_factory_random_test::run() const {
+    auto offset = [](double o) {return tensor_cptr(new tensor( { 1 }, { o }));};
+
+    // the Philox4x32-10 known answer for a zero key and counter, through the uniform samples (word + 0.5) / 2^32
+    tensor_cptr words = tensor_function_factory::random_uniform( { 4 }, 0, 4294967296.0, 0)->value( { offset(0) });
+    std::vector<double> expected_words { 0x6627e8d5 + 0.5, 0xe169c58d + 0.5, 0xbc57ac4c + 0.5, 0x9b00dbd8 + 0.5 };
+    assert_tensors_are_close(*words, tensor( { 4 }, std::move(expected_words)), 0,
+            "random_uniform should use the Philox4x32-10 generator.");
+
+    // dropout: values, derivatives (with the mask regenerated) and the fraction of dropped elements
+    const double rate = 0.3;
+    auto dropout = tensor_function_factory::dropout(rate, 42);
+    tensor_cptr x = generate_random_tensor( { 3, 5 }, dre, 1);
+    x = tensor_cptr(new tensor(tensor::add(*x, tensor(x->dimensionalities, std::vector<double>(x->size(), 1)))));
+    tensor_cptr dropped = dropout->value( { x });
+    for (std::size_t i = 0; i < x->size(); ++i)
+        assert((*dropped)[i] == 0 || std::abs((*dropped)[i] - (*x)[i] / (1 - rate)) < 1e-15,
+                "dropout should either drop or scale every element.");
+    test_function("dropout", dropout, { x }, *dropped, dre);
+
+    const std::size_t original_num_threads = get_num_threads();
+    tensor_cptr ones(new tensor( { 1 << 17 }, std::vector<double>(1 << 17, 1)));
+    set_num_threads(1);
+    tensor_cptr serial_mask = dropout->value( { ones, offset(7) });
+    tensor_cptr serial_normal = tensor_function_factory::random_normal( { 1 << 17 }, 1, 2, 5)->value( { offset(3) });
+    set_num_threads(4);
+    tensor_cptr mask = dropout->value( { ones, offset(7) });
+    tensor_cptr normal = tensor_function_factory::random_normal( { 1 << 17 }, 1, 2, 5)->value( { offset(3) });
+    set_num_threads(original_num_threads);
+    assert_tensors_are_close(*mask, *serial_mask, 0, "dropout should not depend on the number of threads.");
+    assert_tensors_are_close(*normal, *serial_normal, 0, "random_normal should not depend on the number of threads.");
+    const double kept = std::count_if(mask->cbegin(), mask->cend(), [](double d) {return d != 0;});
+    assert_doubles_are_close(kept / mask->size(), 1 - rate, 1e-2, "dropout should drop elements at its rate.");
+    tensor_cptr other_mask = dropout->value( { ones, offset(8) });
+    assert(!std::equal(mask->cbegin(), mask->cend(), other_mask->cbegin()),
+            "dropout should draw a new mask at every offset.");
+
+    // the moments of the samples
+    auto moments = [](const tensor& t) {
+        const double mean = std::accumulate(t.cbegin(), t.cend(), 0.0) / t.size();
+        const double variance = std::accumulate(t.cbegin(), t.cend(), 0.0, [&](double acc, double d) {
+            return acc + (d - mean) * (d - mean);
+        }) / t.size();
+        return std::make_pair(mean, variance);
+    };
+    assert_doubles_are_close(moments(*normal).first, 1, 2e-2, "random_normal should have its mean.");
+    assert_doubles_are_close(moments(*normal).second, 4, 5e-2, "random_normal should have its variance.");
+    tensor_cptr uniform = tensor_function_factory::random_uniform( { 256, 256 }, -1, 3, 9)->value( { offset(0) });
+    assert(std::all_of(uniform->cbegin(), uniform->cend(), [](double d) {return d > -1 && d < 3;}),
+            "random_uniform should be in (low, high).");
+    assert_doubles_are_close(moments(*uniform).first, 1, 2e-2, "random_uniform should have its mean.");
+    assert_doubles_are_close(moments(*uniform).second, 16 / 12.0, 2e-2, "random_uniform should have its variance.");
+
+    // in a graph, the derivatives w.r.t. the offset are zero
+    auto mgb = ml_graph_builder::empty();
+    variable xv = mgb->add_variable("x", { 3, 5 }), step = mgb->add_variable("step", { 1 });
+    operation noisy = mgb->add(mgb->dropout(xv, step, rate, 42), mgb->random_normal(step, { 3, 5 }, 0, 1, 1));
+    graph_cuptr g = mgb->build_graph();
+    tensor_cptr_vec inputs = g->create_variable_values( { { xv, x }, { step, offset(2) } });
+    derivative d = g->partial_gradient(noisy, { xv, step }, inputs);
+    assert_tensors_are_close(*d.node_derivative[1], tensor::zero_derivative( { 3, 5 }, { 1 }), 0,
+            "random functions should have zero derivatives w.r.t. the offset.");
+    assert_tensors_are_close(*d.node_derivative[0], *dropout->deriv( { x, offset(2) }).node_derivative[0], 0,
+            "dropout should differentiate with the mask of its offset.");
+
+    // vmapped dropout draws a different mask for every example
+    auto bgb = ml_graph_builder::empty();
+    variable example = bgb->add_variable("example", { 64 });
+    bgb->dropout(example, rate, 42);
+    graph_cuptr batch_graph = vmap(*bgb->build_graph(), { { example, 0 } });
+    tensor_cptr two_examples(new tensor( { 2, 64 }, std::vector<double>(128, 1)));
+    tensor_cptr batch_masks = batch_graph->value(operation(batch_graph->num_operations() - 1),
+            batch_graph->create_variable_values( { { example, two_examples } }));
+    assert(!std::equal(batch_masks->cbegin(), batch_masks->cbegin() + 64, batch_masks->cbegin() + 64),
+            "vmapped dropout should draw a different mask for every example.");
+
+    assert(is_failing([&]() {dropout->value( {x, offset(0.5)});}), "dropout should reject fractional offsets.");
+    assert(is_failing([&]() {tensor_function_factory::dropout(1, 0);}), "dropout should reject a rate of 1.");
 }
 
 } // end namespace graph
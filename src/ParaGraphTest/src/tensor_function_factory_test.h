@@ -42,6 +42,11 @@ struct tensor_function_factory_reduce_sum_test: unit_test {
     void run() const override;
 };
 
+struct tensor_function_factory_reduce_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
 struct tensor_function_factory_log_test: unit_test {
     std::string name() const override;
     void run() const override;
@@ -62,6 +67,66 @@ struct tensor_function_factory_softmax_test: unit_test {
     void run() const override;
 };
 
+struct tensor_function_factory_softmax_cross_entropy_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_linear_softmax_cross_entropy_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_conv2d_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_pool_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_gather_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_sparse_chain_multiplication_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_quantize_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_activation_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_attention_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_normalization_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_einsum_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
+struct tensor_function_factory_random_test: unit_test {
+    std::string name() const override;
+    void run() const override;
+};
+
 }
 // end namespace graph
 }// end namespace para